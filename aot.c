@@ -0,0 +1,272 @@
+#include "aot.h"
+
+#include "error.h"
+#include "mem.h"
+#include "instruction.h"
+#include "intr.h"
+#include "machine.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Internal constants + helper macros
+////////////////////////////////////////////////////////////////////////////////
+
+#define AOT_INDEX(addr) (((addr) >> 1) & (AOT_LOOKUP_SIZE - 1))
+#define AOT_NO_ADDR 0xFFFFFFFF // Odd, so never the address of a block
+
+#define AOT_MAX_BLOCK_SIZE (AOT_BLOCK_INS * INS_MAX_SIZE)
+
+// Code is watched in lines of guest memory
+#define LINE_SIZE (1u << MEM_LINE_SHIFT)
+
+////////////////////////////////////////////////////////////////////////////////
+// Module internal declarations
+////////////////////////////////////////////////////////////////////////////////
+
+enum _aot_state {
+	AOT_UNCHECKED, // Not yet compared with memory, or written over since
+	AOT_VALID, // Matches memory, so may be run
+	AOT_CHANGED, // Doesn't match memory, so is left to the interpreter
+};
+
+typedef struct _aot_lookup {
+	mem_addr addr;
+	const aot_block *blk; // NULL if no block starts at addr
+} aot_lookup;
+
+struct _aot_context {
+	const aot_image *image;
+	uint8_t *state; // One per block of the image
+
+	// Direct-mapped by guest address, remembering misses too so that
+	// interpreted code doesn't search the image for every instruction
+	aot_lookup lookup[AOT_LOOKUP_SIZE];
+};
+
+/**
+ * Finds the block starting at an address.
+ *
+ * Returns: The block, or NULL if there is none.
+ */
+static const aot_block *find_block(aot_context *aot, mem_addr addr);
+
+/**
+ * Finds the first block starting at or after an address.
+ *
+ * Returns: The index of that block, or the number of blocks if there is none.
+ */
+static size_t lower_bound(const aot_image *image, mem_addr addr);
+
+/**
+ * Compares a block with the code in memory, watching the code so that
+ * any later change is noticed.
+ *
+ * Returns: Whether the block matches, and can be run.
+ */
+static bool check_block(vx4_machine *vm, const aot_block *blk);
+
+////////////////////////////////////////////////////////////////////////////////
+// Interface functions
+////////////////////////////////////////////////////////////////////////////////
+
+error_t aot_begin(vx4_cpu *vcpu, const aot_image *image)
+{
+	aot_context *aot = malloc(sizeof (aot_context));
+	if (aot == NULL) {
+		return ERR_NOMEM;
+	}
+
+	aot->image = image;
+	aot->state = calloc(image->num_blocks + 1, 1);
+
+	if (aot->state == NULL) {
+		free(aot);
+		return ERR_NOMEM;
+	}
+
+	vcpu->aot = aot;
+	aot_flush(vcpu);
+
+	return ERR_NOERR;
+}
+
+void aot_end(vx4_cpu *vcpu)
+{
+	if (vcpu->aot == NULL) {
+		return;
+	}
+
+	free(vcpu->aot->state);
+	free(vcpu->aot);
+	vcpu->aot = NULL;
+}
+
+mem_addr aot_run(vx4_cpu *vcpu, mem_addr ip, int64_t *budget)
+{
+	aot_context *aot = vcpu->aot;
+
+	while (!aot_events_pending(vcpu)) {
+		const aot_block *blk = find_block(aot, ip);
+
+		if (blk == NULL) {
+			break;
+		}
+
+		uint8_t *state = &aot->state[blk - aot->image->blocks];
+
+		if (*state == AOT_UNCHECKED) {
+			*state = check_block(vcpu->vm, blk) ? AOT_VALID : AOT_CHANGED;
+		}
+
+		// Leave the rest of the budget to the interpreter
+		if (*state != AOT_VALID || blk->num_ins > *budget) {
+			break;
+		}
+
+		ip = blk->func(vcpu, budget);
+	}
+
+	return ip;
+}
+
+void aot_invalidate(vx4_cpu *vcpu, mem_addr base, mem_size num)
+{
+	const aot_image *image = vcpu->aot->image;
+
+	if (num == 0) {
+		return;
+	}
+
+	// Blocks starting this far back may still reach into the range
+	mem_addr from = base > AOT_MAX_BLOCK_SIZE ? base - AOT_MAX_BLOCK_SIZE : 0;
+
+	for (size_t i = lower_bound(image, from); i < image->num_blocks; ++i) {
+		const aot_block *blk = &image->blocks[i];
+
+		if (blk->addr >= base + num) {
+			break;
+		}
+
+		if (blk->addr + blk->size > base) {
+			vcpu->aot->state[i] = AOT_UNCHECKED;
+		}
+	}
+}
+
+void aot_flush(vx4_cpu *vcpu)
+{
+	aot_context *aot = vcpu->aot;
+
+	memset(aot->state, AOT_UNCHECKED, aot->image->num_blocks);
+
+	for (size_t i = 0; i < AOT_LOOKUP_SIZE; ++i) {
+		aot->lookup[i].addr = AOT_NO_ADDR;
+		aot->lookup[i].blk = NULL;
+	}
+}
+
+bool aot_store(vx4_cpu *vcpu, mem_addr addr, uint32_t val)
+{
+	if (mem_cached_write_word(vcpu->vm, &vcpu->memcache, addr, val) != ERR_NOERR) {
+		interrupt_send(vcpu->vm, vcpu->id, INTR_INS);
+		return true;
+	}
+
+	// Written code is only rechecked once the CPU services its events, and
+	// may be in the very block being run
+	return aot_events_pending(vcpu);
+}
+
+bool aot_load(vx4_cpu *vcpu, mem_addr addr, uint32_t *dest)
+{
+	if (mem_cached_read_word(vcpu->vm, &vcpu->memcache, addr, dest) != ERR_NOERR) {
+		interrupt_send(vcpu->vm, vcpu->id, INTR_INS);
+		return true;
+	}
+
+	return false;
+}
+
+bool aot_fault(vx4_cpu *vcpu, error_t err)
+{
+	if (err != ERR_NOERR) {
+		interrupt_send(vcpu->vm, vcpu->id, INTR_INS);
+		return true;
+	}
+
+	return false;
+}
+
+bool aot_events_pending(vx4_cpu *vcpu)
+{
+	return atomic_load_explicit(&vcpu->cpu.events, memory_order_relaxed) != 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Module internal functions
+////////////////////////////////////////////////////////////////////////////////
+
+const aot_block *find_block(aot_context *aot, mem_addr addr)
+{
+	aot_lookup *entry = &aot->lookup[AOT_INDEX(addr)];
+
+	if (entry->addr != addr) {
+		size_t i = lower_bound(aot->image, addr);
+
+		entry->addr = addr;
+		entry->blk = NULL;
+
+		if (i < aot->image->num_blocks && aot->image->blocks[i].addr == addr) {
+			entry->blk = &aot->image->blocks[i];
+		}
+	}
+
+	return entry->blk;
+}
+
+size_t lower_bound(const aot_image *image, mem_addr addr)
+{
+	size_t lo = 0;
+	size_t hi = image->num_blocks;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (image->blocks[mid].addr < addr) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+bool check_block(vx4_machine *vm, const aot_block *blk)
+{
+	uint8_t code[AOT_MAX_BLOCK_SIZE];
+
+	if (blk->size == 0 || blk->size > AOT_MAX_BLOCK_SIZE) {
+		return false;
+	}
+
+	// Watched before reading, so another CPU rewriting the code meanwhile
+	// is still reported. Writes to device mappings aren't reported at all.
+	for (mem_addr line = blk->addr & ~(LINE_SIZE - 1); line < blk->addr + blk->size; line += LINE_SIZE) {
+		if (!mem_watch_line(vm, line)) {
+			return false;
+		}
+	}
+
+	mem_read_mem(vm, blk->addr, code, blk->size);
+
+	// Byte for byte, as any change at all must leave the block unrun
+	return memcmp(code, blk->code, blk->size) == 0;
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "error.h"
+#include "mem.h"
+#include "vx4.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Constants + helper macros
+////////////////////////////////////////////////////////////////////////////////
+
+#define AOT_BLOCK_INS 64 // The most instructions vx4-aot puts in one block
+#define AOT_LOOKUP_SIZE 4096 // Entries in each CPU's direct-mapped block lookup
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Runs a block translated by vx4-aot. The caller must already have checked
+ * that the budget covers the whole block. Runs straight through, unless a
+ * memory or stack access fails or a write leaves an event waiting (see
+ * aot_store), and blocks that jump back to their own start keep looping
+ * while the budget allows.
+ *
+ * IN budget: The most instructions to run.
+ * OUT budget: Reduced by the number of instructions run.
+ *
+ * Returns: The address of the next instruction to run.
+ */
+typedef mem_addr (*aot_block_pf)(vx4_cpu *vcpu, int64_t *budget);
+
+typedef struct _aot_block {
+	mem_addr addr; // The guest address the block was translated from
+	mem_size size; // How many bytes of code the block covers
+	unsigned num_ins; // How many guest instructions one pass of the block runs
+	const uint8_t *code; // The size bytes of code translated, to match against memory
+	aot_block_pf func;
+} aot_block;
+
+/**
+ * Everything vx4-aot translated from one firmware image. vx4-aot emits a C
+ * file defining one of these, which is built into the emulator with
+ * VX4_AOT defined, see cpu_set_aot.
+ */
+typedef struct _aot_image {
+	const char *source; // The image translated, for diagnostics
+	const aot_block *blocks; // Sorted by address
+	size_t num_blocks;
+} aot_image;
+
+// A CPU's view of an image's blocks, private to aot.c
+typedef struct _aot_context aot_context;
+
+////////////////////////////////////////////////////////////////////////////////
+// Function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Prepares a CPU to run the blocks of a translated image. Each block is
+ * checked against guest memory before it is first run, and again after
+ * anything writes over it, so that code changed since translation (or an
+ * image that isn't the one loaded) is left to the interpreter.
+ *
+ * IN image: The translated image. Must outlive the CPU.
+ *
+ * Returns:
+ * ERR_NOERR: The CPU is ready to run translated blocks.
+ * ERR_NOMEM: The CPU's block state couldn't be allocated.
+ */
+extern error_t aot_begin(vx4_cpu *vcpu, const aot_image *image);
+
+/**
+ * Frees the CPU's block state.
+ */
+extern void aot_end(vx4_cpu *vcpu);
+
+/**
+ * Runs translated blocks, starting at a given address. Returns when the
+ * CPU's events word becomes nonzero, at an address with no block (or
+ * whose code no longer matches its block), or at a block longer than
+ * the remaining budget. The caller must interpret the next instruction
+ * itself.
+ *
+ * IN ip: The address of the first instruction to run.
+ * IN budget: The most instructions to run.
+ * OUT budget: Reduced by the number of instructions run.
+ *
+ * Returns: The address of the next instruction to run.
+ */
+extern mem_addr aot_run(vx4_cpu *vcpu, mem_addr ip, int64_t *budget);
+
+/**
+ * Rechecks any blocks overlapping a range of memory before they next run.
+ *
+ * IN base: The address of the start of the range.
+ * IN num: The length of the range in bytes.
+ */
+extern void aot_invalidate(vx4_cpu *vcpu, mem_addr base, mem_size num);
+
+/**
+ * Rechecks every block before it next runs.
+ */
+extern void aot_flush(vx4_cpu *vcpu);
+
+/**
+ * Called from translated blocks to write memory.
+ *
+ * Returns: Whether the block must be left straight away, because the
+ * write failed (raising INTR_INS) or left an event waiting, such as the
+ * write having replaced code.
+ */
+extern bool aot_store(vx4_cpu *vcpu, mem_addr addr, uint32_t val);
+
+/**
+ * Called from translated blocks to read memory.
+ *
+ * OUT dest: The word read.
+ *
+ * Returns: Whether the block must be left straight away, because the
+ * read failed (raising INTR_INS).
+ */
+extern bool aot_load(vx4_cpu *vcpu, mem_addr addr, uint32_t *dest);
+
+/**
+ * Called from translated blocks with the result of a stack operation or
+ * vector load or store.
+ *
+ * Returns: Whether it failed, raising INTR_INS, so the block must be left.
+ */
+extern bool aot_fault(vx4_cpu *vcpu, error_t err);
+
+/**
+ * Called from translated blocks before looping back to their start.
+ *
+ * Returns: Whether an event is waiting, so the block must be left.
+ */
+extern bool aot_events_pending(vx4_cpu *vcpu);
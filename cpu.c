@@ -6,24 +6,55 @@
 #include "graphics.h"
 #include "intr.h"
 #include "stack.h"
+#include "mmu.h"
 #include "instruction.h"
+#include "icache.h"
+#include "jit.h"
+#include "aot.h"
+#include "port.h"
+#include "machine.h"
+#include "sync.h"
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <math.h>
 
 #include <SDL2/SDL_thread.h>
 #include <SDL2/SDL_mutex.h>
+#include <SDL2/SDL_timer.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 // Internal constants + helper macros
 ////////////////////////////////////////////////////////////////////////////////
 
+// The threaded interpreter relies on the GNU C labels-as-values extension
+#if defined(__GNUC__) && !defined(CPU_NO_THREADED)
+#define CPU_THREADED
+#endif // __GNUC__
+
+#define CPU_SLICE_INS 100000 // Instructions between checks of cpu_run's time limit
+#define CPU_TURN_INS 10000 // Instructions each CPU runs in turn, when cpu_run has several
+#define CPU_IDLE_POLL_MS 1 // How long cpu_run sleeps before returning CPU_STOPPED_IDLE
+#define CPU_PACE_MS 2 // How often a CPU held to a speed checks its schedule
+#define CPU_PACE_MAX_LAG_MS 20 // How far behind schedule a CPU may catch up from
+#define CPU_VIRTUAL_MHZ 1000 // The speed of cpu_read_time's virtual clock, without a governor
+
+// The bytes cpu_state_spill pushes below its frame: ip, flags, registers,
+// floating-point registers, compared operands and vector registers
+#define CPU_SPILL_SIZE (4 + sizeof (cpu_flags) + REG_NUM_REGS * 4 + FREG_NUM_REGS * FREG_SIZE \
+    + 8 + sizeof (vreg_file))
+
 #define RESET_ON(expr) \
     do { \
         if ((expr) != ERR_NOERR) { \
-            flags.reset = true; \
-            return true; \
+            vcpu->cpu.flags.reset = true; \
+            SYNC_UNLOCK(vcpu->cpu.flags_mutex); \
+            signal_events(vcpu); \
+            return CPU_AGAIN; \
         } \
     } while (0)
 
@@ -31,215 +62,2341 @@
 // Module internal declarations
 ////////////////////////////////////////////////////////////////////////////////
 
-static mem_addr reg_ip; // Instruction pointer
+typedef enum _cpu_status {
+    CPU_STOP, // The CPU is halting
+    CPU_AGAIN, // Events must be serviced again before running
+    CPU_RUN, // The next instruction can be run
+    CPU_INTERRUPT, // An interrupt is waiting, but wasn't to be taken
+    CPU_WAIT, // Nothing to run until an interrupt is pending, see cpu_queue_wait
+    CPU_BACKOFF, // Spinning on a port, so should sleep a while, see cpu_port_polled
+} cpu_status;
+
+/**
+ * Sets up everything needed to run the CPUs, short of threads to run them.
+ *
+ * Returns: As cpu_begin_sync.
+ */
+static error_t cpu_prepare(vx4_machine *vm);
+
+/**
+ * Undoes cpu_prepare, once the CPUs have stopped running.
+ */
+static void cpu_cleanup(vx4_machine *vm);
+
+/**
+ * Allocates a CPU along with its caches, ready to start from the reset
+ * vector.
+ *
+ * IN id: The id of the CPU, which is also its place in the CPU list.
+ *
+ * Returns:
+ * ERR_NOERR: The CPU was created.
+ * ERR_EXTERN: An error occurred creating the CPU's mutexes.
+ * ERR_NOMEM: The CPU or its caches couldn't be allocated.
+ */
+static error_t cpu_create(vx4_machine *vm, unsigned id);
+
+/**
+ * Frees a CPU created by cpu_create, even one only partly created.
+ */
+static void cpu_destroy(vx4_cpu *vcpu);
+
+/**
+ * Deal with any pending reset, halt or interrupt, ahead of the
+ * next instruction.
+ *
+ * IN take_interrupts: Whether a waiting interrupt may be taken. If not,
+ * CPU_INTERRUPT is returned instead, and the event is left pending.
+ *
+ * Returns: What the CPU should do next.
+ */
+static cpu_status cpu_service(vx4_cpu *vcpu, bool take_interrupts);
+
+/**
+ * Saves the state an interrupt preserves to the CPU's bank, for the
+ * outermost interrupt, or restores it from there.
+ */
+static void cpu_bank_save(vx4_cpu *vcpu);
+static void cpu_bank_restore(vx4_cpu *vcpu);
+
+/**
+ * Pushes the state an interrupt preserves in a new stack frame, for a
+ * nested interrupt, or pops it back again.
+ *
+ * Returns:
+ * ERR_NOERR: The state was pushed or popped.
+ * ERR_PCOND: The stack is unaligned, or runs outside memory or onto a page
+ * that is unmapped or read-only.
+ */
+static error_t cpu_state_spill(vx4_cpu *vcpu);
+static error_t cpu_state_fill(vx4_cpu *vcpu);
+
+/**
+ * Saves the state an interrupt preserves, to the bank or the stack, and
+ * jumps to the handler with interrupts masked. The CPU's flags_mutex must
+ * be held.
+ *
+ * IN next_ip: The handler, read from the interrupt's vector.
+ *
+ * Returns:
+ * ERR_NOERR: The CPU is at the handler.
+ * ERR_PCOND: The state couldn't be spilled, see cpu_state_spill.
+ */
+static error_t cpu_interrupt_enter(vx4_cpu *vcpu, mem_addr next_ip);
+
+/**
+ * Records that a CPU has halted for good, stopping the machine if it was
+ * the last one running.
+ */
+static void cpu_stopped(vx4_cpu *vcpu);
+
+/**
+ * Sleeps the calling thread until a CPU is signalled.
+ *
+ * IN vcpu: The CPU to wait for, or NULL to wait for any of the machine's.
+ * IN timeout_ms: The longest to wait, or SDL_MUTEX_MAXWAIT.
+ */
+static void cpu_sleep(vx4_machine *vm, vx4_cpu *vcpu, uint32_t timeout_ms);
+
+#ifndef VX4_SINGLE_THREAD
+/**
+ * Finds a CPU with events to service, for cpu_sleep.
+ *
+ * IN vcpu: The CPU to check, or NULL to check all of the machine's.
+ *
+ * Returns: The CPU found, or NULL if there was none.
+ */
+static vx4_cpu *cpu_signalled(vx4_machine *vm, vx4_cpu *vcpu);
+#endif // VX4_SINGLE_THREAD
+
+/**
+ * Returns whether every CPU is halted, at wfi or backing off, with no
+ * events to service.
+ */
+static bool cpu_all_idle(vx4_machine *vm);
+
+/**
+ * Starts a CPU backing off from a spin loop, doubling the time it sleeps
+ * for each time it is found still spinning.
+ *
+ * Returns: How long the CPU should sleep for, in milliseconds.
+ */
+static uint32_t cpu_backoff_begin(vx4_cpu *vcpu);
+
+/**
+ * Lets a backing off CPU run again.
+ *
+ * IN start: When it started sleeping, as a performance counter value.
+ */
+static void cpu_backoff_end(vx4_cpu *vcpu, uint64_t start);
+
+/**
+ * Finds how many instructions a CPU may run before it next checks its
+ * speed, restarting its schedule if the target has changed.
+ *
+ * Returns: The instructions, or INT64_MAX if it isn't held to a speed.
+ */
+static int64_t cpu_pace_slice(vx4_cpu *vcpu);
+
+/**
+ * Counts instructions run towards a CPU's schedule, sleeping the calling
+ * thread if the CPU has got ahead of it.
+ *
+ * IN ran: Instructions run since the last call.
+ */
+static void cpu_pace(vx4_cpu *vcpu, uint64_t ran);
+
+/**
+ * Accounts for the instructions run by the core since it was given a
+ * new slice.
+ */
+static void cpu_retire(vx4_cpu *vcpu);
+
+/**
+ * Returns whether there may be anything for cpu_service to deal with.
+ */
+static bool cpu_events_pending(vx4_cpu *vcpu);
+
+/**
+ * As cpu_signal_events, for a CPU known to exist.
+ */
+static void signal_events(vx4_cpu *vcpu);
+
+/**
+ * Notified of writes to memory that code has been read from, so that
+ * anything derived from the old code can be discarded. The write may come
+ * from any CPU, so each one discards from its own caches the next time it
+ * services its events.
+ */
+static void cpu_code_written(vx4_machine *vm, mem_addr base, mem_size num);
 
-typedef struct _cpu_flags {
-    bool reset : 1;
-    bool halt : 1;
-    bool intr : 1; // Are interrupts enabled?
-    int reserved : 29; // Needed to fill out structure size
-} cpu_flags;
+/**
+ * Discards anything derived from code written since the CPU last checked.
+ */
+static void cpu_discard_stale(vx4_cpu *vcpu);
 
-static cpu_flags flags;
+/**
+ * Execute the instruction at the ip, without checking for events.
+ */
+static void cpu_execute(vx4_cpu *vcpu);
 
-static SDL_Thread *cpu_thread;
-static SDL_mutex *flags_mutex;
-static bool do_stopping;
+/**
+ * Fetches the instruction at a virtual address, for paging on. Also right
+ * with paging off, though icache_fetch is quicker then.
+ *
+ * IN ip: The address of the instruction.
+ * OUT curr: The decoded instruction, valid until the next fetch.
+ *
+ * Returns:
+ * ERR_NOERR: The instruction was fetched.
+ * ERR_PCOND: A page of the instruction isn't mapped to be run, see
+ * mmu_take_fault. curr is not set.
+ */
+static error_t cpu_fetch_paged(vx4_cpu *vcpu, mem_addr ip, const instruction_decoded **curr);
 
 /**
- * Advance the CPU by executing a single instruction.
+ * Raises the interrupt for an instruction that failed. One that page
+ * faulted is run again once the fault has been dealt with, so must not
+ * have changed anything. The fault can't wait, so INTR_PAGE is taken
+ * straight away, even with interrupts masked. Only if entering its
+ * handler faults too is the CPU reset instead.
  *
- * Returns: If the CPU should continue executing.
+ * IN ip: The address of the instruction.
+ */
+static void cpu_fault(vx4_cpu *vcpu, mem_addr ip);
+
+/**
+ * Run instructions using the selected core, until an event needs to be
+ * serviced or the budget runs out. Every core can run with paging on, the
+ * JIT and AOT interpreting each block instead of running its translation.
+ */
+static void cpu_run_core(vx4_cpu *vcpu);
+
+/**
+ * Run instructions one at a time through the instructions table, as
+ * cpu_run_core.
+ */
+static void cpu_run_reference(vx4_cpu *vcpu);
+
+#ifdef CPU_THREADED
+/**
+ * Run instructions using the threaded interpreter, as cpu_run_core.
+ */
+static void cpu_run_threaded(vx4_cpu *vcpu);
+#endif // CPU_THREADED
+
+#ifdef JIT_SUPPORTED
+/**
+ * Run translated code where possible, interpreting anything the JIT
+ * can't translate, as cpu_run_core.
+ */
+static void cpu_run_jit(vx4_cpu *vcpu);
+#endif // JIT_SUPPORTED
+
+/**
+ * Run blocks translated ahead of time where possible, interpreting
+ * anything else, as cpu_run_core.
  */
-static bool cpu_step();
+static void cpu_run_aot(vx4_cpu *vcpu);
 
+#ifndef VX4_SINGLE_THREAD
 /**
- * Run the CPU indefinitely
+ * Run a CPU until it halts.
+ *
+ * IN data: The CPU to run.
  */
 static int cpu_loop(void *data);
+#endif // VX4_SINGLE_THREAD
+
+/**
+ * Raises an interrupt on another CPU, see cpu_begin.
+ *
+ * IN num: Ignored, part of the callback signature.
+ * IN data: The id of the CPU in the high dbyte, and the interrupt in the
+ * low dbyte.
+ */
+static void control_write(vx4_machine *vm, port_id num, uint32_t data);
+
+/**
+ * Fetches the number of CPUs.
+ *
+ * IN num: Ignored, part of the callback signature.
+ *
+ * Returns: That number.
+ */
+static uint32_t control_read(vx4_machine *vm, port_id num);
+
+static port_entry control_port = {
+    "CPU control",
+    control_write,
+    control_read
+};
 
 ////////////////////////////////////////////////////////////////////////////////
 // Interface functions
 ////////////////////////////////////////////////////////////////////////////////
 
-error_t cpu_begin()
+void cpu_init(vx4_machine *vm)
 {
-    flags_mutex = SDL_CreateMutex();
-    if (!flags_mutex) {
-        return ERR_EXTERN;
-    }
-
-    // Cause the CPU to jump to the correct firmware address
-    flags.reset = true;
+    #ifdef CPU_THREADED
+    vm->cpus.selected_core = CPU_CORE_THREADED;
+    #else
+    vm->cpus.selected_core = CPU_CORE_REFERENCE;
+    #endif // CPU_THREADED
 
-    cpu_thread = SDL_CreateThread(cpu_loop, "cpu", NULL);
+    vm->cpus.trace_file = NULL;
+    vm->cpus.count = 1;
+    atomic_store(&vm->cpus.target_mhz, 0);
+}
 
-    if (!cpu_thread) {
-        SDL_DestroyMutex(flags_mutex);
-        return ERR_EXTERN;
+error_t cpu_set_count(vx4_machine *vm, unsigned count)
+{
+    if (count == 0 || count > CPU_MAX_CPUS) {
+        return ERR_INVAL;
     }
 
+    vm->cpus.count = count;
     return ERR_NOERR;
 }
 
-void cpu_wait_end()
+unsigned cpu_get_count(vx4_machine *vm)
 {
-    SDL_DestroyMutex(flags_mutex);
-    SDL_WaitThread(cpu_thread, NULL);
+    return vm->cpus.count;
 }
 
-bool cpu_halting()
+error_t cpu_set_core(vx4_machine *vm, cpu_core core)
 {
-    if (SDL_LockMutex(flags_mutex) != 0) {
-        return false;
-    }
+    switch (core) {
+        case CPU_CORE_REFERENCE:
+        #ifdef CPU_THREADED
+        case CPU_CORE_THREADED:
+        #endif // CPU_THREADED
+        #ifdef JIT_SUPPORTED
+        case CPU_CORE_JIT:
+        #endif // JIT_SUPPORTED
+            vm->cpus.selected_core = core;
+            return ERR_NOERR;
 
-    bool ret = do_stopping;
+        case CPU_CORE_AOT:
+            if (vm->cpus.aot_image == NULL) {
+                return ERR_INVAL;
+            }
+
+            vm->cpus.selected_core = core;
+            return ERR_NOERR;
 
-    SDL_UnlockMutex(flags_mutex);
-    return ret;
+        default:
+            return ERR_INVAL;
+    }
 }
 
-void cpu_queue_reset()
+void cpu_set_aot(vx4_machine *vm, const aot_image *image)
 {
-    if (SDL_LockMutex(flags_mutex) != 0) {
-        return;
+    vm->cpus.aot_image = image;
+    vm->cpus.selected_core = CPU_CORE_AOT;
+}
+
+void cpu_set_speed(vx4_machine *vm, unsigned mhz)
+{
+    atomic_store_explicit(&vm->cpus.target_mhz, mhz, memory_order_relaxed);
+
+    // Stops the cores, so that each CPU starts a new schedule
+    for (unsigned i = 0; i < CPU_MAX_CPUS; ++i) {
+        cpu_signal_events(vm, i);
     }
+}
 
-    flags.reset = true;
+unsigned cpu_get_speed(vx4_machine *vm)
+{
+    return atomic_load_explicit(&vm->cpus.target_mhz, memory_order_relaxed);
+}
 
-    SDL_UnlockMutex(flags_mutex);
+void cpu_set_trace(vx4_machine *vm, FILE *file)
+{
+    vm->cpus.trace_file = file;
 }
 
-void cpu_queue_halt()
+#ifndef VX4_SINGLE_THREAD
+error_t cpu_begin(vx4_machine *vm)
 {
-    if (SDL_LockMutex(flags_mutex) != 0) {
-        return;
+    error_t err = cpu_prepare(vm);
+    if (err != ERR_NOERR) {
+        return err;
     }
 
-    flags.halt = true;
+    for (unsigned i = 0; i < vm->cpus.count; ++i) {
+        vx4_cpu *vcpu = vm->cpus.list[i];
+        vcpu->cpu.thread = SDL_CreateThread(cpu_loop, "cpu", vcpu);
 
-    SDL_UnlockMutex(flags_mutex);
-}
+        if (!vcpu->cpu.thread) {
+            // Those already started have to stop before anything is freed
+            cpu_queue_halt(vm);
 
-void cpu_queue_jump(mem_addr new_ip)
-{
-    reg_ip = new_ip;
+            for (unsigned j = 0; j < i; ++j) {
+                SDL_WaitThread(vm->cpus.list[j]->cpu.thread, NULL);
+            }
+
+            cpu_cleanup(vm);
+            return ERR_EXTERN;
+        }
+    }
+
+    return ERR_NOERR;
 }
 
-void cpu_interrupt_set(bool enabled)
+void cpu_wait_end(vx4_machine *vm)
 {
-    if (SDL_LockMutex(flags_mutex) != 0) {
-        return;
+    for (unsigned i = 0; i < vm->cpus.count; ++i) {
+        SDL_WaitThread(vm->cpus.list[i]->cpu.thread, NULL);
     }
 
-    flags.intr = enabled;
+    cpu_cleanup(vm);
+}
+#endif // VX4_SINGLE_THREAD
 
-    SDL_UnlockMutex(flags_mutex);
+error_t cpu_begin_sync(vx4_machine *vm)
+{
+    return cpu_prepare(vm);
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// Module internal functions
-////////////////////////////////////////////////////////////////////////////////
+void cpu_end_sync(vx4_machine *vm)
+{
+    cpu_cleanup(vm);
+}
 
-bool cpu_step()
+cpu_stop_reason cpu_run(vx4_machine *vm, uint64_t max_ins, uint64_t max_us)
 {
-    if (SDL_LockMutex(flags_mutex) != 0) {
-        return true;
-    }
+    uint64_t start = SDL_GetPerformanceCounter();
+    uint64_t limit = UINT64_MAX;
 
-    if (flags.halt) {
-        SDL_UnlockMutex(flags_mutex);
-        return false;
+    // Only interrupts that were waiting before the call are taken
+    bool take_interrupts[CPU_MAX_CPUS];
+
+    for (unsigned i = 0; i < vm->cpus.count; ++i) {
+        take_interrupts[i] = true;
     }
 
-    if (flags.reset) {
-        flags.reset = false;
-        mem_read_word(0x0, &reg_ip); // The reset vector is in place of the 0th IV
-        // Sensible values for sp and bp, remembering they grow down
-        reg_sp = reg_bp = GFX_MMAP_START;
-        // Because we have a sensible stack, we can start with interrupts
-        flags.intr = true;
+    if (max_us != CPU_RUN_FOREVER) {
+        limit = max_us * SDL_GetPerformanceFrequency() / 1000000;
     }
 
-    if (flags.intr) {
-        intr_id next_intr = interrupt_which();
-        if (next_intr != INTR_INVALID) {
-            // Fetch our interrupt vector (IV)
-            mem_addr next_ip;
-            mem_read_word(next_intr * 4, &next_ip);
+    for (;;) {
+        if (atomic_load(&vm->cpus.running) == 0) {
+            return CPU_STOPPED_HALT;
+        }
 
-            // Neither 0 nor 1 are sensible IVs (they are both inside the IVT)
-            // So we use them as a signal to reset (0) or halt (1) instead
-            if (next_ip == 0) {
-                flags.reset = true;
-                SDL_UnlockMutex(flags_mutex);
-                return true;
+        vx4_cpu *vcpu = vm->cpus.list[vm->cpus.turn];
+
+        if (!vcpu->cpu.stopped && cpu_events_pending(vcpu)) {
+            switch (cpu_service(vcpu, take_interrupts[vcpu->id])) {
+                case CPU_STOP:
+                    cpu_stopped(vcpu);
+                    continue;
+
+                case CPU_INTERRUPT:
+                    return CPU_STOPPED_INTERRUPT;
+
+                case CPU_AGAIN:
+                    continue;
+
+                case CPU_BACKOFF:
+                    vcpu->cpu.spin.sleep_ms = cpu_backoff_begin(vcpu);
+                    break;
+
+                case CPU_WAIT:
+                case CPU_RUN:
+                    break;
             }
-            else if (next_ip == 1) {
-                flags.halt = true;
-                SDL_UnlockMutex(flags_mutex);
-                return true;
+        }
+
+        if (vcpu->cpu.stopped || vcpu->cpu.waiting || vcpu->cpu.spin.backoff) {
+            vm->cpus.turn_left = 0;
+
+            if (cpu_all_idle(vm)) {
+                uint64_t now = SDL_GetPerformanceCounter();
+                uint32_t timeout = SDL_MUTEX_MAXWAIT;
+
+                if (max_us != CPU_RUN_FOREVER) {
+                    if (now - start >= limit) {
+                        return CPU_STOPPED_DEADLINE;
+                    }
+
+                    timeout = (limit - (now - start)) * 1000 / SDL_GetPerformanceFrequency() + 1;
+                }
+
+                #ifdef VX4_SINGLE_THREAD
+                if (timeout > CPU_IDLE_POLL_MS) {
+                    timeout = CPU_IDLE_POLL_MS;
+                }
+                #endif // VX4_SINGLE_THREAD
+
+                // Backing off ends with the shortest sleep of any CPU
+                for (unsigned i = 0; i < vm->cpus.count; ++i) {
+                    cpu_spin_state *spin = &vm->cpus.list[i]->cpu.spin;
+
+                    if (spin->backoff && spin->sleep_ms < timeout) {
+                        timeout = spin->sleep_ms;
+                    }
+                }
+
+                // Whichever CPU was signalled is found as the turns go round
+                cpu_sleep(vm, NULL, timeout);
+
+                for (unsigned i = 0; i < vm->cpus.count; ++i) {
+                    if (vm->cpus.list[i]->cpu.spin.backoff) {
+                        cpu_backoff_end(vm->cpus.list[i], now);
+                    }
+                }
+
+                #ifdef VX4_SINGLE_THREAD
+                // Only input delivered by the caller can end a wfi now
+                if (atomic_load(&vm->cpus.running) != 0 && cpu_all_idle(vm)) {
+                    return CPU_STOPPED_IDLE;
+                }
+                #endif // VX4_SINGLE_THREAD
+                continue;
+            }
+        }
+        else {
+            take_interrupts[vcpu->id] = false;
+
+            if (max_ins == 0) {
+                return CPU_STOPPED_BUDGET;
+            }
+
+            if (SDL_GetPerformanceCounter() - start >= limit) {
+                return CPU_STOPPED_DEADLINE;
+            }
+
+            // Without a time limit or other CPUs, there's no need to come back any sooner
+            uint64_t slice = max_ins;
+
+            if (max_us != CPU_RUN_FOREVER && slice > CPU_SLICE_INS) {
+                slice = CPU_SLICE_INS;
+            }
+            if (vm->cpus.count > 1 && slice > vm->cpus.turn_left) {
+                slice = vm->cpus.turn_left;
+            }
+
+            uint64_t pace_slice = cpu_pace_slice(vcpu);
+
+            if (slice > pace_slice) {
+                slice = pace_slice;
+            }
+
+            vcpu->cpu.budget = vcpu->cpu.slice = slice;
+            cpu_run_core(vcpu);
+
+            uint64_t ran = slice - vcpu->cpu.budget;
+            cpu_retire(vcpu);
+            cpu_pace(vcpu, ran);
+
+            if (max_ins != CPU_RUN_FOREVER) {
+                max_ins -= ran;
             }
 
-            // Push all our registers
-            // If this fails, cause a reset
-            RESET_ON(stack_enter_frame());
-            // If the stack is aligned correctly here, the following won't fail
-            stack_push(reg_ip);
-            stack_push_multi((uint32_t *)&flags, sizeof (cpu_flags) / 4);
-            stack_skip(REG_NUM_REGS);
-            reg_write_all_mem(reg_sp);
+            vm->cpus.turn_left -= ran;
+        }
 
-            // Finally, do the jump
-            reg_ip = next_ip;
+        // Turns carry over between calls, so that short runs still share the CPUs fairly
+        if (vm->cpus.turn_left == 0) {
+            vm->cpus.turn = (vm->cpus.turn + 1) % vm->cpus.count;
+            vm->cpus.turn_left = CPU_TURN_INS;
         }
     }
+}
+
+bool cpu_halting(vx4_machine *vm)
+{
+    return atomic_load(&vm->cpus.do_stopping);
+}
+
+void cpu_queue_reset(vx4_machine *vm)
+{
+    for (unsigned i = 0; i < vm->cpus.count; ++i) {
+        vx4_cpu *vcpu = vm->cpus.list[i];
 
-    SDL_UnlockMutex(flags_mutex);
+        if (vcpu == NULL || SYNC_LOCK(vcpu->cpu.flags_mutex) != 0) {
+            continue;
+        }
+
+        vcpu->cpu.flags.reset = true;
+
+        SYNC_UNLOCK(vcpu->cpu.flags_mutex);
+        signal_events(vcpu);
+    }
+}
 
-    instruction_id curr;
-    mem_read_dbyte(reg_ip, &curr);
-    reg_ip += 2;
+void cpu_queue_halt(vx4_machine *vm)
+{
+    for (unsigned i = 0; i < vm->cpus.count; ++i) {
+        if (vm->cpus.list[i] != NULL) {
+            cpu_queue_stop(vm->cpus.list[i]);
+        }
+    }
+}
 
-    if (!valid_instruction(curr)) {
-        interrupt_raise(INTR_INS);
-        return true;
+void cpu_queue_stop(vx4_cpu *vcpu)
+{
+    if (SYNC_LOCK(vcpu->cpu.flags_mutex) != 0) {
+        return;
     }
 
-    mem_size extra = instructions[curr].extra;
-    error_t stat;
+    vcpu->cpu.flags.halt = true;
 
-    if (extra > 0) {
-        uint8_t data[extra];
-        mem_read_mem(reg_ip, data, extra);
-        reg_ip += extra;
+    SYNC_UNLOCK(vcpu->cpu.flags_mutex);
+    signal_events(vcpu);
+}
 
-        stat = (instructions[curr].func)(data);
+void cpu_queue_wait(vx4_cpu *vcpu)
+{
+    if (SYNC_LOCK(vcpu->cpu.flags_mutex) != 0) {
+        return;
     }
-    else {
-        stat = (instructions[curr].func)(NULL);
+
+    vcpu->cpu.waiting = true;
+
+    SYNC_UNLOCK(vcpu->cpu.flags_mutex);
+
+    // Stops the core, so that cpu_service can put the CPU to sleep
+    signal_events(vcpu);
+}
+
+void cpu_port_polled(vx4_cpu *vcpu, port_id port, uint32_t value)
+{
+    cpu_spin_state *spin = &vcpu->cpu.spin;
+    mem_addr ip = vcpu->cpu.ip; // Already past the instruction that read the port
+
+    ++vcpu->vm->cpus.spin_stats[vcpu->id].polls;
+
+    // Emptied for the next read to check, whatever this one finds
+    bool touched = mem_cache_used(&vcpu->memcache);
+    mem_cache_empty(&vcpu->memcache);
+
+    if (touched || spin->ip != ip || spin->port != port || spin->value != value ||
+        memcmp(spin->regs, vcpu->registers, sizeof (reg_file)) != 0 ||
+        memcmp(spin->vregs, vcpu->vregisters, sizeof (vreg_file)) != 0 ||
+        memcmp(spin->fregs, vcpu->fregisters, sizeof (freg_file)) != 0 ||
+        memcmp(spin->compared, vcpu->compared, sizeof (spin->compared)) != 0) {
+        spin->ip = ip;
+        spin->port = port;
+        spin->value = value;
+        memcpy(spin->regs, vcpu->registers, sizeof (reg_file));
+        memcpy(spin->vregs, vcpu->vregisters, sizeof (vreg_file));
+        memcpy(spin->fregs, vcpu->fregisters, sizeof (freg_file));
+        memcpy(spin->compared, vcpu->compared, sizeof (spin->compared));
+
+        spin->repeats = 0;
+        spin->sleep_ms = 0;
+        return;
     }
 
-    if (stat != ERR_NOERR) {
-        interrupt_raise(INTR_INS);
+    if (spin->repeats < CPU_SPIN_REPEATS) {
+        if (++spin->repeats < CPU_SPIN_REPEATS) {
+            return;
+        }
+
+        ++vcpu->vm->cpus.spin_stats[vcpu->id].detections;
     }
 
-    return true;
+    // Stops the core, so that cpu_service can put the CPU to sleep
+    spin->backoff = true;
+    signal_events(vcpu);
 }
 
-int cpu_loop(void *data)
+void cpu_port_written(vx4_cpu *vcpu)
+{
+    vcpu->cpu.spin.repeats = 0;
+    vcpu->cpu.spin.sleep_ms = 0;
+}
+
+uint64_t cpu_read_ins(vx4_cpu *vcpu)
+{
+    return vcpu->vm->cpus.retired[vcpu->id] + (vcpu->cpu.slice - vcpu->cpu.budget);
+}
+
+uint64_t cpu_read_time(vx4_cpu *vcpu)
+{
+    cpus_context *cpus = &vcpu->vm->cpus;
+
+    #ifdef VX4_SINGLE_THREAD
+    unsigned mhz = vcpu->cpu.pace.mhz ? vcpu->cpu.pace.mhz : CPU_VIRTUAL_MHZ;
+
+    return cpus->virtual_ns[vcpu->id] + (uint64_t)(vcpu->cpu.slice - vcpu->cpu.budget) * 1000 / mhz;
+    #else
+    uint64_t freq = SDL_GetPerformanceFrequency();
+    uint64_t ticks = SDL_GetPerformanceCounter() - cpus->started;
+
+    return ticks / freq * 1000000000 + ticks % freq * 1000000000 / freq;
+    #endif // VX4_SINGLE_THREAD
+}
+
+void cpu_queue_jump(vx4_cpu *vcpu, mem_addr new_ip)
+{
+    vcpu->cpu.ip = new_ip;
+}
+
+void cpu_interrupt_set(vx4_cpu *vcpu, bool enabled)
 {
-    (void)data;
+    if (SYNC_LOCK(vcpu->cpu.flags_mutex) != 0) {
+        return;
+    }
+
+    vcpu->cpu.flags.intr = enabled;
 
-    while (cpu_step());
+    SYNC_UNLOCK(vcpu->cpu.flags_mutex);
 
-    if (SDL_LockMutex(flags_mutex) != 0) {
-        return 1;
+    // Any interrupts raised while disabled can now be taken
+    if (enabled) {
+        signal_events(vcpu);
+    }
+}
+
+error_t cpu_interrupt_return(vx4_cpu *vcpu)
+{
+    if (SYNC_LOCK(vcpu->cpu.flags_mutex) != 0) {
+        return ERR_EXTERN;
     }
 
-    do_stopping = true;
+    if (vcpu->intr_depth == 0) {
+        SYNC_UNLOCK(vcpu->cpu.flags_mutex);
+        return ERR_PCOND;
+    }
 
-    SDL_UnlockMutex(flags_mutex);
-    return 0;
+    // Only the interrupted code's intr flag comes back, so that a reset or
+    // halt raised since isn't lost
+    if (vcpu->intr_depth == 1) {
+        cpu_bank_restore(vcpu);
+    }
+    else if (cpu_state_fill(vcpu) != ERR_NOERR) {
+        SYNC_UNLOCK(vcpu->cpu.flags_mutex);
+        return ERR_PCOND;
+    }
+
+    --vcpu->intr_depth;
+    bool enabled = vcpu->cpu.flags.intr;
+
+    SYNC_UNLOCK(vcpu->cpu.flags_mutex);
+
+    // Any interrupts raised during the handler can now be taken
+    if (enabled) {
+        signal_events(vcpu);
+    }
+
+    return ERR_NOERR;
+}
+
+void cpu_signal_events(vx4_machine *vm, unsigned cpu)
+{
+    if (cpu < CPU_MAX_CPUS && vm->cpus.list[cpu] != NULL) {
+        signal_events(vm->cpus.list[cpu]);
+    }
+}
+
+error_t cpu_get_wake_stats(vx4_machine *vm, unsigned cpu, cpu_wake_stats *stats)
+{
+    if (cpu >= vm->cpus.count) {
+        return ERR_INVAL;
+    }
+
+    *stats = vm->cpus.wake_stats[cpu];
+    return ERR_NOERR;
+}
+
+error_t cpu_get_spin_stats(vx4_machine *vm, unsigned cpu, cpu_spin_stats *stats)
+{
+    if (cpu >= vm->cpus.count) {
+        return ERR_INVAL;
+    }
+
+    *stats = vm->cpus.spin_stats[cpu];
+    return ERR_NOERR;
+}
+
+error_t cpu_get_retired(vx4_machine *vm, unsigned cpu, uint64_t *count)
+{
+    if (cpu >= vm->cpus.count) {
+        return ERR_INVAL;
+    }
+
+    *count = vm->cpus.retired[cpu];
+    return ERR_NOERR;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Module internal functions
+////////////////////////////////////////////////////////////////////////////////
+
+error_t cpu_prepare(vx4_machine *vm)
+{
+    if (port_install(vm, &control_port, &vm->cpus.port) != ERR_NOERR) {
+        return ERR_PORT;
+    }
+
+    vm->cpus.idle_mutex = SDL_CreateMutex();
+    vm->cpus.idle_cond = SDL_CreateCond();
+
+    if (!vm->cpus.idle_mutex || !vm->cpus.idle_cond) {
+        cpu_cleanup(vm);
+        return ERR_EXTERN;
+    }
+
+    atomic_store(&vm->cpus.sleeping, 0);
+    memset(vm->cpus.wake_stats, 0, sizeof (vm->cpus.wake_stats));
+    memset(vm->cpus.spin_stats, 0, sizeof (vm->cpus.spin_stats));
+    memset(vm->cpus.retired, 0, sizeof (vm->cpus.retired));
+    memset(vm->cpus.virtual_ns, 0, sizeof (vm->cpus.virtual_ns));
+    vm->cpus.started = SDL_GetPerformanceCounter();
+
+    atomic_store(&vm->cpus.running, vm->cpus.count);
+    atomic_store(&vm->cpus.do_stopping, false);
+
+    vm->cpus.turn = 0;
+    vm->cpus.turn_left = CPU_TURN_INS;
+
+    for (unsigned i = 0; i < vm->cpus.count; ++i) {
+        error_t err = cpu_create(vm, i);
+
+        if (err != ERR_NOERR) {
+            cpu_cleanup(vm);
+            return err;
+        }
+    }
+
+    mem_watch_set_handler(vm, cpu_code_written);
+
+    return ERR_NOERR;
+}
+
+void cpu_cleanup(vx4_machine *vm)
+{
+    mem_watch_set_handler(vm, NULL);
+
+    for (unsigned i = 0; i < CPU_MAX_CPUS; ++i) {
+        if (vm->cpus.list[i] != NULL) {
+            cpu_destroy(vm->cpus.list[i]);
+        }
+    }
+
+    SDL_DestroyCond(vm->cpus.idle_cond);
+    SDL_DestroyMutex(vm->cpus.idle_mutex);
+    vm->cpus.idle_cond = NULL;
+    vm->cpus.idle_mutex = NULL;
+
+    port_remove(vm, vm->cpus.port);
+}
+
+error_t cpu_create(vx4_machine *vm, unsigned id)
+{
+    vx4_cpu *vcpu = calloc(1, sizeof (vx4_cpu));
+    if (vcpu == NULL) {
+        return ERR_NOMEM;
+    }
+
+    // Listed straight away, so cpu_cleanup can free it if anything fails
+    vcpu->vm = vm;
+    vcpu->id = id;
+    vm->cpus.list[id] = vcpu;
+
+    mem_cache_begin(vm, &vcpu->memcache);
+
+    vcpu->cpu.flags_mutex = SDL_CreateMutex();
+    vcpu->cpu.stale_mutex = SDL_CreateMutex();
+
+    if (!vcpu->cpu.flags_mutex || !vcpu->cpu.stale_mutex) {
+        return ERR_EXTERN;
+    }
+
+    error_t err = mmu_begin(vcpu);
+
+    if (err == ERR_NOERR) {
+        err = icache_begin(vcpu);
+    }
+
+    if (err == ERR_NOERR && vm->cpus.selected_core == CPU_CORE_JIT) {
+        err = jit_begin(vcpu);
+    }
+
+    if (err == ERR_NOERR && vm->cpus.selected_core == CPU_CORE_AOT) {
+        err = aot_begin(vcpu, vm->cpus.aot_image);
+    }
+
+    if (err != ERR_NOERR) {
+        return err;
+    }
+
+    // Cause the CPU to jump to the correct firmware address
+    vcpu->cpu.flags.reset = true;
+    signal_events(vcpu);
+
+    return ERR_NOERR;
+}
+
+void cpu_destroy(vx4_cpu *vcpu)
+{
+    mmu_end(vcpu);
+    icache_end(vcpu);
+    jit_end(vcpu);
+    aot_end(vcpu);
+
+    SDL_DestroyMutex(vcpu->cpu.stale_mutex);
+    SDL_DestroyMutex(vcpu->cpu.flags_mutex);
+
+    vcpu->vm->cpus.list[vcpu->id] = NULL;
+    free(vcpu);
+}
+
+cpu_status cpu_service(vx4_cpu *vcpu, bool take_interrupts)
+{
+    vx4_machine *vm = vcpu->vm;
+
+    // Anything signalled from here on will be seen on the next check
+    atomic_exchange_explicit(&vcpu->cpu.events, 0, memory_order_acq_rel);
+
+    if (SYNC_LOCK(vcpu->cpu.flags_mutex) != 0) {
+        signal_events(vcpu);
+        return CPU_AGAIN;
+    }
+
+    if (vcpu->cpu.flags.halt) {
+        SYNC_UNLOCK(vcpu->cpu.flags_mutex);
+        return CPU_STOP;
+    }
+
+    cpu_discard_stale(vcpu);
+
+    if (vcpu->cpu.flags.reset) {
+        vcpu->cpu.flags.reset = false;
+        vcpu->cpu.waiting = false;
+        vcpu->cpu.spin.repeats = 0;
+        mem_read_word(vm, 0x0, &vcpu->cpu.ip); // The reset vector is in place of the 0th IV
+        // Sensible values for sp and bp, remembering they grow down
+        vcpu->stack.sp = vcpu->stack.bp = GFX_MMAP_START - (vcpu->id * CPU_STACK_SIZE);
+        // Every CPU runs the same firmware, so it needs some way to tell them apart
+        vcpu->registers[REG_R0] = vcpu->id;
+        // Because we have a sensible stack, we can start with interrupts
+        vcpu->cpu.flags.intr = true;
+        vcpu->intr_depth = 0;
+        // Paging starts off, and any fault from before is forgotten
+        mmu_set_base(vcpu, 0);
+        mmu_take_fault(vcpu);
+    }
+
+    // Any pending interrupt ends a wfi, even one that can't be taken yet
+    if (vcpu->cpu.waiting && interrupt_pending(vm, vcpu->id)) {
+        vcpu->cpu.waiting = false;
+    }
+
+    if (vcpu->cpu.flags.intr && !take_interrupts && interrupt_pending(vm, vcpu->id)) {
+        SYNC_UNLOCK(vcpu->cpu.flags_mutex);
+        signal_events(vcpu);
+        return CPU_INTERRUPT;
+    }
+
+    if (vcpu->cpu.flags.intr) {
+        intr_id next_intr = interrupt_which(vm, vcpu->id);
+        if (next_intr != INTR_INVALID) {
+            // Fetch our interrupt vector (IV)
+            mem_addr next_ip;
+            mem_read_word(vm, next_intr * 4, &next_ip);
+
+            // Neither 0 nor 1 are sensible IVs (they are both inside the IVT)
+            // So we use them as a signal to reset (0) or halt (1) instead
+            if (next_ip == 0) {
+                vcpu->cpu.flags.reset = true;
+                SYNC_UNLOCK(vcpu->cpu.flags_mutex);
+                signal_events(vcpu);
+                return CPU_AGAIN;
+            }
+            else if (next_ip == 1) {
+                // Halts the whole machine, which needs every CPU's lock in turn
+                SYNC_UNLOCK(vcpu->cpu.flags_mutex);
+                cpu_queue_halt(vm);
+                return CPU_AGAIN;
+            }
+
+            // If spilling to the stack fails, cause a reset
+            RESET_ON(cpu_interrupt_enter(vcpu, next_ip));
+
+            // Only one interrupt is taken at a time, leave the rest for later
+            if (interrupt_pending(vm, vcpu->id)) {
+                signal_events(vcpu);
+            }
+        }
+    }
+
+    cpu_status stat = CPU_RUN;
+
+    if (vcpu->cpu.waiting) {
+        stat = CPU_WAIT;
+    }
+    else if (vcpu->cpu.spin.backoff) {
+        stat = CPU_BACKOFF;
+    }
+
+    SYNC_UNLOCK(vcpu->cpu.flags_mutex);
+    return stat;
+}
+
+void cpu_bank_save(vx4_cpu *vcpu)
+{
+    cpu_bank *bank = &vcpu->bank;
+
+    memcpy(bank->registers, vcpu->registers, sizeof (reg_file));
+    memcpy(bank->compared, vcpu->compared, sizeof (bank->compared));
+    memcpy(bank->vregisters, vcpu->vregisters, sizeof (vreg_file));
+    memcpy(bank->fregisters, vcpu->fregisters, sizeof (freg_file));
+    bank->stack = vcpu->stack;
+    bank->ip = vcpu->cpu.ip;
+    bank->flags = vcpu->cpu.flags;
+}
+
+void cpu_bank_restore(vx4_cpu *vcpu)
+{
+    const cpu_bank *bank = &vcpu->bank;
+
+    memcpy(vcpu->registers, bank->registers, sizeof (reg_file));
+    memcpy(vcpu->compared, bank->compared, sizeof (bank->compared));
+    memcpy(vcpu->vregisters, bank->vregisters, sizeof (vreg_file));
+    memcpy(vcpu->fregisters, bank->fregisters, sizeof (freg_file));
+    vcpu->stack = bank->stack;
+    vcpu->cpu.ip = bank->ip;
+    vcpu->cpu.flags.intr = bank->flags.intr;
+}
+
+error_t cpu_state_spill(vx4_cpu *vcpu)
+{
+    if (stack_enter_frame(vcpu) != ERR_NOERR
+        || stack_push(vcpu, vcpu->cpu.ip) != ERR_NOERR
+        || stack_push_multi(vcpu, (uint32_t *)&vcpu->cpu.flags, sizeof (cpu_flags) / 4) != ERR_NOERR
+        || stack_skip(vcpu, REG_NUM_REGS) != ERR_NOERR
+        || reg_write_all_mem(vcpu, vcpu->stack.sp) != ERR_NOERR
+        || stack_skip(vcpu, FREG_NUM_REGS * FREG_SIZE / 4) != ERR_NOERR
+        || fpu_write_all_mem(vcpu, vcpu->stack.sp) != ERR_NOERR
+        || stack_push_multi(vcpu, vcpu->compared, 2) != ERR_NOERR
+        || stack_skip(vcpu, sizeof (vreg_file) / 4) != ERR_NOERR
+        || mmu_write_mem(vcpu, vcpu->stack.sp, vcpu->vregisters, sizeof (vreg_file)) != ERR_NOERR) {
+        return ERR_PCOND;
+    }
+
+    return ERR_NOERR;
+}
+
+error_t cpu_interrupt_enter(vx4_cpu *vcpu, mem_addr next_ip)
+{
+    // Save our state, to the bank unless an interrupt is already using it
+    if (vcpu->intr_depth == 0) {
+        cpu_bank_save(vcpu);
+    }
+    else if (cpu_state_spill(vcpu) != ERR_NOERR) {
+        return ERR_PCOND;
+    }
+
+    // Handlers run with interrupts masked until iret (or sti)
+    ++vcpu->intr_depth;
+    vcpu->cpu.flags.intr = false;
+
+    // Finally, do the jump
+    vcpu->cpu.ip = next_ip;
+    vcpu->cpu.spin.repeats = 0;
+
+    return ERR_NOERR;
+}
+
+error_t cpu_state_fill(vx4_cpu *vcpu)
+{
+    cpu_flags flags;
+
+    // The exact reverse of cpu_state_spill, from the frame it entered, so
+    // anything the handler left on the stack is dropped as by leave
+    vcpu->stack.sp = vcpu->stack.bp - CPU_SPILL_SIZE;
+
+    if (mmu_read_mem(vcpu, vcpu->stack.sp, vcpu->vregisters, sizeof (vreg_file)) != ERR_NOERR
+        || stack_unskip(vcpu, sizeof (vreg_file) / 4) != ERR_NOERR
+        || stack_pop_multi(vcpu, vcpu->compared, 2) != ERR_NOERR
+        || fpu_read_all_mem(vcpu, vcpu->stack.sp) != ERR_NOERR
+        || stack_unskip(vcpu, FREG_NUM_REGS * FREG_SIZE / 4) != ERR_NOERR
+        || reg_read_all_mem(vcpu, vcpu->stack.sp) != ERR_NOERR
+        || stack_unskip(vcpu, REG_NUM_REGS) != ERR_NOERR
+        || stack_pop_multi(vcpu, (uint32_t *)&flags, sizeof (cpu_flags) / 4) != ERR_NOERR
+        || stack_pop(vcpu, &vcpu->cpu.ip) != ERR_NOERR
+        || stack_leave_frame(vcpu) != ERR_NOERR) {
+        return ERR_PCOND;
+    }
+
+    vcpu->cpu.flags.intr = flags.intr;
+    return ERR_NOERR;
+}
+
+void cpu_stopped(vx4_cpu *vcpu)
+{
+    vcpu->cpu.stopped = true;
+
+    if (atomic_fetch_sub(&vcpu->vm->cpus.running, 1) == 1) {
+        atomic_store(&vcpu->vm->cpus.do_stopping, true);
+    }
+}
+
+void cpu_retire(vx4_cpu *vcpu)
+{
+    uint64_t ran = vcpu->cpu.slice - vcpu->cpu.budget;
+
+    vcpu->vm->cpus.retired[vcpu->id] += ran;
+
+    #ifdef VX4_SINGLE_THREAD
+    unsigned mhz = vcpu->cpu.pace.mhz ? vcpu->cpu.pace.mhz : CPU_VIRTUAL_MHZ;
+
+    vcpu->vm->cpus.virtual_ns[vcpu->id] += ran * 1000 / mhz;
+    #endif // VX4_SINGLE_THREAD
+
+    // Counted from here on by cpu_read_ins, until the next slice
+    vcpu->cpu.slice = vcpu->cpu.budget;
+}
+
+int64_t cpu_pace_slice(vx4_cpu *vcpu)
+{
+    cpu_pace_state *pace = &vcpu->cpu.pace;
+    unsigned mhz = cpu_get_speed(vcpu->vm);
+
+    if (mhz != pace->mhz) {
+        pace->mhz = mhz;
+        pace->start = SDL_GetPerformanceCounter();
+        pace->ins = 0;
+    }
+
+    if (mhz == 0) {
+        return INT64_MAX;
+    }
+
+    return (int64_t)mhz * 1000 * CPU_PACE_MS;
+}
+
+void cpu_pace(vx4_cpu *vcpu, uint64_t ran)
+{
+    cpu_pace_state *pace = &vcpu->cpu.pace;
+
+    if (pace->mhz == 0) {
+        return;
+    }
+
+    pace->ins += ran;
+
+    // Measured from the start of the schedule, so rounding never adds up
+    uint64_t freq = SDL_GetPerformanceFrequency();
+    uint64_t now = SDL_GetPerformanceCounter();
+    uint64_t ticks = now - pace->start;
+    uint64_t elapsed_us = ticks / freq * 1000000 + ticks % freq * 1000000 / freq;
+    uint64_t due_us = pace->ins / pace->mhz;
+
+    if (due_us > elapsed_us + 1000) {
+        // Anything waking the CPU also cuts the sleep short, to be dealt
+        // with promptly. The schedule then sends it back to sleep.
+        cpu_sleep(vcpu->vm, vcpu, (due_us - elapsed_us) / 1000);
+    }
+    else if (elapsed_us > due_us + CPU_PACE_MAX_LAG_MS * 1000) {
+        // Too far behind to catch up without a burst, so start afresh
+        pace->start = now;
+        pace->ins = 0;
+    }
+}
+
+bool cpu_events_pending(vx4_cpu *vcpu)
+{
+    // Only a hint, cpu_service does the synchronisation when it's nonzero
+    return atomic_load_explicit(&vcpu->cpu.events, memory_order_relaxed) != 0;
+}
+
+void cpu_sleep(vx4_machine *vm, vx4_cpu *vcpu, uint32_t timeout_ms)
+{
+    #ifdef VX4_SINGLE_THREAD
+    // Nothing else runs that could signal a CPU, so there's only the timeout
+    (void)vm;
+    (void)vcpu;
+    SDL_Delay(timeout_ms);
+    #else
+    cpus_context *cpus = &vm->cpus;
+
+    if (SYNC_LOCK(cpus->idle_mutex) != 0) {
+        return;
+    }
+
+    // Only signals from here on count towards the wakeup latency
+    for (unsigned i = 0; i < cpus->count; ++i) {
+        if (vcpu == NULL || vcpu == cpus->list[i]) {
+            cpus->list[i]->cpu.signalled_at = 0;
+        }
+    }
+
+    atomic_fetch_add(&cpus->sleeping, 1);
+
+    vx4_cpu *woken;
+
+    while ((woken = cpu_signalled(vm, vcpu)) == NULL) {
+        if (SDL_CondWaitTimeout(cpus->idle_cond, cpus->idle_mutex, timeout_ms) == SDL_MUTEX_TIMEDOUT) {
+            woken = cpu_signalled(vm, vcpu);
+            break;
+        }
+    }
+
+    atomic_fetch_sub(&cpus->sleeping, 1);
+
+    if (woken != NULL && woken->cpu.signalled_at != 0) {
+        cpu_wake_stats *stats = &cpus->wake_stats[woken->id];
+        uint64_t ns = (SDL_GetPerformanceCounter() - woken->cpu.signalled_at) * 1000000000 /
+            SDL_GetPerformanceFrequency();
+
+        ++stats->wakes;
+        stats->total_ns += ns;
+
+        if (ns > stats->max_ns) {
+            stats->max_ns = ns;
+        }
+    }
+
+    SYNC_UNLOCK(cpus->idle_mutex);
+    #endif // VX4_SINGLE_THREAD
+}
+
+#ifndef VX4_SINGLE_THREAD
+vx4_cpu *cpu_signalled(vx4_machine *vm, vx4_cpu *vcpu)
+{
+    if (vcpu != NULL) {
+        return cpu_events_pending(vcpu) ? vcpu : NULL;
+    }
+
+    for (unsigned i = 0; i < vm->cpus.count; ++i) {
+        vx4_cpu *curr = vm->cpus.list[i];
+
+        if (!curr->cpu.stopped && cpu_events_pending(curr)) {
+            return curr;
+        }
+    }
+
+    return NULL;
+}
+#endif // VX4_SINGLE_THREAD
+
+bool cpu_all_idle(vx4_machine *vm)
+{
+    for (unsigned i = 0; i < vm->cpus.count; ++i) {
+        vx4_cpu *vcpu = vm->cpus.list[i];
+
+        if (vcpu->cpu.stopped) {
+            continue;
+        }
+
+        if ((!vcpu->cpu.waiting && !vcpu->cpu.spin.backoff) || cpu_events_pending(vcpu)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+uint32_t cpu_backoff_begin(vx4_cpu *vcpu)
+{
+    cpu_spin_state *spin = &vcpu->cpu.spin;
+
+    if (spin->sleep_ms == 0) {
+        spin->sleep_ms = 1;
+    }
+    else if (spin->sleep_ms < CPU_SPIN_MAX_SLEEP_MS) {
+        spin->sleep_ms *= 2;
+    }
+
+    ++vcpu->vm->cpus.spin_stats[vcpu->id].backoffs;
+    return spin->sleep_ms;
+}
+
+void cpu_backoff_end(vx4_cpu *vcpu, uint64_t start)
+{
+    uint64_t ns = (SDL_GetPerformanceCounter() - start) * 1000000000 / SDL_GetPerformanceFrequency();
+
+    vcpu->vm->cpus.spin_stats[vcpu->id].slept_ns += ns;
+    vcpu->cpu.spin.backoff = false;
+}
+
+void signal_events(vx4_cpu *vcpu)
+{
+    cpus_context *cpus = &vcpu->vm->cpus;
+
+    // Pairs with the exchange in cpu_service, so everything written before
+    // this call is visible by the time the event is serviced. Sequentially
+    // consistent against cpu_sleep, so a sleeper either sees the event before
+    // waiting, or is counted in sleeping and woken here.
+    #ifdef VX4_SINGLE_THREAD
+    // Only ever serviced by this thread, and nothing can be asleep waiting for it
+    (void)cpus;
+    atomic_store_explicit(&vcpu->cpu.events, 1, memory_order_relaxed);
+    #else
+    atomic_store(&vcpu->cpu.events, 1);
+
+    if (atomic_load(&cpus->sleeping) == 0 || SYNC_LOCK(cpus->idle_mutex) != 0) {
+        return;
+    }
+
+    if (vcpu->cpu.signalled_at == 0) {
+        vcpu->cpu.signalled_at = SDL_GetPerformanceCounter();
+    }
+
+    SDL_CondBroadcast(cpus->idle_cond);
+    SYNC_UNLOCK(cpus->idle_mutex);
+    #endif // VX4_SINGLE_THREAD
+}
+
+void cpu_code_written(vx4_machine *vm, mem_addr base, mem_size num)
+{
+    for (unsigned i = 0; i < vm->cpus.count; ++i) {
+        vx4_cpu *vcpu = vm->cpus.list[i];
+        cpu_context *cpu = &vcpu->cpu;
+
+        if (SYNC_LOCK(cpu->stale_mutex) != 0) {
+            continue;
+        }
+
+        if (cpu->num_stale < CPU_STALE_RANGES) {
+            cpu->stale[cpu->num_stale].base = base;
+            cpu->stale[cpu->num_stale].num = num;
+        }
+
+        // Past CPU_STALE_RANGES, the count only says to flush everything
+        if (cpu->num_stale <= CPU_STALE_RANGES) {
+            ++cpu->num_stale;
+        }
+
+        SYNC_UNLOCK(cpu->stale_mutex);
+        signal_events(vcpu);
+    }
+}
+
+void cpu_discard_stale(vx4_cpu *vcpu)
+{
+    cpu_context *cpu = &vcpu->cpu;
+    cpu_stale_range stale[CPU_STALE_RANGES];
+    unsigned num_stale;
+
+    // Copied out, so that other CPUs aren't kept waiting on the lock
+    if (SYNC_LOCK(cpu->stale_mutex) != 0) {
+        return;
+    }
+
+    num_stale = cpu->num_stale;
+    cpu->num_stale = 0;
+
+    for (unsigned i = 0; i < num_stale && i < CPU_STALE_RANGES; ++i) {
+        stale[i] = cpu->stale[i];
+    }
+
+    SYNC_UNLOCK(cpu->stale_mutex);
+
+    cpu_core core = vcpu->vm->cpus.selected_core;
+
+    if (num_stale > CPU_STALE_RANGES) {
+        icache_flush(vcpu);
+
+        if (core == CPU_CORE_JIT) {
+            jit_flush(vcpu);
+        }
+        else if (core == CPU_CORE_AOT) {
+            aot_flush(vcpu);
+        }
+        return;
+    }
+
+    for (unsigned i = 0; i < num_stale; ++i) {
+        icache_invalidate(vcpu, stale[i].base, stale[i].num);
+
+        if (core == CPU_CORE_JIT) {
+            jit_invalidate(vcpu, stale[i].base, stale[i].num);
+        }
+        else if (core == CPU_CORE_AOT) {
+            aot_invalidate(vcpu, stale[i].base, stale[i].num);
+        }
+    }
+}
+
+void cpu_execute(vx4_cpu *vcpu)
+{
+    mem_addr ip = vcpu->cpu.ip;
+    const instruction_decoded *curr;
+
+    if (!mmu_enabled(vcpu)) {
+        curr = icache_fetch(vcpu, ip);
+    }
+    else {
+        if (cpu_fetch_paged(vcpu, ip, &curr) != ERR_NOERR) {
+            cpu_fault(vcpu, ip);
+            return;
+        }
+    }
+
+    vcpu->cpu.ip += curr->size;
+
+    if ((curr->func)(vcpu, &curr->ops) != ERR_NOERR) {
+        cpu_fault(vcpu, ip);
+    }
+}
+
+error_t cpu_fetch_paged(vx4_cpu *vcpu, mem_addr ip, const instruction_decoded **curr)
+{
+    mem_addr addr, last;
+
+    if (mmu_translate(vcpu, ip, MMU_EXEC, &addr) != ERR_NOERR) {
+        return ERR_PCOND;
+    }
+
+    // Decoded from physical memory, so cached by physical address, which
+    // also keeps the cache coherent with writes through other mappings
+    *curr = icache_fetch(vcpu, addr);
+    mem_size size = (*curr)->size;
+
+    // A misaligned instruction is invalid, wherever its bytes come from
+    if (MMU_PAGE_OFFSET(addr) + size <= MMU_PAGE_SIZE || !MEM_IS_ALIGNED(addr, 2)) {
+        return ERR_NOERR;
+    }
+
+    if (mmu_translate(vcpu, ip + size - 1, MMU_EXEC, &last) != ERR_NOERR) {
+        return ERR_PCOND;
+    }
+
+    // The icache decoded the rest from the wrong page, so the bytes are
+    // gathered from both and decoded apart, uncached as this is rare
+    if (last != addr + size - 1) {
+        uint8_t code[INS_MAX_SIZE];
+        mem_size first = MMU_PAGE_SIZE - MMU_PAGE_OFFSET(addr);
+
+        mem_read_mem(vcpu->vm, addr, code, first);
+        mem_read_mem(vcpu->vm, last - (size - 1 - first), code + first, size - first);
+
+        instruction_decode_bytes(code, &vcpu->cpu.split);
+        *curr = &vcpu->cpu.split;
+    }
+
+    return ERR_NOERR;
+}
+
+void cpu_fault(vx4_cpu *vcpu, mem_addr ip)
+{
+    if (!mmu_take_fault(vcpu)) {
+        interrupt_send(vcpu->vm, vcpu->id, INTR_INS);
+        return;
+    }
+
+    vcpu->cpu.ip = ip;
+
+    if (SYNC_LOCK(vcpu->cpu.flags_mutex) != 0) {
+        return;
+    }
+
+    // Taken here rather than sent, as the instruction can't go on until
+    // the page is mapped, whether or not interrupts are masked. The vector
+    // can reset (0) or halt (1) instead, as for any other interrupt
+    mem_addr next_ip;
+    mem_read_word(vcpu->vm, INTR_PAGE * 4, &next_ip);
+
+    if (next_ip == 1) {
+        SYNC_UNLOCK(vcpu->cpu.flags_mutex);
+        cpu_queue_halt(vcpu->vm);
+        return;
+    }
+
+    // A fault spilling the state is one the handler could never see
+    bool reset = next_ip == 0 || cpu_interrupt_enter(vcpu, next_ip) != ERR_NOERR;
+
+    if (reset) {
+        vcpu->cpu.flags.reset = true;
+    }
+
+    SYNC_UNLOCK(vcpu->cpu.flags_mutex);
+
+    if (reset) {
+        signal_events(vcpu);
+    }
+}
+
+void cpu_run_core(vx4_cpu *vcpu)
+{
+    switch (vcpu->vm->cpus.selected_core) {
+        case CPU_CORE_REFERENCE:
+            cpu_run_reference(vcpu);
+            break;
+
+        #ifdef CPU_THREADED
+        case CPU_CORE_THREADED:
+            cpu_run_threaded(vcpu);
+            break;
+        #endif // CPU_THREADED
+
+        #ifdef JIT_SUPPORTED
+        case CPU_CORE_JIT:
+            cpu_run_jit(vcpu);
+            break;
+        #endif // JIT_SUPPORTED
+
+        case CPU_CORE_AOT:
+            cpu_run_aot(vcpu);
+            break;
+
+        default:
+            // A core this build doesn't have, which cpu_set_core refuses
+            cpu_run_reference(vcpu);
+            break;
+    }
+}
+
+void cpu_run_reference(vx4_cpu *vcpu)
+{
+    FILE *trace_file = vcpu->vm->cpus.trace_file;
+
+    while (vcpu->cpu.budget > 0 && !cpu_events_pending(vcpu)) {
+        const instruction_decoded *curr;
+
+        // An instruction that can't be fetched will fault instead
+        if (trace_file != NULL && cpu_fetch_paged(vcpu, vcpu->cpu.ip, &curr) == ERR_NOERR) {
+            char text[64];
+
+            instruction_disassemble(curr->id, &curr->ops, text, sizeof (text));
+            fprintf(trace_file, "%08x %u %s\n", (unsigned)vcpu->cpu.ip, (unsigned)curr->size, text);
+        }
+
+        cpu_execute(vcpu);
+        --vcpu->cpu.budget;
+    }
+}
+
+#ifdef CPU_THREADED
+void cpu_run_threaded(vx4_cpu *vcpu)
+{
+    // Indexed by instruction id, every id (fused or not) must have an entry,
+    // each instruction's do_<name> label being listed by ISA_INSTRUCTIONS
+    static const void *const handlers[INS_NUM_IDS] = {
+#define X(NAME, name, form) [INS_##NAME] = &&do_##name,
+        ISA_INSTRUCTIONS(X)
+#undef X
+        [INS_INVALID] = &&do_invalid,
+
+        [INS_FUSED_MOVRC_STORR] = &&do_movrc_storr,
+        [INS_FUSED_MOVRC_OUTPR] = &&do_movrc_outpr,
+        [INS_FUSED_ADDRC_STORR] = &&do_addrc_storr,
+        [INS_FUSED_ADDRC_JMPC] = &&do_addrc_jmpc,
+        [INS_FUSED_MOVRC_MOVRC_STORR] = &&do_movrc_movrc_storr,
+    };
+
+    // Kept in host locals for the duration, the ip is only updated on exit
+    vx4_machine *const vm = vcpu->vm;
+    uint32_t *const regs = vcpu->registers;
+    vreg *const vregs = vcpu->vregisters;
+    freg *const fregs = vcpu->fregisters;
+    mem_addr ip = vcpu->cpu.ip;
+    int64_t left = vcpu->cpu.budget;
+    const instruction_decoded *curr;
+    uint32_t word;
+    uint64_t dword;
+    mem_size offset;
+
+    // Set for the whole run, as changing the page table base stops it
+    const bool paged = mmu_enabled(vcpu);
+    mem_addr code_page = MMU_NO_PAGE; // The page last fetched from, and its frame
+    mem_addr code_frame = 0;
+
+    // Each handler ends with its own copy of the dispatch code, which gives
+    // the host's branch predictor a separate history for every instruction.
+    // Paged code shares one, see dispatch_paged
+    #define DISPATCH() \
+        do { \
+            if (cpu_events_pending(vcpu) || left == 0) { \
+                goto out; \
+            } \
+            if (paged) { \
+                goto dispatch_paged; \
+            } \
+            curr = icache_fetch(vcpu, ip); \
+            if (curr->fused_len <= left) { \
+                left -= curr->fused_len; \
+                ip += curr->fused_size; \
+                goto *handlers[curr->fused]; \
+            } \
+            /* Not enough budget left for the whole superinstruction */ \
+            --left; \
+            ip += curr->size; \
+            goto *handlers[curr->id]; \
+        } while (0)
+
+    #define OP(n) (curr->ops.n)
+    #define NEXT(i, n) (curr->next[i].n) // Operands of fused instructions
+
+    // The operands of the last compare, as signed for the signed jumps
+    #define CMP_A (vcpu->compared[0])
+    #define CMP_B (vcpu->compared[1])
+    #define CMP_SA ((int32_t)vcpu->compared[0])
+    #define CMP_SB ((int32_t)vcpu->compared[1])
+
+    DISPATCH();
+
+do_nop:
+    DISPATCH();
+
+do_hlt:
+    cpu_queue_stop(vcpu);
+    goto out;
+
+do_jmpc:
+    ip = OP(imm);
+    DISPATCH();
+
+do_movrc:
+    regs[OP(reg[0])] = OP(imm);
+    DISPATCH();
+
+do_movmr:
+    if (mmu_write_word(vcpu, OP(imm), regs[OP(reg[0])]) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    DISPATCH();
+
+do_addrc:
+    regs[OP(reg[0])] += OP(imm);
+    DISPATCH();
+
+do_storr:
+    if (mmu_write_word(vcpu, regs[OP(reg[0])], regs[OP(reg[1])]) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    DISPATCH();
+
+do_outpr:
+    port_write(vm, OP(port), regs[OP(reg[0])]);
+    cpu_port_written(vcpu);
+    DISPATCH();
+
+do_inrp:
+    word = 0;
+    port_read(vm, OP(port), &word);
+    regs[OP(reg[0])] = word;
+    vcpu->cpu.ip = ip; // Where the spin detection finds it
+    cpu_port_polled(vcpu, OP(port), word);
+    DISPATCH();
+
+do_cli:
+    cpu_interrupt_set(vcpu, false);
+    DISPATCH();
+
+do_sti:
+    cpu_interrupt_set(vcpu, true);
+    DISPATCH();
+
+do_wfi:
+    cpu_queue_wait(vcpu);
+    goto out;
+
+do_rdins:
+    // Counted before this instruction, as the other cores do
+    vcpu->cpu.budget = left + 1;
+    dword = cpu_read_ins(vcpu);
+    regs[OP(reg[0])] = (uint32_t)dword;
+    regs[OP(reg[1])] = (uint32_t)(dword >> 32);
+    DISPATCH();
+
+do_rdtime:
+    vcpu->cpu.budget = left + 1;
+    dword = cpu_read_time(vcpu);
+    regs[OP(reg[0])] = (uint32_t)dword;
+    regs[OP(reg[1])] = (uint32_t)(dword >> 32);
+    DISPATCH();
+
+do_movrr:
+    regs[OP(reg[0])] = regs[OP(reg[1])];
+    DISPATCH();
+
+do_movrm:
+    if (mmu_read_word(vcpu, OP(imm), &regs[OP(reg[0])]) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    DISPATCH();
+
+do_loado:
+    if (mmu_read_word(vcpu, regs[OP(reg[0])] + OP(imm), &regs[OP(reg[1])]) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    DISPATCH();
+
+do_storo:
+    if (mmu_write_word(vcpu, regs[OP(reg[0])] + OP(imm), regs[OP(reg[1])]) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    DISPATCH();
+
+do_addrr:
+    regs[OP(reg[0])] += regs[OP(reg[1])];
+    DISPATCH();
+
+do_subrr:
+    regs[OP(reg[0])] -= regs[OP(reg[1])];
+    DISPATCH();
+
+do_mulrr:
+    regs[OP(reg[0])] *= regs[OP(reg[1])];
+    DISPATCH();
+
+do_divrr:
+    if (regs[OP(reg[1])] == 0) {
+        goto do_invalid;
+    }
+    regs[OP(reg[0])] /= regs[OP(reg[1])];
+    DISPATCH();
+
+do_andrr:
+    regs[OP(reg[0])] &= regs[OP(reg[1])];
+    DISPATCH();
+
+do_orrr:
+    regs[OP(reg[0])] |= regs[OP(reg[1])];
+    DISPATCH();
+
+do_xorrr:
+    regs[OP(reg[0])] ^= regs[OP(reg[1])];
+    DISPATCH();
+
+do_shlrr:
+    regs[OP(reg[0])] <<= regs[OP(reg[1])] % 32;
+    DISPATCH();
+
+do_shrrr:
+    regs[OP(reg[0])] >>= regs[OP(reg[1])] % 32;
+    DISPATCH();
+
+do_sarrr:
+    regs[OP(reg[0])] = (uint32_t)((int32_t)regs[OP(reg[0])] >> regs[OP(reg[1])] % 32);
+    DISPATCH();
+
+do_subrc:
+    regs[OP(reg[0])] -= OP(imm);
+    DISPATCH();
+
+do_mulrc:
+    regs[OP(reg[0])] *= OP(imm);
+    DISPATCH();
+
+do_divrc:
+    if (OP(imm) == 0) {
+        goto do_invalid;
+    }
+    regs[OP(reg[0])] /= OP(imm);
+    DISPATCH();
+
+do_andrc:
+    regs[OP(reg[0])] &= OP(imm);
+    DISPATCH();
+
+do_orrc:
+    regs[OP(reg[0])] |= OP(imm);
+    DISPATCH();
+
+do_xorrc:
+    regs[OP(reg[0])] ^= OP(imm);
+    DISPATCH();
+
+do_shlrc:
+    regs[OP(reg[0])] <<= OP(imm) % 32;
+    DISPATCH();
+
+do_shrrc:
+    regs[OP(reg[0])] >>= OP(imm) % 32;
+    DISPATCH();
+
+do_sarrc:
+    regs[OP(reg[0])] = (uint32_t)((int32_t)regs[OP(reg[0])] >> OP(imm) % 32);
+    DISPATCH();
+
+do_cmprr:
+    vcpu->compared[0] = regs[OP(reg[0])];
+    vcpu->compared[1] = regs[OP(reg[1])];
+    DISPATCH();
+
+do_cmprc:
+    vcpu->compared[0] = regs[OP(reg[0])];
+    vcpu->compared[1] = OP(imm);
+    DISPATCH();
+
+do_jeq:
+    if (CMP_A == CMP_B) {
+        ip = OP(imm);
+    }
+    DISPATCH();
+
+do_jne:
+    if (CMP_A != CMP_B) {
+        ip = OP(imm);
+    }
+    DISPATCH();
+
+do_jlt:
+    if (CMP_SA < CMP_SB) {
+        ip = OP(imm);
+    }
+    DISPATCH();
+
+do_jle:
+    if (CMP_SA <= CMP_SB) {
+        ip = OP(imm);
+    }
+    DISPATCH();
+
+do_jgt:
+    if (CMP_SA > CMP_SB) {
+        ip = OP(imm);
+    }
+    DISPATCH();
+
+do_jge:
+    if (CMP_SA >= CMP_SB) {
+        ip = OP(imm);
+    }
+    DISPATCH();
+
+do_jltu:
+    if (CMP_A < CMP_B) {
+        ip = OP(imm);
+    }
+    DISPATCH();
+
+do_jleu:
+    if (CMP_A <= CMP_B) {
+        ip = OP(imm);
+    }
+    DISPATCH();
+
+do_jgtu:
+    if (CMP_A > CMP_B) {
+        ip = OP(imm);
+    }
+    DISPATCH();
+
+do_jgeu:
+    if (CMP_A >= CMP_B) {
+        ip = OP(imm);
+    }
+    DISPATCH();
+
+do_callc:
+    if (stack_push(vcpu, ip) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    ip = OP(imm);
+    DISPATCH();
+
+do_ret:
+    if (stack_pop(vcpu, &word) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    ip = word;
+    DISPATCH();
+
+do_enter:
+    if (stack_enter_frame(vcpu) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    DISPATCH();
+
+do_leave:
+    if (stack_leave_frame(vcpu) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    DISPATCH();
+
+do_pushr:
+    if (stack_push(vcpu, regs[OP(reg[0])]) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    DISPATCH();
+
+do_popr:
+    if (stack_pop(vcpu, &regs[OP(reg[0])]) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    DISPATCH();
+
+do_vload:
+    if (mmu_read_vector(vcpu, regs[OP(reg[1])], &vregs[OP(reg[0])]) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    DISPATCH();
+
+do_vstor:
+    if (mmu_write_vector(vcpu, regs[OP(reg[0])], &vregs[OP(reg[1])]) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    DISPATCH();
+
+do_vmov:
+    vregs[OP(reg[0])] = vregs[OP(reg[1])];
+    DISPATCH();
+
+do_vsplat:
+    word = regs[OP(reg[1])];
+    for (int i = 0; i < VREG_SIZE / 4; ++i) {
+        vregs[OP(reg[0])].w[i] = word;
+    }
+    DISPATCH();
+
+do_vextr:
+    regs[OP(reg[0])] = vregs[OP(reg[1])].w[OP(imm)];
+    DISPATCH();
+
+do_vshuf32:
+    vector_shuf32(&vregs[OP(reg[0])], &vregs[OP(reg[1])], (uint8_t)OP(imm));
+    DISPATCH();
+
+do_vadd8:
+    vector_add8(&vregs[OP(reg[0])], &vregs[OP(reg[1])]);
+    DISPATCH();
+
+do_vadd16:
+    vector_add16(&vregs[OP(reg[0])], &vregs[OP(reg[1])]);
+    DISPATCH();
+
+do_vadd32:
+    vector_add32(&vregs[OP(reg[0])], &vregs[OP(reg[1])]);
+    DISPATCH();
+
+do_vsub8:
+    vector_sub8(&vregs[OP(reg[0])], &vregs[OP(reg[1])]);
+    DISPATCH();
+
+do_vsub16:
+    vector_sub16(&vregs[OP(reg[0])], &vregs[OP(reg[1])]);
+    DISPATCH();
+
+do_vsub32:
+    vector_sub32(&vregs[OP(reg[0])], &vregs[OP(reg[1])]);
+    DISPATCH();
+
+do_vmul8:
+    vector_mul8(&vregs[OP(reg[0])], &vregs[OP(reg[1])]);
+    DISPATCH();
+
+do_vmul16:
+    vector_mul16(&vregs[OP(reg[0])], &vregs[OP(reg[1])]);
+    DISPATCH();
+
+do_vmul32:
+    vector_mul32(&vregs[OP(reg[0])], &vregs[OP(reg[1])]);
+    DISPATCH();
+
+do_vminu8:
+    vector_minu8(&vregs[OP(reg[0])], &vregs[OP(reg[1])]);
+    DISPATCH();
+
+do_vminu16:
+    vector_minu16(&vregs[OP(reg[0])], &vregs[OP(reg[1])]);
+    DISPATCH();
+
+do_vminu32:
+    vector_minu32(&vregs[OP(reg[0])], &vregs[OP(reg[1])]);
+    DISPATCH();
+
+do_vmaxu8:
+    vector_maxu8(&vregs[OP(reg[0])], &vregs[OP(reg[1])]);
+    DISPATCH();
+
+do_vmaxu16:
+    vector_maxu16(&vregs[OP(reg[0])], &vregs[OP(reg[1])]);
+    DISPATCH();
+
+do_vmaxu32:
+    vector_maxu32(&vregs[OP(reg[0])], &vregs[OP(reg[1])]);
+    DISPATCH();
+
+do_vcmpeq8:
+    vector_cmpeq8(&vregs[OP(reg[0])], &vregs[OP(reg[1])]);
+    DISPATCH();
+
+do_vcmpeq16:
+    vector_cmpeq16(&vregs[OP(reg[0])], &vregs[OP(reg[1])]);
+    DISPATCH();
+
+do_vcmpeq32:
+    vector_cmpeq32(&vregs[OP(reg[0])], &vregs[OP(reg[1])]);
+    DISPATCH();
+
+do_vcmpgt8:
+    vector_cmpgt8(&vregs[OP(reg[0])], &vregs[OP(reg[1])]);
+    DISPATCH();
+
+do_vcmpgt16:
+    vector_cmpgt16(&vregs[OP(reg[0])], &vregs[OP(reg[1])]);
+    DISPATCH();
+
+do_vcmpgt32:
+    vector_cmpgt32(&vregs[OP(reg[0])], &vregs[OP(reg[1])]);
+    DISPATCH();
+
+do_vand:
+    vector_and(&vregs[OP(reg[0])], &vregs[OP(reg[1])]);
+    DISPATCH();
+
+do_vor:
+    vector_or(&vregs[OP(reg[0])], &vregs[OP(reg[1])]);
+    DISPATCH();
+
+do_vxor:
+    vector_xor(&vregs[OP(reg[0])], &vregs[OP(reg[1])]);
+    DISPATCH();
+
+do_vshuf8:
+    vector_shuf8(&vregs[OP(reg[0])], &vregs[OP(reg[1])]);
+    DISPATCH();
+
+do_fmovff:
+    fregs[OP(reg[0])].bits = fregs[OP(reg[1])].bits;
+    DISPATCH();
+
+do_fmovfr:
+    fregs[OP(reg[0])].word = regs[OP(reg[1])];
+    DISPATCH();
+
+do_fmovrf:
+    regs[OP(reg[0])] = fregs[OP(reg[1])].word;
+    DISPATCH();
+
+do_floado32:
+    if (mmu_read_word(vcpu, regs[OP(reg[0])] + OP(imm), &fregs[OP(reg[1])].word) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    DISPATCH();
+
+do_floado64:
+    if (mmu_read_dword(vcpu, regs[OP(reg[0])] + OP(imm), &fregs[OP(reg[1])].bits) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    DISPATCH();
+
+do_fstoro32:
+    if (mmu_write_word(vcpu, regs[OP(reg[0])] + OP(imm), fregs[OP(reg[1])].word) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    DISPATCH();
+
+do_fstoro64:
+    if (mmu_write_dword(vcpu, regs[OP(reg[0])] + OP(imm), fregs[OP(reg[1])].bits) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    DISPATCH();
+
+do_fadd32:
+    fregs[OP(reg[0])].f += fregs[OP(reg[1])].f;
+    DISPATCH();
+
+do_fadd64:
+    fregs[OP(reg[0])].d += fregs[OP(reg[1])].d;
+    DISPATCH();
+
+do_fsub32:
+    fregs[OP(reg[0])].f -= fregs[OP(reg[1])].f;
+    DISPATCH();
+
+do_fsub64:
+    fregs[OP(reg[0])].d -= fregs[OP(reg[1])].d;
+    DISPATCH();
+
+do_fmul32:
+    fregs[OP(reg[0])].f *= fregs[OP(reg[1])].f;
+    DISPATCH();
+
+do_fmul64:
+    fregs[OP(reg[0])].d *= fregs[OP(reg[1])].d;
+    DISPATCH();
+
+do_fdiv32:
+    fregs[OP(reg[0])].f /= fregs[OP(reg[1])].f;
+    DISPATCH();
+
+do_fdiv64:
+    fregs[OP(reg[0])].d /= fregs[OP(reg[1])].d;
+    DISPATCH();
+
+do_fsqrt32:
+    fregs[OP(reg[0])].f = sqrtf(fregs[OP(reg[1])].f);
+    DISPATCH();
+
+do_fsqrt64:
+    fregs[OP(reg[0])].d = sqrt(fregs[OP(reg[1])].d);
+    DISPATCH();
+
+do_fma32:
+    fpu_fma32(&fregs[OP(reg[0])], &fregs[OP(reg[1])], &fregs[OP(imm)]);
+    DISPATCH();
+
+do_fma64:
+    fpu_fma64(&fregs[OP(reg[0])], &fregs[OP(reg[1])], &fregs[OP(imm)]);
+    DISPATCH();
+
+do_fcmp32:
+    vcpu->compared[0] = fpu_compare(fregs[OP(reg[0])].f, fregs[OP(reg[1])].f);
+    vcpu->compared[1] = 0;
+    DISPATCH();
+
+do_fcmp64:
+    vcpu->compared[0] = fpu_compare(fregs[OP(reg[0])].d, fregs[OP(reg[1])].d);
+    vcpu->compared[1] = 0;
+    DISPATCH();
+
+do_fwiden:
+    fregs[OP(reg[0])].d = fregs[OP(reg[1])].f;
+    DISPATCH();
+
+do_fnarrow:
+    fregs[OP(reg[0])].f = (float)fregs[OP(reg[1])].d;
+    DISPATCH();
+
+do_fitof32:
+    fregs[OP(reg[0])].f = (float)(int32_t)regs[OP(reg[1])];
+    DISPATCH();
+
+do_fitof64:
+    fregs[OP(reg[0])].d = (int32_t)regs[OP(reg[1])];
+    DISPATCH();
+
+do_fftoi32:
+    fpu_ftoi32(&regs[OP(reg[0])], &fregs[OP(reg[1])]);
+    DISPATCH();
+
+do_fftoi64:
+    fpu_ftoi64(&regs[OP(reg[0])], &fregs[OP(reg[1])]);
+    DISPATCH();
+
+do_mcopy:
+    if (mmu_copy(vcpu, regs[OP(reg[0])], regs[OP(reg[1])], regs[OP(imm)]) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    DISPATCH();
+
+do_mfill:
+    if (mmu_set_bytes(vcpu, regs[OP(reg[0])], (uint8_t)regs[OP(reg[1])], regs[OP(imm)]) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    DISPATCH();
+
+do_mcmp:
+    if (mmu_compare(vcpu, regs[OP(reg[0])], regs[OP(reg[1])], regs[OP(imm)], vcpu->compared, &offset) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    DISPATCH();
+
+do_xchg:
+    if (mmu_exchange_word(vcpu, regs[OP(reg[0])], regs[OP(reg[1])], &regs[OP(reg[1])]) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    DISPATCH();
+
+do_xadd:
+    if (mmu_fetch_add_word(vcpu, regs[OP(reg[0])], regs[OP(reg[1])], &regs[OP(reg[1])]) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    DISPATCH();
+
+do_cas:
+    word = regs[OP(reg[1])];
+    if (mmu_cas_word(vcpu, regs[OP(reg[0])], &regs[OP(reg[1])], regs[OP(imm)]) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    vcpu->compared[0] = regs[OP(reg[1])];
+    vcpu->compared[1] = word;
+    DISPATCH();
+
+do_iret:
+    if (cpu_interrupt_return(vcpu) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    ip = vcpu->cpu.ip;
+    DISPATCH();
+
+do_setptb:
+    // Signals the CPU, so the run ends and the next sets paged afresh
+    mmu_set_base(vcpu, regs[OP(reg[0])]);
+    DISPATCH();
+
+do_invlpg:
+    mmu_invalidate(vcpu, regs[OP(reg[0])]);
+    code_page = MMU_NO_PAGE;
+    DISPATCH();
+
+do_tlbflush:
+    mmu_flush(vcpu);
+    code_page = MMU_NO_PAGE;
+    DISPATCH();
+
+do_rdfault:
+    mmu_last_fault(vcpu, &regs[OP(reg[0])], &regs[OP(reg[1])]);
+    DISPATCH();
+
+    // Superinstructions, see instruction_fusions
+do_movrc_storr:
+    regs[OP(reg[0])] = OP(imm);
+    if (mmu_write_word(vcpu, regs[NEXT(0, reg[0])], regs[NEXT(0, reg[1])]) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    DISPATCH();
+
+do_movrc_outpr:
+    regs[OP(reg[0])] = OP(imm);
+    port_write(vm, NEXT(0, port), regs[NEXT(0, reg[0])]);
+    cpu_port_written(vcpu);
+    DISPATCH();
+
+do_addrc_storr:
+    regs[OP(reg[0])] += OP(imm);
+    if (mmu_write_word(vcpu, regs[NEXT(0, reg[0])], regs[NEXT(0, reg[1])]) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    DISPATCH();
+
+do_addrc_jmpc:
+    regs[OP(reg[0])] += OP(imm);
+    ip = NEXT(0, imm);
+    DISPATCH();
+
+do_movrc_movrc_storr:
+    regs[OP(reg[0])] = OP(imm);
+    regs[NEXT(0, reg[0])] = NEXT(0, imm);
+    if (mmu_write_word(vcpu, regs[NEXT(1, reg[0])], regs[NEXT(1, reg[1])]) != ERR_NOERR) {
+        goto do_invalid;
+    }
+    DISPATCH();
+
+dispatch_paged:
+    // Never fused, as the instructions following may be on another page,
+    // and a fault must be pinned on the one instruction that made it
+    --left;
+
+    // Most instructions are on the same page as the last, which is already
+    // translated. Any other goes through the TLB
+    if (MMU_PAGE_OF(ip) == code_page) {
+        curr = icache_fetch(vcpu, code_frame | MMU_PAGE_OFFSET(ip));
+
+        if (MMU_PAGE_OFFSET(ip) + curr->size <= MMU_PAGE_SIZE) {
+            ip += curr->size;
+            goto *handlers[curr->id];
+        }
+    }
+
+    if (cpu_fetch_paged(vcpu, ip, &curr) != ERR_NOERR) {
+        cpu_fault(vcpu, ip);
+        ip = vcpu->cpu.ip;
+        goto out;
+    }
+
+    // Hits the TLB, having just been fetched from
+    code_page = MMU_PAGE_OF(ip);
+    mmu_translate(vcpu, code_page, MMU_EXEC, &code_frame);
+
+    ip += curr->size;
+    goto *handlers[curr->id];
+
+do_invalid:
+    // Raises INTR_INS, unless the instruction page faulted, see cpu_fault.
+    // Only unfused instructions can fault, as paged code isn't fused
+    vcpu->cpu.ip = ip;
+    cpu_fault(vcpu, ip - curr->size);
+    ip = vcpu->cpu.ip;
+
+out:
+    vcpu->cpu.ip = ip;
+    vcpu->cpu.budget = left;
+
+    #undef CMP_SB
+    #undef CMP_SA
+    #undef CMP_B
+    #undef CMP_A
+    #undef NEXT
+    #undef OP
+    #undef DISPATCH
+}
+#endif // CPU_THREADED
+
+#ifdef JIT_SUPPORTED
+void cpu_run_jit(vx4_cpu *vcpu)
+{
+    while (vcpu->cpu.budget > 0 && !cpu_events_pending(vcpu)) {
+        // Translated code takes its addresses to be physical, so with paging
+        // on, each block falls back to being interpreted
+        if (!mmu_enabled(vcpu)) {
+            vcpu->cpu.ip = jit_run(vcpu, vcpu->cpu.ip, &vcpu->cpu.budget);
+        }
+
+        // The JIT stopped at an instruction it doesn't translate, or
+        // doesn't have the budget to run a whole block
+        if (vcpu->cpu.budget > 0 && !cpu_events_pending(vcpu)) {
+            cpu_execute(vcpu);
+            --vcpu->cpu.budget;
+        }
+    }
+}
+#endif // JIT_SUPPORTED
+
+void cpu_run_aot(vx4_cpu *vcpu)
+{
+    while (vcpu->cpu.budget > 0 && !cpu_events_pending(vcpu)) {
+        // As for the JIT, blocks are only run with paging off
+        if (!mmu_enabled(vcpu)) {
+            vcpu->cpu.ip = aot_run(vcpu, vcpu->cpu.ip, &vcpu->cpu.budget);
+        }
+
+        // No block was translated here, or the budget can't cover it
+        if (vcpu->cpu.budget > 0 && !cpu_events_pending(vcpu)) {
+            cpu_execute(vcpu);
+            --vcpu->cpu.budget;
+        }
+    }
+}
+
+#ifndef VX4_SINGLE_THREAD
+int cpu_loop(void *data)
+{
+    vx4_cpu *vcpu = data;
+
+    cpu_status stat;
+
+    // Each core only returns once there's an event to service
+    while ((stat = cpu_service(vcpu, true)) != CPU_STOP) {
+        if (stat == CPU_RUN) {
+            int64_t slice = cpu_pace_slice(vcpu);
+
+            vcpu->cpu.budget = vcpu->cpu.slice = slice;
+            cpu_run_core(vcpu);
+
+            cpu_retire(vcpu);
+            cpu_pace(vcpu, slice - vcpu->cpu.budget);
+        }
+        else if (stat == CPU_WAIT) {
+            cpu_sleep(vcpu->vm, vcpu, SDL_MUTEX_MAXWAIT);
+        }
+        else if (stat == CPU_BACKOFF) {
+            uint64_t start = SDL_GetPerformanceCounter();
+
+            cpu_sleep(vcpu->vm, vcpu, cpu_backoff_begin(vcpu));
+            cpu_backoff_end(vcpu, start);
+        }
+    }
+
+    cpu_stopped(vcpu);
+    return 0;
+}
+#endif // VX4_SINGLE_THREAD
+
+void control_write(vx4_machine *vm, port_id num, uint32_t data)
+{
+    (void)num;
+    unsigned cpu = data >> 16;
+
+    // Nothing would ever take an interrupt sent to a CPU that doesn't exist
+    if (cpu < vm->cpus.count) {
+        interrupt_send(vm, cpu, data & 0xFFFF);
+    }
+}
+
+uint32_t control_read(vx4_machine *vm, port_id num)
+{
+    (void)num;
+    return vm->cpus.count;
 }
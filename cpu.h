@@ -2,49 +2,455 @@
 
 #include "error.h"
 #include "mem.h"
+#include "port.h"
+#include "register.h"
+#include "vector.h"
+#include "fpu.h"
+#include "instruction.h"
+#include "aot.h"
+#include "vx4.h"
 
+#include <stdio.h>
+#include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+
+#include <SDL2/SDL_thread.h>
+#include <SDL2/SDL_mutex.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Constants + helper macros
+////////////////////////////////////////////////////////////////////////////////
+
+typedef enum _cpu_core {
+    CPU_CORE_REFERENCE, // Steps through the instructions table one at a time
+    CPU_CORE_THREADED, // Jumps directly between handlers, needs GNU C
+    CPU_CORE_JIT, // Translates basic blocks to host code, needs x86-64
+    CPU_CORE_AOT, // Runs blocks translated by vx4-aot, see cpu_set_aot
+} cpu_core;
+
+// Why cpu_run returned
+typedef enum _cpu_stop_reason {
+    CPU_STOPPED_BUDGET, // The requested number of instructions were run
+    CPU_STOPPED_DEADLINE, // The time limit passed, or was reached with every CPU at wfi
+    CPU_STOPPED_HALT, // The CPU halted, and won't run again
+    CPU_STOPPED_INTERRUPT, // An interrupt is waiting to be taken
+    CPU_STOPPED_IDLE, // Every CPU is at wfi, and only the caller can wake one (VX4_SINGLE_THREAD)
+} cpu_stop_reason;
+
+#define CPU_RUN_FOREVER UINT64_MAX // No limit, for either argument of cpu_run
+
+#define CPU_MAX_CPUS 64 // The most CPUs a machine may have
+
+// Each CPU starts with its own stack of this size, CPU 0's ending at GFX_MMAP_START
+#define CPU_STACK_SIZE 0x10000
+
+#define CPU_STALE_RANGES 4 // Writes to code remembered before flushing everything
+
+#define CPU_SPIN_REPEATS 64 // Identical port reads in a row before a CPU is taken to be spinning
+#define CPU_SPIN_MAX_SLEEP_MS 8 // The longest a spinning CPU sleeps before polling again
+
+////////////////////////////////////////////////////////////////////////////////
+// Machine state
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct _cpu_flags {
+    bool reset : 1;
+    bool halt : 1;
+    bool intr : 1; // Are interrupts enabled?
+    int reserved : 29; // Needed to fill out structure size
+} cpu_flags;
+
+// How quickly a CPU resumed after being woken from wfi, see cpu_get_wake_stats
+typedef struct _cpu_wake_stats {
+    uint64_t wakes; // Times the CPU was woken
+    uint64_t total_ns; // From each signal to the CPU's thread running again
+    uint64_t max_ns;
+} cpu_wake_stats;
+
+// How often CPUs were found spinning on a port, see cpu_get_spin_stats
+typedef struct _cpu_spin_stats {
+    uint64_t polls; // Port reads
+    uint64_t detections; // Loops found to be spinning
+    uint64_t backoffs; // Times the CPU slept instead of polling again
+    uint64_t slept_ns;
+} cpu_spin_stats;
+
+// Recognises a CPU polling a port in a loop, see cpu_port_polled
+typedef struct _cpu_spin_state {
+    mem_addr ip; // Following the last port read
+    port_id port;
+    uint32_t value;
+    reg_file regs; // As they were after the last port read
+    vreg_file vregs;
+    freg_file fregs;
+    uint32_t compared[2];
+    unsigned repeats; // Identical reads in a row
+    bool backoff; // Set once spinning, until the CPU has slept
+    uint32_t sleep_ms; // How long the last backoff was, doubling each time
+} cpu_spin_state;
+
+// Holds a CPU to the speed set by cpu_set_speed, see cpu_pace
+typedef struct _cpu_pace_state {
+    unsigned mhz; // The speed the schedule was started for, 0 for none
+    uint64_t start; // When the schedule started, as a performance counter value
+    uint64_t ins; // Instructions run since start
+} cpu_pace_state;
+
+// A range of memory written since the CPU last serviced its events
+typedef struct _cpu_stale_range {
+    mem_addr base;
+    mem_size num;
+} cpu_stale_range;
+
+// The state of one CPU, should not be touched except by functions in cpu.c
+typedef struct _cpu_context {
+    mem_addr ip; // Instruction pointer
+    cpu_flags flags;
+
+    // Nonzero whenever cpu_service may have something to do, which lets the
+    // CPU check for events without taking any locks
+    atomic_uint events;
+
+    SDL_Thread *thread;
+    SDL_mutex *flags_mutex;
+    bool stopped; // Has this CPU halted for good?
+    bool waiting; // Stopped at wfi until an interrupt is pending
+    uint64_t signalled_at; // When first signalled while asleep, guarded by idle_mutex
+    cpu_spin_state spin;
+    cpu_pace_state pace;
+
+    // Code written by any CPU, yet to be discarded from this CPU's caches
+    // Once more than CPU_STALE_RANGES are waiting, the caches are flushed
+    cpu_stale_range stale[CPU_STALE_RANGES];
+    unsigned num_stale;
+    SDL_mutex *stale_mutex; // No other lock may be taken while this is held
+
+    // Instructions left before the running core must return, counted down by
+    // every core as it goes, out of the slice it was given
+    int64_t budget;
+    int64_t slice;
+
+    // Decoded by cpu_fetch_paged when an instruction spans two pages that
+    // aren't neighbours in memory, so the icache can't hold it
+    instruction_decoded split;
+} cpu_context;
+
+// Settings and state shared by every CPU of a machine
+// Should not be touched except by functions in cpu.c
+typedef struct _cpus_context {
+    vx4_cpu *list[CPU_MAX_CPUS]; // Indexed by CPU id, allocated while running
+    unsigned count;
+
+    cpu_core selected_core;
+    const aot_image *aot_image; // See cpu_set_aot
+    FILE *trace_file;
+
+    atomic_uint running; // CPUs yet to halt
+    atomic_bool do_stopping; // Set once every CPU has halted
+    atomic_uint target_mhz; // See cpu_set_speed, 0 runs flat out
+    port_id port; // See cpu_begin
+
+    // CPUs with nothing to do until signalled sleep on idle_cond, rather
+    // than spinning their host thread
+    SDL_mutex *idle_mutex;
+    SDL_cond *idle_cond;
+    atomic_uint sleeping; // Threads waiting on idle_cond
+    cpu_wake_stats wake_stats[CPU_MAX_CPUS];
+    cpu_spin_stats spin_stats[CPU_MAX_CPUS];
+    uint64_t retired[CPU_MAX_CPUS]; // Instructions run by each CPU, see cpu_get_retired
+    uint64_t started; // When the CPUs were started, as a performance counter value
+    uint64_t virtual_ns[CPU_MAX_CPUS]; // Each CPU's rdtime at its last slice (VX4_SINGLE_THREAD)
+
+    // Whose turn it is to run in cpu_run, and how many instructions they have left
+    unsigned turn;
+    uint64_t turn_left;
+} cpus_context;
 
 ////////////////////////////////////////////////////////////////////////////////
 // Function declarations
 ////////////////////////////////////////////////////////////////////////////////
 
 /**
- * Starts the CPU simulation thread.
+ * Puts the CPUs' settings in their default state. Called by machine_create.
+ */
+extern void cpu_init(vx4_machine *vm);
+
+/**
+ * Sets how many CPUs the machine has, each running on its own host thread
+ * when started with cpu_begin. Takes effect the next time the CPUs are
+ * started. Defaults to 1.
+ *
+ * Every CPU starts at the reset vector, with its id (counting up from 0)
+ * in r0 and its own stack, so that firmware can tell them apart. Device
+ * interrupts are only delivered to CPU 0, see interrupt_raise.
+ *
+ * IN count: The number of CPUs.
+ *
+ * Returns:
+ * ERR_NOERR: The number of CPUs was set.
+ * ERR_INVAL: The number was 0, or more than CPU_MAX_CPUS.
+ */
+extern error_t cpu_set_count(vx4_machine *vm, unsigned count);
+
+/**
+ * Returns the number of CPUs set by cpu_set_count.
+ */
+extern unsigned cpu_get_count(vx4_machine *vm);
+
+/**
+ * Selects the interpreter used to run instructions. Takes effect the next
+ * time the CPUs are started. Defaults to the threaded core where available.
+ *
+ * IN core: The interpreter to use.
+ *
+ * Returns:
+ * ERR_NOERR: The interpreter was selected.
+ * ERR_INVAL: The interpreter isn't supported by this build, or is
+ * CPU_CORE_AOT with no image given to cpu_set_aot yet.
+ */
+extern error_t cpu_set_core(vx4_machine *vm, cpu_core core);
+
+/**
+ * Sets how fast each CPU runs, so that many machines can share a host
+ * predictably. Each CPU sleeps whenever it gets ahead of the target rate,
+ * on a schedule that corrects for drift instead of accumulating it. Time
+ * spent at wfi or otherwise held up is only made up for with a burst of
+ * speed if it was short. May be called while the CPUs run, including by
+ * the guest through the system port. Defaults to 0.
+ *
+ * IN mhz: Millions of instructions per second, per CPU, or 0 to run as
+ * fast as the host allows ("turbo").
+ */
+extern void cpu_set_speed(vx4_machine *vm, unsigned mhz);
+
+/**
+ * Returns the speed set by cpu_set_speed.
+ */
+extern unsigned cpu_get_speed(vx4_machine *vm);
+
+/**
+ * Selects the core that runs firmware translated ahead of time by vx4-aot,
+ * falling back to interpretation for code it didn't translate or that has
+ * changed since. Takes effect the next time the CPUs are started.
+ *
+ * IN image: The translated firmware, see aot_image.
+ */
+extern void cpu_set_aot(vx4_machine *vm, const aot_image *image);
+
+/**
+ * Records every instruction run by the reference core to a file, one line
+ * each giving its address, size and mnemonic. tools/fusemine reads these
+ * traces to suggest superinstructions. Should be set before the CPUs are
+ * started.
+ *
+ * IN file: The file to write to, or NULL to stop tracing. Must stay open
+ * until the CPUs have stopped.
+ */
+extern void cpu_set_trace(vx4_machine *vm, FILE *file);
+
+/**
+ * Starts a simulation thread for each CPU.
+ *
+ * While the CPUs run, they also have a port identified as "CPU control".
+ * Writing (cpu << 16) | intr to it raises interrupt intr on the CPU with
+ * id cpu, so that CPUs can interrupt each other. Reading from it returns
+ * the number of CPUs.
  *
  * Returns:
- * ERR_NOERR: The CPU was started.
- * ERR_EXTERN: An error occurred creating the thread.
+ * ERR_NOERR: The CPUs were started.
+ * ERR_EXTERN: An error occurred creating a thread or mutex.
+ * ERR_NOMEM: The CPUs or their caches couldn't be allocated.
+ * ERR_PORT: The CPU control port couldn't be installed.
+ *
+ * Not available when built with VX4_SINGLE_THREAD, which only runs the
+ * CPUs through cpu_run.
+ */
+#ifndef VX4_SINGLE_THREAD
+extern error_t cpu_begin(vx4_machine *vm);
+
+/**
+ * Waits for the end of every CPU simulation thread.
+ */
+extern void cpu_wait_end(vx4_machine *vm);
+#endif // VX4_SINGLE_THREAD
+
+/**
+ * Prepares the CPUs to be run by cpu_run on the calling thread, instead of
+ * starting threads of their own. Not to be mixed with cpu_begin.
+ *
+ * Returns: As cpu_begin, other than thread creation.
+ */
+extern error_t cpu_begin_sync(vx4_machine *vm);
+
+/**
+ * Cleans up after cpu_begin_sync.
+ */
+extern void cpu_end_sync(vx4_machine *vm);
+
+/**
+ * Runs the CPUs on the calling thread, until a limit is reached or they
+ * have to stop. With more than one CPU, they take turns running a slice
+ * of instructions each. Interrupts already waiting when called are taken,
+ * but one raised during the run ends it, so that the host can decide when
+ * to let the CPUs deal with it. Requires cpu_begin_sync.
+ *
+ * Once every CPU is stopped at wfi, the calling thread sleeps until one
+ * of them is signalled, or the time limit passes. Built with
+ * VX4_SINGLE_THREAD, nothing else could signal one, so the run instead
+ * stops with CPU_STOPPED_IDLE after a short sleep, for the caller to
+ * deliver any input. With no time limit, the CPUs then run the same
+ * instructions in the same order on every run, however the host schedules
+ * the calling thread.
  *
+ * IN max_ins: The most instructions to run, counting every CPU, or
+ * CPU_RUN_FOREVER.
+ * IN max_us: The most host microseconds to run for, or CPU_RUN_FOREVER.
+ * The time is checked between slices of instructions, so may be
+ * overrun slightly.
+ *
+ * Returns: Why the run stopped. CPU_STOPPED_HALT once every CPU has halted.
+ */
+extern cpu_stop_reason cpu_run(vx4_machine *vm, uint64_t max_ins, uint64_t max_us);
+
+/**
+ * Returns whether every CPU has halted, or is preparing to.
+ */
+extern bool cpu_halting(vx4_machine *vm);
+
+/**
+ * Set every CPU for immediate (non-interrupt-based) soft reset next step.
+ */
+extern void cpu_queue_reset(vx4_machine *vm);
+
+/**
+ * Set every CPU for immediate (non-interrupt-based) halt next step.
  */
-extern error_t cpu_begin();
+extern void cpu_queue_halt(vx4_machine *vm);
 
 /**
- * Waits for the end of the CPU simulation thread.
+ * Set a single CPU to halt next step, leaving any others running.
  */
-extern void cpu_wait_end();
+extern void cpu_queue_stop(vx4_cpu *vcpu);
 
 /**
- * Returns whether the CPU is preparing to stop.
+ * Stops the CPU until an interrupt is pending, whether or not interrupts
+ * are enabled, or it is reset or halted. Meanwhile its host thread sleeps.
  */
-extern bool cpu_halting();
+extern void cpu_queue_wait(vx4_cpu *vcpu);
 
 /**
- * Set the CPU for immediate (non-interrupt-based) soft reset next step.
+ * Tells the CPU's spin detection that it has read from a port. Once the
+ * same read gives the same value CPU_SPIN_REPEATS times in a row, with
+ * the registers unchanged each time, no port written and memory not
+ * touched in between, the loop around it can only repeat until a device
+ * or interrupt changes something. The CPU then sleeps instead of polling,
+ * for up to CPU_SPIN_MAX_SLEEP_MS at a time, unless it is signalled sooner.
+ *
+ * A loop that loads could see another CPU's stores, and one that stores
+ * may be what another CPU is waiting on, so either kind never counts as
+ * spinning. The CPU's mem_cache is emptied at each read to tell whether
+ * it has been used since, see mem_cache_used. Otherwise the ip and the
+ * general, vector and floating-point registers and compared operands are
+ * all the state such a loop has.
+ *
+ * IN port: The port read.
+ * IN value: The value read.
  */
-extern void cpu_queue_reset();
+extern void cpu_port_polled(vx4_cpu *vcpu, port_id port, uint32_t value);
 
 /**
- * Set the CPU for immediate (non-interrupt-based) halt next step.
+ * Tells the CPU's spin detection that it has written to a port, so isn't
+ * just polling.
  */
-extern void cpu_queue_halt();
+extern void cpu_port_written(vx4_cpu *vcpu);
+
+/**
+ * Counts the instructions the CPU has run since the CPUs were started,
+ * not including the one running. Kept up to date a slice at a time, so
+ * costs nothing per instruction. For the rdins instruction.
+ */
+extern uint64_t cpu_read_ins(vx4_cpu *vcpu);
+
+/**
+ * Reads a monotonic clock in nanoseconds, starting from 0 when the CPUs
+ * were started, for the rdtime instruction. Built with VX4_SINGLE_THREAD,
+ * host time would make runs differ, so the clock is instead advanced by
+ * the instructions the CPU runs, at the speed set by cpu_set_speed (or at
+ * 1 instruction per nanosecond without one).
+ */
+extern uint64_t cpu_read_time(vx4_cpu *vcpu);
 
 /**
  * Redirects the CPU's execution to a new address for the next cycle.
  */
-extern void cpu_queue_jump(mem_addr new_ip);
+extern void cpu_queue_jump(vx4_cpu *vcpu, mem_addr new_ip);
 
 /**
  * Enables/disables interrupts on the CPU.
  */
-extern void cpu_interrupt_set(bool enabled);
+extern void cpu_interrupt_set(vx4_cpu *vcpu, bool enabled);
+
+/**
+ * Returns from the interrupt the CPU is handling, for the iret instruction.
+ * Restores the registers, compared operands, vector and floating-point
+ * registers, stack, ip and interrupt flag the interrupt saved, from the
+ * CPU's bank for the outermost interrupt, or the stack for a nested one.
+ *
+ * Returns:
+ * ERR_NOERR: The CPU will resume the interrupted code.
+ * ERR_PCOND: No interrupt is being handled, or the spilled state couldn't
+ * be read back.
+ * ERR_EXTERN: The CPU's flags couldn't be locked.
+ */
+extern error_t cpu_interrupt_return(vx4_cpu *vcpu);
+
+/**
+ * Tells a CPU that it may have a reset, halt or interrupt to deal with
+ * before its next instruction. Safe to call from any thread, and does
+ * nothing if the CPU isn't running.
+ *
+ * IN cpu: The id of the CPU to tell.
+ */
+extern void cpu_signal_events(vx4_machine *vm, unsigned cpu);
+
+/**
+ * Fetches how quickly a CPU has resumed after being woken from wfi, since
+ * the CPUs were last started. Only exact once the CPUs have stopped.
+ *
+ * IN cpu: The id of the CPU.
+ * OUT stats: The CPU's wakeup latencies.
+ *
+ * Returns:
+ * ERR_NOERR: The statistics were fetched.
+ * ERR_INVAL: The machine has no such CPU.
+ */
+extern error_t cpu_get_wake_stats(vx4_machine *vm, unsigned cpu, cpu_wake_stats *stats);
+
+/**
+ * Fetches how often a CPU was found spinning on a port, and how long it
+ * slept as a result, since the CPUs were last started. Only exact once the
+ * CPUs have stopped.
+ *
+ * IN cpu: The id of the CPU.
+ * OUT stats: The CPU's spin detection counts.
+ *
+ * Returns:
+ * ERR_NOERR: The statistics were fetched.
+ * ERR_INVAL: The machine has no such CPU.
+ */
+extern error_t cpu_get_spin_stats(vx4_machine *vm, unsigned cpu, cpu_spin_stats *stats);
+
+/**
+ * Fetches how many instructions a CPU has run since the CPUs were last
+ * started. Only exact once the CPUs have stopped, or between calls to
+ * cpu_run.
+ *
+ * IN cpu: The id of the CPU.
+ * OUT count: The number of instructions.
+ *
+ * Returns:
+ * ERR_NOERR: The count was fetched.
+ * ERR_INVAL: The machine has no such CPU.
+ */
+extern error_t cpu_get_retired(vx4_machine *vm, unsigned cpu, uint64_t *count);
@@ -3,6 +3,7 @@
 #include "error.h"
 #include "mem.h"
 #include "port.h"
+#include "machine.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -10,14 +11,6 @@
 #include <stdint.h>
 #include <stddef.h>
 
-////////////////////////////////////////////////////////////////////////////////
-// Type declarations
-////////////////////////////////////////////////////////////////////////////////
-
-typedef uint32_t disk_addr; // Disks use linear addressing
-typedef uint32_t disk_size; // General size type for disk addressing
-typedef uint8_t disk_block; // Compatible with mem_block
-
 ////////////////////////////////////////////////////////////////////////////////
 // Internal constants + helper macros
 ////////////////////////////////////////////////////////////////////////////////
@@ -31,23 +24,6 @@ typedef uint8_t disk_block; // Compatible with mem_block
 // Module internal declarations
 ////////////////////////////////////////////////////////////////////////////////
 
-typedef struct _disk_info_entry {
-	const char *name;
-	FILE *file;
-	size_t fsize;
-
-	disk_block *buffer;
-	bool active;
-
-	port_id cmd_port;
-	port_id data_port;
-
-	disk_addr off; // The offset of the window into the file
-} disk_info_entry;
-
-// Every entry is initialized to empty
-static disk_info_entry disks[DISK_MAX_DISKS];
-
 /**
  * Writes the disk buffer out to its backing file. On success,
  * the entire buffer (MEM_BLK_SIZE bytes) is written to bytes
@@ -60,7 +36,7 @@ static disk_info_entry disks[DISK_MAX_DISKS];
  * ERR_INVAL: The disk provided was out of range (can never exist).
  * ERR_PCOND: The disk provided is not currently in use.
  */
-static error_t sync_disk(disk_id num);
+static error_t sync_disk(vx4_machine *vm, disk_id num);
 
 /**
  * Changes the offset of the file buffer and reloads it from the filesystem.
@@ -78,7 +54,7 @@ static error_t sync_disk(disk_id num);
  * ERR_PCOND: The disk provided is not currently in use.
  * ERR_FILE: Seeking in the file failed.
  */
-static error_t seek_disk(disk_id num, disk_addr new_off);
+static error_t seek_disk(vx4_machine *vm, disk_id num, disk_addr new_off);
 
 /**
  * Binds a file to a disk slot, maps a buffer into virtual memory at a set
@@ -100,7 +76,7 @@ static error_t seek_disk(disk_id num, disk_addr new_off);
  * ERR_PORT: An error occurred acquiring two ports to use for the disk,
  * likely because there are no remaining ports.
  */
-static error_t bind_disk(disk_id num, const char *filename);
+static error_t bind_disk(vx4_machine *vm, disk_id num, const char *filename);
 
 /**
  * Unbinds the given disk from its file and disables it. If partial != 0,
@@ -118,31 +94,22 @@ static error_t bind_disk(disk_id num, const char *filename);
  * ERR_FILE: The disk was successfully unbound, but writing it back to
  * file may have failed.
  */
-static error_t unbind_disk(disk_id num, error_t partial);
+static error_t unbind_disk(vx4_machine *vm, disk_id num, error_t partial);
 
 /**
  * Returns the lowest-numbered disk unused (ready to be allocated).
  */
-static disk_id next_unused();
+static disk_id next_unused(vx4_machine *vm);
 
 /**
  * Marks a disk as available for reuse.
  */
-static void mark_unused(disk_id num);
-
-typedef struct _disk_operation {
-	disk_action act;
-	disk_state res;
-	uint32_t data;
-} disk_operation;
-
-// Every disk has a command state with it
-static disk_operation curr_op[DISK_MAX_DISKS];
+static void mark_unused(vx4_machine *vm, disk_id num);
 
 /**
  * Calculate which disk is attached to a port.
  */
-static disk_id identify_disk(port_id port);
+static disk_id identify_disk(vx4_machine *vm, port_id port);
 
 /**
  * The following 4 functions provide the callbacks for the command and data
@@ -153,11 +120,11 @@ static disk_id identify_disk(port_id port);
  * - Checking the success of any actions by reading the command port.
  */
 
-static void command_recv(port_id num, uint32_t command);
-static uint32_t command_reply(port_id num);
+static void command_recv(vx4_machine *vm, port_id num, uint32_t command);
+static uint32_t command_reply(vx4_machine *vm, port_id num);
 
-static void data_write(port_id num, uint32_t data);
-static uint32_t data_read(port_id num);
+static void data_write(vx4_machine *vm, port_id num, uint32_t data);
+static uint32_t data_read(vx4_machine *vm, port_id num);
 
 // Every disk has the same port structure
 static port_entry disk_port[] = {
@@ -169,11 +136,11 @@ static port_entry disk_port[] = {
 // Interface functions
 ////////////////////////////////////////////////////////////////////////////////
 
-error_t disk_install(const char *filename, disk_id *num)
+error_t disk_install(vx4_machine *vm, const char *filename, disk_id *num)
 {
-	*num = next_unused();
+	*num = next_unused(vm);
 
-	error_t stat = bind_disk(*num, filename);
+	error_t stat = bind_disk(vm, *num, filename);
 
 	if (stat == ERR_INVAL || stat == ERR_PCOND) {
 		return ERR_PCOND;
@@ -181,21 +148,21 @@ error_t disk_install(const char *filename, disk_id *num)
 
 	// If we failed halfway through, we need to clean up
 	if (stat != ERR_NOERR) {
-		unbind_disk(*num, stat);
-		mark_unused(*num);
+		unbind_disk(vm, *num, stat);
+		mark_unused(vm, *num);
 	}
 
 	return stat;
 }
 
-error_t disk_remove(disk_id num)
+error_t disk_remove(vx4_machine *vm, disk_id num)
 {
-	error_t stat = unbind_disk(num, ERR_NOERR);
+	error_t stat = unbind_disk(vm, num, ERR_NOERR);
 
 	// If the unbinding failed, the disk may not be able to be reused
 	// So we don't attempt to reuse it
 	if (stat == ERR_NOERR || stat == ERR_FILE) {
-		mark_unused(num);
+		mark_unused(vm, num);
 	}
 
 	return stat;
@@ -205,13 +172,13 @@ error_t disk_remove(disk_id num)
 // Module internal functions
 ////////////////////////////////////////////////////////////////////////////////
 
-error_t sync_disk(disk_id num)
+error_t sync_disk(vx4_machine *vm, disk_id num)
 {
 	if (!IS_VALID_DISK(num)) {
 		return ERR_INVAL;
 	}
 
-	disk_info_entry *curr = &disks[num];
+	disk_info_entry *curr = &vm->disks.disks[num];
 
 	if (!curr->active) {
         return ERR_PCOND;
@@ -226,13 +193,13 @@ error_t sync_disk(disk_id num)
 	return ERR_NOERR;
 }
 
-error_t seek_disk(disk_id num, disk_addr new_off)
+error_t seek_disk(vx4_machine *vm, disk_id num, disk_addr new_off)
 {
 	if (!IS_VALID_DISK(num)) {
 		return ERR_INVAL;
 	}
 
-	disk_info_entry *curr = &disks[num];
+	disk_info_entry *curr = &vm->disks.disks[num];
 
 	if ((curr->fsize - new_off) < MEM_BLK_SIZE) {
 		// We still need space for a full block
@@ -255,13 +222,13 @@ error_t seek_disk(disk_id num, disk_addr new_off)
 	return ERR_NOERR;
 }
 
-error_t bind_disk(disk_id num, const char *filename)
+error_t bind_disk(vx4_machine *vm, disk_id num, const char *filename)
 {
 	if (!IS_VALID_DISK(num)) {
 		return ERR_INVAL;
 	}
 
-	disk_info_entry *curr = &disks[num];
+	disk_info_entry *curr = &vm->disks.disks[num];
 
 	if (curr->active) {
         return ERR_PCOND;
@@ -289,32 +256,32 @@ error_t bind_disk(disk_id num, const char *filename)
 		return ERR_NOMEM;
 	}
 
-	seek_disk(num, 0);
+	seek_disk(vm, num, 0);
 
-	mem_map_device(DISK_MMAP_ADDR(num), curr->buffer);
+	mem_map_device(vm, DISK_MMAP_ADDR(num), curr->buffer);
 
-	error_t stat = port_install(&disk_port[0], &curr->cmd_port);
+	error_t stat = port_install(vm, &disk_port[0], &curr->cmd_port);
 	if (stat != ERR_NOERR) {
 		return ERR_PORT;
 	}
 
-	stat = port_install(&disk_port[1], &curr->data_port);
+	stat = port_install(vm, &disk_port[1], &curr->data_port);
 	if (stat != ERR_NOERR) {
 		// Clean up the successfully created port first
-		port_remove(curr->cmd_port);
+		port_remove(vm, curr->cmd_port);
 		return ERR_PORT;
 	}
 
 	return ERR_NOERR;
 }
 
-error_t unbind_disk(disk_id num, error_t partial)
+error_t unbind_disk(vx4_machine *vm, disk_id num, error_t partial)
 {
 	if (!IS_VALID_DISK(num)) {
 		return ERR_INVAL;
 	}
 
-	disk_info_entry *curr = &disks[num];
+	disk_info_entry *curr = &vm->disks.disks[num];
 
 	if (!curr->active) {
         return ERR_PCOND;
@@ -325,7 +292,7 @@ error_t unbind_disk(disk_id num, error_t partial)
 	if (partial == ERR_NOERR) {
         // If the file was opened correctly (and potentially used)
         // Then we need to write out its contents
-        stat = sync_disk(num);
+        stat = sync_disk(vm, num);
 	}
 
 	curr->name = NULL;
@@ -344,7 +311,7 @@ error_t unbind_disk(disk_id num, error_t partial)
 		return stat;
 	}
 
-	mem_unmap_device(DISK_MMAP_ADDR(num));
+	mem_unmap_device(vm, DISK_MMAP_ADDR(num));
 
 	free(curr->buffer);
     curr->buffer = NULL;
@@ -353,52 +320,49 @@ error_t unbind_disk(disk_id num, error_t partial)
 		return stat;
     }
 
-	port_remove(curr->cmd_port);
+	port_remove(vm, curr->cmd_port);
 	curr->cmd_port = 0;
-	port_remove(curr->data_port);
+	port_remove(vm, curr->data_port);
 	curr->data_port = 0;
 
 	return stat;
 }
 
-// Used to hold state for the following two functions
-static disk_id next_alloc;
-
-disk_id next_unused()
+disk_id next_unused(vx4_machine *vm)
 {
 	// First check the next_alloc variable
 	// If it's good, we're good
 	// Otherwise we have to go hunting
-	if (disks[next_alloc].active) {
+	if (vm->disks.disks[vm->disks.next_alloc].active) {
 		for (disk_id i = 0; IS_VALID_DISK(i); ++i) {
-			if (!disks[i].active) {
-				next_alloc = i;
+			if (!vm->disks.disks[i].active) {
+				vm->disks.next_alloc = i;
 				break;
 			}
 		}
 	}
 
-	disk_id to_ret = next_alloc;
+	disk_id to_ret = vm->disks.next_alloc;
 
-	if (!IS_VALID_DISK(++next_alloc)) {
-		next_alloc = 0;
+	if (!IS_VALID_DISK(++vm->disks.next_alloc)) {
+		vm->disks.next_alloc = 0;
 	}
 
 	return to_ret;
 }
 
-void mark_unused(disk_id num)
+void mark_unused(vx4_machine *vm, disk_id num)
 {
 	// We want to prefer low-numbered ports
-	if (num < next_alloc) {
-		next_alloc = num;
+	if (num < vm->disks.next_alloc) {
+		vm->disks.next_alloc = num;
 	}
 }
 
-disk_id identify_disk(port_id port)
+disk_id identify_disk(vx4_machine *vm, port_id port)
 {
 	for (disk_id i = 0; IS_VALID_DISK(i); ++i) {
-		if (disks[i].cmd_port == port || disks[i].data_port == port) {
+		if (vm->disks.disks[i].cmd_port == port || vm->disks.disks[i].data_port == port) {
 			return i;
 		}
 	}
@@ -406,46 +370,46 @@ disk_id identify_disk(port_id port)
 	return DISK_MAX_DISKS; // Guaranteed to be invalid
 }
 
-void command_recv(port_id num, uint32_t command)
+void command_recv(vx4_machine *vm, port_id num, uint32_t command)
 {
-	disk_id curr = identify_disk(num);
+	disk_id curr = identify_disk(vm, num);
 
 	// Only act if we're in a correct location
 	if (curr != DISK_MAX_DISKS) {
-		curr_op[curr].act = (int)command;
+		vm->disks.curr_op[curr].act = (int)command;
 
-		if (curr_op[curr].act == DA_NONE) {
-			curr_op[curr].res = DS_OK;
+		if (vm->disks.curr_op[curr].act == DA_NONE) {
+			vm->disks.curr_op[curr].res = DS_OK;
 		}
 		else {
-			curr_op[curr].res = DS_WAIT;
+			vm->disks.curr_op[curr].res = DS_WAIT;
 		}
 	}
 }
 
-uint32_t command_reply(port_id num)
+uint32_t command_reply(vx4_machine *vm, port_id num)
 {
-	disk_id curr = identify_disk(num);
+	disk_id curr = identify_disk(vm, num);
 
 	// Automatic error if we can't identify which disk
 	if (curr == DISK_MAX_DISKS) {
 		return (uint32_t)DS_ERROR;
 	}
 
-	return (uint32_t)curr_op[curr].res;
+	return (uint32_t)vm->disks.curr_op[curr].res;
 }
 
-void data_write(port_id num, uint32_t data)
+void data_write(vx4_machine *vm, port_id num, uint32_t data)
 {
-	disk_id curr = identify_disk(num);
+	disk_id curr = identify_disk(vm, num);
 
 	// Automatic error if we can't identify which disk
 	if (curr == DISK_MAX_DISKS) {
 		return;
 	}
 
-	disk_info_entry *disk = &disks[curr];
-	disk_operation *action = &curr_op[curr];
+	disk_info_entry *disk = &vm->disks.disks[curr];
+	disk_operation *action = &vm->disks.curr_op[curr];
 
 	action->data = data;
 
@@ -461,7 +425,7 @@ void data_write(port_id num, uint32_t data)
 			return;
 
 		case DA_SEEK:
-			if (seek_disk(num, data) == ERR_NOERR) {
+			if (seek_disk(vm, curr, data) == ERR_NOERR) {
 				action->res = DS_OK;
 			}
 			else {
@@ -470,7 +434,7 @@ void data_write(port_id num, uint32_t data)
 			return;
 
 		case DA_SYNC:
-			if (sync_disk(num) == ERR_NOERR) {
+			if (sync_disk(vm, curr) == ERR_NOERR) {
 				action->res = DS_OK;
 			}
 			else {
@@ -480,17 +444,17 @@ void data_write(port_id num, uint32_t data)
 	}
 }
 
-uint32_t data_read(port_id num)
+uint32_t data_read(vx4_machine *vm, port_id num)
 {
-	disk_id curr = identify_disk(num);
+	disk_id curr = identify_disk(vm, num);
 
 	// Automatic error if we can't identify which disk
 	if (curr == DISK_MAX_DISKS) {
 		return 0;
 	}
 
-	disk_info_entry *disk = &disks[curr];
-	disk_operation *action = &curr_op[curr];
+	disk_info_entry *disk = &vm->disks.disks[curr];
+	disk_operation *action = &vm->disks.curr_op[curr];
 
 	if (!disk->active) {
 		action->res = DS_ERROR;
@@ -1,8 +1,13 @@
 #pragma once
 
 #include "error.h"
+#include "port.h"
+#include "vx4.h"
 
+#include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 // Type declarations
@@ -10,6 +15,10 @@
 
 typedef uint16_t disk_id;
 
+typedef uint32_t disk_addr; // Disks use linear addressing
+typedef uint32_t disk_size; // General size type for disk addressing
+typedef uint8_t disk_block; // Compatible with mem_block
+
 ////////////////////////////////////////////////////////////////////////////////
 // Constants + helper macros
 ////////////////////////////////////////////////////////////////////////////////
@@ -34,6 +43,37 @@ typedef enum _disk_state {
 	DS_ERROR,
 } disk_state;
 
+////////////////////////////////////////////////////////////////////////////////
+// Machine state
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct _disk_info_entry {
+	const char *name;
+	FILE *file;
+	size_t fsize;
+
+	disk_block *buffer;
+	bool active;
+
+	port_id cmd_port;
+	port_id data_port;
+
+	disk_addr off; // The offset of the window into the file
+} disk_info_entry;
+
+typedef struct _disk_operation {
+	disk_action act;
+	disk_state res;
+	uint32_t data;
+} disk_operation;
+
+// Should not be touched except by functions in disk.c
+typedef struct _disk_context {
+	disk_info_entry disks[DISK_MAX_DISKS]; // Every entry starts empty
+	disk_operation curr_op[DISK_MAX_DISKS]; // Every disk has a command state with it
+	disk_id next_alloc; // Where next_unused starts looking
+} disk_context;
+
 ////////////////////////////////////////////////////////////////////////////////
 // Function declarations
 ////////////////////////////////////////////////////////////////////////////////
@@ -55,7 +95,7 @@ typedef enum _disk_state {
  * ERR_PORT: An error occurred acquiring two ports to use for the disk,
  * likely because there are no remaining ports.
  */
-extern error_t disk_install(const char *filename, disk_id *num);
+extern error_t disk_install(vx4_machine *vm, const char *filename, disk_id *num);
 
 /**
  * Unbinds the given disk from its file and disables it. The buffer is
@@ -70,4 +110,4 @@ extern error_t disk_install(const char *filename, disk_id *num);
  * ERR_FILE: The disk was successfully unbound, but writing it back to
  * file may have failed.
  */
-extern error_t disk_remove(disk_id num);
+extern error_t disk_remove(vx4_machine *vm, disk_id num);
@@ -1,10 +1,10 @@
 #include "error.h"
 
-#include "graphics.h"
-
 #include <stdlib.h>
 #include <stdio.h>
 
+#include <SDL2/SDL.h>
+
 ////////////////////////////////////////////////////////////////////////////////
 // Interface functions
 ////////////////////////////////////////////////////////////////////////////////
@@ -69,7 +69,7 @@ noreturn void error_exit(error_t err_code, const char *file, unsigned line, cons
         fprintf(stderr, "%s.\n", info);
     }
 
-    graphics_end(); // Called to avoid leaking graphics resources
+    SDL_Quit(); // Called to avoid leaking graphics resources, for every machine
     exit(err_code);
 }
 
@@ -0,0 +1,99 @@
+#include "fpu.h"
+
+#include "error.h"
+#include "mem.h"
+#include "mmu.h"
+#include "machine.h"
+
+#include <stdint.h>
+#include <math.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Module internal declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Converts a float (either size, widened exactly) to a saturated integer,
+ * see fpu_ftoi32.
+ */
+static uint32_t to_int(double val);
+
+////////////////////////////////////////////////////////////////////////////////
+// Interface functions
+////////////////////////////////////////////////////////////////////////////////
+
+void fpu_fma32(freg *dest, const freg *a, const freg *b)
+{
+	dest->f = fmaf(a->f, b->f, dest->f);
+}
+
+void fpu_fma64(freg *dest, const freg *a, const freg *b)
+{
+	dest->d = fma(a->d, b->d, dest->d);
+}
+
+void fpu_ftoi32(uint32_t *dest, const freg *src)
+{
+	*dest = to_int(src->f);
+}
+
+void fpu_ftoi64(uint32_t *dest, const freg *src)
+{
+	*dest = to_int(src->d);
+}
+
+uint32_t fpu_compare(double a, double b)
+{
+	if (a < b) {
+		return FPU_LESS;
+	}
+	else if (a > b) {
+		return FPU_GREATER;
+	}
+	else if (a == b) {
+		return FPU_EQUAL;
+	}
+
+	return FPU_UNORDERED;
+}
+
+error_t fpu_write_all_mem(vx4_cpu *vcpu, mem_addr start)
+{
+	static const mem_size freg_sz = FREG_SIZE * FREG_NUM_REGS;
+
+	if (mmu_write_mem(vcpu, start, vcpu->fregisters, freg_sz) != ERR_NOERR) {
+		return ERR_EXTERN;
+	}
+
+	return ERR_NOERR;
+}
+
+error_t fpu_read_all_mem(vx4_cpu *vcpu, mem_addr start)
+{
+	static const mem_size freg_sz = FREG_SIZE * FREG_NUM_REGS;
+
+	if (mmu_read_mem(vcpu, start, vcpu->fregisters, freg_sz) != ERR_NOERR) {
+		return ERR_EXTERN;
+	}
+
+	return ERR_NOERR;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Module internal functions
+////////////////////////////////////////////////////////////////////////////////
+
+uint32_t to_int(double val)
+{
+	if (isnan(val)) {
+		return 0;
+	}
+	else if (val <= (double)INT32_MIN) {
+		return (uint32_t)INT32_MIN;
+	}
+	else if (val >= (double)INT32_MAX) {
+		return (uint32_t)INT32_MAX;
+	}
+
+	return (uint32_t)(int32_t)val;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "error.h"
+#include "mem.h"
+#include "vx4.h"
+
+#include <stdint.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+typedef uint8_t freg_id;
+
+/**
+ * A 64-bit floating-point register, holding either an f64 or (in its low
+ * word) an f32. The f32 instructions leave the high word as it was.
+ */
+typedef union _freg {
+	double d;
+	float f;
+	uint32_t word; // The bits of the f32
+	uint64_t bits; // The bits of the f64
+} freg;
+
+////////////////////////////////////////////////////////////////////////////////
+// Constants + helper macros
+////////////////////////////////////////////////////////////////////////////////
+
+#define FREG_NUM_REGS 16
+#define FREG_SIZE 8
+
+#define IS_VALID_FREGISTER(reg) ((reg) < FREG_NUM_REGS)
+
+// What fcmp32 and fcmp64 leave as the first compared operand, the second
+// being 0, so that the signed conditional jumps test the order
+#define FPU_LESS 0xFFFFFFFFu
+#define FPU_EQUAL 0u
+#define FPU_GREATER 1u
+#define FPU_UNORDERED 2u // Either operand is NaN, which otherwise compares as greater
+
+////////////////////////////////////////////////////////////////////////////////
+// Machine state
+////////////////////////////////////////////////////////////////////////////////
+
+// Should not be touched except by functions in fpu.c or the CPU cores
+typedef freg freg_file[FREG_NUM_REGS];
+
+////////////////////////////////////////////////////////////////////////////////
+// Function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Sets dest to a * b + dest, rounded once.
+ */
+extern void fpu_fma32(freg *dest, const freg *a, const freg *b);
+extern void fpu_fma64(freg *dest, const freg *a, const freg *b);
+
+/**
+ * Converts a float to a signed integer, rounding toward zero. Values out
+ * of range saturate, and NaN becomes 0, so the result doesn't depend on
+ * the host.
+ *
+ * IN src: The register holding the f32 or f64.
+ * OUT dest: The integer.
+ */
+extern void fpu_ftoi32(uint32_t *dest, const freg *src);
+extern void fpu_ftoi64(uint32_t *dest, const freg *src);
+
+/**
+ * Orders two floats, as fcmp32 and fcmp64 do.
+ *
+ * Returns: FPU_LESS, FPU_EQUAL, FPU_GREATER or FPU_UNORDERED.
+ */
+extern uint32_t fpu_compare(double a, double b);
+
+/**
+ * Causes all the floating-point register values to be read from/written
+ * to memory beginning at a specified address.
+ *
+ * IN start: The virtual address to begin writing, see mmu_translate.
+ *
+ * Returns:
+ * ERR_NOERR: Writing/reading completed successfully.
+ * ERR_EXTERN: All of the registers couldn't be written/read.
+ */
+extern error_t fpu_write_all_mem(vx4_cpu *vcpu, mem_addr start);
+extern error_t fpu_read_all_mem(vx4_cpu *vcpu, mem_addr start);
@@ -11,7 +11,7 @@
 // Interface functions
 ////////////////////////////////////////////////////////////////////////////////
 
-error_t firmware_load(mem_addr loc, const char *filename)
+error_t firmware_load(vx4_machine *vm, mem_addr loc, const char *filename)
 {
     FILE *fw_file = fopen(filename, "rb");
     if (fw_file == NULL) {
@@ -44,7 +44,7 @@ error_t firmware_load(mem_addr loc, const char *filename)
         return ERR_FILE;
     }
 
-    mem_write_mem(loc, fw_buf, read);
+    mem_write_mem(vm, loc, fw_buf, read);
 
     free(fw_buf);
     fclose(fw_file);
@@ -2,6 +2,7 @@
 
 #include "error.h"
 #include "mem.h"
+#include "vx4.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 // Function declarations
@@ -18,4 +19,4 @@
  * ERR_FILE: The file doesn't exist or otherwise can't be accessed.
  * ERR_NOMEM: A buffer to hold the file could not be allocated.
  */
-extern error_t firmware_load(mem_addr loc, const char *filename);
+extern error_t firmware_load(vx4_machine *vm, mem_addr loc, const char *filename);
@@ -5,6 +5,7 @@
 #include "port.h"
 #include "kbd.h"
 #include "intr.h"
+#include "machine.h"
 
 #include <SDL2/SDL.h>
 
@@ -24,18 +25,9 @@
 // Module internal declarations
 ////////////////////////////////////////////////////////////////////////////////
 
-// Pointers to resources used by SDL for rendering.
-static SDL_Window *window;
-static SDL_Renderer *renderer;
-static SDL_Texture *texture;
-
-// The current dimensions of the window
-static int win_width;
-static int win_height;
-
 /**
  * Initialize all resources for the SDL rendering subsystem, and create
- * the rendering window.
+ * the rendering window. When headless, only checks the dimensions.
  *
  * IN width, height: The dimensions of the window to create.
  *
@@ -45,21 +37,13 @@ static int win_height;
  * ERR_EXTERN: An error occurred while trying to acquire one of the resources
  * required for rendering.
  */
-static error_t sdl_subsys_init(int width, int height);
+static error_t sdl_subsys_init(vx4_machine *vm, int width, int height);
 
 /**
  * Clean up the all resources of the SDL rendering subsystem, and close
  * the window.
  */
-static void sdl_subsys_quit();
-
-// The memory-mapped framebuffer
-static uint8_t *gfx_buffer;
-
-// State for the command ports
-static gfx_action act; // The current queued action
-static gfx_state res; // The success/failure to be reported via command_reply
-static uint32_t port_data; // Auxiliary data used by the port functions
+static void sdl_subsys_quit(vx4_machine *vm);
 
 /**
  * Sets the command to be executed on subsequent reads/writes to the data port.
@@ -67,7 +51,7 @@ static uint32_t port_data; // Auxiliary data used by the port functions
  * IN num: Ignored, part of the callback signature.
  * IN command: The command to set.
  */
-static void command_recv(port_id num, uint32_t command);
+static void command_recv(vx4_machine *vm, port_id num, uint32_t command);
 
 /**
  * Fetch the status of the last read/write to the data port.
@@ -76,7 +60,7 @@ static void command_recv(port_id num, uint32_t command);
  *
  * Returns: That status.
  */
-static uint32_t command_reply(port_id num);
+static uint32_t command_reply(vx4_machine *vm, port_id num);
 
 /**
  * Executes the set command, if it requires data being written to the port,
@@ -85,7 +69,7 @@ static uint32_t command_reply(port_id num);
  * IN num: Ignored, part of the callback signature.
  * IN data: The data that was written to the port that triggered the callback.
  */
-static void data_write(port_id num, uint32_t data);
+static void data_write(vx4_machine *vm, port_id num, uint32_t data);
 
 /**
  * Executes the set command, if it involves reading of the data port to
@@ -95,259 +79,284 @@ static void data_write(port_id num, uint32_t data);
  *
  * Returns: Whatever data was requested to be read from the port.
  */
-static uint32_t data_read(port_id num);
+static uint32_t data_read(vx4_machine *vm, port_id num);
 
 static port_entry graphics_port[] = {
 	{"Graphics v1 command", command_recv, command_reply},
 	{"Graphics v1 data", data_write, data_read}
 };
 
-static port_id cmd_port;
-static port_id data_port;
-
-// Has the graphics subsystem been initialized yet?
-static bool gfx_init;
-
 ////////////////////////////////////////////////////////////////////////////////
 // Interface functions
 ////////////////////////////////////////////////////////////////////////////////
 
-error_t graphics_begin(int width, int height)
+void graphics_set_headless(vx4_machine *vm, bool enabled)
+{
+	vm->gfx.headless = enabled;
+}
+
+bool graphics_headless(vx4_machine *vm)
+{
+	return vm->gfx.headless;
+}
+
+error_t graphics_begin(vx4_machine *vm, int width, int height)
 {
-	int stat = sdl_subsys_init(width, height);
+	int stat = sdl_subsys_init(vm, width, height);
 	if (stat != ERR_NOERR) {
 		return stat;
 	}
 
-    win_width = width;
-    win_height = height;
+    vm->gfx.win_width = width;
+    vm->gfx.win_height = height;
 
-	gfx_buffer = malloc(GFX_MEM_MAX);
-	if (gfx_buffer == NULL) {
+	vm->gfx.buffer = malloc(GFX_MEM_MAX);
+	if (vm->gfx.buffer == NULL) {
         return ERR_NOMEM;
 	}
 
 	for (unsigned i = 0; i < (GFX_MEM_MAX / MEM_BLK_SIZE); ++i) {
 		mem_addr off = i * MEM_BLK_SIZE;
 		mem_addr blk = GFX_MMAP_START + off;
-		mem_map_device(blk, &gfx_buffer[off]);
+		mem_map_device(vm, blk, &vm->gfx.buffer[off]);
 	}
 
-	stat = port_install(&graphics_port[0], &cmd_port);
+	stat = port_install(vm, &graphics_port[0], &vm->gfx.cmd_port);
 	if (stat != ERR_NOERR) {
 		return ERR_PORT;
 	}
 
-	stat = port_install(&graphics_port[1], &data_port);
+	stat = port_install(vm, &graphics_port[1], &vm->gfx.data_port);
 	if (stat != ERR_NOERR) {
 		return ERR_PORT;
 	}
 
-	gfx_init = true;
+	vm->gfx.init = true;
 	return ERR_NOERR;
 }
 
-error_t graphics_restart(int width, int height)
+error_t graphics_restart(vx4_machine *vm, int width, int height)
 {
-	if (!gfx_init) {
+	if (!vm->gfx.init) {
 		return ERR_PCOND;
 	}
 
-	sdl_subsys_quit();
+	sdl_subsys_quit(vm);
 
-	win_width = 0;
-	win_height = 0;
+	vm->gfx.win_width = 0;
+	vm->gfx.win_height = 0;
 
-	int stat = sdl_subsys_init(width, height);
+	int stat = sdl_subsys_init(vm, width, height);
 
 	if (stat == ERR_NOERR) {
-		win_width = width;
-		win_height = height;
+		vm->gfx.win_width = width;
+		vm->gfx.win_height = height;
 	}
 	else {
-        gfx_init = false;
+        vm->gfx.init = false;
 	}
 
     return stat;
 }
 
-void graphics_step()
+void graphics_step(vx4_machine *vm)
 {
     SDL_Event event;
 
+	if (vm->gfx.headless) {
+		return;
+	}
+
     while (SDL_PollEvent(&event)) {
 		switch (event.type) {
 			case SDL_QUIT:
-				interrupt_raise(INTR_HALT);
+				interrupt_raise(vm, INTR_HALT);
 				break;
 
 			case SDL_KEYDOWN:
-                keyboard_queue_press((event.key.keysym.mod << 16) | (event.key.keysym.scancode & 0xFFFF));
+                keyboard_queue_press(vm, (event.key.keysym.mod << 16) | (event.key.keysym.scancode & 0xFFFF));
                 break;
 		}
     }
 }
 
-void graphics_render()
+void graphics_render(vx4_machine *vm)
 {
 	void *pixels;
 	int pitch;
 
-	if (SDL_LockTexture(texture, NULL, &pixels, &pitch) == 0) {
-		memcpy(pixels, gfx_buffer, RECT_BYTE_SIZE(win_width, win_height));
-		SDL_UnlockTexture(texture);
+	if (vm->gfx.headless) {
+		return;
+	}
+
+	if (SDL_LockTexture(vm->gfx.texture, NULL, &pixels, &pitch) == 0) {
+		memcpy(pixels, vm->gfx.buffer, RECT_BYTE_SIZE(vm->gfx.win_width, vm->gfx.win_height));
+		SDL_UnlockTexture(vm->gfx.texture);
 	}
 
-	SDL_RenderClear(renderer);
-	SDL_RenderCopy(renderer, texture, NULL, NULL);
-	SDL_RenderPresent(renderer);
+	SDL_RenderClear(vm->gfx.renderer);
+	SDL_RenderCopy(vm->gfx.renderer, vm->gfx.texture, NULL, NULL);
+	SDL_RenderPresent(vm->gfx.renderer);
 }
 
-void graphics_end()
+void graphics_end(vx4_machine *vm)
 {
-	gfx_init = false;
+	vm->gfx.init = false;
 
-	if (cmd_port) {
-		port_remove(cmd_port);
+	if (vm->gfx.cmd_port) {
+		port_remove(vm, vm->gfx.cmd_port);
 	}
 
-	if (data_port) {
-		port_remove(data_port);
+	if (vm->gfx.data_port) {
+		port_remove(vm, vm->gfx.data_port);
 	}
 
-	if (gfx_buffer) {
+	if (vm->gfx.buffer) {
 		for (unsigned i = 0; i < (GFX_MEM_MAX / MEM_BLK_SIZE); ++i) {
-			mem_unmap_device(GFX_MMAP_START + (i * MEM_BLK_SIZE));
+			mem_unmap_device(vm, GFX_MMAP_START + (i * MEM_BLK_SIZE));
 		}
 
-		free(gfx_buffer);
+		free(vm->gfx.buffer);
 	}
 
-	sdl_subsys_quit();
+	sdl_subsys_quit(vm);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // Module internal functions
 ////////////////////////////////////////////////////////////////////////////////
 
-error_t sdl_subsys_init(int width, int height)
+error_t sdl_subsys_init(vx4_machine *vm, int width, int height)
 {
 	if (!IS_VALID_MODE(width, height)) {
 		return ERR_INVAL;
 	}
 
-	if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+	// The mode only decides how much of the framebuffer is in use
+	if (vm->gfx.headless) {
+		return ERR_NOERR;
+	}
+
+	// Counted by SDL, so every machine's window can come and go independently
+	if (SDL_InitSubSystem(SDL_INIT_VIDEO) < 0) {
         return ERR_EXTERN;
 	}
 
 	// From here, we have an SDL context which must be destroyed on exit
 	// To avoid leaking graphics resources
 
-	window = SDL_CreateWindow("vx4", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, width, height, 0);
-	if (!window) {
-		graphics_end();
+	vm->gfx.window = SDL_CreateWindow("vx4", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, width, height, 0);
+	if (!vm->gfx.window) {
+		graphics_end(vm);
 		return ERR_EXTERN;
 	}
 
-	renderer = SDL_CreateRenderer(window, -1, 0);
-	if (!renderer) {
-		graphics_end();
+	vm->gfx.renderer = SDL_CreateRenderer(vm->gfx.window, -1, 0);
+	if (!vm->gfx.renderer) {
+		graphics_end(vm);
 		return ERR_EXTERN;
 	}
 
-	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+	SDL_SetRenderDrawColor(vm->gfx.renderer, 0, 0, 0, 255);
 
-	texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, width, height);
-	if (!texture) {
+	vm->gfx.texture = SDL_CreateTexture(vm->gfx.renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, width, height);
+	if (!vm->gfx.texture) {
 		return ERR_EXTERN;
 	}
 
 	return ERR_NOERR;
 }
 
-void sdl_subsys_quit()
+void sdl_subsys_quit(vx4_machine *vm)
 {
-	if (texture) {
-		SDL_DestroyTexture(texture);
+	if (vm->gfx.headless) {
+		return;
+	}
+
+	if (vm->gfx.texture) {
+		SDL_DestroyTexture(vm->gfx.texture);
+		vm->gfx.texture = NULL;
 	}
 
-	if (renderer) {
-		SDL_DestroyRenderer(renderer);
+	if (vm->gfx.renderer) {
+		SDL_DestroyRenderer(vm->gfx.renderer);
+		vm->gfx.renderer = NULL;
 	}
 
-	if (window) {
-		SDL_DestroyWindow(window);
+	if (vm->gfx.window) {
+		SDL_DestroyWindow(vm->gfx.window);
+		vm->gfx.window = NULL;
 	}
 
-	SDL_Quit();
+	SDL_QuitSubSystem(SDL_INIT_VIDEO);
 }
 
-void command_recv(port_id num, uint32_t command)
+void command_recv(vx4_machine *vm, port_id num, uint32_t command)
 {
 	(void)num;
-    act = (int)command;
+    vm->gfx.act = (int)command;
 
-    if (act == GA_NONE) {
-		res = GS_OK;
+    if (vm->gfx.act == GA_NONE) {
+		vm->gfx.res = GS_OK;
     }
     else {
-		res = GS_WAIT;
+		vm->gfx.res = GS_WAIT;
     }
 }
 
-uint32_t command_reply(port_id num)
+uint32_t command_reply(vx4_machine *vm, port_id num)
 {
 	(void)num;
-    return (uint32_t)res;
+    return (uint32_t)vm->gfx.res;
 }
 
-void data_write(port_id num, uint32_t data)
+void data_write(vx4_machine *vm, port_id num, uint32_t data)
 {
 	(void)num;
-	port_data = data;
+	vm->gfx.port_data = data;
 
-	switch (act) {
+	switch (vm->gfx.act) {
 		default:
 		case GA_NONE:
-			res = GS_ERROR;
+			vm->gfx.res = GS_ERROR;
 			break;
 
 		case GA_RES:
-            if (graphics_restart(data & 0xFFFF, data >> 16) == ERR_NOERR) {
-				res = GS_OK;
+            if (graphics_restart(vm, data & 0xFFFF, data >> 16) == ERR_NOERR) {
+				vm->gfx.res = GS_OK;
             }
             else {
-				res = GS_ERROR;
+				vm->gfx.res = GS_ERROR;
             }
             break;
 	}
 }
 
-uint32_t data_read(port_id num)
+uint32_t data_read(vx4_machine *vm, port_id num)
 {
 	(void)num;
 	uint32_t ret;
 
-	switch (act) {
+	switch (vm->gfx.act) {
 		default:
 		case GA_NONE:
-			res = GS_ERROR;
+			vm->gfx.res = GS_ERROR;
 			ret = 0;
 			break;
 
 		case GA_ADDR:
-			res = GS_OK;
+			vm->gfx.res = GS_OK;
 			ret = GFX_MMAP_START;
 			break;
 
 		case GA_BUFSZ:
-			res = GS_OK;
+			vm->gfx.res = GS_OK;
 			ret = GFX_MEM_MAX;
 			break;
 
 		case GA_RES:
-			res = GS_OK;
-			ret = ((uint32_t)win_width) | (((uint32_t)win_height) << 16);
+			vm->gfx.res = GS_OK;
+			ret = ((uint32_t)vm->gfx.win_width) | (((uint32_t)vm->gfx.win_height) << 16);
 			break;
 	}
 
@@ -2,10 +2,15 @@
 
 #include "error.h"
 #include "disk.h" // For DISK_MMAP_START constant
+#include "port.h"
+#include "vx4.h"
 
 #include <stdint.h>
 #include <stdbool.h>
 
+#include <SDL2/SDL_video.h>
+#include <SDL2/SDL_render.h>
+
 ////////////////////////////////////////////////////////////////////////////////
 // Constants + helper macros
 ////////////////////////////////////////////////////////////////////////////////
@@ -28,10 +33,58 @@ typedef enum _gfx_state {
 	GS_ERROR,
 } gfx_state;
 
+////////////////////////////////////////////////////////////////////////////////
+// Machine state
+////////////////////////////////////////////////////////////////////////////////
+
+// Should not be touched except by functions in graphics.c
+typedef struct _graphics_context {
+	// Pointers to resources used by SDL for rendering.
+	SDL_Window *window;
+	SDL_Renderer *renderer;
+	SDL_Texture *texture;
+
+	// The current dimensions of the window
+	int win_width;
+	int win_height;
+
+	// The memory-mapped framebuffer
+	uint8_t *buffer;
+
+	// State for the command ports
+	gfx_action act; // The current queued action
+	gfx_state res; // The success/failure to be reported via command_reply
+	uint32_t port_data; // Auxiliary data used by the port functions
+
+	port_id cmd_port;
+	port_id data_port;
+
+	// Has the graphics subsystem been initialized yet?
+	bool init;
+
+	// Is there no window, and so nothing to draw to?
+	bool headless;
+} graphics_context;
+
 ////////////////////////////////////////////////////////////////////////////////
 // Function declarations
 ////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * Selects whether the graphics system runs without a window. When headless,
+ * the framebuffer and control ports behave as normal, but SDL video is never
+ * initialised and nothing is ever drawn. Must be called before
+ * graphics_begin.
+ *
+ * IN headless: Whether to run without a window.
+ */
+extern void graphics_set_headless(vx4_machine *vm, bool headless);
+
+/**
+ * Returns whether the graphics system is running without a window.
+ */
+extern bool graphics_headless(vx4_machine *vm);
+
 /**
  * Start the graphics system, including creating a window, framebuffer
  * and control ports.
@@ -46,7 +99,7 @@ typedef enum _gfx_state {
  * ERR_NOMEM: The framebuffer couldn't be allocated.
  * ERR_PORT: Enought ports couldn't be allocated for the graphics system.
  */
-extern error_t graphics_begin(int width, int height);
+extern error_t graphics_begin(vx4_machine *vm, int width, int height);
 
 /**
  * Reinitialize the rendering subsystem with a different window size.
@@ -61,21 +114,21 @@ extern error_t graphics_begin(int width, int height);
  * ERR_EXTERN: An error occurred while attempting to initialize the
  * rendering subsystem.
  */
-extern error_t graphics_restart(int width, int height);
+extern error_t graphics_restart(vx4_machine *vm, int width, int height);
 
 /**
  * Process all frame-wise and event loop actions for the graphics subsystem.
  */
-extern void graphics_step();
+extern void graphics_step(vx4_machine *vm);
 
 /**
  * Draw the graphics framebuffer to the window, and update the window on
  * screen.
  */
-extern void graphics_render();
+extern void graphics_render(vx4_machine *vm);
 
 /**
  * Clean up all resources related to the graphics subsystem and shut it down.
  * Must be called on application exit to avoid leaking graphics resources.
  */
-extern void graphics_end();
+extern void graphics_end(vx4_machine *vm);
@@ -0,0 +1,120 @@
+#include "icache.h"
+
+#include "error.h"
+#include "mem.h"
+#include "instruction.h"
+#include "machine.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Module internal declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Decodes an instruction into an entry, and decides whether the entry
+ * may remain valid after this fetch.
+ *
+ * IN addr: The address of the instruction.
+ * OUT entry: The entry to fill.
+ */
+static void fill_entry(vx4_cpu *vcpu, mem_addr addr, icache_entry *entry);
+
+////////////////////////////////////////////////////////////////////////////////
+// Interface functions
+////////////////////////////////////////////////////////////////////////////////
+
+error_t icache_begin(vx4_cpu *vcpu)
+{
+	vcpu->icache = malloc(sizeof (icache_context));
+	if (vcpu->icache == NULL) {
+		return ERR_NOMEM;
+	}
+
+	icache_flush(vcpu);
+	return ERR_NOERR;
+}
+
+void icache_end(vx4_cpu *vcpu)
+{
+	free(vcpu->icache);
+	vcpu->icache = NULL;
+}
+
+const instruction_decoded *icache_fill(vx4_cpu *vcpu, mem_addr addr)
+{
+	icache_context *cache = vcpu->icache;
+	icache_entry *entry = &cache->entries[ICACHE_INDEX(addr)];
+
+	// Decode somewhere temporary first, the instruction may not be cacheable
+	fill_entry(vcpu, addr, &cache->uncached);
+
+	if (!cache->uncached.valid) {
+		return &cache->uncached.ins;
+	}
+
+	*entry = cache->uncached;
+	return &entry->ins;
+}
+
+void icache_invalidate(vx4_cpu *vcpu, mem_addr base, mem_size num)
+{
+	// Past a certain size, it's quicker to throw everything away
+	if (num >= ICACHE_NUM_ENTRIES * 2) {
+		icache_flush(vcpu);
+		return;
+	}
+
+	// Any superinstruction starting up to INS_MAX_FUSED_SIZE - 1 bytes
+	// before the range could overlap its beginning
+	mem_addr addr = (base - (INS_MAX_FUSED_SIZE - 1)) & ~1u;
+	mem_size count = (base + num - addr + 1) / 2;
+
+	for (; count > 0; --count, addr += 2) {
+		icache_entry *entry = &vcpu->icache->entries[ICACHE_INDEX(addr)];
+
+		if (entry->valid && entry->addr == addr) {
+			if ((mem_addr)(base - addr) < entry->ins.fused_size || (mem_addr)(addr - base) < num) {
+				entry->valid = false;
+			}
+		}
+	}
+}
+
+void icache_flush(vx4_cpu *vcpu)
+{
+	for (size_t i = 0; i < ICACHE_NUM_ENTRIES; ++i) {
+		vcpu->icache->entries[i].valid = false;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Module internal functions
+////////////////////////////////////////////////////////////////////////////////
+
+void fill_entry(vx4_cpu *vcpu, mem_addr addr, icache_entry *entry)
+{
+	entry->addr = addr;
+
+	// Watched before decoding, so another CPU rewriting the code meanwhile
+	// is still reported
+	// Odd addresses can't hold instructions, so aren't worth keeping
+	bool watched = (addr & 1) == 0 && mem_watch_line(vcpu->vm, addr);
+
+	instruction_decode(vcpu->vm, addr, &entry->ins);
+
+	// An instruction may span two lines, both of which need watching
+	entry->valid = watched && mem_watch_line(vcpu->vm, addr + entry->ins.size - 1);
+
+	// Superinstructions also depend on the code after them
+	if (entry->valid && instruction_fuse(vcpu->vm, addr, &entry->ins)) {
+		if (!mem_watch_line(vcpu->vm, addr + entry->ins.fused_size - 1)) {
+			entry->ins.fused = entry->ins.id;
+			entry->ins.fused_size = entry->ins.size;
+			entry->ins.fused_len = 1;
+		}
+	}
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "error.h"
+#include "mem.h"
+#include "instruction.h"
+#include "machine.h"
+
+#include <stdbool.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct _icache_entry {
+	mem_addr addr; // The address the instruction was decoded from
+	bool valid;
+	instruction_decoded ins;
+} icache_entry;
+
+////////////////////////////////////////////////////////////////////////////////
+// Constants + helper macros
+////////////////////////////////////////////////////////////////////////////////
+
+#define ICACHE_NUM_ENTRIES 8192 // Must be a power of two
+
+// Instructions are dbyte-aligned, so the lowest address bit carries no information
+#define ICACHE_INDEX(addr) (((addr) >> 1) & (ICACHE_NUM_ENTRIES - 1))
+
+////////////////////////////////////////////////////////////////////////////////
+// Machine state
+////////////////////////////////////////////////////////////////////////////////
+
+// Left visible so that icache_fetch can be inlined into the interpreter loops
+// Should not be touched except by functions in icache.c or icache_fetch
+typedef struct _icache_context {
+	// Direct-mapped, so each address can only ever live in a single entry
+	icache_entry entries[ICACHE_NUM_ENTRIES];
+
+	// Holds instructions which can't be cached, until the next fetch
+	icache_entry uncached;
+} icache_context;
+
+////////////////////////////////////////////////////////////////////////////////
+// Function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Allocates a CPU's decoded instruction cache. The owner must pass memory
+ * writes on to icache_invalidate, so that stale entries can be discarded.
+ * Each CPU has its own cache, which only it may touch.
+ *
+ * Returns:
+ * ERR_NOERR: The cache is ready for use.
+ * ERR_NOMEM: The cache couldn't be allocated.
+ */
+extern error_t icache_begin(vx4_cpu *vcpu);
+
+/**
+ * Frees the cache.
+ */
+extern void icache_end(vx4_cpu *vcpu);
+
+/**
+ * Decodes and caches the instruction at an address. Instructions read
+ * from device mappings are never cached, as their contents can change
+ * without notice. Cached instructions are also fused with any that
+ * follow them where possible, see instruction_fuse. Use icache_fetch
+ * instead, which only calls this on a cache miss.
+ *
+ * IN addr: The address of the instruction to decode.
+ *
+ * Returns: The decoded instruction, valid until the next fetch.
+ */
+extern const instruction_decoded *icache_fill(vx4_cpu *vcpu, mem_addr addr);
+
+/**
+ * Discards any cached instructions overlapping a range of memory.
+ *
+ * IN base: The address of the start of the range.
+ * IN num: The length of the range in bytes.
+ */
+extern void icache_invalidate(vx4_cpu *vcpu, mem_addr base, mem_size num);
+
+/**
+ * Discards every cached instruction.
+ */
+extern void icache_flush(vx4_cpu *vcpu);
+
+////////////////////////////////////////////////////////////////////////////////
+// Inline function definitions
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Fetches the decoded instruction at an address, decoding it first if
+ * it isn't already cached.
+ *
+ * IN addr: The address of the instruction to fetch.
+ *
+ * Returns: The decoded instruction, valid until the next fetch.
+ */
+static inline const instruction_decoded *icache_fetch(vx4_cpu *vcpu, mem_addr addr)
+{
+	const icache_entry *entry = &vcpu->icache->entries[ICACHE_INDEX(addr)];
+
+	if (entry->valid && entry->addr == addr) {
+		return &entry->ins;
+	}
+
+	return icache_fill(vcpu, addr);
+}
@@ -2,44 +2,387 @@
 
 #include "error.h"
 #include "mem.h"
+#include "mmu.h"
 #include "port.h"
 #include "register.h"
+#include "stack.h"
 #include "cpu.h"
+#include "machine.h"
 
+#include <stdio.h>
+#include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <math.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Internal constants + helper macros
+////////////////////////////////////////////////////////////////////////////////
+
+// The size of each form's operands, as constants the tables can use
+enum _form_extra {
+#define X(form, a, b, c) FORM_EXTRA_##form = INS_FORM_EXTRA(INS_OPERAND_##a, INS_OPERAND_##b, INS_OPERAND_##c),
+	ISA_FORMS(X)
+#undef X
+};
+
+// Longer than any mnemonic and three operands, see instruction_disassemble
+#define DISASM_MAX_TEXT 64
+
+#define IS_REGISTER_OPERAND(kind) \
+	((kind) == INS_OPERAND_REG || (kind) == INS_OPERAND_VREG || (kind) == INS_OPERAND_FREG)
+
+// Where in instruction_ops an operand is decoded to
+typedef enum _operand_slot {
+	SLOT_NONE,
+	SLOT_REG0,
+	SLOT_REG1,
+	SLOT_PORT,
+	SLOT_IMM,
+} operand_slot;
+
+#define X(form, a, b, c) _Static_assert(FORM_EXTRA_##form + 2 <= INS_MAX_SIZE, #form " instructions must fit in INS_MAX_SIZE");
+ISA_FORMS(X)
+#undef X
 
 ////////////////////////////////////////////////////////////////////////////////
 // Module internal declarations
 ////////////////////////////////////////////////////////////////////////////////
 
-static error_t instruction_nop(void *data);
-static error_t instruction_hlt(void *data);
-static error_t instruction_jmpc(void *data);
-static error_t instruction_movrc(void *data);
-static error_t instruction_movmr(void *data);
-static error_t instruction_addrc(void *data);
-static error_t instruction_storr(void *data);
-static error_t instruction_outpr(void *data);
-static error_t instruction_inrp(void *data);
-static error_t instruction_cli(void *data);
-static error_t instruction_sti(void *data);
+/**
+ * Decodes an instruction from its opcode and the bytes following it, see
+ * instruction_decode.
+ *
+ * IN id: The opcode, which may be invalid.
+ * IN data: The bytes after the opcode, as many as it says there are.
+ * OUT dest: The decoded instruction.
+ */
+static void decode_body(instruction_id id, const uint8_t *data, instruction_decoded *dest);
+
+/**
+ * Operand decoders, one for each of ISA_FORMS, named decode_<form>. Each
+ * is decode_operands specialised for its form's operands.
+ *
+ * IN data: The raw operand bytes following the opcode.
+ * OUT ops: The unpacked operands.
+ *
+ * Returns:
+ * ERR_NOERR: The operands were valid.
+ * ERR_INVAL: A register, port or lane was out of range.
+ */
+#define X(form, a, b, c) static error_t decode_##form(const uint8_t *data, instruction_ops *ops);
+ISA_FORMS(X)
+#undef X
+
+/**
+ * Unpacks and checks the operands of any form, see ISA_FORMS. Only called
+ * with constant kinds, so that each decoder gets its own copy with the
+ * sizes and checks worked out at compile time.
+ *
+ * IN data: The raw operand bytes following the opcode.
+ * IN a, b, c: The form's operands.
+ * OUT ops: The unpacked operands.
+ *
+ * Returns:
+ * ERR_NOERR: The operands were valid.
+ * ERR_INVAL: A register, port or lane was out of range.
+ */
+static inline error_t decode_operands(const uint8_t *data, instruction_operand a, instruction_operand b,
+	instruction_operand c, instruction_ops *ops);
+
+/**
+ * Returns whether an operand's value is in range for its kind.
+ */
+static inline bool operand_valid(instruction_operand kind, uint32_t val);
+
+/**
+ * Returns the member of instruction_ops which holds an operand, see
+ * ISA_FORMS.
+ *
+ * IN kind: The operand's kind.
+ * IN index: Its place in the form.
+ * IN form: The form's operands.
+ */
+static inline operand_slot slot_of(instruction_operand kind, size_t index, const instruction_operand *form);
+
+/**
+ * Returns the operand held in a member of instruction_ops.
+ */
+static uint32_t slot_get(const instruction_ops *ops, operand_slot slot);
+
+/**
+ * Stands in for the handler of any instruction that failed to decode.
+ */
+static error_t instruction_invalid(vx4_cpu *vcpu, const instruction_ops *ops);
+
+static error_t instruction_nop(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_hlt(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_jmpc(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_movrc(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_movmr(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_addrc(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_storr(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_outpr(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_inrp(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_cli(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_sti(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_wfi(vx4_cpu *vcpu, const instruction_ops *ops);
+
+/**
+ * Returns from an interrupt handler, see cpu_interrupt_return. Fails
+ * outside of one.
+ */
+static error_t instruction_iret(vx4_cpu *vcpu, const instruction_ops *ops);
+
+/**
+ * Paging instructions, see mmu.h. setptb sets the physical address of the
+ * page directory (or turns paging off, given 0), invlpg discards the TLB's
+ * translation of the page holding an address, and tlbflush discards all of
+ * them. rdfault reads the address and mmu_access of the last page fault.
+ */
+static error_t instruction_setptb(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_invlpg(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_tlbflush(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_rdfault(vx4_cpu *vcpu, const instruction_ops *ops);
+
+/**
+ * Read the CPU's instruction count (rdins) or clock (rdtime, in ns) as
+ * 64 bits, the low half into the first register and the high half into
+ * the second.
+ */
+static error_t instruction_rdins(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_rdtime(vx4_cpu *vcpu, const instruction_ops *ops);
+
+static error_t instruction_movrr(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_movrm(vx4_cpu *vcpu, const instruction_ops *ops);
+
+/**
+ * Load into, or store from, the second register at the address in the
+ * first register plus a constant offset.
+ */
+static error_t instruction_loado(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_storo(vx4_cpu *vcpu, const instruction_ops *ops);
+
+/**
+ * Arithmetic, with the result replacing the first operand. All of it is
+ * on unsigned words that wrap, except that sar shifts in copies of the
+ * sign bit. Shift counts are taken modulo 32, and dividing by zero fails.
+ */
+static error_t instruction_addrr(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_subrr(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_mulrr(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_divrr(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_andrr(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_orrr(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_xorrr(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_shlrr(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_shrrr(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_sarrr(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_subrc(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_mulrc(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_divrc(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_andrc(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_orrc(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_xorrc(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_shlrc(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_shrrc(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_sarrc(vx4_cpu *vcpu, const instruction_ops *ops);
+
+/**
+ * Compare two operands for the conditional jumps that follow. Nothing is
+ * worked out until a jump needs it, the operands are only kept in
+ * vcpu->compared.
+ */
+static error_t instruction_cmprr(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_cmprc(vx4_cpu *vcpu, const instruction_ops *ops);
+
+/**
+ * Jump if the first operand compared was equal, not equal, less, less or
+ * equal, greater or greater or equal to the second. The u forms compare
+ * unsigned, the others signed.
+ */
+static error_t instruction_jeq(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_jne(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_jlt(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_jle(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_jgt(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_jge(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_jltu(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_jleu(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_jgtu(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_jgeu(vx4_cpu *vcpu, const instruction_ops *ops);
+
+/**
+ * Call pushes the address of the next instruction before jumping, and ret
+ * pops it back into the ip. Enter and leave create and destroy a stack
+ * frame, see stack_enter_frame.
+ */
+static error_t instruction_callc(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_ret(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_enter(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_leave(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_pushr(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_popr(vx4_cpu *vcpu, const instruction_ops *ops);
+
+/**
+ * Vector instructions. vload and vstor move a vector to or from the
+ * 16 byte aligned address in a register. vsplat copies a register into
+ * every word lane, and vextr copies one word lane (given by a constant)
+ * out to a register. The rest work lane-wise, see vector_add8 onwards.
+ */
+static error_t instruction_vload(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vstor(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vmov(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vsplat(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vextr(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vshuf32(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vadd8(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vadd16(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vadd32(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vsub8(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vsub16(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vsub32(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vmul8(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vmul16(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vmul32(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vminu8(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vminu16(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vminu32(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vmaxu8(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vmaxu16(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vmaxu32(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vcmpeq8(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vcmpeq16(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vcmpeq32(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vcmpgt8(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vcmpgt16(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vcmpgt32(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vand(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vor(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vxor(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_vshuf8(vx4_cpu *vcpu, const instruction_ops *ops);
+
+/**
+ * Floating-point instructions. The 32 forms work on the f32 in the low
+ * word of each register, and the 64 forms on the whole register as an
+ * f64. floado and storo move between memory and a register, addressed as
+ * loado and storo are. fma sets its first operand to the product of the
+ * other two plus itself, and fcmp sets the compared operands so that the
+ * signed conditional jumps test the order (see FPU_LESS). fwiden and
+ * fnarrow convert between f32 and f64, and fitof and fftoi between signed
+ * integers and floats, see fpu_ftoi32.
+ */
+static error_t instruction_fmovff(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_fmovfr(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_fmovrf(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_floado32(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_floado64(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_fstoro32(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_fstoro64(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_fadd32(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_fadd64(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_fsub32(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_fsub64(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_fmul32(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_fmul64(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_fdiv32(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_fdiv64(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_fsqrt32(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_fsqrt64(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_fma32(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_fma64(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_fcmp32(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_fcmp64(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_fwiden(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_fnarrow(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_fitof32(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_fitof64(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_fftoi32(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_fftoi64(vx4_cpu *vcpu, const instruction_ops *ops);
+
+/**
+ * Block memory instructions, each taking its length in bytes from the
+ * register in the constant. mcopy copies from the second register's
+ * address to the first's (as memmove does), and mfill fills the first's
+ * with the low byte of the second. mcmp compares like memcmp, setting the
+ * compared operands to the first pair of bytes that differ (or zeroes),
+ * so the unsigned conditional jumps order the spans.
+ */
+static error_t instruction_mcopy(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_mfill(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_mcmp(vx4_cpu *vcpu, const instruction_ops *ops);
+
+/**
+ * Atomic instructions on the word at the first register's address, see
+ * mem_exchange_word. xchg swaps it with the second register, and xadd
+ * adds the second register to it, leaving the old word there. cas stores
+ * the register in the constant if the word equals the second register,
+ * which is then left holding the old word. The compared operands become
+ * the old word and the expected one, so jeq follows a successful swap.
+ */
+static error_t instruction_xchg(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_xadd(vx4_cpu *vcpu, const instruction_ops *ops);
+static error_t instruction_cas(vx4_cpu *vcpu, const instruction_ops *ops);
+
+/**
+ * Jumps to the target of a conditional jump if its condition held.
+ */
+static error_t jump_if(vx4_cpu *vcpu, const instruction_ops *ops, bool cond);
 
 instruction_info instructions[] = {
-    {instruction_nop, 0},
-    {instruction_hlt, 0},
-    {instruction_jmpc, 4},
-    {instruction_movrc, 6},
-    {instruction_movmr, 6},
-    {instruction_addrc, 6},
-    {instruction_storr, 2},
-    {instruction_outpr, 4},
-	{instruction_inrp, 4},
-	{instruction_cli, 0},
-	{instruction_sti, 0},
+#define X(NAME, name, form) \
+	[INS_##NAME] = {instruction_##name, decode_##form, INS_FORM_##form, FORM_EXTRA_##form, #name},
+	ISA_INSTRUCTIONS(X)
+#undef X
+};
+
+const instruction_form instruction_forms[] = {
+#define X(form, a, b, c) \
+	[INS_FORM_##form] = {{INS_OPERAND_##a, INS_OPERAND_##b, INS_OPERAND_##c}, FORM_EXTRA_##form},
+	ISA_FORMS(X)
+#undef X
+};
+
+// Mined from firmware traces with tools/fusemine, longest sequences first
+const instruction_fusion instruction_fusions[] = {
+	{{INS_MOVRC, INS_MOVRC, INS_STORR}, 3, INS_FUSED_MOVRC_MOVRC_STORR},
+	{{INS_MOVRC, INS_STORR}, 2, INS_FUSED_MOVRC_STORR},
+	{{INS_MOVRC, INS_OUTPR}, 2, INS_FUSED_MOVRC_OUTPR},
+	{{INS_ADDRC, INS_STORR}, 2, INS_FUSED_ADDRC_STORR},
+	{{INS_ADDRC, INS_JMPC}, 2, INS_FUSED_ADDRC_JMPC},
+
+	{{0}, 0, 0} // Terminates the list
+};
+
+// See instruction_vector_func
+static const vector_pf vector_funcs[INS_NUM_INS] = {
+	[INS_VADD8] = vector_add8,
+	[INS_VADD16] = vector_add16,
+	[INS_VADD32] = vector_add32,
+	[INS_VSUB8] = vector_sub8,
+	[INS_VSUB16] = vector_sub16,
+	[INS_VSUB32] = vector_sub32,
+	[INS_VMUL8] = vector_mul8,
+	[INS_VMUL16] = vector_mul16,
+	[INS_VMUL32] = vector_mul32,
+	[INS_VMINU8] = vector_minu8,
+	[INS_VMINU16] = vector_minu16,
+	[INS_VMINU32] = vector_minu32,
+	[INS_VMAXU8] = vector_maxu8,
+	[INS_VMAXU16] = vector_maxu16,
+	[INS_VMAXU32] = vector_maxu32,
+	[INS_VCMPEQ8] = vector_cmpeq8,
+	[INS_VCMPEQ16] = vector_cmpeq16,
+	[INS_VCMPEQ32] = vector_cmpeq32,
+	[INS_VCMPGT8] = vector_cmpgt8,
+	[INS_VCMPGT16] = vector_cmpgt16,
+	[INS_VCMPGT32] = vector_cmpgt32,
+	[INS_VAND] = vector_and,
+	[INS_VOR] = vector_or,
+	[INS_VXOR] = vector_xor,
+	[INS_VSHUF8] = vector_shuf8,
 };
 
-#define INS_NUM_INS (sizeof (instructions) / sizeof (instruction_info))
 #define IS_VALID_INSTRUCTION(id) ((id) < INS_NUM_INS)
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -51,144 +394,1128 @@ bool valid_instruction(instruction_id ins)
 	return IS_VALID_INSTRUCTION(ins);
 }
 
+void instruction_decode(vx4_machine *vm, mem_addr addr, instruction_decoded *dest)
+{
+	instruction_id id;
+	uint8_t data[INS_MAX_SIZE - 2];
+
+	if (mem_read_dbyte(vm, addr, &id) != ERR_NOERR) {
+		id = INS_INVALID;
+	}
+
+	// Only as many bytes as the opcode says follow it
+	if (IS_VALID_INSTRUCTION(id)) {
+		mem_read_mem(vm, addr + 2, data, instructions[id].extra);
+	}
+
+	decode_body(id, data, dest);
+}
+
+void instruction_decode_bytes(const uint8_t *code, instruction_decoded *dest)
+{
+	decode_body((instruction_id)(code[0] | code[1] << 8), code + 2, dest);
+}
+
+bool instruction_fuse(vx4_machine *vm, mem_addr addr, instruction_decoded *dest)
+{
+	instruction_decoded following[INS_MAX_FUSED - 1];
+	size_t num = 0;
+
+	if (dest->id == INS_INVALID) {
+		return false;
+	}
+
+	// Decode as far ahead as the longest sequence could need
+	addr += dest->size;
+
+	while (num < INS_MAX_FUSED - 1) {
+		instruction_decode(vm, addr, &following[num]);
+
+		if (following[num].id == INS_INVALID) {
+			break;
+		}
+
+		addr += following[num].size;
+		++num;
+	}
+
+	for (const instruction_fusion *fusion = instruction_fusions; fusion->len > 0; ++fusion) {
+		if (fusion->len - 1 > num || fusion->seq[0] != dest->id) {
+			continue;
+		}
+
+		size_t i;
+
+		for (i = 1; i < fusion->len; ++i) {
+			if (fusion->seq[i] != following[i - 1].id) {
+				break;
+			}
+		}
+
+		if (i < fusion->len) {
+			continue;
+		}
+
+		dest->fused = fusion->fused;
+		dest->fused_size = dest->size;
+		dest->fused_len = fusion->len;
+
+		for (i = 1; i < fusion->len; ++i) {
+			dest->next[i - 1] = following[i - 1].ops;
+			dest->fused_size += following[i - 1].size;
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+vector_pf instruction_vector_func(instruction_id ins)
+{
+	if (!IS_VALID_INSTRUCTION(ins)) {
+		return NULL;
+	}
+
+	return vector_funcs[ins];
+}
+
+const char *instruction_name(instruction_id ins)
+{
+	if (!IS_VALID_INSTRUCTION(ins)) {
+		return "invalid";
+	}
+
+	return instructions[ins].name;
+}
+
+mem_size instruction_encode(instruction_id ins, const instruction_ops *ops, uint8_t *dest)
+{
+	if (!IS_VALID_INSTRUCTION(ins)) {
+		return 0;
+	}
+
+	const instruction_form *form = &instruction_forms[instructions[ins].form];
+	mem_size size = 2 + form->extra;
+
+	memset(dest, 0, size);
+	memcpy(dest, &ins, 2);
+
+	uint8_t *data = dest + 2;
+
+	for (size_t i = 0; i < INS_MAX_OPERANDS; ++i) {
+		uint32_t val = slot_get(ops, slot_of(form->operands[i], i, form->operands));
+
+		memcpy(data, &val, INS_OPERAND_SIZE(form->operands[i]));
+		data += INS_OPERAND_SIZE(form->operands[i]);
+	}
+
+	return size;
+}
+
+int instruction_disassemble(instruction_id ins, const instruction_ops *ops, char *dest, size_t size)
+{
+	if (!IS_VALID_INSTRUCTION(ins)) {
+		return snprintf(dest, size, "invalid");
+	}
+
+	const instruction_form *form = &instruction_forms[instructions[ins].form];
+
+	// Built up in full first, then truncated to fit dest
+	char text[DISASM_MAX_TEXT];
+	int len = snprintf(text, sizeof (text), "%s", instructions[ins].name);
+
+	for (size_t i = 0; i < INS_MAX_OPERANDS && form->operands[i] != INS_OPERAND_NONE; ++i) {
+		uint32_t val = slot_get(ops, slot_of(form->operands[i], i, form->operands));
+		const char *sep = i == 0 ? " " : ", ";
+
+		switch (form->operands[i]) {
+			case INS_OPERAND_REG:
+				len += snprintf(text + len, sizeof (text) - len, "%sr%u", sep, (unsigned)val);
+				break;
+
+			case INS_OPERAND_VREG:
+				len += snprintf(text + len, sizeof (text) - len, "%sv%u", sep, (unsigned)val);
+				break;
+
+			case INS_OPERAND_FREG:
+				len += snprintf(text + len, sizeof (text) - len, "%sf%u", sep, (unsigned)val);
+				break;
+
+			case INS_OPERAND_PORT:
+				len += snprintf(text + len, sizeof (text) - len, "%sp%u", sep, (unsigned)val);
+				break;
+
+			case INS_OPERAND_ADDR:
+				len += snprintf(text + len, sizeof (text) - len, "%s[0x%x]", sep, (unsigned)val);
+				break;
+
+			default:
+				len += snprintf(text + len, sizeof (text) - len, "%s0x%x", sep, (unsigned)val);
+				break;
+		}
+	}
+
+	return snprintf(dest, size, "%s", text);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Module internal functions
 ////////////////////////////////////////////////////////////////////////////////
 
-error_t instruction_nop(void *data)
+void decode_body(instruction_id id, const uint8_t *data, instruction_decoded *dest)
+{
+	dest->func = instruction_invalid;
+	dest->id = INS_INVALID;
+	dest->size = 2;
+	dest->fused = INS_INVALID;
+	dest->fused_size = 2;
+	dest->fused_len = 1;
+
+	if (!IS_VALID_INSTRUCTION(id)) {
+		return;
+	}
+
+	const instruction_info *info = &instructions[id];
+
+	dest->size += info->extra;
+	dest->fused_size = dest->size;
+
+	if (info->decode(data, &dest->ops) == ERR_NOERR) {
+		dest->func = info->func;
+		dest->id = id;
+		dest->fused = id;
+	}
+}
+
+#define X(form, a, b, c) \
+	error_t decode_##form(const uint8_t *data, instruction_ops *ops) \
+	{ \
+		return decode_operands(data, INS_OPERAND_##a, INS_OPERAND_##b, INS_OPERAND_##c, ops); \
+	}
+ISA_FORMS(X)
+#undef X
+
+error_t decode_operands(const uint8_t *data, instruction_operand a, instruction_operand b,
+	instruction_operand c, instruction_ops *ops)
+{
+	const instruction_operand form[INS_MAX_OPERANDS] = {a, b, c};
+
+	for (size_t i = 0; i < INS_MAX_OPERANDS; ++i) {
+		uint32_t val = 0;
+
+		// Copied rather than cast, as operands needn't be aligned
+		memcpy(&val, data, INS_OPERAND_SIZE(form[i]));
+		data += INS_OPERAND_SIZE(form[i]);
+
+		if (!operand_valid(form[i], val)) {
+			return ERR_INVAL;
+		}
+
+		switch (slot_of(form[i], i, form)) {
+			case SLOT_REG0:
+				ops->reg[0] = (reg_id)val;
+				break;
+
+			case SLOT_REG1:
+				ops->reg[1] = (reg_id)val;
+				break;
+
+			case SLOT_PORT:
+				ops->port = (port_id)val;
+				break;
+
+			case SLOT_IMM:
+				ops->imm = val;
+				break;
+
+			case SLOT_NONE:
+				break;
+		}
+	}
+
+	return ERR_NOERR;
+}
+
+bool operand_valid(instruction_operand kind, uint32_t val)
 {
-	(void)data;
+	switch (kind) {
+		case INS_OPERAND_REG:
+			return IS_VALID_REGISTER(val);
+
+		case INS_OPERAND_VREG:
+			return IS_VALID_VREGISTER(val);
+
+		case INS_OPERAND_FREG:
+			return IS_VALID_FREGISTER(val);
+
+		case INS_OPERAND_PORT:
+			return IS_VALID_PORT(val);
+
+		case INS_OPERAND_LANE:
+			// Only a word lane can be named
+			return val < VREG_SIZE / 4;
+
+		default:
+			return true;
+	}
+}
+
+operand_slot slot_of(instruction_operand kind, size_t index, const instruction_operand *form)
+{
+	switch (kind) {
+		case INS_OPERAND_NONE:
+			return SLOT_NONE;
+
+		case INS_OPERAND_PORT:
+			return SLOT_PORT;
+
+		case INS_OPERAND_REG:
+		case INS_OPERAND_VREG:
+		case INS_OPERAND_FREG: {
+			size_t before = 0;
+
+			for (size_t i = 0; i < index; ++i) {
+				before += IS_REGISTER_OPERAND(form[i]);
+			}
+
+			// A third register is kept in the constant
+			return before == 0 ? SLOT_REG0 : before == 1 ? SLOT_REG1 : SLOT_IMM;
+		}
+
+		default:
+			return SLOT_IMM;
+	}
+}
+
+uint32_t slot_get(const instruction_ops *ops, operand_slot slot)
+{
+	switch (slot) {
+		case SLOT_REG0:
+			return ops->reg[0];
+
+		case SLOT_REG1:
+			return ops->reg[1];
+
+		case SLOT_PORT:
+			return ops->port;
+
+		case SLOT_IMM:
+			return ops->imm;
+
+		default:
+			return 0;
+	}
+}
+
+error_t instruction_invalid(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	(void)vcpu;
+	(void)ops;
+	return ERR_INVAL;
+}
+
+error_t instruction_nop(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	(void)vcpu;
+	(void)ops;
 	return ERR_NOERR;
 }
 
-error_t instruction_hlt(void *data)
+error_t instruction_hlt(vx4_cpu *vcpu, const instruction_ops *ops)
 {
-	(void)data;
+	(void)ops;
 
-	cpu_queue_halt();
+	cpu_queue_stop(vcpu);
 	return ERR_NOERR;
 }
 
-error_t instruction_jmpc(void *data)
+error_t instruction_jmpc(vx4_cpu *vcpu, const instruction_ops *ops)
 {
-	cpu_queue_jump(*(mem_addr *)data);
+	cpu_queue_jump(vcpu, ops->imm);
 	return ERR_NOERR;
 }
 
-error_t instruction_movrc(void *data)
+error_t instruction_movrc(vx4_cpu *vcpu, const instruction_ops *ops)
 {
-	reg_id *dest = (reg_id *)data;
-    uint32_t *src = (uint32_t *)(dest + 1);
+	vcpu->registers[ops->reg[0]] = ops->imm;
+	return ERR_NOERR;
+}
 
-    if (!IS_VALID_REGISTER(*dest)) {
-		return ERR_INVAL;
-    }
+error_t instruction_movmr(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	return mmu_write_word(vcpu, ops->imm, vcpu->registers[ops->reg[0]]);
+}
 
-    reg_write_word(*dest, *src);
-    return ERR_NOERR;
+error_t instruction_addrc(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->registers[ops->reg[0]] += ops->imm;
+	return ERR_NOERR;
 }
 
-error_t instruction_movmr(void *data)
+error_t instruction_storr(vx4_cpu *vcpu, const instruction_ops *ops)
 {
-	mem_addr *dest = (mem_addr *)data;
-	reg_id *src = (reg_id *)(dest + 1);
+	return mmu_write_word(vcpu, vcpu->registers[ops->reg[0]], vcpu->registers[ops->reg[1]]);
+}
 
-	if (!IS_VALID_REGISTER(*src)) {
-		return ERR_INVAL;
-	}
+error_t instruction_outpr(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	port_write(vcpu->vm, ops->port, vcpu->registers[ops->reg[0]]);
+	cpu_port_written(vcpu);
 
-	uint32_t word;
-    reg_read_word(*src, &word);
-    return mem_write_word(*dest, word);
+	return ERR_NOERR;
 }
 
-error_t instruction_addrc(void *data)
+error_t instruction_inrp(vx4_cpu *vcpu, const instruction_ops *ops)
 {
-	reg_id *dest = (reg_id *)data;
-    uint32_t *src = (uint32_t *)(dest + 1);
+	uint32_t word = 0;
+	port_read(vcpu->vm, ops->port, &word);
+	vcpu->registers[ops->reg[0]] = word;
+	cpu_port_polled(vcpu, ops->port, word);
 
-    if (!IS_VALID_REGISTER(*dest)) {
-		return ERR_INVAL;
-    }
+	return ERR_NOERR;
+}
 
-    uint32_t word;
-    reg_read_word(*dest, &word);
-    word += *src;
-    reg_write_word(*dest, word);
+error_t instruction_cli(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	(void)ops;
+	cpu_interrupt_set(vcpu, false);
 
-    return ERR_NOERR;
+	return ERR_NOERR;
 }
 
-error_t instruction_storr(void *data)
+error_t instruction_sti(vx4_cpu *vcpu, const instruction_ops *ops)
 {
-	reg_id *dest = (reg_id *)data;
-	reg_id *src = (reg_id *)(dest + 1);
+	(void)ops;
+	cpu_interrupt_set(vcpu, true);
 
-	if (!IS_VALID_REGISTER(*dest)) {
-		return ERR_INVAL;
-    }
-    if (!IS_VALID_REGISTER(*src)) {
-		return ERR_INVAL;
-    }
+	return ERR_NOERR;
+}
 
-    mem_addr where;
-    reg_read_word(*dest, &where);
-    uint32_t word;
-    reg_read_word(*src, &word);
+error_t instruction_wfi(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	(void)ops;
+	cpu_queue_wait(vcpu);
 
-    return mem_write_word(where, word);
+	return ERR_NOERR;
 }
 
-error_t instruction_outpr(void *data)
+error_t instruction_iret(vx4_cpu *vcpu, const instruction_ops *ops)
 {
-	port_id *dest = (port_id *)data;
-	reg_id *src = (reg_id *)(dest + 1);
+	(void)ops;
+	return cpu_interrupt_return(vcpu);
+}
 
-	if (!IS_VALID_PORT(*dest)) {
-		return ERR_INVAL;
-    }
-    if (!IS_VALID_REGISTER(*src)) {
-		return ERR_INVAL;
-    }
+error_t instruction_setptb(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	mmu_set_base(vcpu, vcpu->registers[ops->reg[0]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_invlpg(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	mmu_invalidate(vcpu, vcpu->registers[ops->reg[0]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_tlbflush(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	(void)ops;
+	mmu_flush(vcpu);
 
-    uint32_t word;
-    reg_read_word(*src, &word);
-    port_write(*dest, word);
+	return ERR_NOERR;
+}
 
-    return ERR_NOERR;
+error_t instruction_rdfault(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	mmu_last_fault(vcpu, &vcpu->registers[ops->reg[0]], &vcpu->registers[ops->reg[1]]);
+	return ERR_NOERR;
 }
 
-error_t instruction_inrp(void *data)
+error_t instruction_rdins(vx4_cpu *vcpu, const instruction_ops *ops)
 {
-	reg_id *dest = (reg_id *)data;
-	port_id *src = (port_id *)(dest + 1);
+	uint64_t count = cpu_read_ins(vcpu);
 
-	if (!IS_VALID_REGISTER(*dest)) {
-		return ERR_INVAL;
-    }
-    if (!IS_VALID_PORT(*src)) {
+	vcpu->registers[ops->reg[0]] = (uint32_t)count;
+	vcpu->registers[ops->reg[1]] = (uint32_t)(count >> 32);
+
+	return ERR_NOERR;
+}
+
+error_t instruction_rdtime(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	uint64_t ns = cpu_read_time(vcpu);
+
+	vcpu->registers[ops->reg[0]] = (uint32_t)ns;
+	vcpu->registers[ops->reg[1]] = (uint32_t)(ns >> 32);
+
+	return ERR_NOERR;
+}
+
+error_t instruction_movrr(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->registers[ops->reg[0]] = vcpu->registers[ops->reg[1]];
+	return ERR_NOERR;
+}
+
+error_t instruction_movrm(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	return mmu_read_word(vcpu, ops->imm, &vcpu->registers[ops->reg[0]]);
+}
+
+error_t instruction_loado(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	return mmu_read_word(vcpu, vcpu->registers[ops->reg[0]] + ops->imm, &vcpu->registers[ops->reg[1]]);
+}
+
+error_t instruction_storo(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	return mmu_write_word(vcpu, vcpu->registers[ops->reg[0]] + ops->imm, vcpu->registers[ops->reg[1]]);
+}
+
+error_t instruction_addrr(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->registers[ops->reg[0]] += vcpu->registers[ops->reg[1]];
+	return ERR_NOERR;
+}
+
+error_t instruction_subrr(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->registers[ops->reg[0]] -= vcpu->registers[ops->reg[1]];
+	return ERR_NOERR;
+}
+
+error_t instruction_mulrr(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->registers[ops->reg[0]] *= vcpu->registers[ops->reg[1]];
+	return ERR_NOERR;
+}
+
+error_t instruction_divrr(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	uint32_t divisor = vcpu->registers[ops->reg[1]];
+
+	if (divisor == 0) {
 		return ERR_INVAL;
-    }
+	}
+
+	vcpu->registers[ops->reg[0]] /= divisor;
+	return ERR_NOERR;
+}
+
+error_t instruction_andrr(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->registers[ops->reg[0]] &= vcpu->registers[ops->reg[1]];
+	return ERR_NOERR;
+}
+
+error_t instruction_orrr(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->registers[ops->reg[0]] |= vcpu->registers[ops->reg[1]];
+	return ERR_NOERR;
+}
+
+error_t instruction_xorrr(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->registers[ops->reg[0]] ^= vcpu->registers[ops->reg[1]];
+	return ERR_NOERR;
+}
 
-    uint32_t word;
-    port_read(*src, &word);
-    reg_write_word(*dest, word);
+error_t instruction_shlrr(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->registers[ops->reg[0]] <<= vcpu->registers[ops->reg[1]] % 32;
+	return ERR_NOERR;
+}
 
-    return ERR_NOERR;
+error_t instruction_shrrr(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->registers[ops->reg[0]] >>= vcpu->registers[ops->reg[1]] % 32;
+	return ERR_NOERR;
 }
 
-error_t instruction_cli(void *data)
+error_t instruction_sarrr(vx4_cpu *vcpu, const instruction_ops *ops)
 {
-	(void)data;
-	cpu_interrupt_set(false);
+	int32_t value = (int32_t)vcpu->registers[ops->reg[0]];
 
+	// Relies on the host shifting signed values arithmetically, as gcc does
+	vcpu->registers[ops->reg[0]] = (uint32_t)(value >> vcpu->registers[ops->reg[1]] % 32);
 	return ERR_NOERR;
 }
 
-error_t instruction_sti(void *data)
+error_t instruction_subrc(vx4_cpu *vcpu, const instruction_ops *ops)
 {
-	(void)data;
-	cpu_interrupt_set(true);
+	vcpu->registers[ops->reg[0]] -= ops->imm;
+	return ERR_NOERR;
+}
+
+error_t instruction_mulrc(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->registers[ops->reg[0]] *= ops->imm;
+	return ERR_NOERR;
+}
+
+error_t instruction_divrc(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	uint32_t divisor = ops->imm;
+
+	if (divisor == 0) {
+		return ERR_INVAL;
+	}
+
+	vcpu->registers[ops->reg[0]] /= divisor;
+	return ERR_NOERR;
+}
+
+error_t instruction_andrc(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->registers[ops->reg[0]] &= ops->imm;
+	return ERR_NOERR;
+}
+
+error_t instruction_orrc(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->registers[ops->reg[0]] |= ops->imm;
+	return ERR_NOERR;
+}
+
+error_t instruction_xorrc(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->registers[ops->reg[0]] ^= ops->imm;
+	return ERR_NOERR;
+}
+
+error_t instruction_shlrc(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->registers[ops->reg[0]] <<= ops->imm % 32;
+	return ERR_NOERR;
+}
+
+error_t instruction_shrrc(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->registers[ops->reg[0]] >>= ops->imm % 32;
+	return ERR_NOERR;
+}
+
+error_t instruction_sarrc(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	int32_t value = (int32_t)vcpu->registers[ops->reg[0]];
+
+	// Relies on the host shifting signed values arithmetically, as gcc does
+	vcpu->registers[ops->reg[0]] = (uint32_t)(value >> ops->imm % 32);
+	return ERR_NOERR;
+}
+
+error_t instruction_cmprr(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->compared[0] = vcpu->registers[ops->reg[0]];
+	vcpu->compared[1] = vcpu->registers[ops->reg[1]];
+
+	return ERR_NOERR;
+}
+
+error_t instruction_cmprc(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->compared[0] = vcpu->registers[ops->reg[0]];
+	vcpu->compared[1] = ops->imm;
+
+	return ERR_NOERR;
+}
+
+error_t instruction_jeq(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	return jump_if(vcpu, ops, vcpu->compared[0] == vcpu->compared[1]);
+}
+
+error_t instruction_jne(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	return jump_if(vcpu, ops, vcpu->compared[0] != vcpu->compared[1]);
+}
+
+error_t instruction_jlt(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	return jump_if(vcpu, ops, (int32_t)vcpu->compared[0] < (int32_t)vcpu->compared[1]);
+}
+
+error_t instruction_jle(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	return jump_if(vcpu, ops, (int32_t)vcpu->compared[0] <= (int32_t)vcpu->compared[1]);
+}
+
+error_t instruction_jgt(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	return jump_if(vcpu, ops, (int32_t)vcpu->compared[0] > (int32_t)vcpu->compared[1]);
+}
+
+error_t instruction_jge(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	return jump_if(vcpu, ops, (int32_t)vcpu->compared[0] >= (int32_t)vcpu->compared[1]);
+}
+
+error_t instruction_jltu(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	return jump_if(vcpu, ops, vcpu->compared[0] < vcpu->compared[1]);
+}
+
+error_t instruction_jleu(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	return jump_if(vcpu, ops, vcpu->compared[0] <= vcpu->compared[1]);
+}
+
+error_t instruction_jgtu(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	return jump_if(vcpu, ops, vcpu->compared[0] > vcpu->compared[1]);
+}
+
+error_t instruction_jgeu(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	return jump_if(vcpu, ops, vcpu->compared[0] >= vcpu->compared[1]);
+}
+
+error_t instruction_callc(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	// The ip has already been moved past the call
+	if (stack_push(vcpu, vcpu->cpu.ip) != ERR_NOERR) {
+		return ERR_PCOND;
+	}
+
+	cpu_queue_jump(vcpu, ops->imm);
+	return ERR_NOERR;
+}
+
+error_t instruction_ret(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	uint32_t addr;
+	(void)ops;
+
+	if (stack_pop(vcpu, &addr) != ERR_NOERR) {
+		return ERR_PCOND;
+	}
+
+	cpu_queue_jump(vcpu, addr);
+	return ERR_NOERR;
+}
+
+error_t instruction_enter(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	(void)ops;
+	return stack_enter_frame(vcpu);
+}
+
+error_t instruction_leave(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	(void)ops;
+	return stack_leave_frame(vcpu);
+}
+
+error_t instruction_pushr(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	return stack_push(vcpu, vcpu->registers[ops->reg[0]]);
+}
+
+error_t instruction_popr(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	return stack_pop(vcpu, &vcpu->registers[ops->reg[0]]);
+}
+
+error_t instruction_vload(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	return mmu_read_vector(vcpu, vcpu->registers[ops->reg[1]], &vcpu->vregisters[ops->reg[0]]);
+}
+
+error_t instruction_vstor(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	return mmu_write_vector(vcpu, vcpu->registers[ops->reg[0]], &vcpu->vregisters[ops->reg[1]]);
+}
+
+error_t instruction_vmov(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->vregisters[ops->reg[0]] = vcpu->vregisters[ops->reg[1]];
+	return ERR_NOERR;
+}
+
+error_t instruction_vsplat(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vreg *dest = &vcpu->vregisters[ops->reg[0]];
+
+	for (int i = 0; i < VREG_SIZE / 4; ++i) {
+		dest->w[i] = vcpu->registers[ops->reg[1]];
+	}
+
+	return ERR_NOERR;
+}
+
+error_t instruction_vextr(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->registers[ops->reg[0]] = vcpu->vregisters[ops->reg[1]].w[ops->imm];
+	return ERR_NOERR;
+}
+
+error_t instruction_vshuf32(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vector_shuf32(&vcpu->vregisters[ops->reg[0]], &vcpu->vregisters[ops->reg[1]], (uint8_t)ops->imm);
+	return ERR_NOERR;
+}
+
+error_t instruction_vadd8(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vector_add8(&vcpu->vregisters[ops->reg[0]], &vcpu->vregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_vadd16(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vector_add16(&vcpu->vregisters[ops->reg[0]], &vcpu->vregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_vadd32(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vector_add32(&vcpu->vregisters[ops->reg[0]], &vcpu->vregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_vsub8(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vector_sub8(&vcpu->vregisters[ops->reg[0]], &vcpu->vregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_vsub16(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vector_sub16(&vcpu->vregisters[ops->reg[0]], &vcpu->vregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_vsub32(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vector_sub32(&vcpu->vregisters[ops->reg[0]], &vcpu->vregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_vmul8(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vector_mul8(&vcpu->vregisters[ops->reg[0]], &vcpu->vregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_vmul16(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vector_mul16(&vcpu->vregisters[ops->reg[0]], &vcpu->vregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_vmul32(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vector_mul32(&vcpu->vregisters[ops->reg[0]], &vcpu->vregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_vminu8(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vector_minu8(&vcpu->vregisters[ops->reg[0]], &vcpu->vregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_vminu16(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vector_minu16(&vcpu->vregisters[ops->reg[0]], &vcpu->vregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_vminu32(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vector_minu32(&vcpu->vregisters[ops->reg[0]], &vcpu->vregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_vmaxu8(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vector_maxu8(&vcpu->vregisters[ops->reg[0]], &vcpu->vregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_vmaxu16(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vector_maxu16(&vcpu->vregisters[ops->reg[0]], &vcpu->vregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_vmaxu32(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vector_maxu32(&vcpu->vregisters[ops->reg[0]], &vcpu->vregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_vcmpeq8(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vector_cmpeq8(&vcpu->vregisters[ops->reg[0]], &vcpu->vregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_vcmpeq16(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vector_cmpeq16(&vcpu->vregisters[ops->reg[0]], &vcpu->vregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_vcmpeq32(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vector_cmpeq32(&vcpu->vregisters[ops->reg[0]], &vcpu->vregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_vcmpgt8(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vector_cmpgt8(&vcpu->vregisters[ops->reg[0]], &vcpu->vregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_vcmpgt16(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vector_cmpgt16(&vcpu->vregisters[ops->reg[0]], &vcpu->vregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_vcmpgt32(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vector_cmpgt32(&vcpu->vregisters[ops->reg[0]], &vcpu->vregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_vand(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vector_and(&vcpu->vregisters[ops->reg[0]], &vcpu->vregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_vor(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vector_or(&vcpu->vregisters[ops->reg[0]], &vcpu->vregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_vxor(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vector_xor(&vcpu->vregisters[ops->reg[0]], &vcpu->vregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_vshuf8(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vector_shuf8(&vcpu->vregisters[ops->reg[0]], &vcpu->vregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_fmovff(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->fregisters[ops->reg[0]].bits = vcpu->fregisters[ops->reg[1]].bits;
+	return ERR_NOERR;
+}
+
+error_t instruction_fmovfr(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->fregisters[ops->reg[0]].word = vcpu->registers[ops->reg[1]];
+	return ERR_NOERR;
+}
+
+error_t instruction_fmovrf(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->registers[ops->reg[0]] = vcpu->fregisters[ops->reg[1]].word;
+	return ERR_NOERR;
+}
+
+error_t instruction_floado32(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	return mmu_read_word(vcpu, vcpu->registers[ops->reg[0]] + ops->imm, &vcpu->fregisters[ops->reg[1]].word);
+}
+
+error_t instruction_floado64(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	return mmu_read_dword(vcpu, vcpu->registers[ops->reg[0]] + ops->imm, &vcpu->fregisters[ops->reg[1]].bits);
+}
+
+error_t instruction_fstoro32(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	return mmu_write_word(vcpu, vcpu->registers[ops->reg[0]] + ops->imm, vcpu->fregisters[ops->reg[1]].word);
+}
+
+error_t instruction_fstoro64(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	return mmu_write_dword(vcpu, vcpu->registers[ops->reg[0]] + ops->imm, vcpu->fregisters[ops->reg[1]].bits);
+}
+
+error_t instruction_fadd32(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->fregisters[ops->reg[0]].f += vcpu->fregisters[ops->reg[1]].f;
+	return ERR_NOERR;
+}
+
+error_t instruction_fadd64(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->fregisters[ops->reg[0]].d += vcpu->fregisters[ops->reg[1]].d;
+	return ERR_NOERR;
+}
+
+error_t instruction_fsub32(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->fregisters[ops->reg[0]].f -= vcpu->fregisters[ops->reg[1]].f;
+	return ERR_NOERR;
+}
+
+error_t instruction_fsub64(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->fregisters[ops->reg[0]].d -= vcpu->fregisters[ops->reg[1]].d;
+	return ERR_NOERR;
+}
+
+error_t instruction_fmul32(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->fregisters[ops->reg[0]].f *= vcpu->fregisters[ops->reg[1]].f;
+	return ERR_NOERR;
+}
+
+error_t instruction_fmul64(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->fregisters[ops->reg[0]].d *= vcpu->fregisters[ops->reg[1]].d;
+	return ERR_NOERR;
+}
+
+error_t instruction_fdiv32(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->fregisters[ops->reg[0]].f /= vcpu->fregisters[ops->reg[1]].f;
+	return ERR_NOERR;
+}
+
+error_t instruction_fdiv64(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->fregisters[ops->reg[0]].d /= vcpu->fregisters[ops->reg[1]].d;
+	return ERR_NOERR;
+}
+
+error_t instruction_fsqrt32(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->fregisters[ops->reg[0]].f = sqrtf(vcpu->fregisters[ops->reg[1]].f);
+	return ERR_NOERR;
+}
+
+error_t instruction_fsqrt64(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->fregisters[ops->reg[0]].d = sqrt(vcpu->fregisters[ops->reg[1]].d);
+	return ERR_NOERR;
+}
+
+error_t instruction_fma32(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	fpu_fma32(&vcpu->fregisters[ops->reg[0]], &vcpu->fregisters[ops->reg[1]], &vcpu->fregisters[ops->imm]);
+	return ERR_NOERR;
+}
+
+error_t instruction_fma64(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	fpu_fma64(&vcpu->fregisters[ops->reg[0]], &vcpu->fregisters[ops->reg[1]], &vcpu->fregisters[ops->imm]);
+	return ERR_NOERR;
+}
+
+error_t instruction_fcmp32(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->compared[0] = fpu_compare(vcpu->fregisters[ops->reg[0]].f, vcpu->fregisters[ops->reg[1]].f);
+	vcpu->compared[1] = 0;
+	return ERR_NOERR;
+}
+
+error_t instruction_fcmp64(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->compared[0] = fpu_compare(vcpu->fregisters[ops->reg[0]].d, vcpu->fregisters[ops->reg[1]].d);
+	vcpu->compared[1] = 0;
+	return ERR_NOERR;
+}
+
+error_t instruction_fwiden(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->fregisters[ops->reg[0]].d = vcpu->fregisters[ops->reg[1]].f;
+	return ERR_NOERR;
+}
+
+error_t instruction_fnarrow(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->fregisters[ops->reg[0]].f = (float)vcpu->fregisters[ops->reg[1]].d;
+	return ERR_NOERR;
+}
+
+error_t instruction_fitof32(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->fregisters[ops->reg[0]].f = (float)(int32_t)vcpu->registers[ops->reg[1]];
+	return ERR_NOERR;
+}
+
+error_t instruction_fitof64(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	vcpu->fregisters[ops->reg[0]].d = (int32_t)vcpu->registers[ops->reg[1]];
+	return ERR_NOERR;
+}
+
+error_t instruction_fftoi32(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	fpu_ftoi32(&vcpu->registers[ops->reg[0]], &vcpu->fregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_fftoi64(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	fpu_ftoi64(&vcpu->registers[ops->reg[0]], &vcpu->fregisters[ops->reg[1]]);
+	return ERR_NOERR;
+}
+
+error_t instruction_mcopy(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	return mmu_copy(vcpu, vcpu->registers[ops->reg[0]], vcpu->registers[ops->reg[1]], vcpu->registers[ops->imm]);
+}
+
+error_t instruction_mfill(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	return mmu_set_bytes(vcpu, vcpu->registers[ops->reg[0]], (uint8_t)vcpu->registers[ops->reg[1]], vcpu->registers[ops->imm]);
+}
+
+error_t instruction_mcmp(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	mem_size offset;
+	return mmu_compare(vcpu, vcpu->registers[ops->reg[0]], vcpu->registers[ops->reg[1]], vcpu->registers[ops->imm],
+		vcpu->compared, &offset);
+}
+
+error_t instruction_xchg(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	uint32_t *val = &vcpu->registers[ops->reg[1]];
+	return mmu_exchange_word(vcpu, vcpu->registers[ops->reg[0]], *val, val);
+}
+
+error_t instruction_xadd(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	uint32_t *val = &vcpu->registers[ops->reg[1]];
+	return mmu_fetch_add_word(vcpu, vcpu->registers[ops->reg[0]], *val, val);
+}
+
+error_t instruction_cas(vx4_cpu *vcpu, const instruction_ops *ops)
+{
+	uint32_t *expected = &vcpu->registers[ops->reg[1]];
+	uint32_t wanted = *expected;
+
+	error_t err = mmu_cas_word(vcpu, vcpu->registers[ops->reg[0]], expected, vcpu->registers[ops->imm]);
+
+	if (err != ERR_NOERR) {
+		return err;
+	}
+
+	vcpu->compared[0] = *expected;
+	vcpu->compared[1] = wanted;
+	return ERR_NOERR;
+}
+
+error_t jump_if(vx4_cpu *vcpu, const instruction_ops *ops, bool cond)
+{
+	if (cond) {
+		cpu_queue_jump(vcpu, ops->imm);
+	}
 
 	return ERR_NOERR;
 }
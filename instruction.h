@@ -1,31 +1,397 @@
 #pragma once
 
 #include "mem.h"
+#include "register.h"
+#include "vector.h"
+#include "fpu.h"
+#include "port.h"
+#include "vx4.h"
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdbool.h>
 
+////////////////////////////////////////////////////////////////////////////////
+// Constants + helper macros
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The instruction set, described once in opcode order. Every table indexed
+ * by opcode (the ids below, the handlers, the names and the threaded core's
+ * dispatch table) is generated from this list, so adding an instruction is
+ * one line here plus its handler, instruction_<name>, and the threaded
+ * core's do_<name>.
+ *
+ * X(NAME, name, form): form is one of ISA_FORMS, which gives the layout of
+ * the operands following the opcode, and so the instruction's size, decoder,
+ * encoding and disassembly.
+ */
+#define ISA_INSTRUCTIONS(X) \
+	X(NOP, nop, none) \
+	X(HLT, hlt, none) \
+	X(JMPC, jmpc, c) \
+	X(MOVRC, movrc, rc) \
+	X(MOVMR, movmr, mr) \
+	X(ADDRC, addrc, rc) \
+	X(STORR, storr, rr) \
+	X(OUTPR, outpr, pr) \
+	X(INRP, inrp, rp) \
+	X(CLI, cli, none) \
+	X(STI, sti, none) \
+	X(WFI, wfi, none) \
+	X(RDINS, rdins, rr) \
+	X(RDTIME, rdtime, rr) \
+	X(MOVRR, movrr, rr) \
+	X(MOVRM, movrm, rm) \
+	X(LOADO, loado, rrc) \
+	X(STORO, storo, rrc) \
+	X(ADDRR, addrr, rr) \
+	X(SUBRR, subrr, rr) \
+	X(MULRR, mulrr, rr) \
+	X(DIVRR, divrr, rr) \
+	X(ANDRR, andrr, rr) \
+	X(ORRR, orrr, rr) \
+	X(XORRR, xorrr, rr) \
+	X(SHLRR, shlrr, rr) \
+	X(SHRRR, shrrr, rr) \
+	X(SARRR, sarrr, rr) \
+	X(SUBRC, subrc, rc) \
+	X(MULRC, mulrc, rc) \
+	X(DIVRC, divrc, rc) \
+	X(ANDRC, andrc, rc) \
+	X(ORRC, orrc, rc) \
+	X(XORRC, xorrc, rc) \
+	X(SHLRC, shlrc, rc) \
+	X(SHRRC, shrrc, rc) \
+	X(SARRC, sarrc, rc) \
+	X(CMPRR, cmprr, rr) \
+	X(CMPRC, cmprc, rc) \
+	X(JEQ, jeq, c) \
+	X(JNE, jne, c) \
+	X(JLT, jlt, c) \
+	X(JLE, jle, c) \
+	X(JGT, jgt, c) \
+	X(JGE, jge, c) \
+	X(JLTU, jltu, c) \
+	X(JLEU, jleu, c) \
+	X(JGTU, jgtu, c) \
+	X(JGEU, jgeu, c) \
+	X(CALLC, callc, c) \
+	X(RET, ret, none) \
+	X(ENTER, enter, none) \
+	X(LEAVE, leave, none) \
+	X(PUSHR, pushr, r) \
+	X(POPR, popr, r) \
+	X(VLOAD, vload, vr) \
+	X(VSTOR, vstor, rv) \
+	X(VMOV, vmov, vv) \
+	X(VSPLAT, vsplat, vr) \
+	X(VEXTR, vextr, rvc) \
+	X(VSHUF32, vshuf32, vvc) \
+	X(VADD8, vadd8, vv) \
+	X(VADD16, vadd16, vv) \
+	X(VADD32, vadd32, vv) \
+	X(VSUB8, vsub8, vv) \
+	X(VSUB16, vsub16, vv) \
+	X(VSUB32, vsub32, vv) \
+	X(VMUL8, vmul8, vv) \
+	X(VMUL16, vmul16, vv) \
+	X(VMUL32, vmul32, vv) \
+	X(VMINU8, vminu8, vv) \
+	X(VMINU16, vminu16, vv) \
+	X(VMINU32, vminu32, vv) \
+	X(VMAXU8, vmaxu8, vv) \
+	X(VMAXU16, vmaxu16, vv) \
+	X(VMAXU32, vmaxu32, vv) \
+	X(VCMPEQ8, vcmpeq8, vv) \
+	X(VCMPEQ16, vcmpeq16, vv) \
+	X(VCMPEQ32, vcmpeq32, vv) \
+	X(VCMPGT8, vcmpgt8, vv) \
+	X(VCMPGT16, vcmpgt16, vv) \
+	X(VCMPGT32, vcmpgt32, vv) \
+	X(VAND, vand, vv) \
+	X(VOR, vor, vv) \
+	X(VXOR, vxor, vv) \
+	X(VSHUF8, vshuf8, vv) \
+	X(FMOVFF, fmovff, ff) \
+	X(FMOVFR, fmovfr, fr) \
+	X(FMOVRF, fmovrf, rf) \
+	X(FLOADO32, floado32, rfc) \
+	X(FLOADO64, floado64, rfc) \
+	X(FSTORO32, fstoro32, rfc) \
+	X(FSTORO64, fstoro64, rfc) \
+	X(FADD32, fadd32, ff) \
+	X(FADD64, fadd64, ff) \
+	X(FSUB32, fsub32, ff) \
+	X(FSUB64, fsub64, ff) \
+	X(FMUL32, fmul32, ff) \
+	X(FMUL64, fmul64, ff) \
+	X(FDIV32, fdiv32, ff) \
+	X(FDIV64, fdiv64, ff) \
+	X(FSQRT32, fsqrt32, ff) \
+	X(FSQRT64, fsqrt64, ff) \
+	X(FMA32, fma32, fff) \
+	X(FMA64, fma64, fff) \
+	X(FCMP32, fcmp32, ff) \
+	X(FCMP64, fcmp64, ff) \
+	X(FWIDEN, fwiden, ff) \
+	X(FNARROW, fnarrow, ff) \
+	X(FITOF32, fitof32, fr) \
+	X(FITOF64, fitof64, fr) \
+	X(FFTOI32, fftoi32, rf) \
+	X(FFTOI64, fftoi64, rf) \
+	X(MCOPY, mcopy, rrr) \
+	X(MFILL, mfill, rrr) \
+	X(MCMP, mcmp, rrr) \
+	X(XCHG, xchg, rr) \
+	X(XADD, xadd, rr) \
+	X(CAS, cas, rrr) \
+	X(IRET, iret, none) \
+	X(SETPTB, setptb, r) \
+	X(INVLPG, invlpg, r) \
+	X(TLBFLUSH, tlbflush, none) \
+	X(RDFAULT, rdfault, rr)
+
+/**
+ * The operand layouts, named by the suffix letters of the instructions
+ * using them: r = register, c = constant, m = memory address, p = port,
+ * v = vector register and f = floating-point register. The operands follow
+ * the opcode in the order given, packed and padded to an even size.
+ *
+ * X(form, a, b, c): a, b and c are instruction_operand kinds, minus their
+ * INS_OPERAND_ prefix. Registers are decoded into reg[0] and reg[1] in
+ * order, with a third register going in imm, which also takes any
+ * constant, address, byte or lane.
+ */
+#define ISA_FORMS(X) \
+	X(none, NONE, NONE, NONE) \
+	X(c, CONST, NONE, NONE) \
+	X(r, REG, NONE, NONE) \
+	X(rc, REG, CONST, NONE) \
+	X(rm, REG, ADDR, NONE) \
+	X(mr, ADDR, REG, NONE) \
+	X(rr, REG, REG, NONE) \
+	X(pr, PORT, REG, NONE) \
+	X(rp, REG, PORT, NONE) \
+	X(rrc, REG, REG, CONST) \
+	X(rrr, REG, REG, REG) \
+	X(vv, VREG, VREG, NONE) \
+	X(vr, VREG, REG, NONE) \
+	X(rv, REG, VREG, NONE) \
+	X(vvc, VREG, VREG, BYTE) \
+	X(rvc, REG, VREG, LANE) \
+	X(ff, FREG, FREG, NONE) \
+	X(fr, FREG, REG, NONE) \
+	X(rf, REG, FREG, NONE) \
+	X(fff, FREG, FREG, FREG) \
+	X(rfc, REG, FREG, CONST)
+
+#define INS_MAX_OPERANDS 3
+
+// The encoded size of each kind of operand, as a constant expression
+#define INS_OPERAND_SIZE(kind) \
+	((kind) == INS_OPERAND_NONE ? 0 : \
+	(kind) == INS_OPERAND_PORT ? 2 : \
+	(kind) == INS_OPERAND_CONST || (kind) == INS_OPERAND_ADDR ? 4 : 1)
+
+// How large (minus the leading 2 bytes) an instruction of a form is
+#define INS_FORM_EXTRA(a, b, c) \
+	((INS_OPERAND_SIZE(a) + INS_OPERAND_SIZE(b) + INS_OPERAND_SIZE(c) + 1) & ~1u)
+
+// The kinds of operand an instruction can take, see ISA_FORMS
+typedef enum _instruction_operand {
+	INS_OPERAND_NONE,
+	INS_OPERAND_REG,
+	INS_OPERAND_VREG,
+	INS_OPERAND_FREG,
+	INS_OPERAND_PORT,
+	INS_OPERAND_CONST, // 32 bits
+	INS_OPERAND_ADDR, // 32 bits
+	INS_OPERAND_BYTE, // An 8 bit constant
+	INS_OPERAND_LANE, // A word lane of a vector register
+} instruction_operand;
+
+enum _instruction_form_name {
+#define X(form, a, b, c) INS_FORM_##form,
+	ISA_FORMS(X)
+#undef X
+
+	INS_NUM_FORMS
+};
+
+enum _instruction_name {
+#define X(NAME, name, form) INS_##NAME,
+	ISA_INSTRUCTIONS(X)
+#undef X
+
+	INS_NUM_INS,
+	INS_INVALID = INS_NUM_INS // Given to instructions that fail to decode
+};
+
+// Superinstructions, numbered on from the real ones so both can share a table
+enum _instruction_fused_name {
+	INS_FUSED_MOVRC_STORR = INS_INVALID + 1,
+	INS_FUSED_MOVRC_OUTPR,
+	INS_FUSED_ADDRC_STORR,
+	INS_FUSED_ADDRC_JMPC,
+	INS_FUSED_MOVRC_MOVRC_STORR,
+
+	INS_NUM_IDS // Every instruction and superinstruction id is below this
+};
+
+#define INS_MAX_SIZE 8 // The largest instruction, including the leading 2 bytes
+#define INS_MAX_FUSED 3 // The most instructions in one superinstruction
+#define INS_MAX_FUSED_SIZE (INS_MAX_FUSED * INS_MAX_SIZE)
+
 ////////////////////////////////////////////////////////////////////////////////
 // Type declarations
 ////////////////////////////////////////////////////////////////////////////////
 
 typedef uint16_t instruction_id;
 
-typedef error_t (*instruction_pf)(void *);
+/**
+ * The operands of an instruction once decoded. Any register and port ids
+ * have already been checked for validity, so handlers can use them directly.
+ */
+typedef struct _instruction_ops {
+	reg_id reg[2];
+	port_id port;
+	uint32_t imm; // A constant, address or offset operand
+} instruction_ops;
+
+// Unpacks the raw operand bytes following the opcode, checking any ids
+typedef error_t (*instruction_decode_pf)(const uint8_t *, instruction_ops *);
+typedef error_t (*instruction_pf)(vx4_cpu *, const instruction_ops *);
+
+typedef uint8_t instruction_form_id;
+
+// An operand layout, generated from ISA_FORMS
+typedef struct _instruction_form {
+	instruction_operand operands[INS_MAX_OPERANDS]; // Unused ones are INS_OPERAND_NONE
+	mem_size extra; // How large (minus the leading 2 bytes) are its instructions?
+} instruction_form;
 
+// An instruction, generated from ISA_INSTRUCTIONS
 typedef struct _instruction_info {
 	instruction_pf func;
+	instruction_decode_pf decode; // Specialised for the form, see ISA_FORMS
+	instruction_form_id form;
 	mem_size extra; // How large (minus the leading 2 bytes) is the instruction?
+	const char *name; // The mnemonic, as used in traces
 } instruction_info;
 
+/**
+ * A fully decoded instruction, ready to be executed on a CPU by calling
+ * func(vcpu, &ops). Invalid instructions decode to a handler that always
+ * fails, so they need no special treatment by the caller.
+ *
+ * Interpreters able to run superinstructions may instead dispatch on
+ * fused, which covers fused_size bytes of this and any following
+ * instructions. Unless instruction_fuse found a match, fused is just
+ * id, fused_size is just size and fused_len is 1.
+ */
+typedef struct _instruction_decoded {
+	instruction_pf func;
+	instruction_id id; // The opcode, or INS_INVALID
+	mem_size size; // How large (including the leading 2 bytes) is the instruction?
+	instruction_ops ops;
+
+	instruction_id fused; // A superinstruction id, or the same as id
+	mem_size fused_size;
+	unsigned fused_len; // How many instructions fused covers
+	instruction_ops next[INS_MAX_FUSED - 1]; // Operands of the instructions after this one
+} instruction_decoded;
+
+/**
+ * A sequence of adjacent instructions which can be run as one
+ * superinstruction. Only the last instruction of a sequence may write
+ * memory, use a port or change the ip, so that the ones before it can't
+ * have been rewritten or skipped by the time they run.
+ */
+typedef struct _instruction_fusion {
+	instruction_id seq[INS_MAX_FUSED];
+	size_t len;
+	instruction_id fused;
+} instruction_fusion;
+
 ////////////////////////////////////////////////////////////////////////////////
 // Global variable declarations
 ////////////////////////////////////////////////////////////////////////////////
 
 extern instruction_info instructions[];
+extern const instruction_form instruction_forms[];
+extern const instruction_fusion instruction_fusions[];
 
 ////////////////////////////////////////////////////////////////////////////////
 // Function declarations
 ////////////////////////////////////////////////////////////////////////////////
 
 extern bool valid_instruction(instruction_id ins);
+
+/**
+ * Reads and decodes the instruction beginning at a given address.
+ *
+ * IN addr: The address of the instruction's leading 2 bytes.
+ * OUT dest: The decoded instruction. If the opcode or any of the operand
+ * ids are invalid, dest->id is INS_INVALID and dest->func is a handler
+ * that returns ERR_INVAL.
+ */
+extern void instruction_decode(vx4_machine *vm, mem_addr addr, instruction_decoded *dest);
+
+/**
+ * As instruction_decode, from bytes already gathered rather than read
+ * from an address, for an instruction that isn't contiguous in memory.
+ *
+ * IN code: The instruction, from its leading 2 bytes to its last.
+ */
+extern void instruction_decode_bytes(const uint8_t *code, instruction_decoded *dest);
+
+/**
+ * Tries to fuse a decoded instruction with those following it, using the
+ * first matching sequence in instruction_fusions. The longest sequences
+ * are listed first.
+ *
+ * IN addr: The address dest was decoded from.
+ * OUT dest: On a match, gets the superinstruction's id, size and operands.
+ *
+ * Returns: Whether a superinstruction was found.
+ */
+extern bool instruction_fuse(vx4_machine *vm, mem_addr addr, instruction_decoded *dest);
+
+/**
+ * Returns the vector_* function implementing a vector instruction that
+ * takes just two vector registers (vadd8 through vshuf8), or NULL.
+ */
+extern vector_pf instruction_vector_func(instruction_id ins);
+
+/**
+ * Returns the mnemonic of an instruction, or "invalid".
+ */
+extern const char *instruction_name(instruction_id ins);
+
+/**
+ * Encodes an instruction, as instruction_decode would read it back. The
+ * operands are placed as ISA_FORMS describes, and aren't checked.
+ *
+ * IN ins: The instruction to encode.
+ * IN ops: Its operands.
+ * OUT dest: A buffer of at least INS_MAX_SIZE bytes.
+ *
+ * Returns: The size of the instruction (including the leading 2 bytes),
+ * or 0 if ins isn't an instruction.
+ */
+extern mem_size instruction_encode(instruction_id ins, const instruction_ops *ops, uint8_t *dest);
+
+/**
+ * Writes an instruction out as text, such as "loado r1, r2, 0x10", for
+ * traces. Registers are written as r, v or f and their number, ports as p
+ * and their number, constants in hex and addresses in hex within brackets.
+ *
+ * IN ins: The instruction, which may be INS_INVALID.
+ * IN ops: Its operands.
+ * OUT dest: A buffer of size bytes, which gets the text, truncated to fit.
+ * IN size: The size of dest.
+ *
+ * Returns: The length of the full text, as snprintf does.
+ */
+extern int instruction_disassemble(instruction_id ins, const instruction_ops *ops, char *dest, size_t size);
@@ -1,6 +1,9 @@
 #include "intr.h"
 
 #include "error.h"
+#include "cpu.h"
+#include "machine.h"
+#include "sync.h"
 
 #include <stdlib.h>
 #include <stddef.h>
@@ -21,37 +24,24 @@
 
 #define IS_VALID_INTR(intr) ((intr) < INTR_NUM_INTRS)
 
-// How many bits fit in each array element?
-#define INTRS_IN_ELEM (8 * sizeof (unsigned))
-#define INTR_BUFFER_SIZE (INTR_NUM_INTRS / INTRS_IN_ELEM)
-
-////////////////////////////////////////////////////////////////////////////////
-// Module internal declarations
-////////////////////////////////////////////////////////////////////////////////
-
-// Each interrupt being raised or not is represented as a single bit.
-static unsigned intr_buffer[INTR_BUFFER_SIZE];
-
-static SDL_mutex *intr_mutex;
-
 ////////////////////////////////////////////////////////////////////////////////
 // Interface functions
 ////////////////////////////////////////////////////////////////////////////////
 
-error_t begin_interrupts()
+error_t begin_interrupts(vx4_machine *vm)
 {
-    intr_mutex = SDL_CreateMutex();
-    if (!intr_mutex) {
+    vm->intr.mutex = SDL_CreateMutex();
+    if (!vm->intr.mutex) {
         return ERR_EXTERN;
     }
 
     return ERR_NOERR;
 }
 
-void end_interrupts()
+void end_interrupts(vx4_machine *vm)
 {
-    SDL_DestroyMutex(intr_mutex);
-    intr_mutex = NULL;
+    SDL_DestroyMutex(vm->intr.mutex);
+    vm->intr.mutex = NULL;
 }
 
 /*
@@ -60,52 +50,79 @@ void end_interrupts()
  * all EXCEPT the yth bit of x).
  */
 
-error_t interrupt_raise(intr_id which)
+error_t interrupt_raise(vx4_machine *vm, intr_id which)
+{
+    return interrupt_send(vm, 0, which);
+}
+
+error_t interrupt_clear(vx4_machine *vm, intr_id which)
 {
     if (!IS_VALID_INTR(which)) {
         return ERR_INVAL;
     }
 
-    if (SDL_LockMutex(intr_mutex) != 0) {
+    if (SYNC_LOCK(vm->intr.mutex) != 0) {
         return ERR_EXTERN;
     }
 
-    intr_buffer[which / INTRS_IN_ELEM] |= 1u << (which % INTRS_IN_ELEM);
+    vm->intr.buffer[0][which / INTRS_IN_ELEM] &= ~(1u << (which % INTRS_IN_ELEM));
 
-    SDL_UnlockMutex(intr_mutex);
+    SYNC_UNLOCK(vm->intr.mutex);
     return ERR_NOERR;
 }
 
-error_t interrupt_clear(intr_id which)
+error_t interrupt_send(vx4_machine *vm, unsigned cpu, intr_id which)
 {
-    if (!IS_VALID_INTR(which)) {
+    if (!IS_VALID_INTR(which) || cpu >= CPU_MAX_CPUS) {
         return ERR_INVAL;
     }
 
-    if (SDL_LockMutex(intr_mutex) != 0) {
+    if (SYNC_LOCK(vm->intr.mutex) != 0) {
         return ERR_EXTERN;
     }
 
-    intr_buffer[which / INTRS_IN_ELEM] &= ~(1u << (which % INTRS_IN_ELEM));
+    vm->intr.buffer[cpu][which / INTRS_IN_ELEM] |= 1u << (which % INTRS_IN_ELEM);
+
+    SYNC_UNLOCK(vm->intr.mutex);
 
-    SDL_UnlockMutex(intr_mutex);
+    cpu_signal_events(vm, cpu);
     return ERR_NOERR;
 }
 
-void interrupt_clear_all()
+void interrupt_clear_all(vx4_machine *vm)
 {
-    if (SDL_LockMutex(intr_mutex) != 0) {
+    if (SYNC_LOCK(vm->intr.mutex) != 0) {
         return;
     }
 
-    memset(intr_buffer, 0, INTR_BUFFER_SIZE * sizeof (unsigned));
+    memset(vm->intr.buffer, 0, sizeof (vm->intr.buffer));
 
-    SDL_UnlockMutex(intr_mutex);
+    SYNC_UNLOCK(vm->intr.mutex);
 }
 
-intr_id interrupt_which()
+bool interrupt_pending(vx4_machine *vm, unsigned cpu)
 {
-    if (SDL_LockMutex(intr_mutex) != 0) {
+    if (SYNC_LOCK(vm->intr.mutex) != 0) {
+        return false;
+    }
+
+    bool ret = false;
+    for (size_t i = 0; i < INTR_BUFFER_SIZE; ++i) {
+        if (vm->intr.buffer[cpu][i] != 0) {
+            ret = true;
+            break;
+        }
+    }
+
+    SYNC_UNLOCK(vm->intr.mutex);
+    return ret;
+}
+
+intr_id interrupt_which(vx4_machine *vm, unsigned cpu)
+{
+    unsigned *buffer = vm->intr.buffer[cpu];
+
+    if (SYNC_LOCK(vm->intr.mutex) != 0) {
         return INTR_INVALID;
     }
 
@@ -113,20 +130,21 @@ intr_id interrupt_which()
     for (size_t i = 0; i < INTR_BUFFER_SIZE; ++i) {
         int pos //...
         #ifdef __MINGW32__
-            = ffs_shim(intr_buffer[i]);
+            = ffs_shim(buffer[i]);
         #else
         // ffs(3) (Find First Set) returns a 1-based index and 0 for none
         // We have to correct for that
-            = ffs(intr_buffer[i]) - 1;
+            = ffs(buffer[i]) - 1;
         #endif // __MINGW32__
 
         if (pos != -1) {
             // We clear the interrupt first so it doesn't fire infinitely
-            intr_buffer[i] &= ~(1u << pos);
+            buffer[i] &= ~(1u << pos);
             ret = (i * INTRS_IN_ELEM) + pos;
+            break;
         }
     }
 
-    SDL_UnlockMutex(intr_mutex);
+    SYNC_UNLOCK(vm->intr.mutex);
     return ret;
 }
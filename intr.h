@@ -1,10 +1,14 @@
 #pragma once
 
 #include "error.h"
+#include "cpu.h"
+#include "vx4.h"
 
 #include <stdint.h>
 #include <stdbool.h>
 
+#include <SDL2/SDL_mutex.h>
+
 ////////////////////////////////////////////////////////////////////////////////
 // Type declarations
 ////////////////////////////////////////////////////////////////////////////////
@@ -21,12 +25,29 @@ enum _intr_name {
     INTR_GENF, // General fault, causes reset if can't be dealt with
     INTR_INS, // Execution encountered an invalid instruction
     INTR_KBD, // A key press was received
+    INTR_PAGE, // An access wasn't allowed by the page tables, see rdfault, taken even when masked
 
     INTR_INVALID = 512 // Will never be a valid interrupt number
 };
 
 #define INTR_NUM_INTRS 512 // Arbitrary limit
 
+// How many bits fit in each array element?
+#define INTRS_IN_ELEM (8 * sizeof (unsigned))
+#define INTR_BUFFER_SIZE (INTR_NUM_INTRS / INTRS_IN_ELEM)
+
+////////////////////////////////////////////////////////////////////////////////
+// Machine state
+////////////////////////////////////////////////////////////////////////////////
+
+// Should not be touched except by functions in intr.c
+typedef struct _intr_context {
+    // Each interrupt being raised or not is represented as a single bit.
+    // Every CPU has its own set, as interrupts are delivered to just one.
+    unsigned buffer[CPU_MAX_CPUS][INTR_BUFFER_SIZE];
+    SDL_mutex *mutex;
+} intr_context;
+
 ////////////////////////////////////////////////////////////////////////////////
 // Function declarations
 ////////////////////////////////////////////////////////////////////////////////
@@ -38,15 +59,16 @@ enum _intr_name {
  * ERR_NOERR: Initialization completed successfully.
  * ERR_EXTERN: Some problem occurred in creating the resources.
  */
-extern error_t begin_interrupts();
+extern error_t begin_interrupts(vx4_machine *vm);
 
 /**
  * Cleans up resources used by this module.
  */
-extern void end_interrupts();
+extern void end_interrupts(vx4_machine *vm);
 
 /**
- * Raise or clear a specific interrupt.
+ * Raise or clear a specific interrupt on the boot CPU (CPU 0), which
+ * handles every interrupt from devices.
  *
  * IN which: The interrupt to raise/clear.
  *
@@ -55,18 +77,42 @@ extern void end_interrupts();
  * ERR_INVAL: The interrupt specified was not a valid interrupt number.
  * ERR_EXTERN: An error occurred acquiring the mutex.
  */
-extern error_t interrupt_raise(intr_id which);
-extern error_t interrupt_clear(intr_id which);
+extern error_t interrupt_raise(vx4_machine *vm, intr_id which);
+extern error_t interrupt_clear(vx4_machine *vm, intr_id which);
 
 /**
- * Clear all set interrupts at once, ignoring them.
+ * Raise a specific interrupt on any CPU, as used for inter-processor
+ * interrupts.
+ *
+ * IN cpu: The id of the CPU to interrupt.
+ * IN which: The interrupt to raise.
+ *
+ * Returns:
+ * ERR_NOERR: The operation completed successfully.
+ * ERR_INVAL: The CPU or interrupt specified was not valid.
+ * ERR_EXTERN: An error occurred acquiring the mutex.
  */
-extern void interrupt_clear_all();
+extern error_t interrupt_send(vx4_machine *vm, unsigned cpu, intr_id which);
 
 /**
- * Get the lowest-numbered interrupt that is currently raised, and
- * clear it.
+ * Clear all set interrupts at once on every CPU, ignoring them.
+ */
+extern void interrupt_clear_all(vx4_machine *vm);
+
+/**
+ * Returns whether any interrupt is currently raised for a CPU, without
+ * clearing it.
+ *
+ * IN cpu: The id of the CPU to check.
+ */
+extern bool interrupt_pending(vx4_machine *vm, unsigned cpu);
+
+/**
+ * Get the lowest-numbered interrupt that is currently raised for a CPU,
+ * and clear it.
+ *
+ * IN cpu: The id of the CPU taking the interrupt.
  *
  * Returns: The lowest interrupt number raised, or INTR_INVALID if none are.
  */
-extern intr_id interrupt_which();
+extern intr_id interrupt_which(vx4_machine *vm, unsigned cpu);
@@ -0,0 +1,1347 @@
+#include "jit.h"
+
+#include "error.h"
+
+#ifdef JIT_SUPPORTED
+
+#include "mem.h"
+#include "mmu.h"
+#include "register.h"
+#include "instruction.h"
+#include "intr.h"
+#include "stack.h"
+#include "machine.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include <sys/mman.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Internal constants + helper macros
+////////////////////////////////////////////////////////////////////////////////
+
+#define JIT_HOT_THRESHOLD 8 // Times an address is interpreted before translation
+
+#define JIT_INDEX(addr) (((addr) >> 1) & (JIT_MAX_BLOCKS - 1))
+
+// Translated code is tracked in 64 byte lines of guest memory
+#define LINE_SHIFT 6
+#define LINES_IN_BLK (MEM_BLK_SIZE >> LINE_SHIFT)
+#define LINE_BLOCK(line) ((line) >> (20 - LINE_SHIFT))
+#define LINE_MASK(line) ((line) & (LINES_IN_BLK - 1))
+
+// The most host code emitted for any one instruction, including its block
+// exits (a conditional jump has two). A block also has a prologue and a
+// final exit, each smaller than this
+#define MAX_INS_CODE 96
+#define MAX_BLOCK_CODE ((JIT_BLOCK_INS + 2) * MAX_INS_CODE)
+
+#define PROLOGUE_COUNT 4 // See emit_prologue
+
+// Where the operands of the last compare are, relative to the register file
+#define COMPARED_DISP (offsetof(vx4_cpu, compared) - offsetof(vx4_cpu, registers))
+_Static_assert(COMPARED_DISP + 4 < 0x80, "compared must be reachable with an 8 bit displacement");
+
+// Where the vector registers are, relative to the register file
+#define VREG_DISP(id) ((uint32_t)(offsetof(vx4_cpu, vregisters) - offsetof(vx4_cpu, registers) + (id) * VREG_SIZE))
+
+// Where the floating-point registers are, relative to the register file
+#define FREG_DISP(id) ((uint32_t)(offsetof(vx4_cpu, fregisters) - offsetof(vx4_cpu, registers) + (id) * FREG_SIZE))
+
+////////////////////////////////////////////////////////////////////////////////
+// Module internal declarations
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct _jit_block {
+	mem_addr addr; // The guest address the block was translated from
+	uint8_t *code; // The translated host code
+	unsigned num_ins; // How many guest instructions the block runs
+} jit_block;
+
+// Returned from translated code in rax and rdx
+typedef struct _jit_exit {
+	uint64_t ip; // The next guest instruction to run
+	uint8_t *link; // A jump that can be pointed at the translation of ip, or NULL
+} jit_exit;
+
+// Returned from return_pop in rax and rdx
+typedef struct _jit_resume {
+	uint64_t ip; // The guest address returned to
+	uint8_t *code; // Its translation, to carry on in without leaving, or NULL
+} jit_resume;
+
+// An entry of the shadow return stack, pushed by each translated call
+typedef struct _jit_return {
+	mem_addr addr; // The return address the call pushed
+	uint8_t *code; // The translation of the code there when called, or NULL
+} jit_return;
+
+
+/**
+ * Translated code is entered and left through a small stub, which holds
+ * the register file in rbx, the events word in r12, the instruction
+ * budget in r13 and the CPU in r14.
+ */
+typedef jit_exit (*jit_enter_pf)(uint32_t *regs, const atomic_uint *events,
+	const uint8_t *code, int64_t *budget, vx4_cpu *vcpu);
+
+struct _jit_context {
+	uint8_t *code_buf; // JIT_CODE_SIZE bytes of executable memory
+	uint8_t *code_start; // The first byte after the entry and exit stubs
+	uint8_t *code_next; // Where the next block will be emitted
+	uint8_t *out; // Where the block being translated is up to
+
+	jit_enter_pf enter_code;
+	uint8_t *exit_code;
+
+	jit_block blocks[JIT_MAX_BLOCKS];
+	size_t num_blocks;
+
+	// Direct-mapped by guest address, a collision just loses the older block
+	jit_block *lookup[JIT_MAX_BLOCKS];
+	uint8_t heat[JIT_MAX_BLOCKS];
+
+	// One bit per line for each block of guest memory containing translated code
+	uint8_t *line_maps[MEM_NUM_BLKS];
+
+	// Lets anything holding pointers into the code buffer notice they are stale
+	unsigned flush_count;
+
+	// Predicts where each translated ret goes, so that it can jump straight
+	// into the caller's translation. Only a guess, the address popped from
+	// the guest stack always wins. Wraps around, forgetting the oldest calls
+	jit_return returns[JIT_RETURN_DEPTH];
+	unsigned return_top;
+};
+
+/**
+ * Translates a basic block, beginning at a given address.
+ *
+ * IN ip: The address of the first instruction in the block.
+ *
+ * Returns: The new block, or NULL if the first instruction can't be translated.
+ */
+static jit_block *translate(vx4_cpu *vcpu, mem_addr ip);
+
+/**
+ * Decodes an instruction, and decides whether it can be translated.
+ *
+ * IN addr: The address of the instruction.
+ * OUT ins: The decoded instruction.
+ *
+ * Returns: Whether the instruction can be translated.
+ */
+static bool translatable(vx4_machine *vm, mem_addr addr, instruction_decoded *ins);
+
+/**
+ * Records that a range of guest memory has been translated, so that
+ * writes to it cause a flush.
+ */
+static void mark_lines(jit_context *jit, mem_addr base, mem_size num);
+
+/**
+ * Functions called from translated code to write memory.
+ *
+ * Returns: Nonzero if the block must be left straight away, because the
+ * write failed (raising INTR_INS) or left an event waiting, such as the
+ * write having replaced code.
+ */
+static uint32_t store_word(vx4_cpu *vcpu, mem_addr addr, uint32_t val);
+
+/**
+ * Function called from translated code to read memory into a register.
+ *
+ * Returns: Nonzero if the read failed (raising INTR_INS), and the block
+ * must be left straight away.
+ */
+static uint32_t load_word(vx4_cpu *vcpu, mem_addr addr, uint32_t *dest);
+
+/**
+ * As store_word and load_word, for the f64 stores and loads.
+ */
+static uint32_t store_dword(vx4_cpu *vcpu, mem_addr addr, uint64_t val);
+static uint32_t load_dword(vx4_cpu *vcpu, mem_addr addr, uint64_t *dest);
+
+/**
+ * Functions called from translated code for the block memory instructions.
+ *
+ * Returns: Nonzero if the block must be left straight away, because the
+ * write left an event waiting. compare_block returns nothing, as it
+ * only reads.
+ */
+static uint32_t copy_block(vx4_cpu *vcpu, mem_addr dest, mem_addr src, mem_size num);
+static uint32_t fill_block(vx4_cpu *vcpu, mem_addr dest, uint32_t val, mem_size num);
+static void compare_block(vx4_cpu *vcpu, mem_addr a, mem_addr b, mem_size num);
+
+/**
+ * Functions called from translated code for the atomic instructions, see
+ * mmu_exchange_word. The register passed by address is both the operand
+ * and where the old word goes, and cas_word also sets the compared
+ * operands.
+ *
+ * Returns: Nonzero if the block must be left straight away, because the
+ * address was misaligned (raising INTR_INS) or the write left an event
+ * waiting.
+ */
+static uint32_t exchange_word(vx4_cpu *vcpu, mem_addr addr, uint32_t *val);
+static uint32_t fetch_add_word(vx4_cpu *vcpu, mem_addr addr, uint32_t *val);
+static uint32_t cas_word(vx4_cpu *vcpu, mem_addr addr, uint32_t *expected, uint32_t val);
+
+/**
+ * The SSE prefix selecting the single (F3) or double (F2) precision form
+ * of a scalar floating-point instruction.
+ */
+static uint8_t sse_prefix(instruction_id id);
+
+/**
+ * Functions called from translated code to use the guest stack. Each
+ * raises INTR_INS if the stack is misaligned.
+ *
+ * call_push also pushes the return address onto the shadow return stack,
+ * and return_pop checks the address it pops against it.
+ *
+ * IN ret: The return address to push.
+ * IN next: The address after the ret, to go on from if it fails.
+ *
+ * Returns: Nonzero if the block must be left straight away, because the
+ * stack was misaligned or (for those that write memory) the write left an
+ * event waiting. return_pop instead returns where to go next.
+ */
+static uint32_t call_push(vx4_cpu *vcpu, mem_addr ret);
+static jit_resume return_pop(vx4_cpu *vcpu, mem_addr next);
+static uint32_t enter_frame(vx4_cpu *vcpu);
+static uint32_t leave_frame(vx4_cpu *vcpu);
+static uint32_t push_word(vx4_cpu *vcpu, uint32_t val);
+static uint32_t pop_word(vx4_cpu *vcpu, uint32_t *dest);
+
+/**
+ * Functions called from translated code to move a vector register to or
+ * from memory.
+ *
+ * Returns: Nonzero if the block must be left straight away, because the
+ * access failed (raising INTR_INS) or the store left an event waiting.
+ */
+static uint32_t load_vector(vx4_cpu *vcpu, mem_addr addr, vreg *dest);
+static uint32_t store_vector(vx4_cpu *vcpu, mem_addr addr, const vreg *src);
+
+/**
+ * The host jcc rel8 opcode taken when a conditional jump's condition
+ * holds, after cmp of the two compared operands. Each opcode's low bit
+ * flipped gives the opposite condition.
+ */
+static uint8_t host_condition(instruction_id id);
+
+/**
+ * Helpers to write host code at jit->out.
+ */
+static void emit_byte(jit_context *jit, uint8_t val);
+static void emit_word(jit_context *jit, uint32_t val);
+static void emit_quad(jit_context *jit, uint64_t val);
+static void emit_rel(jit_context *jit, const uint8_t *target);
+static void emit_call(jit_context *jit, const void *func);
+
+/**
+ * Emits the start of a block, which leaves the block straight away if
+ * the budget can't cover all of it. The block's instruction count must
+ * be patched in at PROLOGUE_COUNT bytes past the entry point, once known.
+ *
+ * IN ip: The guest address of the block.
+ *
+ * Returns: The entry point of the block.
+ */
+static uint8_t *emit_prologue(jit_context *jit, mem_addr ip);
+
+/**
+ * Emits a block exit to a constant guest address, which can later be
+ * linked straight to the target's translation.
+ *
+ * IN target: The guest address to go to.
+ * IN count: The number of instructions run by the block.
+ */
+static void emit_chain(jit_context *jit, mem_addr target, unsigned count);
+
+/**
+ * Emits an exit to a guest address, taken only when the preceding call
+ * returned nonzero.
+ *
+ * IN next: The guest address to go to.
+ * IN count: The number of instructions run by the block so far.
+ */
+static void emit_exit_on_fail(jit_context *jit, mem_addr next, unsigned count);
+
+/**
+ * Points a jump emitted by emit_chain at a block's translation.
+ */
+static void patch_link(uint8_t *link, const uint8_t *target);
+
+////////////////////////////////////////////////////////////////////////////////
+// Interface functions
+////////////////////////////////////////////////////////////////////////////////
+
+error_t jit_begin(vx4_cpu *vcpu)
+{
+	jit_context *jit = calloc(1, sizeof (jit_context));
+	if (jit == NULL) {
+		return ERR_NOMEM;
+	}
+
+	jit->code_buf = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (jit->code_buf == MAP_FAILED) {
+		free(jit);
+		return ERR_NOMEM;
+	}
+
+	vcpu->jit = jit;
+	jit->out = jit->code_buf;
+
+	// After four pushes and a further 8 bytes the stack is 16-byte aligned for calls
+	jit->enter_code = (jit_enter_pf)jit->out;
+	emit_byte(jit, 0x53); // push rbx
+	emit_byte(jit, 0x41); emit_byte(jit, 0x54); // push r12
+	emit_byte(jit, 0x41); emit_byte(jit, 0x55); // push r13
+	emit_byte(jit, 0x41); emit_byte(jit, 0x56); // push r14
+	emit_byte(jit, 0x48); emit_byte(jit, 0x83); emit_byte(jit, 0xEC); emit_byte(jit, 0x08); // sub rsp, 8
+	emit_byte(jit, 0x48); emit_byte(jit, 0x89); emit_byte(jit, 0xFB); // mov rbx, rdi
+	emit_byte(jit, 0x49); emit_byte(jit, 0x89); emit_byte(jit, 0xF4); // mov r12, rsi
+	emit_byte(jit, 0x49); emit_byte(jit, 0x89); emit_byte(jit, 0xCD); // mov r13, rcx
+	emit_byte(jit, 0x4D); emit_byte(jit, 0x89); emit_byte(jit, 0xC6); // mov r14, r8
+	emit_byte(jit, 0xFF); emit_byte(jit, 0xE2); // jmp rdx
+
+	jit->exit_code = jit->out;
+	emit_byte(jit, 0x48); emit_byte(jit, 0x83); emit_byte(jit, 0xC4); emit_byte(jit, 0x08); // add rsp, 8
+	emit_byte(jit, 0x41); emit_byte(jit, 0x5E); // pop r14
+	emit_byte(jit, 0x41); emit_byte(jit, 0x5D); // pop r13
+	emit_byte(jit, 0x41); emit_byte(jit, 0x5C); // pop r12
+	emit_byte(jit, 0x5B); // pop rbx
+	emit_byte(jit, 0xC3); // ret
+
+	jit->code_start = jit->out;
+	jit_flush(vcpu);
+
+	return ERR_NOERR;
+}
+
+void jit_end(vx4_cpu *vcpu)
+{
+	jit_context *jit = vcpu->jit;
+
+	if (jit == NULL) {
+		return;
+	}
+
+	munmap(jit->code_buf, JIT_CODE_SIZE);
+
+	for (size_t i = 0; i < MEM_NUM_BLKS; ++i) {
+		free(jit->line_maps[i]);
+	}
+
+	free(jit);
+	vcpu->jit = NULL;
+}
+
+mem_addr jit_run(vx4_cpu *vcpu, mem_addr ip, int64_t *budget)
+{
+	jit_context *jit = vcpu->jit;
+	uint8_t *link = NULL;
+	unsigned flushes = jit->flush_count;
+
+	while (atomic_load_explicit(&vcpu->cpu.events, memory_order_relaxed) == 0) {
+		jit_block *blk = jit->lookup[JIT_INDEX(ip)];
+
+		if (blk == NULL || blk->addr != ip) {
+			// Leave cold code to the interpreter
+			if (jit->heat[JIT_INDEX(ip)] < JIT_HOT_THRESHOLD) {
+				++jit->heat[JIT_INDEX(ip)];
+				break;
+			}
+
+			blk = translate(vcpu, ip);
+			if (blk == NULL) {
+				// Cool off again, rather than retrying every time it's reached
+				jit->heat[JIT_INDEX(ip)] = 0;
+				break;
+			}
+		}
+
+		// A link from before a flush points into discarded code
+		if (link != NULL && flushes == jit->flush_count) {
+			patch_link(link, blk->code);
+		}
+
+		// Leave the rest of the budget to the interpreter
+		if (blk->num_ins > *budget) {
+			break;
+		}
+
+		flushes = jit->flush_count;
+
+		jit_exit next = jit->enter_code(vcpu->registers, &vcpu->cpu.events, blk->code, budget, vcpu);
+		ip = next.ip;
+		link = next.link;
+	}
+
+	return ip;
+}
+
+void jit_invalidate(vx4_cpu *vcpu, mem_addr base, mem_size num)
+{
+	if (num == 0) {
+		return;
+	}
+
+	mem_addr line = base >> LINE_SHIFT;
+	mem_size count = ((base + num - 1) >> LINE_SHIFT) - line + 1;
+
+	for (; count > 0; --count, ++line) {
+		const uint8_t *map = vcpu->jit->line_maps[LINE_BLOCK(line)];
+
+		if (map != NULL && (map[LINE_MASK(line) / 8] & (1u << (line % 8)))) {
+			// Translations are chained together, so it's simplest to start over
+			jit_flush(vcpu);
+			return;
+		}
+	}
+}
+
+void jit_flush(vx4_cpu *vcpu)
+{
+	jit_context *jit = vcpu->jit;
+
+	jit->code_next = jit->code_start;
+	jit->num_blocks = 0;
+
+	memset(jit->lookup, 0, sizeof (jit->lookup));
+	memset(jit->heat, 0, sizeof (jit->heat));
+	memset(jit->returns, 0, sizeof (jit->returns));
+
+	for (size_t i = 0; i < MEM_NUM_BLKS; ++i) {
+		if (jit->line_maps[i] != NULL) {
+			memset(jit->line_maps[i], 0, LINES_IN_BLK / 8);
+		}
+	}
+
+	++jit->flush_count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Module internal functions
+////////////////////////////////////////////////////////////////////////////////
+
+jit_block *translate(vx4_cpu *vcpu, mem_addr ip)
+{
+	jit_context *jit = vcpu->jit;
+	size_t space = jit->code_buf + JIT_CODE_SIZE - jit->code_next;
+
+	if (jit->num_blocks == JIT_MAX_BLOCKS || space < MAX_BLOCK_CODE) {
+		jit_flush(vcpu);
+	}
+
+	instruction_decoded ins;
+	mem_addr addr = ip;
+	unsigned count = 0;
+	bool ended = false;
+
+	jit->out = jit->code_next;
+
+	uint8_t *entry = emit_prologue(jit, ip);
+
+	while (count < JIT_BLOCK_INS && !ended && translatable(vcpu->vm, addr, &ins)) {
+		mark_lines(jit, addr, ins.size);
+
+		mem_addr next = addr + ins.size;
+		uint8_t dest = ins.ops.reg[0] * 4; // Offsets into the register file
+		uint8_t src = ins.ops.reg[1] * 4;
+
+		switch (ins.id) {
+			case INS_NOP:
+				break;
+
+			case INS_JMPC:
+				emit_chain(jit, ins.ops.imm, count + 1);
+				ended = true;
+				break;
+
+			case INS_MOVRC:
+				emit_byte(jit, 0xC7); emit_byte(jit, 0x43); emit_byte(jit, dest); // mov dword [rbx + dest], imm32
+				emit_word(jit, ins.ops.imm);
+				break;
+
+			case INS_ADDRC:
+				emit_byte(jit, 0x81); emit_byte(jit, 0x43); emit_byte(jit, dest); // add dword [rbx + dest], imm32
+				emit_word(jit, ins.ops.imm);
+				break;
+
+			case INS_MOVMR:
+				emit_byte(jit, 0x4C); emit_byte(jit, 0x89); emit_byte(jit, 0xF7); // mov rdi, r14
+				emit_byte(jit, 0xBE); emit_word(jit, ins.ops.imm); // mov esi, imm32
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x53); emit_byte(jit, dest); // mov edx, [rbx + dest]
+				emit_call(jit, store_word);
+				emit_exit_on_fail(jit, next, count + 1);
+				break;
+
+			case INS_STORR:
+				emit_byte(jit, 0x4C); emit_byte(jit, 0x89); emit_byte(jit, 0xF7); // mov rdi, r14
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x73); emit_byte(jit, dest); // mov esi, [rbx + dest]
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x53); emit_byte(jit, src); // mov edx, [rbx + src]
+				emit_call(jit, store_word);
+				emit_exit_on_fail(jit, next, count + 1);
+				break;
+
+			case INS_MOVRR:
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x43); emit_byte(jit, src); // mov eax, [rbx + src]
+				emit_byte(jit, 0x89); emit_byte(jit, 0x43); emit_byte(jit, dest); // mov [rbx + dest], eax
+				break;
+
+			case INS_MOVRM:
+				emit_byte(jit, 0x4C); emit_byte(jit, 0x89); emit_byte(jit, 0xF7); // mov rdi, r14
+				emit_byte(jit, 0xBE); emit_word(jit, ins.ops.imm); // mov esi, imm32
+				emit_byte(jit, 0x48); emit_byte(jit, 0x8D); emit_byte(jit, 0x53); emit_byte(jit, dest); // lea rdx, [rbx + dest]
+				emit_call(jit, load_word);
+				emit_exit_on_fail(jit, next, count + 1);
+				break;
+
+			case INS_LOADO:
+				emit_byte(jit, 0x4C); emit_byte(jit, 0x89); emit_byte(jit, 0xF7); // mov rdi, r14
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x73); emit_byte(jit, dest); // mov esi, [rbx + dest]
+				emit_byte(jit, 0x81); emit_byte(jit, 0xC6); emit_word(jit, ins.ops.imm); // add esi, imm32
+				emit_byte(jit, 0x48); emit_byte(jit, 0x8D); emit_byte(jit, 0x53); emit_byte(jit, src); // lea rdx, [rbx + src]
+				emit_call(jit, load_word);
+				emit_exit_on_fail(jit, next, count + 1);
+				break;
+
+			case INS_STORO:
+				emit_byte(jit, 0x4C); emit_byte(jit, 0x89); emit_byte(jit, 0xF7); // mov rdi, r14
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x73); emit_byte(jit, dest); // mov esi, [rbx + dest]
+				emit_byte(jit, 0x81); emit_byte(jit, 0xC6); emit_word(jit, ins.ops.imm); // add esi, imm32
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x53); emit_byte(jit, src); // mov edx, [rbx + src]
+				emit_call(jit, store_word);
+				emit_exit_on_fail(jit, next, count + 1);
+				break;
+
+			case INS_ADDRR:
+			case INS_SUBRR:
+			case INS_ANDRR:
+			case INS_ORRR:
+			case INS_XORRR:
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x43); emit_byte(jit, src); // mov eax, [rbx + src]
+				emit_byte(jit, ins.id == INS_ADDRR ? 0x01 : ins.id == INS_SUBRR ? 0x29 :
+					ins.id == INS_ANDRR ? 0x21 : ins.id == INS_ORRR ? 0x09 : 0x31);
+				emit_byte(jit, 0x43); emit_byte(jit, dest); // op [rbx + dest], eax
+				break;
+
+			case INS_SUBRC:
+			case INS_ANDRC:
+			case INS_ORRC:
+			case INS_XORRC:
+				emit_byte(jit, 0x81); // op dword [rbx + dest], imm32
+				emit_byte(jit, ins.id == INS_SUBRC ? 0x6B : ins.id == INS_ANDRC ? 0x63 :
+					ins.id == INS_ORRC ? 0x4B : 0x73);
+				emit_byte(jit, dest); emit_word(jit, ins.ops.imm);
+				break;
+
+			case INS_MULRR:
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x43); emit_byte(jit, dest); // mov eax, [rbx + dest]
+				emit_byte(jit, 0x0F); emit_byte(jit, 0xAF); emit_byte(jit, 0x43); emit_byte(jit, src); // imul eax, [rbx + src]
+				emit_byte(jit, 0x89); emit_byte(jit, 0x43); emit_byte(jit, dest); // mov [rbx + dest], eax
+				break;
+
+			case INS_MULRC:
+				emit_byte(jit, 0x69); emit_byte(jit, 0x43); emit_byte(jit, dest); // imul eax, [rbx + dest], imm32
+				emit_word(jit, ins.ops.imm);
+				emit_byte(jit, 0x89); emit_byte(jit, 0x43); emit_byte(jit, dest); // mov [rbx + dest], eax
+				break;
+
+			case INS_SHLRR:
+			case INS_SHRRR:
+			case INS_SARRR:
+				// The host takes shift counts modulo 32 too
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x4B); emit_byte(jit, src); // mov ecx, [rbx + src]
+				emit_byte(jit, 0xD3); // shift dword [rbx + dest], cl
+				emit_byte(jit, ins.id == INS_SHLRR ? 0x63 : ins.id == INS_SHRRR ? 0x6B : 0x7B);
+				emit_byte(jit, dest);
+				break;
+
+			case INS_SHLRC:
+			case INS_SHRRC:
+			case INS_SARRC:
+				emit_byte(jit, 0xC1); // shift dword [rbx + dest], imm8
+				emit_byte(jit, ins.id == INS_SHLRC ? 0x63 : ins.id == INS_SHRRC ? 0x6B : 0x7B);
+				emit_byte(jit, dest); emit_byte(jit, ins.ops.imm % 32);
+				break;
+
+			case INS_CMPRR:
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x43); emit_byte(jit, dest); // mov eax, [rbx + dest]
+				emit_byte(jit, 0x89); emit_byte(jit, 0x43); emit_byte(jit, COMPARED_DISP); // mov [rbx + compared], eax
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x43); emit_byte(jit, src); // mov eax, [rbx + src]
+				emit_byte(jit, 0x89); emit_byte(jit, 0x43); emit_byte(jit, COMPARED_DISP + 4); // mov [rbx + compared + 4], eax
+				break;
+
+			case INS_CMPRC:
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x43); emit_byte(jit, dest); // mov eax, [rbx + dest]
+				emit_byte(jit, 0x89); emit_byte(jit, 0x43); emit_byte(jit, COMPARED_DISP); // mov [rbx + compared], eax
+				emit_byte(jit, 0xC7); emit_byte(jit, 0x43); emit_byte(jit, COMPARED_DISP + 4); // mov dword [rbx + compared + 4], imm32
+				emit_word(jit, ins.ops.imm);
+				break;
+
+			case INS_JEQ:
+			case INS_JNE:
+			case INS_JLT:
+			case INS_JLE:
+			case INS_JGT:
+			case INS_JGE:
+			case INS_JLTU:
+			case INS_JLEU:
+			case INS_JGTU:
+			case INS_JGEU: {
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x43); emit_byte(jit, COMPARED_DISP); // mov eax, [rbx + compared]
+				emit_byte(jit, 0x3B); emit_byte(jit, 0x43); emit_byte(jit, COMPARED_DISP + 4); // cmp eax, [rbx + compared + 4]
+				emit_byte(jit, host_condition(ins.id) ^ 1); emit_byte(jit, 0); // jncc past the taken exit
+
+				// Both ways out of the block can be linked
+				uint8_t *skip = jit->out;
+				emit_chain(jit, ins.ops.imm, count + 1);
+				skip[-1] = (uint8_t)(jit->out - skip);
+
+				emit_chain(jit, next, count + 1);
+				ended = true;
+				break;
+			}
+
+			case INS_CALLC:
+				emit_byte(jit, 0x4C); emit_byte(jit, 0x89); emit_byte(jit, 0xF7); // mov rdi, r14
+				emit_byte(jit, 0xBE); emit_word(jit, next); // mov esi, next
+				emit_call(jit, call_push);
+				emit_exit_on_fail(jit, next, count + 1);
+				emit_chain(jit, ins.ops.imm, count + 1);
+				ended = true;
+				break;
+
+			case INS_RET:
+				emit_byte(jit, 0x49); emit_byte(jit, 0x83); emit_byte(jit, 0x6D); emit_byte(jit, 0x00); emit_byte(jit, count + 1); // sub qword [r13], count
+				emit_byte(jit, 0x4C); emit_byte(jit, 0x89); emit_byte(jit, 0xF7); // mov rdi, r14
+				emit_byte(jit, 0xBE); emit_word(jit, next); // mov esi, next
+				emit_call(jit, return_pop);
+				emit_byte(jit, 0x48); emit_byte(jit, 0x85); emit_byte(jit, 0xD2); // test rdx, rdx
+				emit_byte(jit, 0x74); emit_byte(jit, 0x09); // jz past the jump
+				emit_byte(jit, 0x41); emit_byte(jit, 0x83); emit_byte(jit, 0x3C); emit_byte(jit, 0x24); emit_byte(jit, 0x00); // cmp dword [r12], 0
+				emit_byte(jit, 0x75); emit_byte(jit, 0x02); // jne past the jump
+				emit_byte(jit, 0xFF); emit_byte(jit, 0xE2); // jmp rdx
+				emit_byte(jit, 0x31); emit_byte(jit, 0xD2); // xor edx, edx
+				emit_byte(jit, 0xE9); emit_rel(jit, jit->exit_code); // jmp exit_code, with the ip in eax
+				ended = true;
+				break;
+
+			case INS_ENTER:
+			case INS_LEAVE:
+				emit_byte(jit, 0x4C); emit_byte(jit, 0x89); emit_byte(jit, 0xF7); // mov rdi, r14
+				emit_call(jit, ins.id == INS_ENTER ? enter_frame : leave_frame);
+				emit_exit_on_fail(jit, next, count + 1);
+				break;
+
+			case INS_PUSHR:
+				emit_byte(jit, 0x4C); emit_byte(jit, 0x89); emit_byte(jit, 0xF7); // mov rdi, r14
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x73); emit_byte(jit, dest); // mov esi, [rbx + dest]
+				emit_call(jit, push_word);
+				emit_exit_on_fail(jit, next, count + 1);
+				break;
+
+			case INS_POPR:
+				emit_byte(jit, 0x4C); emit_byte(jit, 0x89); emit_byte(jit, 0xF7); // mov rdi, r14
+				emit_byte(jit, 0x48); emit_byte(jit, 0x8D); emit_byte(jit, 0x73); emit_byte(jit, dest); // lea rsi, [rbx + dest]
+				emit_call(jit, pop_word);
+				emit_exit_on_fail(jit, next, count + 1);
+				break;
+
+			case INS_VLOAD:
+				emit_byte(jit, 0x4C); emit_byte(jit, 0x89); emit_byte(jit, 0xF7); // mov rdi, r14
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x73); emit_byte(jit, src); // mov esi, [rbx + src]
+				emit_byte(jit, 0x48); emit_byte(jit, 0x8D); emit_byte(jit, 0x93); emit_word(jit, VREG_DISP(ins.ops.reg[0])); // lea rdx, [rbx + vdest]
+				emit_call(jit, load_vector);
+				emit_exit_on_fail(jit, next, count + 1);
+				break;
+
+			case INS_VSTOR:
+				emit_byte(jit, 0x4C); emit_byte(jit, 0x89); emit_byte(jit, 0xF7); // mov rdi, r14
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x73); emit_byte(jit, dest); // mov esi, [rbx + dest]
+				emit_byte(jit, 0x48); emit_byte(jit, 0x8D); emit_byte(jit, 0x93); emit_word(jit, VREG_DISP(ins.ops.reg[1])); // lea rdx, [rbx + vsrc]
+				emit_call(jit, store_vector);
+				emit_exit_on_fail(jit, next, count + 1);
+				break;
+
+			case INS_VMOV:
+				emit_byte(jit, 0xF3); emit_byte(jit, 0x0F); emit_byte(jit, 0x6F); emit_byte(jit, 0x83); // movdqu xmm0, [rbx + vsrc]
+				emit_word(jit, VREG_DISP(ins.ops.reg[1]));
+				emit_byte(jit, 0xF3); emit_byte(jit, 0x0F); emit_byte(jit, 0x7F); emit_byte(jit, 0x83); // movdqu [rbx + vdest], xmm0
+				emit_word(jit, VREG_DISP(ins.ops.reg[0]));
+				break;
+
+			case INS_VSPLAT:
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x43); emit_byte(jit, src); // mov eax, [rbx + src]
+
+				for (int i = 0; i < VREG_SIZE / 4; ++i) {
+					emit_byte(jit, 0x89); emit_byte(jit, 0x83); emit_word(jit, VREG_DISP(ins.ops.reg[0]) + i * 4); // mov [rbx + vdest + lane], eax
+				}
+				break;
+
+			case INS_VEXTR:
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x83); emit_word(jit, VREG_DISP(ins.ops.reg[1]) + ins.ops.imm * 4); // mov eax, [rbx + vsrc + lane]
+				emit_byte(jit, 0x89); emit_byte(jit, 0x43); emit_byte(jit, dest); // mov [rbx + dest], eax
+				break;
+
+			case INS_FMOVFF:
+				emit_byte(jit, 0x48); emit_byte(jit, 0x8B); emit_byte(jit, 0x83); emit_word(jit, FREG_DISP(ins.ops.reg[1])); // mov rax, [rbx + fsrc]
+				emit_byte(jit, 0x48); emit_byte(jit, 0x89); emit_byte(jit, 0x83); emit_word(jit, FREG_DISP(ins.ops.reg[0])); // mov [rbx + fdest], rax
+				break;
+
+			case INS_FMOVFR:
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x43); emit_byte(jit, src); // mov eax, [rbx + src]
+				emit_byte(jit, 0x89); emit_byte(jit, 0x83); emit_word(jit, FREG_DISP(ins.ops.reg[0])); // mov [rbx + fdest], eax
+				break;
+
+			case INS_FMOVRF:
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x83); emit_word(jit, FREG_DISP(ins.ops.reg[1])); // mov eax, [rbx + fsrc]
+				emit_byte(jit, 0x89); emit_byte(jit, 0x43); emit_byte(jit, dest); // mov [rbx + dest], eax
+				break;
+
+			case INS_FLOADO32:
+			case INS_FLOADO64:
+				emit_byte(jit, 0x4C); emit_byte(jit, 0x89); emit_byte(jit, 0xF7); // mov rdi, r14
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x73); emit_byte(jit, dest); // mov esi, [rbx + dest]
+				emit_byte(jit, 0x81); emit_byte(jit, 0xC6); emit_word(jit, ins.ops.imm); // add esi, imm32
+				emit_byte(jit, 0x48); emit_byte(jit, 0x8D); emit_byte(jit, 0x93); emit_word(jit, FREG_DISP(ins.ops.reg[1])); // lea rdx, [rbx + fsrc]
+				emit_call(jit, ins.id == INS_FLOADO32 ? (const void *)load_word : (const void *)load_dword);
+				emit_exit_on_fail(jit, next, count + 1);
+				break;
+
+			case INS_FSTORO32:
+			case INS_FSTORO64:
+				emit_byte(jit, 0x4C); emit_byte(jit, 0x89); emit_byte(jit, 0xF7); // mov rdi, r14
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x73); emit_byte(jit, dest); // mov esi, [rbx + dest]
+				emit_byte(jit, 0x81); emit_byte(jit, 0xC6); emit_word(jit, ins.ops.imm); // add esi, imm32
+				if (ins.id == INS_FSTORO64) {
+					emit_byte(jit, 0x48); // The next mov takes the whole register
+				}
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x93); emit_word(jit, FREG_DISP(ins.ops.reg[1])); // mov edx/rdx, [rbx + fsrc]
+				emit_call(jit, ins.id == INS_FSTORO32 ? (const void *)store_word : (const void *)store_dword);
+				emit_exit_on_fail(jit, next, count + 1);
+				break;
+
+			case INS_FADD32:
+			case INS_FADD64:
+			case INS_FSUB32:
+			case INS_FSUB64:
+			case INS_FMUL32:
+			case INS_FMUL64:
+			case INS_FDIV32:
+			case INS_FDIV64:
+				emit_byte(jit, sse_prefix(ins.id)); emit_byte(jit, 0x0F); emit_byte(jit, 0x10); emit_byte(jit, 0x83); // movss/movsd xmm0, [rbx + fdest]
+				emit_word(jit, FREG_DISP(ins.ops.reg[0]));
+				emit_byte(jit, sse_prefix(ins.id)); emit_byte(jit, 0x0F); // op xmm0, [rbx + fsrc]
+				emit_byte(jit, ins.id <= INS_FADD64 ? 0x58 : ins.id <= INS_FSUB64 ? 0x5C : ins.id <= INS_FMUL64 ? 0x59 : 0x5E);
+				emit_byte(jit, 0x83); emit_word(jit, FREG_DISP(ins.ops.reg[1]));
+				emit_byte(jit, sse_prefix(ins.id)); emit_byte(jit, 0x0F); emit_byte(jit, 0x11); emit_byte(jit, 0x83); // movss/movsd [rbx + fdest], xmm0
+				emit_word(jit, FREG_DISP(ins.ops.reg[0]));
+				break;
+
+			case INS_FSQRT32:
+			case INS_FSQRT64:
+			case INS_FWIDEN:
+			case INS_FNARROW:
+				// cvtss2sd and cvtsd2ss are prefixed by their source's precision
+				emit_byte(jit, ins.id == INS_FWIDEN ? 0xF3 : ins.id == INS_FNARROW ? 0xF2 : sse_prefix(ins.id));
+				emit_byte(jit, 0x0F); emit_byte(jit, ins.id <= INS_FSQRT64 ? 0x51 : 0x5A); // sqrt/cvt xmm0, [rbx + fsrc]
+				emit_byte(jit, 0x83); emit_word(jit, FREG_DISP(ins.ops.reg[1]));
+				emit_byte(jit, ins.id == INS_FWIDEN ? 0xF2 : ins.id == INS_FNARROW ? 0xF3 : sse_prefix(ins.id));
+				emit_byte(jit, 0x0F); emit_byte(jit, 0x11); emit_byte(jit, 0x83); // movss/movsd [rbx + fdest], xmm0
+				emit_word(jit, FREG_DISP(ins.ops.reg[0]));
+				break;
+
+			case INS_FITOF32:
+			case INS_FITOF64:
+				emit_byte(jit, sse_prefix(ins.id)); emit_byte(jit, 0x0F); emit_byte(jit, 0x2A); emit_byte(jit, 0x43); emit_byte(jit, src); // cvtsi2ss/sd xmm0, [rbx + src]
+				emit_byte(jit, sse_prefix(ins.id)); emit_byte(jit, 0x0F); emit_byte(jit, 0x11); emit_byte(jit, 0x83); // movss/movsd [rbx + fdest], xmm0
+				emit_word(jit, FREG_DISP(ins.ops.reg[0]));
+				break;
+
+			case INS_FCMP32:
+			case INS_FCMP64:
+				// Sets eax to seta - setb, or FPU_UNORDERED when parity says so
+				emit_byte(jit, 0x31); emit_byte(jit, 0xC0); // xor eax, eax
+				emit_byte(jit, 0x31); emit_byte(jit, 0xC9); // xor ecx, ecx
+				emit_byte(jit, 0x31); emit_byte(jit, 0xD2); // xor edx, edx
+				emit_byte(jit, sse_prefix(ins.id)); emit_byte(jit, 0x0F); emit_byte(jit, 0x10); emit_byte(jit, 0x83); // movss/movsd xmm0, [rbx + fdest]
+				emit_word(jit, FREG_DISP(ins.ops.reg[0]));
+				if (ins.id == INS_FCMP64) {
+					emit_byte(jit, 0x66);
+				}
+				emit_byte(jit, 0x0F); emit_byte(jit, 0x2E); emit_byte(jit, 0x83); emit_word(jit, FREG_DISP(ins.ops.reg[1])); // ucomiss/ucomisd xmm0, [rbx + fsrc]
+				emit_byte(jit, 0x0F); emit_byte(jit, 0x97); emit_byte(jit, 0xC0); // seta al
+				emit_byte(jit, 0x0F); emit_byte(jit, 0x92); emit_byte(jit, 0xC1); // setb cl
+				emit_byte(jit, 0x0F); emit_byte(jit, 0x9A); emit_byte(jit, 0xC2); // setp dl
+				emit_byte(jit, 0x29); emit_byte(jit, 0xC8); // sub eax, ecx
+				emit_byte(jit, 0x8D); emit_byte(jit, 0x04); emit_byte(jit, 0x50); // lea eax, [rax + rdx * 2]
+				emit_byte(jit, 0x01); emit_byte(jit, 0xD0); // add eax, edx
+				emit_byte(jit, 0x89); emit_byte(jit, 0x43); emit_byte(jit, COMPARED_DISP); // mov [rbx + compared], eax
+				emit_byte(jit, 0xC7); emit_byte(jit, 0x43); emit_byte(jit, COMPARED_DISP + 4); emit_word(jit, 0); // mov dword [rbx + compared + 4], 0
+				break;
+
+			case INS_FMA32:
+			case INS_FMA64:
+				emit_byte(jit, 0x48); emit_byte(jit, 0x8D); emit_byte(jit, 0xBB); emit_word(jit, FREG_DISP(ins.ops.reg[0])); // lea rdi, [rbx + fdest]
+				emit_byte(jit, 0x48); emit_byte(jit, 0x8D); emit_byte(jit, 0xB3); emit_word(jit, FREG_DISP(ins.ops.reg[1])); // lea rsi, [rbx + fsrc]
+				emit_byte(jit, 0x48); emit_byte(jit, 0x8D); emit_byte(jit, 0x93); emit_word(jit, FREG_DISP(ins.ops.imm)); // lea rdx, [rbx + fsrc2]
+				emit_call(jit, ins.id == INS_FMA32 ? fpu_fma32 : fpu_fma64);
+				break;
+
+			case INS_FFTOI32:
+			case INS_FFTOI64:
+				emit_byte(jit, 0x48); emit_byte(jit, 0x8D); emit_byte(jit, 0x7B); emit_byte(jit, dest); // lea rdi, [rbx + dest]
+				emit_byte(jit, 0x48); emit_byte(jit, 0x8D); emit_byte(jit, 0xB3); emit_word(jit, FREG_DISP(ins.ops.reg[1])); // lea rsi, [rbx + fsrc]
+				emit_call(jit, ins.id == INS_FFTOI32 ? fpu_ftoi32 : fpu_ftoi64);
+				break;
+
+			case INS_MCOPY:
+			case INS_MFILL:
+			case INS_MCMP:
+				emit_byte(jit, 0x4C); emit_byte(jit, 0x89); emit_byte(jit, 0xF7); // mov rdi, r14
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x73); emit_byte(jit, dest); // mov esi, [rbx + dest]
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x53); emit_byte(jit, src); // mov edx, [rbx + src]
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x4B); emit_byte(jit, ins.ops.imm * 4); // mov ecx, [rbx + len]
+
+				if (ins.id == INS_MCMP) {
+					emit_call(jit, compare_block);
+				}
+				else {
+					emit_call(jit, ins.id == INS_MCOPY ? (const void *)copy_block : (const void *)fill_block);
+					emit_exit_on_fail(jit, next, count + 1);
+				}
+				break;
+
+			case INS_XCHG:
+			case INS_XADD:
+			case INS_CAS:
+				emit_byte(jit, 0x4C); emit_byte(jit, 0x89); emit_byte(jit, 0xF7); // mov rdi, r14
+				emit_byte(jit, 0x8B); emit_byte(jit, 0x73); emit_byte(jit, dest); // mov esi, [rbx + dest]
+				emit_byte(jit, 0x48); emit_byte(jit, 0x8D); emit_byte(jit, 0x53); emit_byte(jit, src); // lea rdx, [rbx + src]
+
+				if (ins.id == INS_CAS) {
+					emit_byte(jit, 0x8B); emit_byte(jit, 0x4B); emit_byte(jit, ins.ops.imm * 4); // mov ecx, [rbx + new]
+				}
+
+				emit_call(jit, ins.id == INS_XCHG ? (const void *)exchange_word :
+					ins.id == INS_XADD ? (const void *)fetch_add_word : (const void *)cas_word);
+				emit_exit_on_fail(jit, next, count + 1);
+				break;
+
+			case INS_VSHUF32:
+				emit_byte(jit, 0xBA); emit_word(jit, ins.ops.imm); // mov edx, imm32
+				// Fall through
+
+			default:
+				// The lane-wise operations, see instruction_vector_func
+				emit_byte(jit, 0x48); emit_byte(jit, 0x8D); emit_byte(jit, 0xBB); emit_word(jit, VREG_DISP(ins.ops.reg[0])); // lea rdi, [rbx + vdest]
+				emit_byte(jit, 0x48); emit_byte(jit, 0x8D); emit_byte(jit, 0xB3); emit_word(jit, VREG_DISP(ins.ops.reg[1])); // lea rsi, [rbx + vsrc]
+				emit_call(jit, ins.id == INS_VSHUF32 ? (const void *)vector_shuf32 : (const void *)instruction_vector_func(ins.id));
+				break;
+		}
+
+		addr = next;
+		++count;
+	}
+
+	if (count == 0) {
+		return NULL;
+	}
+
+	// Blocks that didn't end in a jump carry on from the next instruction
+	if (!ended) {
+		emit_chain(jit, addr, count);
+	}
+
+	entry[PROLOGUE_COUNT] = count;
+
+	jit_block *blk = &jit->blocks[jit->num_blocks++];
+	blk->addr = ip;
+	blk->code = entry;
+	blk->num_ins = count;
+
+	jit->code_next = jit->out;
+	jit->lookup[JIT_INDEX(ip)] = blk;
+
+	return blk;
+}
+
+bool translatable(vx4_machine *vm, mem_addr addr, instruction_decoded *ins)
+{
+	// Watched before decoding, so another CPU rewriting the code meanwhile
+	// is still reported
+	if ((addr & 1) || !mem_watch_line(vm, addr)) {
+		return false;
+	}
+
+	instruction_decode(vm, addr, ins);
+
+	switch (ins->id) {
+		case INS_NOP:
+		case INS_JMPC:
+		case INS_MOVRC:
+		case INS_ADDRC:
+		case INS_MOVMR:
+		case INS_STORR:
+		case INS_MOVRR:
+		case INS_MOVRM:
+		case INS_LOADO:
+		case INS_STORO:
+		case INS_ADDRR:
+		case INS_SUBRR:
+		case INS_MULRR:
+		case INS_ANDRR:
+		case INS_ORRR:
+		case INS_XORRR:
+		case INS_SHLRR:
+		case INS_SHRRR:
+		case INS_SARRR:
+		case INS_SUBRC:
+		case INS_MULRC:
+		case INS_ANDRC:
+		case INS_ORRC:
+		case INS_XORRC:
+		case INS_SHLRC:
+		case INS_SHRRC:
+		case INS_SARRC:
+		case INS_CMPRR:
+		case INS_CMPRC:
+		case INS_JEQ:
+		case INS_JNE:
+		case INS_JLT:
+		case INS_JLE:
+		case INS_JGT:
+		case INS_JGE:
+		case INS_JLTU:
+		case INS_JLEU:
+		case INS_JGTU:
+		case INS_JGEU:
+		case INS_CALLC:
+		case INS_RET:
+		case INS_ENTER:
+		case INS_LEAVE:
+		case INS_PUSHR:
+		case INS_POPR:
+		case INS_VLOAD:
+		case INS_VSTOR:
+		case INS_VMOV:
+		case INS_VSPLAT:
+		case INS_VEXTR:
+		case INS_VSHUF32:
+		case INS_FMOVFF:
+		case INS_FMOVFR:
+		case INS_FMOVRF:
+		case INS_FLOADO32:
+		case INS_FLOADO64:
+		case INS_FSTORO32:
+		case INS_FSTORO64:
+		case INS_FADD32:
+		case INS_FADD64:
+		case INS_FSUB32:
+		case INS_FSUB64:
+		case INS_FMUL32:
+		case INS_FMUL64:
+		case INS_FDIV32:
+		case INS_FDIV64:
+		case INS_FSQRT32:
+		case INS_FSQRT64:
+		case INS_FMA32:
+		case INS_FMA64:
+		case INS_FCMP32:
+		case INS_FCMP64:
+		case INS_FWIDEN:
+		case INS_FNARROW:
+		case INS_FITOF32:
+		case INS_FITOF64:
+		case INS_FFTOI32:
+		case INS_FFTOI64:
+		case INS_MCOPY:
+		case INS_MFILL:
+		case INS_MCMP:
+		case INS_XCHG:
+		case INS_XADD:
+		case INS_CAS:
+			break;
+
+		// Division is left to the interpreter, which raises its fault.
+		// Of the rest, only the lane-wise vector operations are translated
+		default:
+			if (instruction_vector_func(ins->id) == NULL) {
+				return false;
+			}
+			break;
+	}
+
+	// Writes to device mappings aren't reported, so their code may change unseen
+	return mem_watch_line(vm, addr + ins->size - 1);
+}
+
+void mark_lines(jit_context *jit, mem_addr base, mem_size num)
+{
+	mem_addr line = base >> LINE_SHIFT;
+	mem_size count = ((base + num - 1) >> LINE_SHIFT) - line + 1;
+
+	for (; count > 0; --count, ++line) {
+		uint8_t **map = &jit->line_maps[LINE_BLOCK(line)];
+
+		if (*map == NULL) {
+			*map = calloc(LINES_IN_BLK / 8, 1);
+
+			if (*map == NULL) {
+				DIE_ON(ERR_NOMEM);
+			}
+		}
+
+		(*map)[LINE_MASK(line) / 8] |= 1u << (line % 8);
+	}
+}
+
+uint32_t store_word(vx4_cpu *vcpu, mem_addr addr, uint32_t val)
+{
+	if (mem_cached_write_word(vcpu->vm, &vcpu->memcache, addr, val) != ERR_NOERR) {
+		interrupt_send(vcpu->vm, vcpu->id, INTR_INS);
+		return 1;
+	}
+
+	// Written code is only discarded once the CPU services its events, and
+	// may be in the very block being run
+	return atomic_load_explicit(&vcpu->cpu.events, memory_order_relaxed) != 0;
+}
+
+uint32_t load_word(vx4_cpu *vcpu, mem_addr addr, uint32_t *dest)
+{
+	if (mem_cached_read_word(vcpu->vm, &vcpu->memcache, addr, dest) != ERR_NOERR) {
+		interrupt_send(vcpu->vm, vcpu->id, INTR_INS);
+		return 1;
+	}
+
+	return 0;
+}
+
+uint32_t store_dword(vx4_cpu *vcpu, mem_addr addr, uint64_t val)
+{
+	if (mem_cached_write_dword(vcpu->vm, &vcpu->memcache, addr, val) != ERR_NOERR) {
+		interrupt_send(vcpu->vm, vcpu->id, INTR_INS);
+		return 1;
+	}
+
+	return atomic_load_explicit(&vcpu->cpu.events, memory_order_relaxed) != 0;
+}
+
+uint32_t load_dword(vx4_cpu *vcpu, mem_addr addr, uint64_t *dest)
+{
+	if (mem_cached_read_dword(vcpu->vm, &vcpu->memcache, addr, dest) != ERR_NOERR) {
+		interrupt_send(vcpu->vm, vcpu->id, INTR_INS);
+		return 1;
+	}
+
+	return 0;
+}
+
+uint32_t copy_block(vx4_cpu *vcpu, mem_addr dest, mem_addr src, mem_size num)
+{
+	mmu_copy(vcpu, dest, src, num);
+	return atomic_load_explicit(&vcpu->cpu.events, memory_order_relaxed) != 0;
+}
+
+uint32_t fill_block(vx4_cpu *vcpu, mem_addr dest, uint32_t val, mem_size num)
+{
+	mmu_set_bytes(vcpu, dest, (uint8_t)val, num);
+	return atomic_load_explicit(&vcpu->cpu.events, memory_order_relaxed) != 0;
+}
+
+void compare_block(vx4_cpu *vcpu, mem_addr a, mem_addr b, mem_size num)
+{
+	mem_size offset;
+	mmu_compare(vcpu, a, b, num, vcpu->compared, &offset);
+}
+
+uint32_t exchange_word(vx4_cpu *vcpu, mem_addr addr, uint32_t *val)
+{
+	if (mmu_exchange_word(vcpu, addr, *val, val) != ERR_NOERR) {
+		interrupt_send(vcpu->vm, vcpu->id, INTR_INS);
+		return 1;
+	}
+
+	return atomic_load_explicit(&vcpu->cpu.events, memory_order_relaxed) != 0;
+}
+
+uint32_t fetch_add_word(vx4_cpu *vcpu, mem_addr addr, uint32_t *val)
+{
+	if (mmu_fetch_add_word(vcpu, addr, *val, val) != ERR_NOERR) {
+		interrupt_send(vcpu->vm, vcpu->id, INTR_INS);
+		return 1;
+	}
+
+	return atomic_load_explicit(&vcpu->cpu.events, memory_order_relaxed) != 0;
+}
+
+uint32_t cas_word(vx4_cpu *vcpu, mem_addr addr, uint32_t *expected, uint32_t val)
+{
+	uint32_t wanted = *expected;
+
+	if (mmu_cas_word(vcpu, addr, expected, val) != ERR_NOERR) {
+		interrupt_send(vcpu->vm, vcpu->id, INTR_INS);
+		return 1;
+	}
+
+	vcpu->compared[0] = *expected;
+	vcpu->compared[1] = wanted;
+
+	return atomic_load_explicit(&vcpu->cpu.events, memory_order_relaxed) != 0;
+}
+
+uint32_t call_push(vx4_cpu *vcpu, mem_addr ret)
+{
+	jit_context *jit = vcpu->jit;
+
+	if (stack_push(vcpu, ret) != ERR_NOERR) {
+		interrupt_send(vcpu->vm, vcpu->id, INTR_INS);
+		return 1;
+	}
+
+	// The block being returned to may not have been translated yet, in
+	// which case the ret leaves, and jit_run finds or translates it
+	const jit_block *blk = jit->lookup[JIT_INDEX(ret)];
+	jit_return *entry = &jit->returns[jit->return_top];
+
+	entry->addr = ret;
+	entry->code = (blk != NULL && blk->addr == ret) ? blk->code : NULL;
+	jit->return_top = (jit->return_top + 1) % JIT_RETURN_DEPTH;
+
+	// The call's block ends in a chain, which checks for events itself
+	return 0;
+}
+
+jit_resume return_pop(vx4_cpu *vcpu, mem_addr next)
+{
+	jit_context *jit = vcpu->jit;
+	uint32_t addr;
+
+	if (stack_pop(vcpu, &addr) != ERR_NOERR) {
+		interrupt_send(vcpu->vm, vcpu->id, INTR_INS);
+		return (jit_resume){next, NULL};
+	}
+
+	jit->return_top = (jit->return_top + JIT_RETURN_DEPTH - 1) % JIT_RETURN_DEPTH;
+	const jit_return *entry = &jit->returns[jit->return_top];
+
+	if (entry->addr != addr) {
+		return (jit_resume){addr, NULL};
+	}
+
+	return (jit_resume){addr, entry->code};
+}
+
+uint32_t enter_frame(vx4_cpu *vcpu)
+{
+	if (stack_enter_frame(vcpu) != ERR_NOERR) {
+		interrupt_send(vcpu->vm, vcpu->id, INTR_INS);
+		return 1;
+	}
+
+	return atomic_load_explicit(&vcpu->cpu.events, memory_order_relaxed) != 0;
+}
+
+uint32_t leave_frame(vx4_cpu *vcpu)
+{
+	if (stack_leave_frame(vcpu) != ERR_NOERR) {
+		interrupt_send(vcpu->vm, vcpu->id, INTR_INS);
+		return 1;
+	}
+
+	return 0;
+}
+
+uint32_t push_word(vx4_cpu *vcpu, uint32_t val)
+{
+	if (stack_push(vcpu, val) != ERR_NOERR) {
+		interrupt_send(vcpu->vm, vcpu->id, INTR_INS);
+		return 1;
+	}
+
+	return atomic_load_explicit(&vcpu->cpu.events, memory_order_relaxed) != 0;
+}
+
+uint32_t pop_word(vx4_cpu *vcpu, uint32_t *dest)
+{
+	if (stack_pop(vcpu, dest) != ERR_NOERR) {
+		interrupt_send(vcpu->vm, vcpu->id, INTR_INS);
+		return 1;
+	}
+
+	return 0;
+}
+
+uint32_t load_vector(vx4_cpu *vcpu, mem_addr addr, vreg *dest)
+{
+	if (mem_cached_read_vector(vcpu->vm, &vcpu->memcache, addr, dest) != ERR_NOERR) {
+		interrupt_send(vcpu->vm, vcpu->id, INTR_INS);
+		return 1;
+	}
+
+	return 0;
+}
+
+uint32_t store_vector(vx4_cpu *vcpu, mem_addr addr, const vreg *src)
+{
+	if (mem_cached_write_vector(vcpu->vm, &vcpu->memcache, addr, src) != ERR_NOERR) {
+		interrupt_send(vcpu->vm, vcpu->id, INTR_INS);
+		return 1;
+	}
+
+	return atomic_load_explicit(&vcpu->cpu.events, memory_order_relaxed) != 0;
+}
+
+uint8_t host_condition(instruction_id id)
+{
+	switch (id) {
+		case INS_JEQ: return 0x74; // je
+		case INS_JNE: return 0x75; // jne
+		case INS_JLT: return 0x7C; // jl
+		case INS_JLE: return 0x7E; // jle
+		case INS_JGT: return 0x7F; // jg
+		case INS_JGE: return 0x7D; // jge
+		case INS_JLTU: return 0x72; // jb
+		case INS_JLEU: return 0x76; // jbe
+		case INS_JGTU: return 0x77; // ja
+		default: return 0x73; // jae, for INS_JGEU
+	}
+}
+
+uint8_t sse_prefix(instruction_id id)
+{
+	switch (id) {
+		case INS_FADD32:
+		case INS_FSUB32:
+		case INS_FMUL32:
+		case INS_FDIV32:
+		case INS_FSQRT32:
+		case INS_FCMP32:
+		case INS_FITOF32:
+			return 0xF3;
+
+		default:
+			return 0xF2;
+	}
+}
+
+void emit_byte(jit_context *jit, uint8_t val)
+{
+	*jit->out++ = val;
+}
+
+void emit_word(jit_context *jit, uint32_t val)
+{
+	memcpy(jit->out, &val, 4);
+	jit->out += 4;
+}
+
+void emit_quad(jit_context *jit, uint64_t val)
+{
+	memcpy(jit->out, &val, 8);
+	jit->out += 8;
+}
+
+void emit_rel(jit_context *jit, const uint8_t *target)
+{
+	// Relative to the end of the 4 byte displacement
+	emit_word(jit, (uint32_t)(target - (jit->out + 4)));
+}
+
+void emit_call(jit_context *jit, const void *func)
+{
+	emit_byte(jit, 0x48); emit_byte(jit, 0xB8); emit_quad(jit, (uint64_t)func); // mov rax, imm64
+	emit_byte(jit, 0xFF); emit_byte(jit, 0xD0); // call rax
+}
+
+uint8_t *emit_prologue(jit_context *jit, mem_addr ip)
+{
+	uint8_t *bail = jit->out;
+	emit_byte(jit, 0xB8); emit_word(jit, ip); // mov eax, ip
+	emit_byte(jit, 0x31); emit_byte(jit, 0xD2); // xor edx, edx
+	emit_byte(jit, 0xE9); emit_rel(jit, jit->exit_code); // jmp exit_code
+
+	uint8_t *entry = jit->out;
+	emit_byte(jit, 0x49); emit_byte(jit, 0x83); emit_byte(jit, 0x7D); emit_byte(jit, 0x00); emit_byte(jit, 0); // cmp qword [r13], count
+	emit_byte(jit, 0x7C); emit_byte(jit, (uint8_t)(bail - (jit->out + 1))); // jl bail
+
+	return entry;
+}
+
+void emit_chain(jit_context *jit, mem_addr target, unsigned count)
+{
+	emit_byte(jit, 0x49); emit_byte(jit, 0x83); emit_byte(jit, 0x6D); emit_byte(jit, 0x00); emit_byte(jit, count); // sub qword [r13], count
+	emit_byte(jit, 0x41); emit_byte(jit, 0x83); emit_byte(jit, 0x3C); emit_byte(jit, 0x24); emit_byte(jit, 0x00); // cmp dword [r12], 0
+	emit_byte(jit, 0x75); emit_byte(jit, 0x05); // jne past the link
+
+	// Until it's linked, this jump goes nowhere
+	uint8_t *link = jit->out;
+	emit_byte(jit, 0xE9); emit_word(jit, 0); // jmp rel32
+
+	emit_byte(jit, 0xB8); emit_word(jit, target); // mov eax, target
+	emit_byte(jit, 0x48); emit_byte(jit, 0x8D); emit_byte(jit, 0x15); emit_rel(jit, link); // lea rdx, [rip + link]
+	emit_byte(jit, 0xE9); emit_rel(jit, jit->exit_code); // jmp exit_code
+}
+
+void emit_exit_on_fail(jit_context *jit, mem_addr next, unsigned count)
+{
+	emit_byte(jit, 0x85); emit_byte(jit, 0xC0); // test eax, eax
+	emit_byte(jit, 0x74); emit_byte(jit, 0x11); // jz past the exit
+	emit_byte(jit, 0x49); emit_byte(jit, 0x83); emit_byte(jit, 0x6D); emit_byte(jit, 0x00); emit_byte(jit, count); // sub qword [r13], count
+	emit_byte(jit, 0xB8); emit_word(jit, next); // mov eax, next
+	emit_byte(jit, 0x31); emit_byte(jit, 0xD2); // xor edx, edx
+	emit_byte(jit, 0xE9); emit_rel(jit, jit->exit_code); // jmp exit_code
+}
+
+void patch_link(uint8_t *link, const uint8_t *target)
+{
+	uint32_t rel = (uint32_t)(target - (link + 5));
+	memcpy(link + 1, &rel, 4);
+}
+
+#else
+
+error_t jit_begin(vx4_cpu *vcpu)
+{
+	(void)vcpu;
+	return ERR_INVAL;
+}
+
+void jit_end(vx4_cpu *vcpu)
+{
+	(void)vcpu;
+}
+
+mem_addr jit_run(vx4_cpu *vcpu, mem_addr ip, int64_t *budget)
+{
+	(void)vcpu;
+	(void)budget;
+	return ip;
+}
+
+void jit_invalidate(vx4_cpu *vcpu, mem_addr base, mem_size num)
+{
+	(void)vcpu;
+	(void)base;
+	(void)num;
+}
+
+void jit_flush(vx4_cpu *vcpu)
+{
+	(void)vcpu;
+}
+
+#endif // JIT_SUPPORTED
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "error.h"
+#include "mem.h"
+#include "vx4.h"
+
+#include <stdint.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Constants + helper macros
+////////////////////////////////////////////////////////////////////////////////
+
+// The JIT emits x86-64 machine code into memory obtained from mmap(2)
+#if defined(__x86_64__) && defined(__unix__) && !defined(CPU_NO_JIT)
+#define JIT_SUPPORTED
+#endif // __x86_64__
+
+#define JIT_CODE_SIZE (16u * 1024 * 1024) // Host code buffer, flushed when full
+#define JIT_MAX_BLOCKS 16384 // Blocks translated before the cache is flushed
+#define JIT_BLOCK_INS 64 // The most instructions translated into one block
+#define JIT_RETURN_DEPTH 32 // Calls remembered by the shadow return stack
+
+////////////////////////////////////////////////////////////////////////////////
+// Machine state
+////////////////////////////////////////////////////////////////////////////////
+
+// A CPU's translation cache, private to jit.c
+typedef struct _jit_context jit_context;
+
+////////////////////////////////////////////////////////////////////////////////
+// Function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Allocates a CPU's translation cache. The CPU's events word is checked
+ * before a translated block jumps straight into another one, execution
+ * returns to the caller of jit_run while it is nonzero. Each CPU has its
+ * own cache, which only it may touch.
+ *
+ * Returns:
+ * ERR_NOERR: The JIT is ready for use.
+ * ERR_NOMEM: Executable memory couldn't be allocated.
+ * ERR_INVAL: The JIT isn't supported by this build.
+ */
+extern error_t jit_begin(vx4_cpu *vcpu);
+
+/**
+ * Frees the translation cache.
+ */
+extern void jit_end(vx4_cpu *vcpu);
+
+/**
+ * Runs translated code, starting at a given address. Basic blocks are
+ * translated once hot, and chained directly to their successors.
+ * Returns when events becomes nonzero, at an instruction that the JIT
+ * doesn't translate (port accesses, cli, sti, hlt and invalid instructions),
+ * or at a block longer than the remaining budget. The caller must
+ * interpret the next instruction itself.
+ *
+ * IN ip: The address of the first instruction to run.
+ * IN budget: The most instructions to run.
+ * OUT budget: Reduced by the number of instructions run.
+ *
+ * Returns: The address of the next instruction to run.
+ */
+extern mem_addr jit_run(vx4_cpu *vcpu, mem_addr ip, int64_t *budget);
+
+/**
+ * Discards translations of any code overlapping a range of memory.
+ *
+ * IN base: The address of the start of the range.
+ * IN num: The length of the range in bytes.
+ */
+extern void jit_invalidate(vx4_cpu *vcpu, mem_addr base, mem_size num);
+
+/**
+ * Discards every translation.
+ */
+extern void jit_flush(vx4_cpu *vcpu);
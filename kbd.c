@@ -2,6 +2,8 @@
 
 #include "port.h"
 #include "intr.h"
+#include "machine.h"
+#include "sync.h"
 
 #include <stdlib.h>
 #include <stdint.h>
@@ -9,12 +11,6 @@
 
 #include <SDL2/SDL_mutex.h>
 
-////////////////////////////////////////////////////////////////////////////////
-// Internal constants + helper macros
-////////////////////////////////////////////////////////////////////////////////
-
-#define KBD_BUFFER_SIZE 2048 // Chosen arbitrarily
-
 ////////////////////////////////////////////////////////////////////////////////
 // Module internal declarations
 ////////////////////////////////////////////////////////////////////////////////
@@ -24,19 +20,12 @@
  *
  * Returns: The code read, or 0 on error (including empty buffer).
  */
-static uint32_t keyboard_read_queue(port_id num);
+static uint32_t keyboard_read_queue(vx4_machine *vm, port_id num);
 
 /**
  * Sets the do_interrupt value.
  */
-static void keyboard_set_interrupt(port_id num, uint32_t data);
-
-// Should every key input cause a hardware interrupt?
-static bool do_interrupt;
-
-static kbd_scancode scancode_buffer[KBD_BUFFER_SIZE];
-static size_t buffer_start;
-static size_t buffer_end;
+static void keyboard_set_interrupt(vx4_machine *vm, port_id num, uint32_t data);
 
 static port_entry kbd_port = {
 	"Window keyboard v2",
@@ -44,82 +33,77 @@ static port_entry kbd_port = {
 	keyboard_read_queue // Port reads come from the buffer.
 };
 
-// We need a place to store the port number we are assigned
-static port_id assigned_port;
-
-static SDL_mutex *kbd_mutex;
-
 ////////////////////////////////////////////////////////////////////////////////
 // Interface functions
 ////////////////////////////////////////////////////////////////////////////////
 
-error_t install_keyboard_handler()
+error_t install_keyboard_handler(vx4_machine *vm)
 {
-	kbd_mutex = SDL_CreateMutex();
-	if (!kbd_mutex) {
+	vm->kbd.mutex = SDL_CreateMutex();
+	if (!vm->kbd.mutex) {
 		return ERR_EXTERN;
 	}
 
-	return port_install(&kbd_port, &assigned_port);
+	return port_install(vm, &kbd_port, &vm->kbd.assigned_port);
 }
 
-void keyboard_queue_press(kbd_scancode code)
+void keyboard_queue_press(vx4_machine *vm, kbd_scancode code)
 {
-	if (SDL_LockMutex(kbd_mutex) != 0) {
+	if (SYNC_LOCK(vm->kbd.mutex) != 0) {
 		return;
 	}
 
-	scancode_buffer[buffer_end] = code;
+	vm->kbd.buffer[vm->kbd.buffer_end] = code;
 
-	buffer_end = (buffer_end + 1) % KBD_BUFFER_SIZE;
-	if (buffer_end == buffer_start) {
-        buffer_start = (buffer_start + 1) % KBD_BUFFER_SIZE;
+	vm->kbd.buffer_end = (vm->kbd.buffer_end + 1) % KBD_BUFFER_SIZE;
+	if (vm->kbd.buffer_end == vm->kbd.buffer_start) {
+        vm->kbd.buffer_start = (vm->kbd.buffer_start + 1) % KBD_BUFFER_SIZE;
 	}
 
-	if (do_interrupt) {
-        interrupt_raise(INTR_KBD);
+	if (vm->kbd.do_interrupt) {
+        interrupt_raise(vm, INTR_KBD);
 	}
 
-	SDL_UnlockMutex(kbd_mutex);
+	SYNC_UNLOCK(vm->kbd.mutex);
 }
 
-error_t remove_keyboard_handler()
+error_t remove_keyboard_handler(vx4_machine *vm)
 {
-    SDL_DestroyMutex(kbd_mutex);
-    kbd_mutex = NULL;
+    SDL_DestroyMutex(vm->kbd.mutex);
+    vm->kbd.mutex = NULL;
 
-	return port_remove(assigned_port);
+	return port_remove(vm, vm->kbd.assigned_port);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // Module internal functions
 ////////////////////////////////////////////////////////////////////////////////
 
-void keyboard_set_interrupt(port_id num, uint32_t data)
+void keyboard_set_interrupt(vx4_machine *vm, port_id num, uint32_t data)
 {
     (void)num;
 
-    do_interrupt = (data) ? true : false;
+    vm->kbd.do_interrupt = (data) ? true : false;
 }
 
-uint32_t keyboard_read_queue(port_id num)
+uint32_t keyboard_read_queue(vx4_machine *vm, port_id num)
 {
 	(void)num;
 
-	if (SDL_LockMutex(kbd_mutex) != 0) {
+	if (SYNC_LOCK(vm->kbd.mutex) != 0) {
 		return 0;
 	}
 
 	uint32_t ret;
 
-	if (buffer_start == buffer_end) {
+	if (vm->kbd.buffer_start == vm->kbd.buffer_end) {
 		ret = 0;
 	}
 	else {
-		ret = scancode_buffer[buffer_start];
-		buffer_start = (buffer_start + 1) % KBD_BUFFER_SIZE;
+		ret = vm->kbd.buffer[vm->kbd.buffer_start];
+		vm->kbd.buffer_start = (vm->kbd.buffer_start + 1) % KBD_BUFFER_SIZE;
 	}
 
-	SDL_UnlockMutex(kbd_mutex);
+	SYNC_UNLOCK(vm->kbd.mutex);
 	return ret;
 }
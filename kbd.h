@@ -1,8 +1,14 @@
 #pragma once
 
 #include "error.h"
+#include "port.h"
+#include "vx4.h"
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <SDL2/SDL_mutex.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 // Type declarations
@@ -10,6 +16,31 @@
 
 typedef uint32_t kbd_scancode;
 
+////////////////////////////////////////////////////////////////////////////////
+// Constants + helper macros
+////////////////////////////////////////////////////////////////////////////////
+
+#define KBD_BUFFER_SIZE 2048 // Chosen arbitrarily
+
+////////////////////////////////////////////////////////////////////////////////
+// Machine state
+////////////////////////////////////////////////////////////////////////////////
+
+// Should not be touched except by functions in kbd.c
+typedef struct _kbd_context {
+	// Should every key input cause a hardware interrupt?
+	bool do_interrupt;
+
+	kbd_scancode buffer[KBD_BUFFER_SIZE];
+	size_t buffer_start;
+	size_t buffer_end;
+
+	// We need a place to store the port number we are assigned
+	port_id assigned_port;
+
+	SDL_mutex *mutex;
+} kbd_context;
+
 ////////////////////////////////////////////////////////////////////////////////
 // Function declarations
 ////////////////////////////////////////////////////////////////////////////////
@@ -20,18 +51,18 @@ typedef uint32_t kbd_scancode;
  * Returns: Any errors occurring during a call to port_insert, or
  * ERR_EXTERN: There was an error creating the keyboard mutex.
  */
-extern error_t install_keyboard_handler();
+extern error_t install_keyboard_handler(vx4_machine *vm);
 
 /**
  * Adds a scancode to the end of the keyboard buffer.
  *
  * IN code: The scancode to add.
  */
-extern void keyboard_queue_press(kbd_scancode code);
+extern void keyboard_queue_press(vx4_machine *vm, kbd_scancode code);
 
 /**
  * Unregisters the keyboard handler from its assigned port.
  *
  * Returns: Any errors occurring during a call to port_remove.
  */
-extern error_t remove_keyboard_handler();
+extern error_t remove_keyboard_handler(vx4_machine *vm);
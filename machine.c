@@ -0,0 +1,43 @@
+#include "machine.h"
+
+#include "error.h"
+#include "mem.h"
+#include "cpu.h"
+#include "port.h"
+
+#include <stdlib.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Interface functions
+////////////////////////////////////////////////////////////////////////////////
+
+error_t machine_create(vx4_machine **vm)
+{
+	// Zeroed memory is the initial state of almost every module
+	*vm = calloc(1, sizeof (vx4_machine));
+	if (*vm == NULL) {
+		return ERR_NOMEM;
+	}
+
+	cpu_init(*vm);
+
+	error_t err = port_begin(*vm);
+	if (err != ERR_NOERR) {
+		free(*vm);
+		*vm = NULL;
+		return err;
+	}
+
+	return ERR_NOERR;
+}
+
+void machine_destroy(vx4_machine *vm)
+{
+	if (vm == NULL) {
+		return;
+	}
+
+	mem_end(vm);
+	port_end(vm);
+	free(vm);
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "error.h"
+#include "vx4.h"
+#include "mem.h"
+#include "register.h"
+#include "vector.h"
+#include "fpu.h"
+#include "stack.h"
+#include "port.h"
+#include "intr.h"
+#include "cpu.h"
+#include "disk.h"
+#include "kbd.h"
+#include "graphics.h"
+#include "sysp.h"
+#include "textio.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Every module keeps its state for a machine here. Modules only touch
+ * their own member, except where their header says otherwise.
+ */
+struct _vx4_machine {
+	mem_context mem;
+	port_context ports;
+	intr_context intr;
+	cpus_context cpus;
+	disk_context disks;
+	kbd_context kbd;
+	graphics_context gfx;
+	sysp_context sysp;
+	textio_context textio;
+
+	void *user; // Free for use by whatever is hosting the machine
+};
+
+/**
+ * The state an interrupt saves and iret restores. The outermost interrupt
+ * keeps it in the CPU's bank rather than on the stack, see
+ * cpu_interrupt_return.
+ */
+typedef struct _cpu_bank {
+	reg_file registers;
+	uint32_t compared[2];
+	vreg_file vregisters;
+	freg_file fregisters;
+	stack_context stack;
+	mem_addr ip;
+	cpu_flags flags;
+} cpu_bank;
+
+/**
+ * One of a machine's virtual CPUs, allocated while the CPUs run. Each CPU
+ * only touches its own, apart from signalling the others' events.
+ */
+struct _vx4_cpu {
+	vx4_machine *vm; // The machine the CPU belongs to
+	unsigned id; // Also the CPU's place in vm->cpus.list
+
+	reg_file registers;
+	uint32_t compared[2]; // The operands of the last cmprr or cmprc
+	vreg_file vregisters;
+	freg_file fregisters;
+	stack_context stack;
+	cpu_context cpu;
+	mem_cache memcache; // The last blocks the CPU loaded from and stored to
+
+	// Interrupts entered and not yet returned from, only the first of which
+	// is saved to the bank, the rest being spilled to the stack
+	unsigned intr_depth;
+	cpu_bank bank;
+
+	// Allocated while the CPU runs, see mmu_begin, icache_begin, jit_begin and aot_begin
+	struct _mmu_context *mmu;
+	struct _icache_context *icache;
+	struct _jit_context *jit;
+	struct _aot_context *aot;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Creates a machine, with every module in its initial state. Memory is
+ * empty and no devices are installed.
+ *
+ * OUT vm: The new machine.
+ *
+ * Returns:
+ * ERR_NOERR: The machine was created.
+ * ERR_NOMEM: The machine couldn't be allocated.
+ * ERR_EXTERN: The machine's port lock couldn't be created.
+ */
+extern error_t machine_create(vx4_machine **vm);
+
+/**
+ * Frees a machine and all of its memory. Every device must already be
+ * removed, and the CPUs stopped.
+ *
+ * IN vm: The machine to destroy.
+ */
+extern void machine_destroy(vx4_machine *vm);
@@ -1,5 +1,6 @@
 #include "error.h"
 
+#include "machine.h"
 #include "textio.h"
 #include "sysp.h"
 #include "fwload.h"
@@ -17,78 +18,261 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <string.h>
+
+// Instructions run between polling for input and rendering, when single threaded
+#define MAIN_SLICE_INS 1000000
 
 static size_t n_disks;
 static disk_id *loaded_disks;
 
-static void load_disks(int argc, char *argv[]);
-static void unload_disks();
+static FILE *trace_file;
+static bool show_wake_stats;
+static bool show_spin_stats;
+static bool show_retired;
+
+#ifdef VX4_AOT
+// Emitted by vx4-aot from the fw.bin this was built with, see aot_image
+extern const aot_image aot_firmware;
+#endif // VX4_AOT
+
+/**
+ * Applies any options given at the start of the command line.
+ *
+ * Returns: The number of arguments consumed as options.
+ */
+static int parse_options(vx4_machine *vm, int argc, char *argv[]);
+
+static void load_disks(vx4_machine *vm, int argc, char *argv[]);
+static void unload_disks(vx4_machine *vm);
+
+/**
+ * Prints how quickly each CPU resumed after wfi, once they have stopped.
+ */
+static void print_wake_stats(vx4_machine *vm);
+
+/**
+ * Prints how often each CPU was found spinning on a port, once they have
+ * stopped.
+ */
+static void print_spin_stats(vx4_machine *vm);
+
+/**
+ * Prints how many instructions each CPU ran, once they have stopped.
+ */
+static void print_retired(vx4_machine *vm);
 
 int main(int argc, char *argv[])
 {
+	vx4_machine *vm;
+	DIE_ON(machine_create(&vm));
+
+	int n_opts = parse_options(vm, argc - 1, &argv[1]);
+
 	// Load core firmware images
 	// These are all considered critical, so we fail if any one fails
-	DIE_ON(firmware_load(0x0, "fw.bin"));
+	DIE_ON(firmware_load(vm, 0x0, "fw.bin"));
 
 	// Install core I/O ports
-	DIE_ON(install_system_handler());
-	DIE_ON(install_textio_handler());
+	DIE_ON(install_system_handler(vm));
+	DIE_ON(install_textio_handler(vm));
 
-	// Each argument passed on the command line becomes a loaded disk
-	load_disks(argc - 1, &argv[1]);
+	// Each remaining argument on the command line becomes a loaded disk
+	load_disks(vm, argc - 1 - n_opts, &argv[1 + n_opts]);
 
 	// Interrupts require initializing because of mutexes
-	DIE_ON(begin_interrupts());
+	DIE_ON(begin_interrupts(vm));
 
 	// At the moment, use a fixed-size render window
-	DIE_ON(graphics_begin(640, 480));
+	DIE_ON(graphics_begin(vm, 640, 480));
 
-	DIE_ON(install_keyboard_handler());
+	DIE_ON(install_keyboard_handler(vm));
 
-	// Finally, begin the CPU simulation thread
-    DIE_ON(cpu_begin());
+	#ifdef VX4_SINGLE_THREAD
+	// The CPUs, input and rendering take turns on this thread in a fixed
+	// order, so the same firmware and input always run the same way
+	DIE_ON(cpu_begin_sync(vm));
 
-	// Main loop
-	while (!cpu_halting()) {
-		graphics_step();
-		graphics_render();
+	while (cpu_run(vm, MAIN_SLICE_INS, CPU_RUN_FOREVER) != CPU_STOPPED_HALT) {
+		graphics_step(vm);
+		graphics_render(vm);
 	}
 
-	// The CPU has told us it will be stopping
-	// So wait for it to do so completely
-	cpu_wait_end();
+	cpu_end_sync(vm);
+	#else
+	if (graphics_headless(vm) && cpu_get_count(vm) == 1) {
+		// With no window to keep up to date, the CPU can run on this thread
+		DIE_ON(cpu_begin_sync(vm));
+
+		while (cpu_run(vm, CPU_RUN_FOREVER, CPU_RUN_FOREVER) != CPU_STOPPED_HALT);
+
+		cpu_end_sync(vm);
+	}
+	else if (graphics_headless(vm)) {
+		// Several CPUs still each get their own thread, which this one
+		// just waits on
+		DIE_ON(cpu_begin(vm));
+		cpu_wait_end(vm);
+	}
+	else {
+		// Finally, begin the CPU simulation thread
+		DIE_ON(cpu_begin(vm));
+
+		// Main loop
+		while (!cpu_halting(vm)) {
+			graphics_step(vm);
+			graphics_render(vm);
+		}
+
+		// The CPU has told us it will be stopping
+		// So wait for it to do so completely
+		cpu_wait_end(vm);
+	}
+	#endif // VX4_SINGLE_THREAD
+
+	if (show_wake_stats) {
+		print_wake_stats(vm);
+	}
+
+	if (show_spin_stats) {
+		print_spin_stats(vm);
+	}
+
+	if (show_retired) {
+		print_retired(vm);
+	}
 
 	// Clean up now, in reverse order
-	remove_keyboard_handler();
+	remove_keyboard_handler(vm);
 
-	graphics_end();
+	graphics_end(vm);
 
-	end_interrupts();
+	end_interrupts(vm);
 
-	unload_disks();
+	unload_disks(vm);
 
-	remove_textio_handler();
-	remove_system_handler();
+	remove_textio_handler(vm);
+	remove_system_handler(vm);
+
+	machine_destroy(vm);
+
+	if (trace_file != NULL) {
+		fclose(trace_file);
+	}
 
 	return EXIT_SUCCESS;
 }
 
-void load_disks(int argc, char *argv[])
+int parse_options(vx4_machine *vm, int argc, char *argv[])
+{
+	int i;
+
+	for (i = 0; i < argc && argv[i][0] == '-'; ++i) {
+		if (strcmp(argv[i], "-reference") == 0) {
+			// Use the simple (but slow) table-driven interpreter
+			DIE_ON(cpu_set_core(vm, CPU_CORE_REFERENCE));
+		}
+		else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc) {
+			// Only the reference core can record each instruction it runs
+			trace_file = fopen(argv[++i], "w");
+
+			if (trace_file == NULL) {
+				error_exit(ERR_EXTERN, __FILE__, __LINE__, "Couldn't open trace file");
+			}
+
+			DIE_ON(cpu_set_core(vm, CPU_CORE_REFERENCE));
+			cpu_set_trace(vm, trace_file);
+		}
+		else if (strcmp(argv[i], "-headless") == 0) {
+			// Never open a window, for firmware that only uses text and disks
+			graphics_set_headless(vm, true);
+		}
+		else if (strcmp(argv[i], "-jit") == 0) {
+			// Translate hot code to x86-64, falling back to interpretation
+			DIE_ON(cpu_set_core(vm, CPU_CORE_JIT));
+		}
+		#ifdef VX4_AOT
+		else if (strcmp(argv[i], "-aot") == 0) {
+			// Run the firmware translated by vx4-aot when this was built
+			cpu_set_aot(vm, &aot_firmware);
+		}
+		#endif // VX4_AOT
+		else if (strcmp(argv[i], "-wakestats") == 0) {
+			// Report the latency of waking each CPU from wfi on exit
+			show_wake_stats = true;
+		}
+		else if (strcmp(argv[i], "-spinstats") == 0) {
+			// Report how often polling loops were caught and slept through on exit
+			show_spin_stats = true;
+		}
+		else if (strcmp(argv[i], "-mhz") == 0 && i + 1 < argc) {
+			// Hold each CPU to a speed, so that many guests can share the host
+			cpu_set_speed(vm, (unsigned)strtoul(argv[++i], NULL, 0));
+		}
+		else if (strcmp(argv[i], "-inscount") == 0) {
+			// Report the instructions each CPU ran on exit
+			show_retired = true;
+		}
+		else if (strcmp(argv[i], "-smp") == 0 && i + 1 < argc) {
+			// Run several CPUs, each on its own host thread
+			DIE_ON(cpu_set_count(vm, (unsigned)strtoul(argv[++i], NULL, 0)));
+		}
+		else {
+			error_exit(ERR_INVAL, __FILE__, __LINE__, "Unrecognised option");
+		}
+	}
+
+	return i;
+}
+
+void load_disks(vx4_machine *vm, int argc, char *argv[])
 {
 	n_disks = argc;
 	loaded_disks = calloc(n_disks, sizeof (disk_id));
 
 	for (size_t i = 0; i < n_disks; ++i) {
-        DIE_ON(disk_install(argv[i], &loaded_disks[i]));
+        DIE_ON(disk_install(vm, argv[i], &loaded_disks[i]));
 	}
 }
 
-void unload_disks()
+void unload_disks(vx4_machine *vm)
 {
 	for (size_t i = 0; i < n_disks; ++i) {
-        disk_remove(loaded_disks[i]);
+        disk_remove(vm, loaded_disks[i]);
 	}
 
 	free(loaded_disks);
 	loaded_disks = NULL;
 }
+
+void print_wake_stats(vx4_machine *vm)
+{
+	cpu_wake_stats stats;
+
+	for (unsigned i = 0; cpu_get_wake_stats(vm, i, &stats) == ERR_NOERR; ++i) {
+		uint64_t mean = stats.wakes ? stats.total_ns / stats.wakes : 0;
+
+		fprintf(stderr, "cpu %u: %llu wakes, mean %llu ns, max %llu ns\n", i,
+			(unsigned long long)stats.wakes, (unsigned long long)mean, (unsigned long long)stats.max_ns);
+	}
+}
+
+void print_spin_stats(vx4_machine *vm)
+{
+	cpu_spin_stats stats;
+
+	for (unsigned i = 0; cpu_get_spin_stats(vm, i, &stats) == ERR_NOERR; ++i) {
+		fprintf(stderr, "cpu %u: %llu polls, %llu spins detected, %llu backoffs sleeping %llu us\n", i,
+			(unsigned long long)stats.polls, (unsigned long long)stats.detections,
+			(unsigned long long)stats.backoffs, (unsigned long long)(stats.slept_ns / 1000));
+	}
+}
+
+void print_retired(vx4_machine *vm)
+{
+	uint64_t count;
+
+	for (unsigned i = 0; cpu_get_retired(vm, i, &count) == ERR_NOERR; ++i) {
+		fprintf(stderr, "cpu %u: %llu instructions\n", i, (unsigned long long)count);
+	}
+}
@@ -1,12 +1,14 @@
 #include "mem.h"
 
 #include "error.h"
+#include "machine.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 // Internal constants + helper macros
@@ -15,40 +17,37 @@
 #define IS_BLOCK_ALIGNED(addr) (MEM_BLOCK_MASK(addr) == 0)
 #define IS_DBYTE_ALIGNED(addr) (((addr) & 0x1) == 0)
 #define IS_WORD_ALIGNED(addr) (((addr) & 0x3) == 0)
+#define IS_DWORD_ALIGNED(addr) (((addr) & 0x7) == 0)
+#define IS_VECTOR_ALIGNED(addr) (((addr) & 0xF) == 0)
 
-////////////////////////////////////////////////////////////////////////////////
-// Module internal declarations
-////////////////////////////////////////////////////////////////////////////////
+#define VECTOR_SIZE 16
 
-/**
- * Each entry defaults to being unmapped, and is mapped only
- * when required.
- */
-typedef struct _mem_blk_entry {
-	enum _mem_type {
-		MAP_NONE,
-		MAP_SYSTEM,
-		MAP_DEVICE,
-	} type;
+// The aligned word at an offset in a block, as an atomic. Every host the
+// emulator runs on gives _Atomic uint32_t the size and alignment of a
+// plain one, so the block's memory can be used as is
+#define ATOMIC_WORD(blk, off) ((_Atomic uint32_t *)&(blk)->base[off])
 
-	mem_block *base; // Pointer to the beginning of a MEM_BLK_SIZE array
-} mem_blk_entry;
+#define LINES_IN_ELEM (8 * sizeof (unsigned)) // Bits in each element of watch_lines
+#define LINE_IN_BLOCK(off) ((off) >> MEM_LINE_SHIFT)
 
-// Every entry is prefilled to MAP_NONE (unloaded).
-static mem_blk_entry memory[MEM_NUM_BLKS];
+////////////////////////////////////////////////////////////////////////////////
+// Module internal declarations
+////////////////////////////////////////////////////////////////////////////////
 
 /**
  * Sets an empty block to be part of main system memory, and allocates
  * memory to store the block. The block type after successful completion
  * of this function is MAP_SYSTEM.
  *
+ * Safe to call from any CPU, only one of them will create the block.
+ *
  * IN block: The block to operate on.
  *
  * Returns:
  * ERR_NOERR: The block was successfully created.
  * ERR_PCOND: The block wasn't empty (MAP_NONE).
  */
-static error_t create_system_block(mem_blk_entry *block);
+static error_t create_system_block(vx4_machine *vm, mem_blk_entry *block);
 
 /**
  * Deletes a block of memory previously allocated as system memory,
@@ -91,101 +90,281 @@ static error_t install_device_block(mem_blk_entry *block, mem_block *mem);
  */
 static error_t remove_device_block(mem_blk_entry *block);
 
+/**
+ * Returns whether writes to a line of a block are to be reported.
+ *
+ * IN block: The block containing the line.
+ * IN off: The offset of any byte in the line, within the block.
+ */
+static bool line_watched(const mem_blk_entry *block, mem_addr off);
+
+/**
+ * Returns how many of the bytes from an address onwards lie in its block.
+ *
+ * IN base: The address of the first byte.
+ * IN num: The number of bytes wanted.
+ */
+static mem_size block_span(mem_addr base, mem_size num);
+
+/**
+ * Returns how many of the bytes up to (not including) an address lie in
+ * the block of the byte before it.
+ *
+ * IN end: The address after the last byte.
+ * IN num: The number of bytes wanted.
+ */
+static mem_size block_span_back(mem_addr end, mem_size num);
+
+/**
+ * Reports a write to a span within one block, if any of its lines are
+ * watched.
+ *
+ * IN base: The address of the first byte written.
+ * IN num: The number of bytes written.
+ */
+static void report_write(vx4_machine *vm, mem_blk_entry *block, mem_addr base, mem_size num);
+
 ////////////////////////////////////////////////////////////////////////////////
 // Interface functions
 ////////////////////////////////////////////////////////////////////////////////
 
-void mem_read_byte(mem_addr base, uint8_t *dest)
+void mem_read_byte(vx4_machine *vm, mem_addr base, uint8_t *dest)
 {
-	mem_blk_entry *blk = &memory[MEM_BLOCK_IN(base)];
+	mem_blk_entry *blk = &vm->mem.memory[MEM_BLOCK_IN(base)];
 	mem_addr off = MEM_BLOCK_MASK(base);
 
-	create_system_block(blk);
+	create_system_block(vm, blk);
 
 	*dest = blk->base[off];
 }
 
-error_t mem_read_dbyte(mem_addr base, uint16_t *dest)
+error_t mem_read_dbyte(vx4_machine *vm, mem_addr base, uint16_t *dest)
 {
 	if (!IS_DBYTE_ALIGNED(base)) {
 		return ERR_INVAL;
 	}
 
-	mem_blk_entry *blk = &memory[MEM_BLOCK_IN(base)];
+	mem_blk_entry *blk = &vm->mem.memory[MEM_BLOCK_IN(base)];
 	mem_addr off = MEM_BLOCK_MASK(base);
 
-	create_system_block(blk);
+	create_system_block(vm, blk);
 
 	*dest = *(uint16_t *)&blk->base[off];
 
 	return ERR_NOERR;
 }
 
-error_t mem_read_word(mem_addr base, uint32_t *dest)
+error_t mem_read_word(vx4_machine *vm, mem_addr base, uint32_t *dest)
 {
 	if (!IS_WORD_ALIGNED(base)) {
 		return ERR_INVAL;
 	}
 
-	mem_blk_entry *blk = &memory[MEM_BLOCK_IN(base)];
+	mem_blk_entry *blk = &vm->mem.memory[MEM_BLOCK_IN(base)];
 	mem_addr off = MEM_BLOCK_MASK(base);
 
-	create_system_block(blk);
+	create_system_block(vm, blk);
 
 	*dest = *(uint32_t *)&blk->base[off];
 
 	return ERR_NOERR;
 }
 
-void mem_write_byte(mem_addr base, uint8_t val)
+void mem_write_byte(vx4_machine *vm, mem_addr base, uint8_t val)
 {
-	mem_blk_entry *blk = &memory[MEM_BLOCK_IN(base)];
+	mem_blk_entry *blk = &vm->mem.memory[MEM_BLOCK_IN(base)];
 	mem_addr off = MEM_BLOCK_MASK(base);
 
-	create_system_block(blk);
+	create_system_block(vm, blk);
 
 	blk->base[off] = val;
+
+	if (blk->watched && line_watched(blk, off)) {
+		vm->mem.watch_handler(vm, base, 1);
+	}
 }
 
-error_t mem_write_dbyte(mem_addr base, uint16_t val)
+error_t mem_write_dbyte(vx4_machine *vm, mem_addr base, uint16_t val)
 {
 	if (!IS_DBYTE_ALIGNED(base)) {
 		return ERR_INVAL;
 	}
 
-	mem_blk_entry *blk = &memory[MEM_BLOCK_IN(base)];
+	mem_blk_entry *blk = &vm->mem.memory[MEM_BLOCK_IN(base)];
 	mem_addr off = MEM_BLOCK_MASK(base);
 
-	create_system_block(blk);
+	create_system_block(vm, blk);
 
 	*(uint16_t *)&blk->base[off] = val;
 
+	if (blk->watched && line_watched(blk, off)) {
+		vm->mem.watch_handler(vm, base, 2);
+	}
+
 	return ERR_NOERR;
 }
 
-error_t mem_write_word(mem_addr base, uint32_t val)
+error_t mem_write_word(vx4_machine *vm, mem_addr base, uint32_t val)
 {
 	if (!IS_WORD_ALIGNED(base)) {
 		return ERR_INVAL;
 	}
 
-	mem_blk_entry *blk = &memory[MEM_BLOCK_IN(base)];
+	mem_blk_entry *blk = &vm->mem.memory[MEM_BLOCK_IN(base)];
 	mem_addr off = MEM_BLOCK_MASK(base);
 
-	create_system_block(blk);
+	create_system_block(vm, blk);
 
 	*(uint32_t *)&blk->base[off] = val;
 
+	if (blk->watched && line_watched(blk, off)) {
+		vm->mem.watch_handler(vm, base, 4);
+	}
+
+	return ERR_NOERR;
+}
+
+error_t mem_exchange_word(vx4_machine *vm, mem_addr base, uint32_t val, uint32_t *old)
+{
+	if (!IS_WORD_ALIGNED(base)) {
+		return ERR_INVAL;
+	}
+
+	mem_blk_entry *blk = &vm->mem.memory[MEM_BLOCK_IN(base)];
+	mem_addr off = MEM_BLOCK_MASK(base);
+
+	create_system_block(vm, blk);
+
+	*old = atomic_exchange(ATOMIC_WORD(blk, off), val);
+
+	if (blk->watched && line_watched(blk, off)) {
+		vm->mem.watch_handler(vm, base, 4);
+	}
+
 	return ERR_NOERR;
 }
 
-mem_size mem_read_string(mem_addr base, char *dest, mem_size max)
+error_t mem_fetch_add_word(vx4_machine *vm, mem_addr base, uint32_t val, uint32_t *old)
+{
+	if (!IS_WORD_ALIGNED(base)) {
+		return ERR_INVAL;
+	}
+
+	mem_blk_entry *blk = &vm->mem.memory[MEM_BLOCK_IN(base)];
+	mem_addr off = MEM_BLOCK_MASK(base);
+
+	create_system_block(vm, blk);
+
+	*old = atomic_fetch_add(ATOMIC_WORD(blk, off), val);
+
+	if (blk->watched && line_watched(blk, off)) {
+		vm->mem.watch_handler(vm, base, 4);
+	}
+
+	return ERR_NOERR;
+}
+
+error_t mem_cas_word(vx4_machine *vm, mem_addr base, uint32_t *expected, uint32_t val)
+{
+	if (!IS_WORD_ALIGNED(base)) {
+		return ERR_INVAL;
+	}
+
+	mem_blk_entry *blk = &vm->mem.memory[MEM_BLOCK_IN(base)];
+	mem_addr off = MEM_BLOCK_MASK(base);
+
+	create_system_block(vm, blk);
+
+	// On failure, expected is updated to what the word held
+	bool swapped = atomic_compare_exchange_strong(ATOMIC_WORD(blk, off), expected, val);
+
+	if (swapped && blk->watched && line_watched(blk, off)) {
+		vm->mem.watch_handler(vm, base, 4);
+	}
+
+	return ERR_NOERR;
+}
+
+error_t mem_read_dword(vx4_machine *vm, mem_addr base, uint64_t *dest)
+{
+	if (!IS_DWORD_ALIGNED(base)) {
+		return ERR_INVAL;
+	}
+
+	mem_blk_entry *blk = &vm->mem.memory[MEM_BLOCK_IN(base)];
+	mem_addr off = MEM_BLOCK_MASK(base);
+
+	create_system_block(vm, blk);
+
+	*dest = *(uint64_t *)&blk->base[off];
+
+	return ERR_NOERR;
+}
+
+error_t mem_write_dword(vx4_machine *vm, mem_addr base, uint64_t val)
+{
+	if (!IS_DWORD_ALIGNED(base)) {
+		return ERR_INVAL;
+	}
+
+	mem_blk_entry *blk = &vm->mem.memory[MEM_BLOCK_IN(base)];
+	mem_addr off = MEM_BLOCK_MASK(base);
+
+	create_system_block(vm, blk);
+
+	*(uint64_t *)&blk->base[off] = val;
+
+	if (blk->watched && line_watched(blk, off)) {
+		vm->mem.watch_handler(vm, base, 8);
+	}
+
+	return ERR_NOERR;
+}
+
+error_t mem_read_vector(vx4_machine *vm, mem_addr base, void *dest)
+{
+	if (!IS_VECTOR_ALIGNED(base)) {
+		return ERR_INVAL;
+	}
+
+	mem_blk_entry *blk = &vm->mem.memory[MEM_BLOCK_IN(base)];
+	mem_addr off = MEM_BLOCK_MASK(base);
+
+	create_system_block(vm, blk);
+
+	memcpy(dest, &blk->base[off], VECTOR_SIZE);
+
+	return ERR_NOERR;
+}
+
+error_t mem_write_vector(vx4_machine *vm, mem_addr base, const void *src)
+{
+	if (!IS_VECTOR_ALIGNED(base)) {
+		return ERR_INVAL;
+	}
+
+	mem_blk_entry *blk = &vm->mem.memory[MEM_BLOCK_IN(base)];
+	mem_addr off = MEM_BLOCK_MASK(base);
+
+	create_system_block(vm, blk);
+
+	memcpy(&blk->base[off], src, VECTOR_SIZE);
+
+	// Being aligned, the vector never spans more than one line
+	if (blk->watched && line_watched(blk, off)) {
+		vm->mem.watch_handler(vm, base, VECTOR_SIZE);
+	}
+
+	return ERR_NOERR;
+}
+
+mem_size mem_read_string(vx4_machine *vm, mem_addr base, char *dest, mem_size max)
 {
 	uint8_t *udest = (uint8_t *)dest;
 	mem_size read = 0;
 
 	while (read < (max - 1)) {
-		mem_read_byte(base, udest);
+		mem_read_byte(vm, base, udest);
 
 		if (*udest == 0) {
 			break;
@@ -198,27 +377,33 @@ mem_size mem_read_string(mem_addr base, char *dest, mem_size max)
 	return read;
 }
 
-mem_size mem_read_mem(mem_addr base, void *dest, mem_size num)
+mem_size mem_read_mem(vx4_machine *vm, mem_addr base, void *dest, mem_size num)
 {
 	uint8_t *udest = (uint8_t *)dest;
 	mem_size read = 0;
 
+	// A block at a time, as the span may cross into another mapping
 	while (read < num) {
-		mem_read_byte(base, udest);
+		mem_blk_entry *blk = &vm->mem.memory[MEM_BLOCK_IN(base)];
+		mem_size span = block_span(base, num - read);
 
-		++base, ++udest, ++read;
+		create_system_block(vm, blk);
+
+		memcpy(udest, &blk->base[MEM_BLOCK_MASK(base)], span);
+
+		base += span, udest += span, read += span;
 	}
 
 	return read;
 }
 
-mem_size mem_write_string(mem_addr base, const char *src)
+mem_size mem_write_string(vx4_machine *vm, mem_addr base, const char *src)
 {
 	const uint8_t *usrc = (uint8_t *)src;
 	mem_size written = 0;
 
 	do {
-		mem_write_byte(base, *usrc);
+		mem_write_byte(vm, base, *usrc);
 
 		++base, ++written;
 	} while (*usrc++ != 0);
@@ -226,37 +411,121 @@ mem_size mem_write_string(mem_addr base, const char *src)
 	return written;
 }
 
-mem_size mem_write_mem(mem_addr base, const void *src, mem_size num)
+mem_size mem_write_mem(vx4_machine *vm, mem_addr base, const void *src, mem_size num)
 {
 	const uint8_t *usrc = (uint8_t *)src;
 	mem_size written = 0;
 
 	while (written < num) {
-		mem_write_byte(base, *usrc);
+		mem_blk_entry *blk = &vm->mem.memory[MEM_BLOCK_IN(base)];
+		mem_size span = block_span(base, num - written);
+
+		create_system_block(vm, blk);
 
-		++base, ++usrc, ++written;
+		memcpy(&blk->base[MEM_BLOCK_MASK(base)], usrc, span);
+		report_write(vm, blk, base, span);
+
+		base += span, usrc += span, written += span;
 	}
 
 	return written;
 }
 
-void mem_set_bytes(mem_addr base, uint8_t val, mem_size num)
+void mem_copy(vx4_machine *vm, mem_addr dest, mem_addr src, mem_size num)
+{
+	// Like memmove, an overlapping copy to a higher address goes backwards
+	// so that it doesn't read bytes it has already written
+	bool backwards = dest != src && (mem_size)(dest - src) < num;
+	mem_size copied = 0;
+
+	while (copied < num) {
+		mem_size left = num - copied;
+		mem_addr to = dest + copied, from = src + copied;
+		mem_size span;
+
+		if (backwards) {
+			span = block_span_back(dest + left, block_span_back(src + left, left));
+			to = dest + left - span, from = src + left - span;
+		}
+		else {
+			span = block_span(to, block_span(from, left));
+		}
+
+		mem_blk_entry *to_blk = &vm->mem.memory[MEM_BLOCK_IN(to)];
+		mem_blk_entry *from_blk = &vm->mem.memory[MEM_BLOCK_IN(from)];
+
+		create_system_block(vm, to_blk);
+		create_system_block(vm, from_blk);
+
+		memmove(&to_blk->base[MEM_BLOCK_MASK(to)], &from_blk->base[MEM_BLOCK_MASK(from)], span);
+		report_write(vm, to_blk, to, span);
+
+		copied += span;
+	}
+}
+
+mem_size mem_compare(vx4_machine *vm, mem_addr a, mem_addr b, mem_size num, uint32_t diff[2])
+{
+	mem_size compared = 0;
+
+	diff[0] = diff[1] = 0;
+
+	while (compared < num) {
+		mem_size span = block_span(a, block_span(b, num - compared));
+
+		mem_blk_entry *a_blk = &vm->mem.memory[MEM_BLOCK_IN(a)];
+		mem_blk_entry *b_blk = &vm->mem.memory[MEM_BLOCK_IN(b)];
+
+		create_system_block(vm, a_blk);
+		create_system_block(vm, b_blk);
+
+		const mem_block *a_mem = &a_blk->base[MEM_BLOCK_MASK(a)];
+		const mem_block *b_mem = &b_blk->base[MEM_BLOCK_MASK(b)];
+
+		// memcmp finds whether there is a difference quickly, but not where.
+		// Another CPU or a device may have made the bytes equal since, so
+		// the search is bounded, and each byte only read once
+		if (memcmp(a_mem, b_mem, span) != 0) {
+			for (mem_size i = 0; i < span; ++i) {
+				uint8_t a_byte = a_mem[i], b_byte = b_mem[i];
+
+				if (a_byte != b_byte) {
+					diff[0] = a_byte;
+					diff[1] = b_byte;
+					return compared + i;
+				}
+			}
+		}
+
+		a += span, b += span, compared += span;
+	}
+
+	return num;
+}
+
+void mem_set_bytes(vx4_machine *vm, mem_addr base, uint8_t val, mem_size num)
 {
 	mem_size written = 0;
 
 	while (written < num) {
-		mem_write_byte(base, val);
+		mem_blk_entry *blk = &vm->mem.memory[MEM_BLOCK_IN(base)];
+		mem_size span = block_span(base, num - written);
 
-		++base, ++written;
+		create_system_block(vm, blk);
+
+		memset(&blk->base[MEM_BLOCK_MASK(base)], val, span);
+		report_write(vm, blk, base, span);
+
+		base += span, written += span;
 	}
 }
 
-error_t mem_set_dbytes(mem_addr base, uint16_t val, mem_size num)
+error_t mem_set_dbytes(vx4_machine *vm, mem_addr base, uint16_t val, mem_size num)
 {
 	mem_size written = 0;
 
 	while (written < num) {
-		error_t stat = mem_write_dbyte(base, val);
+		error_t stat = mem_write_dbyte(vm, base, val);
 
 		if (stat != ERR_NOERR) {
 			return stat;
@@ -270,12 +539,12 @@ error_t mem_set_dbytes(mem_addr base, uint16_t val, mem_size num)
 }
 
 
-error_t mem_set_words(mem_addr base, uint32_t val, mem_size num)
+error_t mem_set_words(vx4_machine *vm, mem_addr base, uint32_t val, mem_size num)
 {
 	mem_size written = 0;
 
 	while (written < num) {
-		error_t stat = mem_write_word(base, val);
+		error_t stat = mem_write_word(vm, base, val);
 
 		if (stat != ERR_NOERR) {
 			return stat;
@@ -288,55 +557,172 @@ error_t mem_set_words(mem_addr base, uint32_t val, mem_size num)
 	return ERR_NOERR;
 }
 
-error_t mem_map_device(mem_addr base, mem_block *mem)
+error_t mem_map_device(vx4_machine *vm, mem_addr base, mem_block *mem)
 {
 	if (!IS_BLOCK_ALIGNED(base)) {
 		return ERR_INVAL;
 	}
 
-	mem_blk_entry *blk = &memory[MEM_BLOCK_IN(base)];
+	mem_blk_entry *blk = &vm->mem.memory[MEM_BLOCK_IN(base)];
+
+	if (blk->watched) {
+		// As far as any watcher is concerned, the whole block was rewritten
+		blk->watched = false;
+		vm->mem.watch_handler(vm, base, MEM_BLK_SIZE);
+	}
 
 	if (blk->type == MAP_SYSTEM) {
 		delete_system_block(blk);
 	}
 
-	return install_device_block(blk, mem);
+	error_t err = install_device_block(blk, mem);
+
+	// After the change, so a cache filled during it still misses
+	atomic_fetch_add(&vm->mem.map_epoch, 1);
+	return err;
 }
 
-error_t mem_unmap_device(mem_addr base)
+error_t mem_unmap_device(vx4_machine *vm, mem_addr base)
 {
 	if (!IS_BLOCK_ALIGNED(base)) {
 		return ERR_INVAL;
 	}
 
-	mem_blk_entry *blk = &memory[MEM_BLOCK_IN(base)];
-	return remove_device_block(blk);
+	mem_blk_entry *blk = &vm->mem.memory[MEM_BLOCK_IN(base)];
+	error_t err = remove_device_block(blk);
+
+	atomic_fetch_add(&vm->mem.map_epoch, 1);
+	return err;
 }
 
-mem_block *mem_raw_block(mem_addr base, bool create)
+mem_block *mem_raw_block(vx4_machine *vm, mem_addr base, bool create)
 {
 	if (!IS_BLOCK_ALIGNED(base)) {
 		return NULL;
 	}
 
-	mem_blk_entry *blk = &memory[MEM_BLOCK_IN(base)];
+	mem_blk_entry *blk = &vm->mem.memory[MEM_BLOCK_IN(base)];
 
 	if (create) {
-		create_system_block(blk);
+		create_system_block(vm, blk);
 	}
 
 	return blk->base;
 }
 
-void mem_dump()
+void mem_watch_set_handler(vx4_machine *vm, mem_watch_pf func)
+{
+	if (func == NULL) {
+		mem_unwatch_all(vm);
+	}
+
+	vm->mem.watch_handler = func;
+}
+
+bool mem_watch_line(vx4_machine *vm, mem_addr addr)
+{
+	if (vm->mem.watch_handler == NULL) {
+		return false;
+	}
+
+	mem_blk_entry *blk = &vm->mem.memory[MEM_BLOCK_IN(addr)];
+
+	create_system_block(vm, blk);
+
+	if (blk->type != MAP_SYSTEM) {
+		return false;
+	}
+
+	mem_addr line = LINE_IN_BLOCK(MEM_BLOCK_MASK(addr));
+	atomic_uint *elem = &blk->watch_lines[line / LINES_IN_ELEM];
+	unsigned bit = 1u << (line % LINES_IN_ELEM);
+
+	if (!blk->watched) {
+		blk->watched = true;
+	}
+
+	// Code is fetched far more often than it is first watched
+	if (!(atomic_load_explicit(elem, memory_order_relaxed) & bit)) {
+		atomic_fetch_or(elem, bit);
+	}
+
+	return true;
+}
+
+void mem_unwatch_all(vx4_machine *vm)
+{
+	for (mem_size i = 0; i < MEM_NUM_BLKS; ++i) {
+		mem_blk_entry *blk = &vm->mem.memory[i];
+
+		if (blk->watched) {
+			blk->watched = false;
+
+			for (size_t j = 0; j < MEM_LINES_IN_BLK / LINES_IN_ELEM; ++j) {
+				atomic_store_explicit(&blk->watch_lines[j], 0, memory_order_relaxed);
+			}
+		}
+	}
+}
+
+void mem_cache_begin(vx4_machine *vm, mem_cache *cache)
+{
+	for (int kind = 0; kind < MEM_CACHE_KINDS; ++kind) {
+		cache->entries[kind].base = NULL;
+		cache->entries[kind].blk = NULL;
+	}
+
+	cache->epoch = &vm->mem.map_epoch;
+	mem_cache_empty(cache);
+}
+
+void mem_cache_empty(mem_cache *cache)
+{
+	for (int kind = 0; kind < MEM_CACHE_KINDS; ++kind) {
+		cache->entries[kind].tag = MEM_CACHE_EMPTY;
+	}
+
+	cache->bypassed = false;
+}
+
+mem_cache_entry *mem_cache_fill(vx4_machine *vm, mem_cache *cache, enum _mem_cache_kind kind, mem_addr addr)
+{
+	// Read before the block, so that a mapping change racing with this
+	// leaves the entry stale straight away, see mem_map_device
+	unsigned epoch = atomic_load_explicit(&vm->mem.map_epoch, memory_order_acquire);
+
+	mem_blk_entry *blk = &vm->mem.memory[MEM_BLOCK_IN(addr)];
+	mem_cache_entry *entry = &cache->entries[kind];
+
+	create_system_block(vm, blk);
+
+	entry->tag = MEM_CACHE_TAG(epoch, addr);
+	entry->base = blk->base;
+	entry->blk = blk;
+
+	return entry;
+}
+
+void mem_cache_report(vx4_machine *vm, const mem_cache_entry *entry, mem_addr base, mem_size num)
+{
+	report_write(vm, entry->blk, base, num);
+}
+
+void mem_end(vx4_machine *vm)
 {
 	for (mem_size i = 0; i < MEM_NUM_BLKS; ++i) {
-		if (memory[i].base != NULL) {
+		delete_system_block(&vm->mem.memory[i]);
+	}
+}
+
+void mem_dump(vx4_machine *vm)
+{
+	for (mem_size i = 0; i < MEM_NUM_BLKS; ++i) {
+		if (vm->mem.memory[i].base != NULL) {
 			char fname[12];
 			snprintf(fname, 12, "%04u.dump", i);
 
 			FILE *dump = fopen(fname, "wb");
-			fwrite(memory[i].base, 1, MEM_BLK_SIZE, dump);
+			fwrite(vm->mem.memory[i].base, 1, MEM_BLK_SIZE, dump);
 			fclose(dump);
 		}
 	}
@@ -346,20 +732,33 @@ void mem_dump()
 // Module internal functions
 ////////////////////////////////////////////////////////////////////////////////
 
-error_t create_system_block(mem_blk_entry *block)
+error_t create_system_block(vx4_machine *vm, mem_blk_entry *block)
 {
-	if (block->type != MAP_NONE) {
+	// Almost every access finds the block ready, so check before locking
+	if (atomic_load_explicit(&block->type, memory_order_acquire) != MAP_NONE) {
 		return ERR_PCOND;
 	}
 
-	block->base = calloc(MEM_BLK_SIZE, 1);
+	while (atomic_flag_test_and_set_explicit(&vm->mem.create_lock, memory_order_acquire));
+
+	error_t ret = ERR_PCOND;
+
+	// Another CPU may have created the block while we waited
+	if (atomic_load_explicit(&block->type, memory_order_relaxed) == MAP_NONE) {
+		block->base = calloc(MEM_BLK_SIZE, 1);
+		block->watch_lines = calloc(MEM_LINES_IN_BLK / LINES_IN_ELEM, sizeof (atomic_uint));
 
-	if (block->base == NULL) {
-		DIE_ON(ERR_NOMEM);
+		if (block->base == NULL || block->watch_lines == NULL) {
+			DIE_ON(ERR_NOMEM);
+		}
+
+		// Pairs with the check above, so base is ready before anyone sees the type
+		atomic_store_explicit(&block->type, MAP_SYSTEM, memory_order_release);
+		ret = ERR_NOERR;
 	}
 
-	block->type = MAP_SYSTEM;
-	return ERR_NOERR;
+	atomic_flag_clear_explicit(&vm->mem.create_lock, memory_order_release);
+	return ret;
 }
 
 error_t delete_system_block(mem_blk_entry *block)
@@ -371,6 +770,10 @@ error_t delete_system_block(mem_blk_entry *block)
 	free(block->base);
 	block->base = NULL;
 
+	free(block->watch_lines);
+	block->watch_lines = NULL;
+	block->watched = false;
+
 	block->type = MAP_NONE;
 	return ERR_NOERR;
 }
@@ -397,3 +800,45 @@ error_t remove_device_block(mem_blk_entry *block)
 	return ERR_NOERR;
 }
 
+mem_size block_span(mem_addr base, mem_size num)
+{
+	mem_size left = MEM_BLK_SIZE - MEM_BLOCK_MASK(base);
+	return num < left ? num : left;
+}
+
+mem_size block_span_back(mem_addr end, mem_size num)
+{
+	mem_size left = MEM_BLOCK_MASK(end - 1) + 1;
+	return num < left ? num : left;
+}
+
+void report_write(vx4_machine *vm, mem_blk_entry *block, mem_addr base, mem_size num)
+{
+	if (!block->watched) {
+		return;
+	}
+
+	mem_addr off = MEM_BLOCK_MASK(base);
+	mem_addr last = off + num - 1;
+
+	// One report covers the span, however many of its lines are watched
+	for (mem_addr line = off; ; line += 1u << MEM_LINE_SHIFT) {
+		if (line_watched(block, line)) {
+			vm->mem.watch_handler(vm, base, num);
+			return;
+		}
+
+		if (LINE_IN_BLOCK(line) == LINE_IN_BLOCK(last)) {
+			return;
+		}
+	}
+}
+
+bool line_watched(const mem_blk_entry *block, mem_addr off)
+{
+	mem_addr line = LINE_IN_BLOCK(off);
+	unsigned elem = atomic_load_explicit(&block->watch_lines[line / LINES_IN_ELEM], memory_order_relaxed);
+
+	return (elem & (1u << (line % LINES_IN_ELEM))) != 0;
+}
+
@@ -1,9 +1,12 @@
 #pragma once
 
 #include "error.h"
+#include "vx4.h"
 
+#include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 // Type declarations
@@ -13,6 +16,9 @@ typedef uint32_t mem_addr; // A virtual CPU memory address
 typedef uint32_t mem_size; // Size type for virtual CPU memory
 typedef uint8_t mem_block; // Byte type to allow byte-wise memory access
 
+// Notified of writes to watched lines, see mem_watch_line
+typedef void (*mem_watch_pf)(vx4_machine *vm, mem_addr base, mem_size num);
+
 ////////////////////////////////////////////////////////////////////////////////
 // Constants + helper macros
 ////////////////////////////////////////////////////////////////////////////////
@@ -24,6 +30,77 @@ typedef uint8_t mem_block; // Byte type to allow byte-wise memory access
 #define MEM_BLOCK_IN(addr) ((addr) >> 20)
 #define MEM_BLOCK_MASK(addr) ((addr) & 0xFFFFF) // Last 20 bits
 
+// Writes are watched in lines of 64 bytes, see mem_watch_line
+#define MEM_LINE_SHIFT 6
+#define MEM_LINES_IN_BLK (MEM_BLK_SIZE >> MEM_LINE_SHIFT)
+
+#define MEM_IS_ALIGNED(addr, size) (((addr) & ((size) - 1)) == 0)
+
+// A mem_cache entry matches a block only while the mappings are unchanged
+#define MEM_CACHE_TAG(epoch, addr) (((uint64_t)(epoch) << 32) | MEM_BLOCK_IN(addr))
+#define MEM_CACHE_EMPTY UINT64_MAX // Above any tag, as blocks are only 12 bits
+
+enum _mem_type {
+	MAP_NONE,
+	MAP_SYSTEM,
+	MAP_DEVICE,
+};
+
+// The kinds of access a mem_cache remembers a block for
+enum _mem_cache_kind {
+	MEM_CACHE_LOAD,
+	MEM_CACHE_STORE,
+
+	MEM_CACHE_KINDS
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Machine state
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Each entry defaults to being unmapped, and is mapped only
+ * when required. Every CPU of a machine shares the entries, so
+ * they may be created by any of them at any time.
+ */
+typedef struct _mem_blk_entry {
+	// A _mem_type, which is only set once base is ready to use
+	atomic_int type;
+
+	mem_block *base; // Pointer to the beginning of a MEM_BLK_SIZE array
+
+	// Should writes to some lines be reported to watch_handler?
+	atomic_bool watched;
+	atomic_uint *watch_lines; // One bit per line, allocated along with system blocks
+} mem_blk_entry;
+
+// Should not be touched except by functions in mem.c
+typedef struct _mem_state {
+	mem_blk_entry memory[MEM_NUM_BLKS]; // Every entry starts as MAP_NONE (unloaded)
+	mem_watch_pf watch_handler;
+
+	atomic_flag create_lock; // Held while a block is being created
+	atomic_uint map_epoch; // Bumped after every device mapping change, see mem_cache
+} mem_context;
+
+typedef struct _mem_cache_entry {
+	uint64_t tag; // MEM_CACHE_TAG of the block when filled, or MEM_CACHE_EMPTY
+	mem_block *base;
+	mem_blk_entry *blk;
+} mem_cache_entry;
+
+/**
+ * The last block each kind of access touched, so that touching it again
+ * is one compare and a host pointer add. Belongs to a single CPU, which
+ * alone may touch it. Entries are tagged with the map epoch along with
+ * the block, so a device being mapped or unmapped empties every cache.
+ */
+typedef struct _mem_cache {
+	mem_cache_entry entries[MEM_CACHE_KINDS];
+	const atomic_uint *epoch; // The map_epoch of the machine the cache is for
+	bool bypassed; // An access was made around the entries, see mem_cache_used
+} mem_cache;
+
 ////////////////////////////////////////////////////////////////////////////////
 // Function declarations
 ////////////////////////////////////////////////////////////////////////////////
@@ -41,9 +118,9 @@ typedef uint8_t mem_block; // Byte type to allow byte-wise memory access
  * ERR_INVAL: The provided address was not correctly aligned for the
  * requested size of data.
  */
-extern void mem_read_byte(mem_addr base, uint8_t *dest);
-extern error_t mem_read_dbyte(mem_addr base, uint16_t *dest);
-extern error_t mem_read_word(mem_addr base, uint32_t *dest);
+extern void mem_read_byte(vx4_machine *vm, mem_addr base, uint8_t *dest);
+extern error_t mem_read_dbyte(vx4_machine *vm, mem_addr base, uint16_t *dest);
+extern error_t mem_read_word(vx4_machine *vm, mem_addr base, uint32_t *dest);
 
 /**
  * Writes data to a size-aligned location in memory.
@@ -56,9 +133,62 @@ extern error_t mem_read_word(mem_addr base, uint32_t *dest);
  * ERR_INVAL: The provided address was not correctly aligned for the
  * size of data provided.
  */
-extern void mem_write_byte(mem_addr base, uint8_t val);
-extern error_t mem_write_dbyte(mem_addr base, uint16_t val);
-extern error_t mem_write_word(mem_addr base, uint32_t val);
+extern void mem_write_byte(vx4_machine *vm, mem_addr base, uint8_t val);
+extern error_t mem_write_dbyte(vx4_machine *vm, mem_addr base, uint16_t val);
+extern error_t mem_write_word(vx4_machine *vm, mem_addr base, uint32_t val);
+
+/**
+ * Atomic read-modify-write operations on a word, which must be word
+ * aligned. Each is a single host atomic on the memory backing the
+ * address, including device mappings, and is sequentially consistent
+ * with the other CPUs' and host devices' atomic accesses.
+ *
+ * mem_exchange_word stores val, mem_fetch_add_word adds val, and
+ * mem_cas_word stores val only if the word equals *expected.
+ *
+ * IN base: The address of the word.
+ * IN val: The value to store or add.
+ * IN expected: The value the word must hold for mem_cas_word to store.
+ * OUT old: (expected for mem_cas_word) The word as it was before.
+ *
+ * Returns:
+ * ERR_NOERR: The operation was carried out (though mem_cas_word may not
+ * have stored anything, see old).
+ * ERR_INVAL: The provided address was not word aligned.
+ */
+extern error_t mem_exchange_word(vx4_machine *vm, mem_addr base, uint32_t val, uint32_t *old);
+extern error_t mem_fetch_add_word(vx4_machine *vm, mem_addr base, uint32_t val, uint32_t *old);
+extern error_t mem_cas_word(vx4_machine *vm, mem_addr base, uint32_t *expected, uint32_t val);
+
+/**
+ * Reads or writes an 8 byte double word, which must be 8 byte aligned, as
+ * the f64 loads and stores do.
+ *
+ * IN base: The address of the double word.
+ * OUT dest: The location to save the read value.
+ * IN val: The data to write.
+ *
+ * Returns:
+ * ERR_NOERR: The double word was successfully read or written.
+ * ERR_INVAL: The provided address was not 8 byte aligned.
+ */
+extern error_t mem_read_dword(vx4_machine *vm, mem_addr base, uint64_t *dest);
+extern error_t mem_write_dword(vx4_machine *vm, mem_addr base, uint64_t val);
+
+/**
+ * Reads or writes a 16 byte vector, which must be 16 byte aligned, as the
+ * vector instructions do.
+ *
+ * IN base: The address of the vector.
+ * OUT dest: A 16 byte buffer to store the read vector.
+ * IN src: A 16 byte buffer holding the vector to write.
+ *
+ * Returns:
+ * ERR_NOERR: The vector was successfully read or written.
+ * ERR_INVAL: The provided address was not 16 byte aligned.
+ */
+extern error_t mem_read_vector(vx4_machine *vm, mem_addr base, void *dest);
+extern error_t mem_write_vector(vx4_machine *vm, mem_addr base, const void *src);
 
 /**
  * Copies a null-terminated string from memory to a buffer. If the
@@ -71,7 +201,7 @@ extern error_t mem_write_word(mem_addr base, uint32_t val);
  *
  * Returns: The number of bytes read.
  */
-extern mem_size mem_read_string(mem_addr base, char *dest, mem_size max);
+extern mem_size mem_read_string(vx4_machine *vm, mem_addr base, char *dest, mem_size max);
 
 /**
  * Reads from a set span of memory into a buffer.
@@ -82,7 +212,7 @@ extern mem_size mem_read_string(mem_addr base, char *dest, mem_size max);
  *
  * Returns: The number of bytes read. A value != num indicates error.
  */
-extern mem_size mem_read_mem(mem_addr base, void *dest, mem_size num);
+extern mem_size mem_read_mem(vx4_machine *vm, mem_addr base, void *dest, mem_size num);
 
 /**
  * Writes a null-terminated string into memory, including the
@@ -93,7 +223,7 @@ extern mem_size mem_read_mem(mem_addr base, void *dest, mem_size num);
  *
  * Returns: The number of bytes written.
  */
-extern mem_size mem_write_string(mem_addr base, const char *src);
+extern mem_size mem_write_string(vx4_machine *vm, mem_addr base, const char *src);
 
 /**
  * Writes from a given buffer into memory at a specific location.
@@ -104,7 +234,30 @@ extern mem_size mem_write_string(mem_addr base, const char *src);
  *
  * Returns: The number of bytes written. A value != num indicates error.
  */
-extern mem_size mem_write_mem(mem_addr base, const void *src, mem_size num);
+extern mem_size mem_write_mem(vx4_machine *vm, mem_addr base, const void *src, mem_size num);
+
+/**
+ * Copies a span of memory to another address, as memmove does, so the
+ * spans may overlap. Either may cross into other mappings.
+ *
+ * IN dest: The address to begin writing.
+ * IN src: The address to begin reading.
+ * IN num: Number of bytes to copy.
+ */
+extern void mem_copy(vx4_machine *vm, mem_addr dest, mem_addr src, mem_size num);
+
+/**
+ * Compares two spans of memory byte by byte.
+ *
+ * IN a: The address of the first span.
+ * IN b: The address of the second span.
+ * IN num: Number of bytes to compare.
+ * OUT diff: The first byte of each span that differs from the other, or
+ * both 0 if the spans match, widened so the pair can be compared directly.
+ *
+ * Returns: The offset of the first byte that differs, or num if none do.
+ */
+extern mem_size mem_compare(vx4_machine *vm, mem_addr a, mem_addr b, mem_size num, uint32_t diff[2]);
 
 /**
  * Fills a size-aligned block of memory with a given value.
@@ -120,9 +273,9 @@ extern mem_size mem_write_mem(mem_addr base, const void *src, mem_size num);
  * ERR_INVAL: The provided address was not correctly aligned for the
  * requested size.
  */
-extern void mem_set_bytes(mem_addr base, uint8_t val, mem_size num);
-extern error_t mem_set_dbytes(mem_addr base, uint16_t val, mem_size num);
-extern error_t mem_set_words(mem_addr base, uint32_t val, mem_size num);
+extern void mem_set_bytes(vx4_machine *vm, mem_addr base, uint8_t val, mem_size num);
+extern error_t mem_set_dbytes(vx4_machine *vm, mem_addr base, uint16_t val, mem_size num);
+extern error_t mem_set_words(vx4_machine *vm, mem_addr base, uint32_t val, mem_size num);
 
 /**
  * Maps a custom block of memory into the virtual address space.
@@ -137,7 +290,7 @@ extern error_t mem_set_words(mem_addr base, uint32_t val, mem_size num);
  * ERR_INVAL: The address specified was not a block boundary.
  * ERR_PCOND: The address specified refers to a block that is already mapped.
  */
-extern error_t mem_map_device(mem_addr base, mem_block *mem);
+extern error_t mem_map_device(vx4_machine *vm, mem_addr base, mem_block *mem);
 
 /**
  * Unmaps a custom memory mapping from the virtual address space, returning
@@ -150,7 +303,7 @@ extern error_t mem_map_device(mem_addr base, mem_block *mem);
  * ERR_INVAL: The address specified was not a block boundary.
  * ERR_PCOND: The address specified is not currently part of a mapping.
  */
-extern error_t mem_unmap_device(mem_addr base);
+extern error_t mem_unmap_device(vx4_machine *vm, mem_addr base);
 
 /**
  * Retrieves the memory currently being used to hold a given block.
@@ -162,11 +315,224 @@ extern error_t mem_unmap_device(mem_addr base);
  * - The base address given refers to no block (is not block aligned).
  * - The block is unloaded and mem_raw_block was called with create = false.
  */
-extern mem_block *mem_raw_block(mem_addr base, bool create);
+extern mem_block *mem_raw_block(vx4_machine *vm, mem_addr base, bool create);
+
+/**
+ * Sets the function notified of writes to watched lines. Every write made
+ * through this module to a watched line is reported after it completes,
+ * as is a block with watched lines being replaced by a device mapping.
+ * This allows caches derived from memory contents to be kept up to date.
+ *
+ * IN func: The function to notify, or NULL to disable watching.
+ */
+extern void mem_watch_set_handler(vx4_machine *vm, mem_watch_pf func);
+
+/**
+ * Starts reporting writes to the line containing an address. Device
+ * mappings can't be watched, because their owners write to them directly.
+ * Safe to call from any CPU. The line is watched before this returns, so
+ * memory read afterwards can't change without a report, barring a write
+ * from another CPU at that same moment.
+ *
+ * IN addr: Any address within the line to watch.
+ *
+ * Returns: Whether the line is now watched.
+ */
+extern bool mem_watch_line(vx4_machine *vm, mem_addr addr);
+
+/**
+ * Stops reporting writes to every line.
+ */
+extern void mem_unwatch_all(vx4_machine *vm);
+
+/**
+ * Empties a cache and ties it to the machine, which must be done before
+ * it is first used.
+ *
+ * IN cache: The cache to set up.
+ */
+extern void mem_cache_begin(vx4_machine *vm, mem_cache *cache);
+
+/**
+ * Empties a cache, so that mem_cache_used can tell whether the CPU it
+ * belongs to has touched memory since. Costs the next access of each kind
+ * a fill.
+ *
+ * IN cache: The cache to empty.
+ */
+extern void mem_cache_empty(mem_cache *cache);
+
+/**
+ * Points a cache's entry at the block holding an address, creating the
+ * block if it is unloaded. Use the mem_cached functions instead, which
+ * only call this when the entry misses.
+ *
+ * IN cache: The cache to fill.
+ * IN kind: The entry to fill.
+ * IN addr: Any address within the block.
+ *
+ * Returns: The filled entry.
+ */
+extern mem_cache_entry *mem_cache_fill(vx4_machine *vm, mem_cache *cache, enum _mem_cache_kind kind, mem_addr addr);
+
+/**
+ * Reports a write made through a cache entry, if any of the lines it
+ * touched are watched, see mem_watch_line.
+ *
+ * IN entry: The entry the write was made through.
+ * IN base: The address of the first byte written.
+ * IN num: The number of bytes written, all within the entry's block.
+ */
+extern void mem_cache_report(vx4_machine *vm, const mem_cache_entry *entry, mem_addr base, mem_size num);
+
+/**
+ * Frees all system memory. Any device mappings must already be removed.
+ */
+extern void mem_end(vx4_machine *vm);
 
 /**
  * Cause all loaded blocks to be written to files. Each block is written
  * to a file with name XXXX.dump, where XXXX is the block number in base-10.
  */
-extern void mem_dump();
+extern void mem_dump(vx4_machine *vm);
+
+////////////////////////////////////////////////////////////////////////////////
+// Inline function definitions
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Finds the entry of a cache for a kind of access, filling it if it
+ * doesn't already hold the block containing an address.
+ *
+ * IN cache: The cache to look in.
+ * IN kind: The kind of access being made.
+ * IN addr: The address being accessed.
+ *
+ * Returns: The entry, holding addr's block.
+ */
+static inline mem_cache_entry *mem_cache_lookup(vx4_machine *vm, mem_cache *cache, enum _mem_cache_kind kind, mem_addr addr)
+{
+	mem_cache_entry *entry = &cache->entries[kind];
+	unsigned epoch = atomic_load_explicit(cache->epoch, memory_order_relaxed);
+
+	if (entry->tag != MEM_CACHE_TAG(epoch, addr)) {
+		entry = mem_cache_fill(vm, cache, kind, addr);
+	}
+
+	return entry;
+}
+
+/**
+ * Records an access a CPU made without going through its cache, such as
+ * an atomic or a copy, so that mem_cache_used still counts it.
+ *
+ * IN cache: The cache of the CPU making the access.
+ */
+static inline void mem_cache_bypass(mem_cache *cache)
+{
+	cache->bypassed = true;
+}
+
+/**
+ * Returns whether the CPU a cache belongs to has loaded from or stored to
+ * memory since the cache was last emptied, see mem_cache_empty.
+ *
+ * IN cache: The cache to check.
+ */
+static inline bool mem_cache_used(const mem_cache *cache)
+{
+	return cache->bypassed
+		|| cache->entries[MEM_CACHE_LOAD].tag != MEM_CACHE_EMPTY
+		|| cache->entries[MEM_CACHE_STORE].tag != MEM_CACHE_EMPTY;
+}
+
+/**
+ * As the functions without "cached" in their names, going through a CPU's
+ * cache of the last block it loaded from and stored to. Hot paths should
+ * use these, as a run of accesses to the same block only looks it up once.
+ *
+ * IN cache: The cache of the CPU making the access.
+ */
+static inline error_t mem_cached_read_word(vx4_machine *vm, mem_cache *cache, mem_addr base, uint32_t *dest)
+{
+	if (!MEM_IS_ALIGNED(base, 4)) {
+		return ERR_INVAL;
+	}
+
+	const mem_cache_entry *entry = mem_cache_lookup(vm, cache, MEM_CACHE_LOAD, base);
+	*dest = *(uint32_t *)&entry->base[MEM_BLOCK_MASK(base)];
+
+	return ERR_NOERR;
+}
+
+static inline error_t mem_cached_write_word(vx4_machine *vm, mem_cache *cache, mem_addr base, uint32_t val)
+{
+	if (!MEM_IS_ALIGNED(base, 4)) {
+		return ERR_INVAL;
+	}
+
+	const mem_cache_entry *entry = mem_cache_lookup(vm, cache, MEM_CACHE_STORE, base);
+	*(uint32_t *)&entry->base[MEM_BLOCK_MASK(base)] = val;
+
+	if (entry->blk->watched) {
+		mem_cache_report(vm, entry, base, 4);
+	}
+
+	return ERR_NOERR;
+}
+
+static inline error_t mem_cached_read_dword(vx4_machine *vm, mem_cache *cache, mem_addr base, uint64_t *dest)
+{
+	if (!MEM_IS_ALIGNED(base, 8)) {
+		return ERR_INVAL;
+	}
+
+	const mem_cache_entry *entry = mem_cache_lookup(vm, cache, MEM_CACHE_LOAD, base);
+	*dest = *(uint64_t *)&entry->base[MEM_BLOCK_MASK(base)];
+
+	return ERR_NOERR;
+}
+
+static inline error_t mem_cached_write_dword(vx4_machine *vm, mem_cache *cache, mem_addr base, uint64_t val)
+{
+	if (!MEM_IS_ALIGNED(base, 8)) {
+		return ERR_INVAL;
+	}
+
+	const mem_cache_entry *entry = mem_cache_lookup(vm, cache, MEM_CACHE_STORE, base);
+	*(uint64_t *)&entry->base[MEM_BLOCK_MASK(base)] = val;
+
+	if (entry->blk->watched) {
+		mem_cache_report(vm, entry, base, 8);
+	}
+
+	return ERR_NOERR;
+}
+
+static inline error_t mem_cached_read_vector(vx4_machine *vm, mem_cache *cache, mem_addr base, void *dest)
+{
+	if (!MEM_IS_ALIGNED(base, 16)) {
+		return ERR_INVAL;
+	}
+
+	const mem_cache_entry *entry = mem_cache_lookup(vm, cache, MEM_CACHE_LOAD, base);
+	memcpy(dest, &entry->base[MEM_BLOCK_MASK(base)], 16);
+
+	return ERR_NOERR;
+}
+
+static inline error_t mem_cached_write_vector(vx4_machine *vm, mem_cache *cache, mem_addr base, const void *src)
+{
+	if (!MEM_IS_ALIGNED(base, 16)) {
+		return ERR_INVAL;
+	}
+
+	const mem_cache_entry *entry = mem_cache_lookup(vm, cache, MEM_CACHE_STORE, base);
+	memcpy(&entry->base[MEM_BLOCK_MASK(base)], src, 16);
+
+	if (entry->blk->watched) {
+		mem_cache_report(vm, entry, base, 16);
+	}
 
+	return ERR_NOERR;
+}
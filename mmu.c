@@ -0,0 +1,340 @@
+#include "mmu.h"
+
+#include "error.h"
+#include "mem.h"
+#include "cpu.h"
+#include "machine.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Internal constants + helper macros
+////////////////////////////////////////////////////////////////////////////////
+
+#define PTE_PERMS (MMU_PTE_PRESENT | MMU_PTE_WRITE | MMU_PTE_EXEC)
+
+// The permission bits each kind of access needs
+static const uint32_t access_needs[MMU_NUM_ACCESSES] = {
+	[MMU_READ] = MMU_PTE_PRESENT,
+	[MMU_WRITE] = MMU_PTE_PRESENT | MMU_PTE_WRITE,
+	[MMU_EXEC] = MMU_PTE_PRESENT | MMU_PTE_EXEC,
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Module internal declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Translates every page of a span, so that any fault happens before the
+ * span is touched.
+ *
+ * IN base: The virtual address of the first byte.
+ * IN num: The length of the span in bytes.
+ * IN kind: How the span is being accessed.
+ *
+ * Returns:
+ * ERR_NOERR: Every page is mapped for the access.
+ * ERR_PCOND: A page isn't, see mmu_fill.
+ */
+static error_t check_span(vx4_cpu *vcpu, mem_addr base, mem_size num, mmu_access kind);
+
+/**
+ * Returns how many of the bytes from an address onwards lie in its page.
+ *
+ * IN base: The address of the first byte.
+ * IN num: The number of bytes wanted.
+ */
+static mem_size page_span(mem_addr base, mem_size num);
+
+/**
+ * Returns how many of the bytes up to (not including) an address lie in
+ * the page of the byte before it.
+ *
+ * IN end: The address after the last byte.
+ * IN num: The number of bytes wanted.
+ */
+static mem_size page_span_back(mem_addr end, mem_size num);
+
+////////////////////////////////////////////////////////////////////////////////
+// Interface functions
+////////////////////////////////////////////////////////////////////////////////
+
+error_t mmu_begin(vx4_cpu *vcpu)
+{
+	vcpu->mmu = malloc(sizeof (mmu_context));
+	if (vcpu->mmu == NULL) {
+		return ERR_NOMEM;
+	}
+
+	vcpu->mmu->base = 0;
+	vcpu->mmu->faulted = false;
+	vcpu->mmu->fault_addr = 0;
+	vcpu->mmu->fault_kind = MMU_READ;
+
+	mmu_flush(vcpu);
+	return ERR_NOERR;
+}
+
+void mmu_end(vx4_cpu *vcpu)
+{
+	free(vcpu->mmu);
+	vcpu->mmu = NULL;
+}
+
+void mmu_set_base(vx4_cpu *vcpu, mem_addr base)
+{
+	vcpu->mmu->base = MMU_PAGE_OF(base);
+	mmu_flush(vcpu);
+
+	cpu_signal_events(vcpu->vm, vcpu->id);
+}
+
+void mmu_invalidate(vx4_cpu *vcpu, mem_addr addr)
+{
+	mmu_tlb_entry *entry = &vcpu->mmu->tlb[MMU_TLB_INDEX(addr)];
+
+	// Only this page's translation can be in its entry
+	if (entry->tags[MMU_READ] == MMU_PAGE_OF(addr)) {
+		for (int kind = 0; kind < MMU_NUM_ACCESSES; ++kind) {
+			entry->tags[kind] = MMU_NO_PAGE;
+		}
+	}
+}
+
+void mmu_flush(vx4_cpu *vcpu)
+{
+	for (size_t i = 0; i < MMU_TLB_ENTRIES; ++i) {
+		for (int kind = 0; kind < MMU_NUM_ACCESSES; ++kind) {
+			vcpu->mmu->tlb[i].tags[kind] = MMU_NO_PAGE;
+		}
+	}
+}
+
+error_t mmu_fill(vx4_cpu *vcpu, mem_addr addr, mmu_access kind, mem_addr *dest)
+{
+	mmu_context *mmu = vcpu->mmu;
+	uint32_t pde, pte = 0;
+
+	// The tables are always in physical memory
+	mem_read_word(vcpu->vm, mmu->base + MMU_DIR_INDEX(addr) * 4, &pde);
+
+	if (pde & MMU_PTE_PRESENT) {
+		mem_read_word(vcpu->vm, MMU_PAGE_OF(pde) + MMU_TABLE_INDEX(addr) * 4, &pte);
+	}
+
+	uint32_t perms = pde & pte & PTE_PERMS;
+
+	if ((perms & access_needs[kind]) != access_needs[kind]) {
+		mmu->faulted = true;
+		mmu->fault_addr = addr;
+		mmu->fault_kind = kind;
+		return ERR_PCOND;
+	}
+
+	// Cached for every kind of access the page allows, not just this one
+	mmu_tlb_entry *entry = &mmu->tlb[MMU_TLB_INDEX(addr)];
+
+	for (int i = 0; i < MMU_NUM_ACCESSES; ++i) {
+		bool allowed = (perms & access_needs[i]) == access_needs[i];
+		entry->tags[i] = allowed ? MMU_PAGE_OF(addr) : MMU_NO_PAGE;
+	}
+
+	entry->frame = MMU_PAGE_OF(pte);
+
+	*dest = entry->frame | MMU_PAGE_OFFSET(addr);
+	return ERR_NOERR;
+}
+
+bool mmu_take_fault(vx4_cpu *vcpu)
+{
+	bool faulted = vcpu->mmu->faulted;
+	vcpu->mmu->faulted = false;
+
+	return faulted;
+}
+
+void mmu_last_fault(vx4_cpu *vcpu, uint32_t *addr, uint32_t *kind)
+{
+	*addr = vcpu->mmu->fault_addr;
+	*kind = vcpu->mmu->fault_kind;
+}
+
+error_t mmu_read_mem(vx4_cpu *vcpu, mem_addr base, void *dest, mem_size num)
+{
+	mem_cache_bypass(&vcpu->memcache);
+
+	if (!mmu_enabled(vcpu)) {
+		return mem_read_mem(vcpu->vm, base, dest, num) == num ? ERR_NOERR : ERR_PCOND;
+	}
+
+	if (check_span(vcpu, base, num, MMU_READ) != ERR_NOERR) {
+		return ERR_PCOND;
+	}
+
+	uint8_t *udest = (uint8_t *)dest;
+
+	// A page at a time, as neighbouring pages needn't be neighbours in memory
+	for (mem_size read = 0, span; read < num; read += span) {
+		mem_addr addr;
+		span = page_span(base + read, num - read);
+
+		mmu_translate(vcpu, base + read, MMU_READ, &addr);
+		mem_read_mem(vcpu->vm, addr, udest + read, span);
+	}
+
+	return ERR_NOERR;
+}
+
+error_t mmu_write_mem(vx4_cpu *vcpu, mem_addr base, const void *src, mem_size num)
+{
+	mem_cache_bypass(&vcpu->memcache);
+
+	if (!mmu_enabled(vcpu)) {
+		return mem_write_mem(vcpu->vm, base, src, num) == num ? ERR_NOERR : ERR_PCOND;
+	}
+
+	if (check_span(vcpu, base, num, MMU_WRITE) != ERR_NOERR) {
+		return ERR_PCOND;
+	}
+
+	const uint8_t *usrc = (const uint8_t *)src;
+
+	for (mem_size written = 0, span; written < num; written += span) {
+		mem_addr addr;
+		span = page_span(base + written, num - written);
+
+		mmu_translate(vcpu, base + written, MMU_WRITE, &addr);
+		mem_write_mem(vcpu->vm, addr, usrc + written, span);
+	}
+
+	return ERR_NOERR;
+}
+
+error_t mmu_copy(vx4_cpu *vcpu, mem_addr dest, mem_addr src, mem_size num)
+{
+	mem_cache_bypass(&vcpu->memcache);
+
+	if (!mmu_enabled(vcpu)) {
+		mem_copy(vcpu->vm, dest, src, num);
+		return ERR_NOERR;
+	}
+
+	if (check_span(vcpu, src, num, MMU_READ) != ERR_NOERR
+		|| check_span(vcpu, dest, num, MMU_WRITE) != ERR_NOERR) {
+		return ERR_PCOND;
+	}
+
+	// Overlap is judged by the virtual addresses, as mem_copy does
+	bool backwards = dest != src && (mem_size)(dest - src) < num;
+
+	for (mem_size copied = 0, span; copied < num; copied += span) {
+		mem_size left = num - copied;
+		mem_addr to = dest + copied, from = src + copied;
+
+		if (backwards) {
+			span = page_span_back(dest + left, page_span_back(src + left, left));
+			to = dest + left - span, from = src + left - span;
+		}
+		else {
+			span = page_span(to, page_span(from, left));
+		}
+
+		mmu_translate(vcpu, to, MMU_WRITE, &to);
+		mmu_translate(vcpu, from, MMU_READ, &from);
+		mem_copy(vcpu->vm, to, from, span);
+	}
+
+	return ERR_NOERR;
+}
+
+error_t mmu_compare(vx4_cpu *vcpu, mem_addr a, mem_addr b, mem_size num, uint32_t diff[2], mem_size *offset)
+{
+	mem_cache_bypass(&vcpu->memcache);
+
+	if (!mmu_enabled(vcpu)) {
+		*offset = mem_compare(vcpu->vm, a, b, num, diff);
+		return ERR_NOERR;
+	}
+
+	if (check_span(vcpu, a, num, MMU_READ) != ERR_NOERR
+		|| check_span(vcpu, b, num, MMU_READ) != ERR_NOERR) {
+		return ERR_PCOND;
+	}
+
+	diff[0] = diff[1] = 0;
+
+	for (mem_size compared = 0, span; compared < num; compared += span) {
+		mem_addr pa, pb;
+		span = page_span(a + compared, page_span(b + compared, num - compared));
+
+		mmu_translate(vcpu, a + compared, MMU_READ, &pa);
+		mmu_translate(vcpu, b + compared, MMU_READ, &pb);
+
+		mem_size same = mem_compare(vcpu->vm, pa, pb, span, diff);
+
+		if (same < span) {
+			*offset = compared + same;
+			return ERR_NOERR;
+		}
+	}
+
+	*offset = num;
+	return ERR_NOERR;
+}
+
+error_t mmu_set_bytes(vx4_cpu *vcpu, mem_addr base, uint8_t val, mem_size num)
+{
+	mem_cache_bypass(&vcpu->memcache);
+
+	if (!mmu_enabled(vcpu)) {
+		mem_set_bytes(vcpu->vm, base, val, num);
+		return ERR_NOERR;
+	}
+
+	if (check_span(vcpu, base, num, MMU_WRITE) != ERR_NOERR) {
+		return ERR_PCOND;
+	}
+
+	for (mem_size written = 0, span; written < num; written += span) {
+		mem_addr addr;
+		span = page_span(base + written, num - written);
+
+		mmu_translate(vcpu, base + written, MMU_WRITE, &addr);
+		mem_set_bytes(vcpu->vm, addr, val, span);
+	}
+
+	return ERR_NOERR;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Module internal functions
+////////////////////////////////////////////////////////////////////////////////
+
+error_t check_span(vx4_cpu *vcpu, mem_addr base, mem_size num, mmu_access kind)
+{
+	for (mem_size checked = 0, span; checked < num; checked += span) {
+		mem_addr addr;
+		span = page_span(base + checked, num - checked);
+
+		if (mmu_translate(vcpu, base + checked, kind, &addr) != ERR_NOERR) {
+			return ERR_PCOND;
+		}
+	}
+
+	return ERR_NOERR;
+}
+
+mem_size page_span(mem_addr base, mem_size num)
+{
+	mem_size left = MMU_PAGE_SIZE - MMU_PAGE_OFFSET(base);
+	return num < left ? num : left;
+}
+
+mem_size page_span_back(mem_addr end, mem_size num)
+{
+	mem_size left = MMU_PAGE_OFFSET(end - 1) + 1;
+	return num < left ? num : left;
+}
@@ -0,0 +1,321 @@
+#pragma once
+
+#include "error.h"
+#include "mem.h"
+#include "machine.h"
+#include "vx4.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+// The kinds of access a page's permissions can allow
+typedef enum _mmu_access {
+	MMU_READ,
+	MMU_WRITE,
+	MMU_EXEC,
+
+	MMU_NUM_ACCESSES
+} mmu_access;
+
+/**
+ * A translation cached from the page tables. Each kind of access is
+ * matched against its own tag, so the fast path is a single compare.
+ */
+typedef struct _mmu_tlb_entry {
+	mem_addr tags[MMU_NUM_ACCESSES]; // The virtual page, for the kinds it allows, MMU_NO_PAGE otherwise
+	mem_addr frame; // The physical page it maps to
+} mmu_tlb_entry;
+
+////////////////////////////////////////////////////////////////////////////////
+// Constants + helper macros
+////////////////////////////////////////////////////////////////////////////////
+
+#define MMU_PAGE_SHIFT 12
+#define MMU_PAGE_SIZE (1u << MMU_PAGE_SHIFT) // 4KiB pages
+
+#define MMU_PAGE_OF(addr) ((addr) & ~(MMU_PAGE_SIZE - 1))
+#define MMU_PAGE_OFFSET(addr) ((addr) & (MMU_PAGE_SIZE - 1))
+
+// A virtual address is split into a directory index, a table index and an offset
+#define MMU_DIR_INDEX(addr) ((addr) >> 22)
+#define MMU_TABLE_INDEX(addr) (((addr) >> MMU_PAGE_SHIFT) & 0x3FF)
+
+// Bits of a directory or table entry, whose top 20 bits give the physical
+// page of the table or mapped page. A page's permissions are those set
+// in both its directory and table entries
+#define MMU_PTE_PRESENT 0x1
+#define MMU_PTE_WRITE 0x2
+#define MMU_PTE_EXEC 0x4
+
+#define MMU_TLB_ENTRIES 256 // Must be a power of two
+#define MMU_TLB_INDEX(addr) (((addr) >> MMU_PAGE_SHIFT) & (MMU_TLB_ENTRIES - 1))
+
+#define MMU_NO_PAGE 1u // Never page-aligned, so matches no address
+
+////////////////////////////////////////////////////////////////////////////////
+// Machine state
+////////////////////////////////////////////////////////////////////////////////
+
+// Left visible so that mmu_translate can be inlined into the accessors below
+// Should not be touched except by functions in mmu.c or mmu_translate
+typedef struct _mmu_context {
+	mem_addr base; // The physical address of the page directory, 0 with paging off
+
+	// Direct-mapped, so each page can only ever live in a single entry
+	mmu_tlb_entry tlb[MMU_TLB_ENTRIES];
+
+	// The last access to fault, see mmu_take_fault
+	bool faulted;
+	mem_addr fault_addr;
+	mmu_access fault_kind;
+} mmu_context;
+
+////////////////////////////////////////////////////////////////////////////////
+// Function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Allocates a CPU's MMU, with paging off. Each CPU has its own page
+ * directory and TLB, which only it may touch, so a CPU changing page tables
+ * other CPUs are using must have them invalidate their own TLBs.
+ *
+ * Returns:
+ * ERR_NOERR: The MMU is ready for use.
+ * ERR_NOMEM: The MMU couldn't be allocated.
+ */
+extern error_t mmu_begin(vx4_cpu *vcpu);
+
+/**
+ * Frees the MMU.
+ */
+extern void mmu_end(vx4_cpu *vcpu);
+
+/**
+ * Sets the page directory used to translate the CPU's accesses, and
+ * empties the TLB. The CPU is signalled, so that the running core stops
+ * and the next run sees whether paging is on, see cpu_run_core.
+ *
+ * IN base: The physical address of the page directory, its low 12 bits
+ * being ignored, or 0 to turn paging off.
+ */
+extern void mmu_set_base(vx4_cpu *vcpu, mem_addr base);
+
+/**
+ * Discards the TLB's translation of one page, for after its page table
+ * entry has been changed.
+ *
+ * IN addr: Any virtual address within the page.
+ */
+extern void mmu_invalidate(vx4_cpu *vcpu, mem_addr addr);
+
+/**
+ * Discards every translation in the TLB.
+ */
+extern void mmu_flush(vx4_cpu *vcpu);
+
+/**
+ * Translates an address that missed in the TLB by walking the page tables,
+ * and caches the result. Use mmu_translate instead, which only calls this
+ * on a miss.
+ *
+ * IN addr: The virtual address accessed.
+ * IN kind: How the address is being accessed.
+ * OUT dest: The physical address.
+ *
+ * Returns:
+ * ERR_NOERR: The address was translated.
+ * ERR_PCOND: The page isn't mapped for this kind of access, so the fault
+ * has been recorded for mmu_take_fault.
+ */
+extern error_t mmu_fill(vx4_cpu *vcpu, mem_addr addr, mmu_access kind, mem_addr *dest);
+
+/**
+ * Checks whether the last failed instruction failed because of a page
+ * fault, and clears it.
+ *
+ * Returns: Whether it was a page fault.
+ */
+extern bool mmu_take_fault(vx4_cpu *vcpu);
+
+/**
+ * Fetches the last page fault, for the rdfault instruction.
+ *
+ * OUT addr: The virtual address accessed.
+ * OUT kind: The mmu_access made.
+ */
+extern void mmu_last_fault(vx4_cpu *vcpu, uint32_t *addr, uint32_t *kind);
+
+/**
+ * As the mem.h functions of the same names, for a CPU's virtual addresses.
+ * Each checks every page of the span before touching any, so a page fault
+ * leaves memory as it was.
+ *
+ * Returns:
+ * ERR_NOERR: The operation completed.
+ * ERR_PCOND: A page wasn't mapped for the access, see mmu_take_fault.
+ */
+extern error_t mmu_read_mem(vx4_cpu *vcpu, mem_addr base, void *dest, mem_size num);
+extern error_t mmu_write_mem(vx4_cpu *vcpu, mem_addr base, const void *src, mem_size num);
+extern error_t mmu_copy(vx4_cpu *vcpu, mem_addr dest, mem_addr src, mem_size num);
+extern error_t mmu_compare(vx4_cpu *vcpu, mem_addr a, mem_addr b, mem_size num, uint32_t diff[2], mem_size *offset);
+extern error_t mmu_set_bytes(vx4_cpu *vcpu, mem_addr base, uint8_t val, mem_size num);
+
+////////////////////////////////////////////////////////////////////////////////
+// Inline function definitions
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Returns whether the CPU's addresses are being translated.
+ */
+static inline bool mmu_enabled(const vx4_cpu *vcpu)
+{
+	return vcpu->mmu->base != 0;
+}
+
+/**
+ * Translates a virtual address to a physical one, walking the page tables
+ * only if the TLB misses. With paging off, addresses are physical already.
+ *
+ * IN addr: The virtual address accessed.
+ * IN kind: How the address is being accessed.
+ * OUT dest: The physical address.
+ *
+ * Returns:
+ * ERR_NOERR: The address was translated.
+ * ERR_PCOND: The page isn't mapped for this kind of access, see mmu_fill.
+ */
+static inline error_t mmu_translate(vx4_cpu *vcpu, mem_addr addr, mmu_access kind, mem_addr *dest)
+{
+	const mmu_context *mmu = vcpu->mmu;
+
+	if (mmu->base == 0) {
+		*dest = addr;
+		return ERR_NOERR;
+	}
+
+	const mmu_tlb_entry *entry = &mmu->tlb[MMU_TLB_INDEX(addr)];
+
+	if (entry->tags[kind] == MMU_PAGE_OF(addr)) {
+		*dest = entry->frame | MMU_PAGE_OFFSET(addr);
+		return ERR_NOERR;
+	}
+
+	return mmu_fill(vcpu, addr, kind, dest);
+}
+
+/**
+ * As the mem.h functions of the same names, for a CPU's virtual addresses.
+ * Being size-aligned, none of these accesses can span two pages.
+ *
+ * Returns:
+ * ERR_NOERR: The access completed.
+ * ERR_INVAL: The address was not correctly aligned.
+ * ERR_PCOND: The page wasn't mapped for the access, see mmu_take_fault.
+ */
+static inline error_t mmu_read_dbyte(vx4_cpu *vcpu, mem_addr base, uint16_t *dest)
+{
+	mem_addr addr;
+	if (mmu_translate(vcpu, base, MMU_READ, &addr) != ERR_NOERR) {
+		return ERR_PCOND;
+	}
+
+	mem_cache_bypass(&vcpu->memcache);
+	return mem_read_dbyte(vcpu->vm, addr, dest);
+}
+
+static inline error_t mmu_read_word(vx4_cpu *vcpu, mem_addr base, uint32_t *dest)
+{
+	mem_addr addr;
+	if (mmu_translate(vcpu, base, MMU_READ, &addr) != ERR_NOERR) {
+		return ERR_PCOND;
+	}
+
+	return mem_cached_read_word(vcpu->vm, &vcpu->memcache, addr, dest);
+}
+
+static inline error_t mmu_write_word(vx4_cpu *vcpu, mem_addr base, uint32_t val)
+{
+	mem_addr addr;
+	if (mmu_translate(vcpu, base, MMU_WRITE, &addr) != ERR_NOERR) {
+		return ERR_PCOND;
+	}
+
+	return mem_cached_write_word(vcpu->vm, &vcpu->memcache, addr, val);
+}
+
+static inline error_t mmu_read_dword(vx4_cpu *vcpu, mem_addr base, uint64_t *dest)
+{
+	mem_addr addr;
+	if (mmu_translate(vcpu, base, MMU_READ, &addr) != ERR_NOERR) {
+		return ERR_PCOND;
+	}
+
+	return mem_cached_read_dword(vcpu->vm, &vcpu->memcache, addr, dest);
+}
+
+static inline error_t mmu_write_dword(vx4_cpu *vcpu, mem_addr base, uint64_t val)
+{
+	mem_addr addr;
+	if (mmu_translate(vcpu, base, MMU_WRITE, &addr) != ERR_NOERR) {
+		return ERR_PCOND;
+	}
+
+	return mem_cached_write_dword(vcpu->vm, &vcpu->memcache, addr, val);
+}
+
+static inline error_t mmu_read_vector(vx4_cpu *vcpu, mem_addr base, void *dest)
+{
+	mem_addr addr;
+	if (mmu_translate(vcpu, base, MMU_READ, &addr) != ERR_NOERR) {
+		return ERR_PCOND;
+	}
+
+	return mem_cached_read_vector(vcpu->vm, &vcpu->memcache, addr, dest);
+}
+
+static inline error_t mmu_write_vector(vx4_cpu *vcpu, mem_addr base, const void *src)
+{
+	mem_addr addr;
+	if (mmu_translate(vcpu, base, MMU_WRITE, &addr) != ERR_NOERR) {
+		return ERR_PCOND;
+	}
+
+	return mem_cached_write_vector(vcpu->vm, &vcpu->memcache, addr, src);
+}
+
+static inline error_t mmu_exchange_word(vx4_cpu *vcpu, mem_addr base, uint32_t val, uint32_t *old)
+{
+	mem_addr addr;
+	if (mmu_translate(vcpu, base, MMU_WRITE, &addr) != ERR_NOERR) {
+		return ERR_PCOND;
+	}
+
+	mem_cache_bypass(&vcpu->memcache);
+	return mem_exchange_word(vcpu->vm, addr, val, old);
+}
+
+static inline error_t mmu_fetch_add_word(vx4_cpu *vcpu, mem_addr base, uint32_t val, uint32_t *old)
+{
+	mem_addr addr;
+	if (mmu_translate(vcpu, base, MMU_WRITE, &addr) != ERR_NOERR) {
+		return ERR_PCOND;
+	}
+
+	mem_cache_bypass(&vcpu->memcache);
+	return mem_fetch_add_word(vcpu->vm, addr, val, old);
+}
+
+static inline error_t mmu_cas_word(vx4_cpu *vcpu, mem_addr base, uint32_t *expected, uint32_t val)
+{
+	mem_addr addr;
+	if (mmu_translate(vcpu, base, MMU_WRITE, &addr) != ERR_NOERR) {
+		return ERR_PCOND;
+	}
+
+	mem_cache_bypass(&vcpu->memcache);
+	return mem_cas_word(vcpu->vm, addr, expected, val);
+}
@@ -1,20 +1,18 @@
 #include "port.h"
 
 #include "error.h"
+#include "machine.h"
+#include "sync.h"
 
 #include <stdlib.h>
 #include <stdint.h>
 
+#include <SDL2/SDL_mutex.h>
+
 ////////////////////////////////////////////////////////////////////////////////
 // Module internal declarations
 ////////////////////////////////////////////////////////////////////////////////
 
-/**
- * Stores the status of each port. Each entry is a pointer to the
- * structure describing the given port.
- */
-static port_entry *ports[PORT_NUM_PORTS];
-
 /**
  * Registers a handler on a specific port.
  *
@@ -29,7 +27,7 @@ static port_entry *ports[PORT_NUM_PORTS];
  * ERR_INVAL: The port specified was out of range (can never exist).
  * ERR_PCOND: The port specified was already in use.
  */
-static error_t bind_port(port_id num, port_entry *cfg);
+static error_t bind_port(vx4_machine *vm, port_id num, port_entry *cfg);
 
 /**
  * Unregisters a handler on a specific port.
@@ -41,49 +39,65 @@ static error_t bind_port(port_id num, port_entry *cfg);
  * ERR_INVAL: The port specified was out of range (can never exist).
  * ERR_PCOND: The port specified is currently unbound.
  */
-static error_t unbind_port(port_id num);
+static error_t unbind_port(vx4_machine *vm, port_id num);
 
 /**
  * Returns the lowest-numbered port unused (ready to be allocated).
  */
-static port_id next_unused();
+static port_id next_unused(vx4_machine *vm);
 
 /**
  * Marks a port as available for reuse.
  */
-static void mark_unused(port_id num);
+static void mark_unused(vx4_machine *vm, port_id num);
 
 ////////////////////////////////////////////////////////////////////////////////
 // Interface functions
 ////////////////////////////////////////////////////////////////////////////////
 
-error_t port_install(port_entry *cfg, port_id *num)
+error_t port_begin(vx4_machine *vm)
+{
+	vm->ports.mutex = SDL_CreateMutex();
+	if (!vm->ports.mutex) {
+		return ERR_EXTERN;
+	}
+
+	return ERR_NOERR;
+}
+
+void port_end(vx4_machine *vm)
 {
-	*num = next_unused();
+	SDL_DestroyMutex(vm->ports.mutex);
+	vm->ports.mutex = NULL;
+}
+
+error_t port_install(vx4_machine *vm, port_entry *cfg, port_id *num)
+{
+	*num = next_unused(vm);
 
-	return bind_port(*num, cfg);
+	return bind_port(vm, *num, cfg);
 }
 
-error_t port_remove(port_id num)
+error_t port_remove(vx4_machine *vm, port_id num)
 {
-	error_t stat = unbind_port(num);
+	error_t stat = unbind_port(vm, num);
 
 	// If the unbinding failed, the port may not be valid
 	// So don't attempt to reuse it.
 	if (stat == ERR_NOERR) {
-		mark_unused(num);
+		mark_unused(vm, num);
 	}
 
 	return stat;
 }
 
-error_t port_write(port_id num, uint32_t data)
+error_t port_write(vx4_machine *vm, port_id num, uint32_t data)
 {
 	if (!IS_VALID_PORT(num)) {
 		return ERR_INVAL;
 	}
 
-	const port_entry *curr = ports[num];
+	const port_entry *curr = vm->ports.ports[num];
 
 	if (curr == NULL) {
 		return ERR_PCOND;
@@ -92,26 +106,38 @@ error_t port_write(port_id num, uint32_t data)
 	// Default write handler just swallows the data
 	// So we don't error on NULL here
 	if (curr->write != NULL) {
-		curr->write(num, data);
+		if (SYNC_LOCK(vm->ports.mutex) != 0) {
+			return ERR_EXTERN;
+		}
+
+		curr->write(vm, num, data);
+
+		SYNC_UNLOCK(vm->ports.mutex);
 	}
 
 	return ERR_NOERR;
 }
 
-error_t port_read(port_id num, uint32_t *data)
+error_t port_read(vx4_machine *vm, port_id num, uint32_t *data)
 {
 	if (!IS_VALID_PORT(num)) {
 		return ERR_INVAL;
 	}
 
-	const port_entry *curr = ports[num];
+	const port_entry *curr = vm->ports.ports[num];
 
 	if (curr == NULL) {
 		return ERR_PCOND;
 	}
 
 	if (curr->read != NULL) {
-		*data = curr->read(num);
+		if (SYNC_LOCK(vm->ports.mutex) != 0) {
+			return ERR_EXTERN;
+		}
+
+		*data = curr->read(vm, num);
+
+		SYNC_UNLOCK(vm->ports.mutex);
 	}
 	else {
 		// Default read handler is an endless stream of zeros
@@ -121,13 +147,13 @@ error_t port_read(port_id num, uint32_t *data)
 	return ERR_NOERR;
 }
 
-const char *port_get_ident(port_id num)
+const char *port_get_ident(vx4_machine *vm, port_id num)
 {
 	if (!IS_VALID_PORT(num)) {
 		return NULL;
 	}
 
-	const port_entry *curr = ports[num];
+	const port_entry *curr = vm->ports.ports[num];
 
 	if (curr == NULL) {
 		return NULL;
@@ -140,65 +166,62 @@ const char *port_get_ident(port_id num)
 // Module internal functions
 ////////////////////////////////////////////////////////////////////////////////
 
-error_t bind_port(port_id num, port_entry *cfg)
+error_t bind_port(vx4_machine *vm, port_id num, port_entry *cfg)
 {
 	if (!IS_VALID_PORT(num)) {
 		return ERR_INVAL;
 	}
 
-	if (ports[num] != NULL) {
+	if (vm->ports.ports[num] != NULL) {
 		return ERR_PCOND;
 	}
 
-	ports[num] = cfg;
+	vm->ports.ports[num] = cfg;
 	return ERR_NOERR;
 }
 
-error_t unbind_port(port_id num)
+error_t unbind_port(vx4_machine *vm, port_id num)
 {
 	if (!IS_VALID_PORT(num)) {
 		return ERR_INVAL;
 	}
 
-	if (ports[num] == NULL) {
+	if (vm->ports.ports[num] == NULL) {
 		return ERR_PCOND;
 	}
 
-	ports[num] = NULL;
+	vm->ports.ports[num] = NULL;
 	return ERR_NOERR;
 }
 
-// Used to hold state for the following two functions
-static port_id next_alloc;
-
-port_id next_unused()
+port_id next_unused(vx4_machine *vm)
 {
 	// First check the next_alloc variable
 	// If it's good, we're good
 	// Otherwise we have to go hunting
-	if (ports[next_alloc] != NULL) {
+	if (vm->ports.ports[vm->ports.next_alloc] != NULL) {
 		for (port_id i = 0; IS_VALID_PORT(i); ++i) {
-			if (ports[i] == NULL) {
-				next_alloc = i;
+			if (vm->ports.ports[i] == NULL) {
+				vm->ports.next_alloc = i;
 				break;
 			}
 		}
 	}
 
-	port_id to_ret = next_alloc;
+	port_id to_ret = vm->ports.next_alloc;
 
-	if (!IS_VALID_PORT(++next_alloc)) {
-		next_alloc = 0;
+	if (!IS_VALID_PORT(++vm->ports.next_alloc)) {
+		vm->ports.next_alloc = 0;
 	}
 
 	return to_ret;
 }
 
-void mark_unused(port_id num)
+void mark_unused(vx4_machine *vm, port_id num)
 {
 	// We want to prefer low-numbered ports
-	if (num < next_alloc) {
-		next_alloc = num;
+	if (num < vm->ports.next_alloc) {
+		vm->ports.next_alloc = num;
 	}
 }
 
@@ -1,19 +1,22 @@
 #pragma once
 
 #include "error.h"
+#include "vx4.h"
 
 #include <stdint.h>
 
+#include <SDL2/SDL_mutex.h>
+
 ////////////////////////////////////////////////////////////////////////////////
 // Type declarations
 ////////////////////////////////////////////////////////////////////////////////
 
 typedef uint16_t port_id;
 
-// The port callbacks receive the port they were called from as an argument
-// This allows for binding one function to multiple ports
-typedef void (*port_out_pf)(port_id, uint32_t);
-typedef uint32_t (*port_in_pf)(port_id);
+// The port callbacks receive the machine and port they were called from
+// This allows for binding one function to multiple ports, and machines
+typedef void (*port_out_pf)(vx4_machine *, port_id, uint32_t);
+typedef uint32_t (*port_in_pf)(vx4_machine *, port_id);
 
 typedef struct _port_entry {
 	const char *ident; // A string identifying the owner of the port
@@ -29,10 +32,38 @@ typedef struct _port_entry {
 
 #define IS_VALID_PORT(port) ((port) < PORT_NUM_PORTS)
 
+////////////////////////////////////////////////////////////////////////////////
+// Machine state
+////////////////////////////////////////////////////////////////////////////////
+
+// Should not be touched except by functions in port.c
+typedef struct _port_context {
+	// Each entry points to the structure describing the given port
+	port_entry *ports[PORT_NUM_PORTS];
+	port_id next_alloc; // Where next_unused starts looking
+
+	// Held while a handler runs, so devices never see two CPUs at once
+	SDL_mutex *mutex;
+} port_context;
+
 ////////////////////////////////////////////////////////////////////////////////
 // Function declarations
 ////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * Creates the lock shared by every port. Called by machine_create.
+ *
+ * Returns:
+ * ERR_NOERR: The ports are ready for use.
+ * ERR_EXTERN: The lock couldn't be created.
+ */
+extern error_t port_begin(vx4_machine *vm);
+
+/**
+ * Frees the lock shared by every port.
+ */
+extern void port_end(vx4_machine *vm);
+
 /**
  * Registers a handler (read/write actions) on the next available port.
  *
@@ -46,7 +77,7 @@ typedef struct _port_entry {
  * ERR_NOERR: The handler was successfully added to a port.
  * ERR_PCOND: No available port exists to bind (all are in use).
  */
-extern error_t port_install(port_entry *cfg, port_id *num);
+extern error_t port_install(vx4_machine *vm, port_entry *cfg, port_id *num);
 
 /**
  * Removes a handler set from a port, and marks it for reuse.
@@ -58,11 +89,12 @@ extern error_t port_install(port_entry *cfg, port_id *num);
  * ERR_INVAL: The port specified was out of range (can never exist).
  * ERR_PCOND: The port specified is currently unbound.
  */
-extern error_t port_remove(port_id num);
+extern error_t port_remove(vx4_machine *vm, port_id num);
 
 /**
  * Writes a word to a given port, causing it to be received by
- * a listening device.
+ * a listening device. Handlers are run one at a time, whichever CPU
+ * they are called from.
  *
  * IN num: The port number to write. Must be in range [0, PORT_NUM_PORTS).
  * IN data: The word to be written.
@@ -71,8 +103,9 @@ extern error_t port_remove(port_id num);
  * ERR_NOERR: The write completed successfully.
  * ERR_INVAL: The port specified was out of range (can never exist).
  * ERR_PCOND: The port specified is currently unbound.
+ * ERR_EXTERN: An error occurred acquiring the mutex.
  */
-extern error_t port_write(port_id num, uint32_t data);
+extern error_t port_write(vx4_machine *vm, port_id num, uint32_t data);
 
 /**
  * Reads a word from a given port, as provided by a device.
@@ -84,8 +117,9 @@ extern error_t port_write(port_id num, uint32_t data);
  * ERR_NOERR: The read completed successfully.
  * ERR_INVAL: The port specified was out of range (can never exist).
  * ERR_PCOND: The port specified is currently unbound.
+ * ERR_EXTERN: An error occurred acquiring the mutex.
  */
-extern error_t port_read(port_id num, uint32_t *data);
+extern error_t port_read(vx4_machine *vm, port_id num, uint32_t *data);
 
 /**
  * Returns the ident name of a particular port.
@@ -94,5 +128,5 @@ extern error_t port_read(port_id num, uint32_t *data);
  *
  * Returns: The ident string for the given port, or NULL on error.
  */
-extern const char *port_get_ident(port_id num);
+extern const char *port_get_ident(vx4_machine *vm, port_id num);
 
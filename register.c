@@ -2,15 +2,11 @@
 
 #include "error.h"
 #include "mem.h"
+#include "mmu.h"
+#include "machine.h"
 
 #include <stdint.h>
 
-////////////////////////////////////////////////////////////////////////////////
-// Module internal declarations
-////////////////////////////////////////////////////////////////////////////////
-
-static uint32_t registers[REG_NUM_REGS];
-
 ////////////////////////////////////////////////////////////////////////////////
 // Interface functions
 ////////////////////////////////////////////////////////////////////////////////
@@ -20,144 +16,144 @@ static uint32_t registers[REG_NUM_REGS];
  * basics are quite similar in each case. Taking reg_read_high_byte
  * as an example:
  *
- * &registers[which] takes the address of register in question.
+ * &vcpu->registers[which] takes the address of register in question.
  * Then we cast it with (uint8_t *) and treat it as an array of
  * 4 bytes. The high byte is bits [8, 15] and is thus at position
  * 1 in the new "array".
  */
 
-error_t reg_read_low_byte(reg_id which, uint8_t *dest)
+error_t reg_read_low_byte(vx4_cpu *vcpu, reg_id which, uint8_t *dest)
 {
 	if (!IS_VALID_REGISTER(which)) {
 		return ERR_INVAL;
 	}
 
-	uint8_t *reg = (uint8_t *)&registers[which];
+	uint8_t *reg = (uint8_t *)&vcpu->registers[which];
 
 	*dest = reg[0];
 	return ERR_NOERR;
 }
 
-error_t reg_read_high_byte(reg_id which, uint8_t *dest)
+error_t reg_read_high_byte(vx4_cpu *vcpu, reg_id which, uint8_t *dest)
 {
 	if (!IS_VALID_REGISTER(which)) {
 		return ERR_INVAL;
 	}
 
-	uint8_t *reg = (uint8_t *)&registers[which];
+	uint8_t *reg = (uint8_t *)&vcpu->registers[which];
 
 	*dest = reg[1];
 	return ERR_NOERR;
 }
 
-error_t reg_read_low_dbyte(reg_id which, uint16_t *dest)
+error_t reg_read_low_dbyte(vx4_cpu *vcpu, reg_id which, uint16_t *dest)
 {
 	if (!IS_VALID_REGISTER(which)) {
 		return ERR_INVAL;
 	}
 
-	uint16_t *reg = (uint16_t *)&registers[which];
+	uint16_t *reg = (uint16_t *)&vcpu->registers[which];
 
 	*dest = reg[0];
 	return ERR_NOERR;
 }
 
-error_t reg_read_high_dbyte(reg_id which, uint16_t *dest)
+error_t reg_read_high_dbyte(vx4_cpu *vcpu, reg_id which, uint16_t *dest)
 {
 	if (!IS_VALID_REGISTER(which)) {
 		return ERR_INVAL;
 	}
 
-	uint16_t *reg = (uint16_t *)&registers[which];
+	uint16_t *reg = (uint16_t *)&vcpu->registers[which];
 
 	*dest = reg[1];
 	return ERR_NOERR;
 }
 
-error_t reg_read_word(reg_id which, uint32_t *dest)
+error_t reg_read_word(vx4_cpu *vcpu, reg_id which, uint32_t *dest)
 {
 	if (!IS_VALID_REGISTER(which)) {
 		return ERR_INVAL;
 	}
 
-	*dest = registers[which];
+	*dest = vcpu->registers[which];
 	return ERR_NOERR;
 }
 
-error_t reg_write_low_byte(reg_id which, uint8_t val)
+error_t reg_write_low_byte(vx4_cpu *vcpu, reg_id which, uint8_t val)
 {
 	if (!IS_VALID_REGISTER(which)) {
 		return ERR_INVAL;
 	}
 
-	uint8_t *reg = (uint8_t *)&registers[which];
+	uint8_t *reg = (uint8_t *)&vcpu->registers[which];
 
 	reg[0] = val;
 	return ERR_NOERR;
 }
 
-error_t reg_write_high_byte(reg_id which, uint8_t val)
+error_t reg_write_high_byte(vx4_cpu *vcpu, reg_id which, uint8_t val)
 {
 	if (!IS_VALID_REGISTER(which)) {
 		return ERR_INVAL;
 	}
 
-	uint8_t *reg = (uint8_t *)&registers[which];
+	uint8_t *reg = (uint8_t *)&vcpu->registers[which];
 
 	reg[1] = val;
 	return ERR_NOERR;
 }
 
-error_t reg_write_low_dbyte(reg_id which, uint16_t val)
+error_t reg_write_low_dbyte(vx4_cpu *vcpu, reg_id which, uint16_t val)
 {
 	if (!IS_VALID_REGISTER(which)) {
 		return ERR_INVAL;
 	}
 
-	uint16_t *reg = (uint16_t *)&registers[which];
+	uint16_t *reg = (uint16_t *)&vcpu->registers[which];
 
 	reg[0] = val;
 	return ERR_NOERR;
 }
 
-error_t reg_write_high_dbyte(reg_id which, uint16_t val)
+error_t reg_write_high_dbyte(vx4_cpu *vcpu, reg_id which, uint16_t val)
 {
 	if (!IS_VALID_REGISTER(which)) {
 		return ERR_INVAL;
 	}
 
-	uint16_t *reg = (uint16_t *)&registers[which];
+	uint16_t *reg = (uint16_t *)&vcpu->registers[which];
 
 	reg[1] = val;
 	return ERR_NOERR;
 }
 
-error_t reg_write_word(reg_id which, uint32_t val)
+error_t reg_write_word(vx4_cpu *vcpu, reg_id which, uint32_t val)
 {
 	if (!IS_VALID_REGISTER(which)) {
 		return ERR_INVAL;
 	}
 
-	registers[which] = val;
+	vcpu->registers[which] = val;
 	return ERR_NOERR;
 }
 
-error_t reg_write_all_mem(mem_addr start)
+error_t reg_write_all_mem(vx4_cpu *vcpu, mem_addr start)
 {
     static const mem_size reg_sz = 4u * REG_NUM_REGS;
 
-	if (mem_write_mem(start, registers, reg_sz) != reg_sz) {
+	if (mmu_write_mem(vcpu, start, vcpu->registers, reg_sz) != ERR_NOERR) {
         return ERR_EXTERN;
 	}
 
 	return ERR_NOERR;
 }
 
-error_t reg_read_all_mem(mem_addr start)
+error_t reg_read_all_mem(vx4_cpu *vcpu, mem_addr start)
 {
 	static const mem_size reg_sz = 4u * REG_NUM_REGS;
 
-	if (mem_read_mem(start, registers, reg_sz) != reg_sz) {
+	if (mmu_read_mem(vcpu, start, vcpu->registers, reg_sz) != ERR_NOERR) {
 		return ERR_EXTERN;
 	}
 
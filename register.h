@@ -2,6 +2,7 @@
 
 #include "error.h"
 #include "mem.h"
+#include "vx4.h"
 
 #include <stdint.h>
 
@@ -38,6 +39,15 @@ enum _reg_id {
  * (e.g. the low dbyte is bits [0, 15] of the word.)
  */
 
+////////////////////////////////////////////////////////////////////////////////
+// Machine state
+////////////////////////////////////////////////////////////////////////////////
+
+// Left visible so that instruction handlers can skip re-checking register ids
+// that were validated when the instruction was decoded
+// Should not be touched except by functions in register.c or the CPU cores
+typedef uint32_t reg_file[REG_NUM_REGS];
+
 ////////////////////////////////////////////////////////////////////////////////
 // Function declarations
 ////////////////////////////////////////////////////////////////////////////////
@@ -52,11 +62,11 @@ enum _reg_id {
  * ERR_NOERR: The read completed successfully.
  * ERR_INVAL: The register specified by which doesn't exist.
  */
-extern error_t reg_read_low_byte(reg_id which, uint8_t *dest);
-extern error_t reg_read_high_byte(reg_id which, uint8_t *dest);
-extern error_t reg_read_low_dbyte(reg_id which, uint16_t *dest);
-extern error_t reg_read_high_dbyte(reg_id which, uint16_t *dest);
-extern error_t reg_read_word(reg_id which, uint32_t *dest);
+extern error_t reg_read_low_byte(vx4_cpu *vcpu, reg_id which, uint8_t *dest);
+extern error_t reg_read_high_byte(vx4_cpu *vcpu, reg_id which, uint8_t *dest);
+extern error_t reg_read_low_dbyte(vx4_cpu *vcpu, reg_id which, uint16_t *dest);
+extern error_t reg_read_high_dbyte(vx4_cpu *vcpu, reg_id which, uint16_t *dest);
+extern error_t reg_read_word(vx4_cpu *vcpu, reg_id which, uint32_t *dest);
 
 
 /**
@@ -73,21 +83,21 @@ extern error_t reg_read_word(reg_id which, uint32_t *dest);
  * ERR_NOERR: The write completed successfully.
  * ERR_INVAL: The register specified by which doesn't exist.
  */
-extern error_t reg_write_low_byte(reg_id which, uint8_t val);
-extern error_t reg_write_high_byte(reg_id which, uint8_t val);
-extern error_t reg_write_low_dbyte(reg_id which, uint16_t val);
-extern error_t reg_write_high_dbyte(reg_id which, uint16_t val);
-extern error_t reg_write_word(reg_id which, uint32_t val);
+extern error_t reg_write_low_byte(vx4_cpu *vcpu, reg_id which, uint8_t val);
+extern error_t reg_write_high_byte(vx4_cpu *vcpu, reg_id which, uint8_t val);
+extern error_t reg_write_low_dbyte(vx4_cpu *vcpu, reg_id which, uint16_t val);
+extern error_t reg_write_high_dbyte(vx4_cpu *vcpu, reg_id which, uint16_t val);
+extern error_t reg_write_word(vx4_cpu *vcpu, reg_id which, uint32_t val);
 
 /**
  * Causes all the register values to be read from/written to memory beginning
  * at a specified address.
  *
- * IN start: The memory address to begin writing.
+ * IN start: The virtual address to begin writing, see mmu_translate.
  *
  * Returns:
  * ERR_NOERR: Writing/reading completed successfully.
  * ERR_EXTERN: All of the registers couldn't be written/read.
  */
-extern error_t reg_write_all_mem(mem_addr start);
-extern error_t reg_read_all_mem(mem_addr start);
+extern error_t reg_write_all_mem(vx4_cpu *vcpu, mem_addr start);
+extern error_t reg_read_all_mem(vx4_cpu *vcpu, mem_addr start);
@@ -2,6 +2,8 @@
 
 #include "error.h"
 #include "mem.h"
+#include "mmu.h"
+#include "machine.h"
 
 #include <stdint.h>
 
@@ -11,107 +13,123 @@
 
 #define IS_ALIGNED(ptr) (((ptr) & 0x3) == 0)
 
-////////////////////////////////////////////////////////////////////////////////
-// Module internal declarations
-////////////////////////////////////////////////////////////////////////////////
-
-mem_addr reg_sp; // Stack pointer
-mem_addr reg_bp; // Base pointer
-
 ////////////////////////////////////////////////////////////////////////////////
 // Interface functions
 ////////////////////////////////////////////////////////////////////////////////
 
-error_t stack_enter_frame()
+error_t stack_enter_frame(vx4_cpu *vcpu)
 {
-	if (!IS_ALIGNED(reg_sp)) {
+	if (!IS_ALIGNED(vcpu->stack.sp)) {
         return ERR_PCOND;
 	}
 
-	stack_push(reg_bp);
-	reg_bp = reg_sp;
+	if (stack_push(vcpu, vcpu->stack.bp) != ERR_NOERR) {
+		return ERR_PCOND;
+	}
+
+	vcpu->stack.bp = vcpu->stack.sp;
 
 	return ERR_NOERR;
 }
 
-error_t stack_leave_frame()
+error_t stack_leave_frame(vx4_cpu *vcpu)
 {
-	if (!IS_ALIGNED(reg_bp)) {
+	if (!IS_ALIGNED(vcpu->stack.bp)) {
         return ERR_PCOND;
 	}
 
-	reg_sp = reg_bp;
-	stack_pop(&reg_bp);
+	uint32_t bp;
+
+	if (mmu_read_word(vcpu, vcpu->stack.bp, &bp) != ERR_NOERR) {
+		return ERR_PCOND;
+	}
+
+	vcpu->stack.sp = vcpu->stack.bp + 4;
+	vcpu->stack.bp = bp;
 
 	return ERR_NOERR;
 }
 
-error_t stack_push(uint32_t word)
+error_t stack_push(vx4_cpu *vcpu, uint32_t word)
 {
-	if (!IS_ALIGNED(reg_sp)) {
+	if (!IS_ALIGNED(vcpu->stack.sp)) {
         return ERR_PCOND;
 	}
 
-    reg_sp -= 4;
-    mem_write_word(reg_sp, word);
+	// The stack only moves once the access has succeeded, so that an
+	// instruction retried after a page fault finds it as it was
+	if (mmu_write_word(vcpu, vcpu->stack.sp - 4, word) != ERR_NOERR) {
+		return ERR_PCOND;
+	}
+
+	vcpu->stack.sp -= 4;
 
     return ERR_NOERR;
 }
 
-error_t stack_push_multi(const uint32_t *words, mem_size num)
+error_t stack_push_multi(vx4_cpu *vcpu, const uint32_t *words, mem_size num)
 {
-	if (!IS_ALIGNED(reg_sp)) {
+	if (!IS_ALIGNED(vcpu->stack.sp)) {
         return ERR_PCOND;
 	}
 
-	reg_sp -= num * 4;
-	mem_write_mem(reg_sp, words, num * 4);
+	if (mmu_write_mem(vcpu, vcpu->stack.sp - num * 4, words, num * 4) != ERR_NOERR) {
+		return ERR_PCOND;
+	}
+
+	vcpu->stack.sp -= num * 4;
 
 	return ERR_NOERR;
 }
 
-error_t stack_pop(uint32_t *word)
+error_t stack_pop(vx4_cpu *vcpu, uint32_t *word)
 {
-	if (!IS_ALIGNED(reg_sp)) {
+	if (!IS_ALIGNED(vcpu->stack.sp)) {
         return ERR_PCOND;
 	}
 
-	mem_read_word(reg_sp, word);
-	reg_sp += 4;
+	if (mmu_read_word(vcpu, vcpu->stack.sp, word) != ERR_NOERR) {
+		return ERR_PCOND;
+	}
+
+	vcpu->stack.sp += 4;
 
 	return ERR_NOERR;
 }
 
-error_t stack_pop_multi(uint32_t *words, mem_size num)
+error_t stack_pop_multi(vx4_cpu *vcpu, uint32_t *words, mem_size num)
 {
-	if (!IS_ALIGNED(reg_sp)) {
+	if (!IS_ALIGNED(vcpu->stack.sp)) {
         return ERR_PCOND;
 	}
 
-	mem_read_mem(reg_sp, words, num * 4);
-	reg_sp += num * 4;
+	if (mmu_read_mem(vcpu, vcpu->stack.sp, words, num * 4) != ERR_NOERR) {
+		return ERR_PCOND;
+	}
+
+	vcpu->stack.sp += num * 4;
 
 	return ERR_NOERR;
 }
 
-error_t stack_skip(mem_size num)
+error_t stack_skip(vx4_cpu *vcpu, mem_size num)
 {
-	if (!IS_ALIGNED(reg_sp)) {
+	if (!IS_ALIGNED(vcpu->stack.sp)) {
         return ERR_PCOND;
 	}
 
-	reg_sp -= num * 4;
+	vcpu->stack.sp -= num * 4;
 
 	return ERR_NOERR;
 }
 
-error_t stack_unskip(mem_size num)
+error_t stack_unskip(vx4_cpu *vcpu, mem_size num)
 {
-	if (!IS_ALIGNED(reg_sp)) {
+	if (!IS_ALIGNED(vcpu->stack.sp)) {
         return ERR_PCOND;
 	}
 
-	reg_sp += num * 4;
+	vcpu->stack.sp += num * 4;
 
 	return ERR_NOERR;
 }
@@ -2,17 +2,20 @@
 
 #include "error.h"
 #include "mem.h"
+#include "vx4.h"
 
 #include <stdint.h>
 
 ////////////////////////////////////////////////////////////////////////////////
-// Global variable declarations
+// Machine state
 ////////////////////////////////////////////////////////////////////////////////
 
-// These are made global because the CPU may need to directly edit them
+// Left visible because the CPU may need to directly edit these
 // Should not be touched except by functions in cpu.c or stack.c
-extern mem_addr reg_sp; // Stack pointer
-extern mem_addr reg_bp; // Base pointer
+typedef struct _stack_state {
+	mem_addr sp; // Stack pointer
+	mem_addr bp; // Base pointer
+} stack_context;
 
 ////////////////////////////////////////////////////////////////////////////////
 // Function declarations
@@ -24,8 +27,9 @@ extern mem_addr reg_bp; // Base pointer
  * Returns:
  * ERR_NOERR: The operation completed successfully.
  * ERR_PCOND: The stack is currently unaligned and thus in an invalid state.
+ * Also returned, leaving the stack as it was, if a page of it isn't mapped.
  */
-extern error_t stack_enter_frame();
+extern error_t stack_enter_frame(vx4_cpu *vcpu);
 
 /**
  * Leave and destroy the bottom stack frame.
@@ -33,8 +37,9 @@ extern error_t stack_enter_frame();
  * Returns:
  * ERR_NOERR: The operation completed successfully.
  * ERR_PCOND: The operation would cause the stack to become unaligned.
+ * Also returned, leaving the stack as it was, if a page of it isn't mapped.
  */
-extern error_t stack_leave_frame();
+extern error_t stack_leave_frame(vx4_cpu *vcpu);
 
 /**
  * Push a word onto the bottom of the stack.
@@ -44,8 +49,9 @@ extern error_t stack_leave_frame();
  * Returns:
  * ERR_NOERR: The operation completed successfully.
  * ERR_PCOND: The stack is currently unaligned and thus in an invalid state.
+ * Also returned, leaving the stack as it was, if a page of it isn't mapped.
  */
-extern error_t stack_push(uint32_t word);
+extern error_t stack_push(vx4_cpu *vcpu, uint32_t word);
 
 /**
  * Push a number of word onto the bottom of the stack.
@@ -56,8 +62,9 @@ extern error_t stack_push(uint32_t word);
  * Returns:
  * ERR_NOERR: The operation completed successfully.
  * ERR_PCOND: The stack is currently unaligned and thus in an invalid state.
+ * Also returned, leaving the stack as it was, if a page of it isn't mapped.
  */
-extern error_t stack_push_multi(const uint32_t *words, mem_size num);
+extern error_t stack_push_multi(vx4_cpu *vcpu, const uint32_t *words, mem_size num);
 
 /**
  * Pop a word from the bottom of the stack.
@@ -67,8 +74,9 @@ extern error_t stack_push_multi(const uint32_t *words, mem_size num);
  * Returns:
  * ERR_NOERR: The operation completed successfully.
  * ERR_PCOND: The stack is currently unaligned and thus in an invalid state.
+ * Also returned, leaving the stack as it was, if a page of it isn't mapped.
  */
-extern error_t stack_pop(uint32_t *word);
+extern error_t stack_pop(vx4_cpu *vcpu, uint32_t *word);
 
 /**
  * Pop a number of words from the bottom of the stack.
@@ -79,8 +87,9 @@ extern error_t stack_pop(uint32_t *word);
  * Returns:
  * ERR_NOERR: The operation completed successfully.
  * ERR_PCOND: The stack is currently unaligned and thus in an invalid state.
+ * Also returned, leaving the stack as it was, if a page of it isn't mapped.
  */
-extern error_t stack_pop_multi(uint32_t *words, mem_size num);
+extern error_t stack_pop_multi(vx4_cpu *vcpu, uint32_t *words, mem_size num);
 
 /**
  * Skip a number of stack slots, leaving holes in the stack.
@@ -91,7 +100,7 @@ extern error_t stack_pop_multi(uint32_t *words, mem_size num);
  * ERR_NOERR: The operation completed successfully.
  * ERR_PCOND: The stack is currently unaligned and thus in an invalid state.
  */
-extern error_t stack_skip(mem_size num);
+extern error_t stack_skip(vx4_cpu *vcpu, mem_size num);
 
 /**
  * Jump back a number of stack slots, causing anything in those slots to
@@ -103,4 +112,4 @@ extern error_t stack_skip(mem_size num);
  * ERR_NOERR: The operation completed successfully.
  * ERR_PCOND: The stack is currently unaligned and thus in an invalid state.
  */
-extern error_t stack_unskip(mem_size num);
+extern error_t stack_unskip(vx4_cpu *vcpu, mem_size num);
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <SDL2/SDL_mutex.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Constants + helper macros
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Building with VX4_SINGLE_THREAD runs the CPUs, devices and window all on
+ * the main thread, in a fixed order (see cpu_run), so nothing shared ever
+ * needs locking. Mutexes are still created and destroyed as usual, so that
+ * setup and error handling are the same in both builds, but locking one
+ * always succeeds without touching it.
+ */
+#ifdef VX4_SINGLE_THREAD
+#define SYNC_LOCK(mutex) ((void)(mutex), 0)
+#define SYNC_UNLOCK(mutex) ((void)(mutex))
+#else
+#define SYNC_LOCK(mutex) SDL_LockMutex(mutex)
+#define SYNC_UNLOCK(mutex) SDL_UnlockMutex(mutex)
+#endif // VX4_SINGLE_THREAD
@@ -2,6 +2,7 @@
 
 #include "port.h"
 #include "cpu.h"
+#include "machine.h"
 
 #include <stdint.h>
 #include <stddef.h>
@@ -23,7 +24,7 @@
  * IN num: The port that caused the function to be called. Ignored.
  * IN command_part: The word to be added to the command.
  */
-static void command_issue(port_id num, uint32_t command_part);
+static void command_issue(vx4_machine *vm, port_id num, uint32_t command_part);
 
 /**
  * Executes the command configured by command_issue.
@@ -37,13 +38,13 @@ static void command_issue(port_id num, uint32_t command_part);
  *
  * Returns: The value produced by this step of the command.
  */
-static uint32_t command_execute(port_id num);
+static uint32_t command_execute(vx4_machine *vm, port_id num);
 
 /**
  * Resets all command procedures. Called in the operation of
  * command_issue.
  */
-static void command_clear();
+static void command_clear(vx4_machine *vm);
 
 static port_entry system_port = {
 	"System command",
@@ -51,24 +52,6 @@ static port_entry system_port = {
 	command_execute
 };
 
-// We need a place to store the port number we are assigned
-static port_id assigned_port;
-
-typedef struct _sys_operation {
-	sys_action act;
-	uint32_t data;
-} sys_operation;
-
-// Current operation as set by command_issue and read by command_execute
-static sys_operation curr_op;
-
-// Used by multiple state machine-type procedures
-typedef enum _cmd_state {
-	CMD_START,
-	CMD_MID,
-	CMD_DONE,
-} cmd_state;
-
 // Implementations of specific commands
 
 /**
@@ -80,41 +63,41 @@ typedef enum _cmd_state {
  * Returns: 0 if reset == true, otherwise the next byte in the ident
  * string of the port specified on the first non-resetting call.
  */
-static uint32_t read_port_ident(port_id port, bool reset);
+static uint32_t read_port_ident(vx4_machine *vm, port_id port, bool reset);
 
 ////////////////////////////////////////////////////////////////////////////////
 // Interface functions
 ////////////////////////////////////////////////////////////////////////////////
 
-error_t install_system_handler()
+error_t install_system_handler(vx4_machine *vm)
 {
-	return port_install(&system_port, &assigned_port);
+	return port_install(vm, &system_port, &vm->sysp.assigned_port);
 }
 
-error_t remove_system_handler()
+error_t remove_system_handler(vx4_machine *vm)
 {
-	return port_remove(assigned_port);
+	return port_remove(vm, vm->sysp.assigned_port);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // Module internal functions
 ////////////////////////////////////////////////////////////////////////////////
 
-void command_issue(port_id num, uint32_t command_part)
+void command_issue(vx4_machine *vm, port_id num, uint32_t command_part)
 {
 	(void)num;
 
-	static cmd_state state = CMD_START;
+	cmd_state *state = &vm->sysp.issue_state;
 
-	switch (state) {
+	switch (*state) {
 		case CMD_START:
 			if (command_part == SYS_CLEAR) {
-				command_clear();
-				state = CMD_START;
+				command_clear(vm);
+				*state = CMD_START;
 			}
 			else {
-				curr_op.act = (int)command_part;
-				state = CMD_MID;
+				vm->sysp.curr_op.act = (int)command_part;
+				*state = CMD_MID;
 			}
 			break;
 
@@ -123,80 +106,82 @@ void command_issue(port_id num, uint32_t command_part)
 			// We might actually _want_ a zero as our data
 			// But if we've issued a one-word command, this means
 			// We need to write _two_ zeros to correctly reset
-			curr_op.data = command_part;
-			state = CMD_DONE;
+			vm->sysp.curr_op.data = command_part;
+			*state = CMD_DONE;
 			break;
 
 		case CMD_DONE:
 			if (command_part == SYS_CLEAR) {
-				command_clear();
-				state = CMD_START;
+				command_clear(vm);
+				*state = CMD_START;
 			}
 			break;
 	}
 }
 
-uint32_t command_execute(port_id num)
+uint32_t command_execute(vx4_machine *vm, port_id num)
 {
 	(void)num;
 
-	switch (curr_op.act) {
+	switch (vm->sysp.curr_op.act) {
 		case SYS_CLEAR:
 		default:
 			return 0;
 
 		case SYS_RESET:
-			cpu_queue_reset();
+			cpu_queue_reset(vm);
 			return SYS_RESET;
 
 		case SYS_HALT:
-			cpu_queue_halt();
+			cpu_queue_halt(vm);
 			return SYS_HALT;
 
 		case SYS_PORTINFO:
-			return read_port_ident(curr_op.data, false);
+			return read_port_ident(vm, vm->sysp.curr_op.data, false);
+
+		case SYS_SPEED:
+			// Reads back the speed now in effect
+			cpu_set_speed(vm, vm->sysp.curr_op.data);
+			return cpu_get_speed(vm);
 	}
 }
 
-void command_clear()
+void command_clear(vx4_machine *vm)
 {
-	curr_op.act = SYS_CLEAR;
-	curr_op.data = 0;
+	vm->sysp.curr_op.act = SYS_CLEAR;
+	vm->sysp.curr_op.data = 0;
 
-	read_port_ident(0, true);
+	read_port_ident(vm, 0, true);
 }
 
-uint32_t read_port_ident(port_id port, bool reset)
+uint32_t read_port_ident(vx4_machine *vm, port_id port, bool reset)
 {
-	static cmd_state state = CMD_START;
-
-	static const char *ident = NULL;
-	static size_t pos = 0;
+	sysp_context *sysp = &vm->sysp;
 
 	if (reset) {
-		ident = NULL;
-		pos = 0;
+		sysp->ident = NULL;
+		sysp->ident_pos = 0;
 
-		state = CMD_START;
+		sysp->ident_state = CMD_START;
 		return 0;
 	}
 
-	switch (state) {
+	switch (sysp->ident_state) {
 		default:
 		case CMD_START:
-			ident = port_get_ident(port);
-			state = CMD_MID;
+			sysp->ident = port_get_ident(vm, port);
+			sysp->ident_state = CMD_MID;
 			// fallthrough
 
 		case CMD_MID:
-			if (ident == NULL) {
+			if (sysp->ident == NULL) {
 				return 0;
 			}
 			else {
-				char out = ident[pos++];
+				char out = sysp->ident[sysp->ident_pos++];
 
 				if (out == 0) {
-					state = CMD_DONE;
+					sysp->ident_state = CMD_DONE;
 				}
 
 				return out;
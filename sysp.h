@@ -1,6 +1,11 @@
 #pragma once
 
 #include "error.h"
+#include "port.h"
+#include "vx4.h"
+
+#include <stdint.h>
+#include <stddef.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 // Constants + helper macros
@@ -11,8 +16,40 @@ typedef enum _sys_action {
 	SYS_RESET, // Reset the whole system
 	SYS_HALT, // Halt the system, quitting the program
 	SYS_PORTINFO, // Make the ident of a port available to be read
+	SYS_SPEED, // Set each CPU's speed in MHz, 0 for unthrottled, see cpu_set_speed
 } sys_action;
 
+////////////////////////////////////////////////////////////////////////////////
+// Machine state
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct _sys_operation {
+	sys_action act;
+	uint32_t data;
+} sys_operation;
+
+// Used by multiple state machine-type procedures
+typedef enum _cmd_state {
+	CMD_START,
+	CMD_MID,
+	CMD_DONE,
+} cmd_state;
+
+// Should not be touched except by functions in sysp.c
+typedef struct _sysp_context {
+	// We need a place to store the port number we are assigned
+	port_id assigned_port;
+
+	// Current operation as set by command_issue and read by command_execute
+	sys_operation curr_op;
+	cmd_state issue_state;
+
+	// Progress of read_port_ident
+	cmd_state ident_state;
+	const char *ident;
+	size_t ident_pos;
+} sysp_context;
+
 ////////////////////////////////////////////////////////////////////////////////
 // Function declarations
 ////////////////////////////////////////////////////////////////////////////////
@@ -22,11 +59,11 @@ typedef enum _sys_action {
  *
  * Returns: Any errors occurring during a call to port_insert.
  */
-extern error_t install_system_handler();
+extern error_t install_system_handler(vx4_machine *vm);
 
 /**
  * Unregisters the system handler from its assigned port.
  *
  * Returns: Any errors occurring during a call to port_remove.
  */
-extern error_t remove_system_handler();
+extern error_t remove_system_handler(vx4_machine *vm);
@@ -1,6 +1,7 @@
 #include "textio.h"
 
 #include "port.h"
+#include "machine.h"
 
 #include <stdio.h>
 #include <stdint.h>
@@ -15,7 +16,7 @@
  *
  * IN c: The unsigned char to write, promoted to 32 bits.
  */
-static void console_write(port_id num, uint32_t c);
+static void console_write(vx4_machine *vm, port_id num, uint32_t c);
 
 /**
  * Reads a character from the console
@@ -23,7 +24,7 @@ static void console_write(port_id num, uint32_t c);
  * Returns: The unsigned char read, promoted to 32 bits,
  * or 0 on error.
  */
-static uint32_t console_read(port_id num);
+static uint32_t console_read(vx4_machine *vm, port_id num);
 
 static port_entry text_port = {
     "Generic serial I/O",
@@ -31,40 +32,39 @@ static port_entry text_port = {
     console_read // Port reads come from console
 };
 
-// We need a place to store the port number we are assigned
-static port_id assigned_port;
-
 ////////////////////////////////////////////////////////////////////////////////
 // Interface functions
 ////////////////////////////////////////////////////////////////////////////////
 
-error_t install_textio_handler()
+error_t install_textio_handler(vx4_machine *vm)
 {
     // We want to see any results immediately
     setvbuf(stdin, NULL, _IONBF, 0);
     setvbuf(stdout, NULL, _IONBF, 0);
 
-    return port_install(&text_port, &assigned_port);
+    return port_install(vm, &text_port, &vm->textio.assigned_port);
 }
 
-error_t remove_textio_handler()
+error_t remove_textio_handler(vx4_machine *vm)
 {
-    return port_remove(assigned_port);
+    return port_remove(vm, vm->textio.assigned_port);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // Module internal functions
 ////////////////////////////////////////////////////////////////////////////////
 
-void console_write(port_id num, uint32_t c)
+void console_write(vx4_machine *vm, port_id num, uint32_t c)
 {
+    (void)vm;
     (void)num;
 
     putchar((unsigned char)c);
 }
 
-uint32_t console_read(port_id num)
+uint32_t console_read(vx4_machine *vm, port_id num)
 {
+    (void)vm;
     (void)num;
 
     int c = getchar();
@@ -1,6 +1,18 @@
 #pragma once
 
 #include "error.h"
+#include "port.h"
+#include "vx4.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// Machine state
+////////////////////////////////////////////////////////////////////////////////
+
+// Should not be touched except by functions in textio.c
+typedef struct _textio_context {
+    // We need a place to store the port number we are assigned
+    port_id assigned_port;
+} textio_context;
 
 ////////////////////////////////////////////////////////////////////////////////
 // Function declarations
@@ -11,11 +23,11 @@
  *
  * Returns: Any errors occurring during a call to port_insert.
  */
-extern error_t install_textio_handler();
+extern error_t install_textio_handler(vx4_machine *vm);
 
 /**
  * Unregisters the text I/O handler from its assigned port.
  *
  * Returns: Any errors occurring during a call to port_remove.
  */
-extern error_t remove_textio_handler();
+extern error_t remove_textio_handler(vx4_machine *vm);
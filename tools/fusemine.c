@@ -0,0 +1,239 @@
+/**
+ * fusemine: suggests superinstructions from a trace recorded with
+ * vx4 -trace <file>.
+ *
+ * Counts how often each pair and triple of instructions runs back to back,
+ * where each instruction directly follows the last in memory (so a taken
+ * jump breaks the sequence). Every sequence run as one superinstruction
+ * saves a dispatch per instruction after the first, and candidates are
+ * listed by the dispatches they'd save. See instruction_fusion in
+ * instruction.h for which candidates can actually be fused.
+ *
+ * Usage: fusemine [-n count] [trace]
+ * The trace is read from stdin if no file is given.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Internal constants + helper macros
+////////////////////////////////////////////////////////////////////////////////
+
+#define MAX_NAMES 64 // Distinct mnemonics the trace may contain
+#define MAX_NAME_LEN 32
+#define DEFAULT_SHOWN 10
+
+////////////////////////////////////////////////////////////////////////////////
+// Module internal declarations
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct _candidate {
+	unsigned seq[3];
+	size_t len;
+	uint64_t count;
+	uint64_t saved; // Dispatches saved if every occurrence were fused
+} candidate;
+
+static char names[MAX_NAMES][MAX_NAME_LEN];
+static unsigned num_names;
+
+static uint64_t pairs[MAX_NAMES][MAX_NAMES];
+static uint64_t triples[MAX_NAMES][MAX_NAMES][MAX_NAMES];
+static uint64_t total; // Instructions in the trace
+
+/**
+ * Finds the index of a mnemonic, adding it if not yet seen.
+ *
+ * Returns: The index, or MAX_NAMES if there are too many names.
+ */
+static unsigned intern(const char *name);
+
+/**
+ * Counts the sequences in a trace.
+ *
+ * Returns: Whether the trace was read without error.
+ */
+static bool mine(FILE *trace);
+
+/**
+ * Sorts candidates by dispatches saved, most first.
+ */
+static int compare_candidates(const void *a, const void *b);
+
+/**
+ * Prints the most profitable candidates.
+ *
+ * IN shown: How many candidates to print.
+ */
+static void report(size_t shown);
+
+////////////////////////////////////////////////////////////////////////////////
+// Program entry
+////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char *argv[])
+{
+	size_t shown = DEFAULT_SHOWN;
+	FILE *trace = stdin;
+	int i = 1;
+
+	if (i + 1 < argc && strcmp(argv[i], "-n") == 0) {
+		shown = strtoul(argv[i + 1], NULL, 10);
+		i += 2;
+	}
+
+	if (i < argc) {
+		trace = fopen(argv[i], "r");
+
+		if (trace == NULL) {
+			fprintf(stderr, "fusemine: couldn't open %s\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	bool ok = mine(trace);
+
+	if (trace != stdin) {
+		fclose(trace);
+	}
+
+	if (!ok) {
+		return EXIT_FAILURE;
+	}
+
+	report(shown);
+	return EXIT_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Module internal functions
+////////////////////////////////////////////////////////////////////////////////
+
+unsigned intern(const char *name)
+{
+	unsigned i;
+
+	for (i = 0; i < num_names; ++i) {
+		if (strcmp(names[i], name) == 0) {
+			return i;
+		}
+	}
+
+	if (num_names == MAX_NAMES) {
+		return MAX_NAMES;
+	}
+
+	snprintf(names[i], MAX_NAME_LEN, "%s", name);
+	return num_names++;
+}
+
+bool mine(FILE *trace)
+{
+	char line[128];
+	char name[MAX_NAME_LEN];
+	unsigned long addr, size;
+
+	// The previous two instructions, valid while run is long enough
+	unsigned prev[2] = {0, 0};
+	unsigned long next_addr = 0;
+	size_t run = 0; // Instructions run back to back, up to the current one
+
+	while (fgets(line, sizeof (line), trace) != NULL) {
+		if (sscanf(line, "%lx %lu %31s", &addr, &size, name) != 3) {
+			fprintf(stderr, "fusemine: malformed trace line: %s", line);
+			return false;
+		}
+
+		unsigned id = intern(name);
+
+		if (id == MAX_NAMES) {
+			fprintf(stderr, "fusemine: too many distinct mnemonics\n");
+			return false;
+		}
+
+		++total;
+		run = (run > 0 && addr == next_addr) ? run + 1 : 1;
+
+		if (run >= 2) {
+			++pairs[prev[1]][id];
+		}
+		if (run >= 3) {
+			++triples[prev[0]][prev[1]][id];
+		}
+
+		prev[0] = prev[1];
+		prev[1] = id;
+		next_addr = (addr + size) & 0xFFFFFFFF;
+	}
+
+	if (ferror(trace)) {
+		fprintf(stderr, "fusemine: error reading trace\n");
+		return false;
+	}
+
+	return true;
+}
+
+int compare_candidates(const void *a, const void *b)
+{
+	const candidate *ca = a;
+	const candidate *cb = b;
+
+	if (ca->saved != cb->saved) {
+		return ca->saved < cb->saved ? 1 : -1;
+	}
+
+	return 0;
+}
+
+void report(size_t shown)
+{
+	size_t max = num_names * num_names * (num_names + 1);
+	candidate *cands = malloc(max * sizeof (candidate));
+	size_t num = 0;
+
+	if (cands == NULL) {
+		fprintf(stderr, "fusemine: out of memory\n");
+		return;
+	}
+
+	for (unsigned a = 0; a < num_names; ++a) {
+		for (unsigned b = 0; b < num_names; ++b) {
+			if (pairs[a][b] > 0) {
+				cands[num++] = (candidate){{a, b, 0}, 2, pairs[a][b], pairs[a][b]};
+			}
+
+			for (unsigned c = 0; c < num_names; ++c) {
+				if (triples[a][b][c] > 0) {
+					cands[num++] = (candidate){{a, b, c}, 3, triples[a][b][c], 2 * triples[a][b][c]};
+				}
+			}
+		}
+	}
+
+	qsort(cands, num, sizeof (candidate), compare_candidates);
+
+	printf("%llu instructions traced\n", (unsigned long long)total);
+	printf("%-24s %12s %8s\n", "sequence", "count", "saved");
+
+	for (size_t i = 0; i < num && i < shown; ++i) {
+		char seq[3 * MAX_NAME_LEN] = "";
+
+		for (size_t j = 0; j < cands[i].len; ++j) {
+			if (j > 0) {
+				strcat(seq, " ");
+			}
+			strcat(seq, names[cands[i].seq[j]]);
+		}
+
+		printf("%-24s %12llu %7.2f%%\n", seq, (unsigned long long)cands[i].count,
+			total > 0 ? 100.0 * cands[i].saved / total : 0.0);
+	}
+
+	free(cands);
+}
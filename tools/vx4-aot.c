@@ -0,0 +1,855 @@
+/**
+ * vx4-aot: translates a firmware image ahead of time into C, to be built
+ * into the emulator and run with vx4 -aot.
+ *
+ * Starting from the reset vector and any vectors in the image's IVT, the
+ * code is followed through every jump and call, and each run of
+ * straight-line instructions becomes one C function (see aot_block in
+ * aot.h), ending at a jump, call or ret. Anything that uses a port,
+ * changes the interrupt flag, divides, stops the CPU or can't be decoded
+ * also ends a block, and is left to the interpreter. Each block records a
+ * copy of the code it came from, so that code since changed in memory (or
+ * a different image altogether) is never run translated.
+ *
+ * Usage: vx4-aot [-n name] [-o out.c] image.bin
+ * The C is written to stdout if no output file is given, and defines an
+ * aot_image called aot_firmware unless another name is given.
+ */
+
+#include "../aot.h"
+#include "../error.h"
+#include "../fwload.h"
+#include "../instruction.h"
+#include "../intr.h"
+#include "../machine.h"
+#include "../mem.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Internal constants + helper macros
+////////////////////////////////////////////////////////////////////////////////
+
+#define DEFAULT_NAME "aot_firmware"
+
+////////////////////////////////////////////////////////////////////////////////
+// Module internal declarations
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct _block_info {
+	mem_addr addr;
+	mem_size size;
+	unsigned num_ins;
+} block_info;
+
+static vx4_machine *vm;
+static mem_size image_size;
+
+// Addresses still to translate, and a bit per even address already queued
+static mem_addr *pending;
+static size_t num_pending;
+static uint8_t *queued;
+
+static block_info *blocks;
+static size_t num_blocks;
+
+/**
+ * Queues an address to be translated, unless it already has been or it
+ * lies outside the image.
+ */
+static void add_entry(mem_addr addr);
+
+/**
+ * Queues the reset vector and every vector in the IVT that points into
+ * the image.
+ */
+static void add_vectors(void);
+
+/**
+ * Whether an instruction can be part of a translated block.
+ */
+static bool translatable(instruction_id id);
+
+/**
+ * Whether an instruction is a conditional jump.
+ */
+static bool conditional(instruction_id id);
+
+/**
+ * Whether the C for an instruction uses the register file.
+ */
+static bool uses_registers(instruction_id id);
+
+/**
+ * Translates the block starting at an address, queueing wherever it
+ * leads next.
+ *
+ * IN out: Where to write the block's function.
+ */
+static void translate(FILE *out, mem_addr ip);
+
+/**
+ * Writes the C for one instruction of a block.
+ *
+ * IN ins: The decoded instruction.
+ * IN next: The address after the instruction.
+ * IN index: How many instructions of the block come before this one.
+ * IN count: How many instructions the whole block runs.
+ */
+static void emit_instruction(FILE *out, const instruction_decoded *ins, mem_addr next, unsigned index, unsigned count);
+
+/**
+ * Returns the C operator for an arithmetic instruction, or the comparison
+ * made by a conditional jump.
+ */
+static const char *c_operator(instruction_id id);
+
+/**
+ * Sorts blocks by address.
+ */
+static int compare_blocks(const void *a, const void *b);
+
+/**
+ * Writes the table of blocks and the aot_image describing them.
+ */
+static void emit_image(FILE *out, const char *name, const char *source);
+
+////////////////////////////////////////////////////////////////////////////////
+// Program entry
+////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char *argv[])
+{
+	const char *name = DEFAULT_NAME;
+	const char *out_name = NULL;
+	int i = 1;
+
+	for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+		if (strcmp(argv[i], "-n") == 0) {
+			name = argv[i + 1];
+		}
+		else if (strcmp(argv[i], "-o") == 0) {
+			out_name = argv[i + 1];
+		}
+		else {
+			break;
+		}
+	}
+
+	if (i + 1 != argc) {
+		fprintf(stderr, "usage: vx4-aot [-n name] [-o out.c] image.bin\n");
+		return EXIT_FAILURE;
+	}
+
+	FILE *image = fopen(argv[i], "rb");
+
+	if (image == NULL) {
+		fprintf(stderr, "vx4-aot: couldn't open %s\n", argv[i]);
+		return EXIT_FAILURE;
+	}
+
+	fseek(image, 0, SEEK_END);
+	long size = ftell(image);
+	fclose(image);
+
+	if (size <= 0 || (unsigned long)size > UINT32_MAX) {
+		fprintf(stderr, "vx4-aot: %s is empty or too large\n", argv[i]);
+		return EXIT_FAILURE;
+	}
+
+	image_size = (mem_size)size;
+
+	// The image is loaded just as the emulator would, so that it decodes alike
+	DIE_ON(machine_create(&vm));
+	DIE_ON(firmware_load(vm, 0x0, argv[i]));
+
+	FILE *out = stdout;
+
+	if (out_name != NULL) {
+		out = fopen(out_name, "w");
+
+		if (out == NULL) {
+			fprintf(stderr, "vx4-aot: couldn't create %s\n", out_name);
+			return EXIT_FAILURE;
+		}
+	}
+
+	pending = malloc(image_size / 2 * sizeof (mem_addr));
+	queued = calloc(image_size / 16 + 1, 1);
+	blocks = malloc(image_size / 2 * sizeof (block_info));
+
+	if (pending == NULL || queued == NULL || blocks == NULL) {
+		error_exit(ERR_NOMEM, __FILE__, __LINE__, "Couldn't allocate block lists");
+	}
+
+	fprintf(out, "// Translated from %s by vx4-aot, do not edit\n\n", argv[i]);
+	fprintf(out, "#include \"aot.h\"\n#include \"machine.h\"\n#include \"mmu.h\"\n#include \"stack.h\"\n\n#include <stdint.h>\n#include <stddef.h>\n#include <math.h>\n\n");
+
+	add_vectors();
+
+	while (num_pending > 0) {
+		translate(out, pending[--num_pending]);
+	}
+
+	emit_image(out, name, argv[i]);
+
+	if (out != stdout) {
+		fclose(out);
+	}
+
+	fprintf(stderr, "vx4-aot: translated %zu blocks\n", num_blocks);
+
+	free(blocks);
+	free(queued);
+	free(pending);
+	machine_destroy(vm);
+
+	return EXIT_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Module internal functions
+////////////////////////////////////////////////////////////////////////////////
+
+void add_entry(mem_addr addr)
+{
+	// Instructions are always at even addresses
+	if (addr % 2 != 0 || addr >= image_size) {
+		return;
+	}
+
+	mem_addr bit = addr / 2;
+
+	if (queued[bit / 8] & (1u << (bit % 8))) {
+		return;
+	}
+
+	queued[bit / 8] |= 1u << (bit % 8);
+	pending[num_pending++] = addr;
+}
+
+void add_vectors(void)
+{
+	uint32_t vector;
+
+	// The reset vector is in place of the 0th IV
+	mem_read_word(vm, 0x0, &vector);
+	add_entry(vector);
+
+	// As in the CPU, 0 and 1 are never jumped to, but signal a reset or halt
+	for (mem_addr i = INTR_HALT; i < INTR_NUM_INTRS && (i + 1) * 4 <= image_size; ++i) {
+		mem_read_word(vm, i * 4, &vector);
+
+		if (vector > 1) {
+			add_entry(vector);
+		}
+	}
+}
+
+bool translatable(instruction_id id)
+{
+	switch (id) {
+		case INS_NOP:
+		case INS_JMPC:
+		case INS_MOVRC:
+		case INS_MOVMR:
+		case INS_ADDRC:
+		case INS_STORR:
+		case INS_MOVRR:
+		case INS_MOVRM:
+		case INS_LOADO:
+		case INS_STORO:
+		case INS_ADDRR:
+		case INS_SUBRR:
+		case INS_MULRR:
+		case INS_ANDRR:
+		case INS_ORRR:
+		case INS_XORRR:
+		case INS_SHLRR:
+		case INS_SHRRR:
+		case INS_SARRR:
+		case INS_SUBRC:
+		case INS_MULRC:
+		case INS_ANDRC:
+		case INS_ORRC:
+		case INS_XORRC:
+		case INS_SHLRC:
+		case INS_SHRRC:
+		case INS_SARRC:
+		case INS_CMPRR:
+		case INS_CMPRC:
+		case INS_CALLC:
+		case INS_RET:
+		case INS_ENTER:
+		case INS_LEAVE:
+		case INS_PUSHR:
+		case INS_POPR:
+		case INS_VLOAD:
+		case INS_VSTOR:
+		case INS_VMOV:
+		case INS_VSPLAT:
+		case INS_VEXTR:
+		case INS_VSHUF32:
+		case INS_FMOVFF:
+		case INS_FMOVFR:
+		case INS_FMOVRF:
+		case INS_FLOADO32:
+		case INS_FLOADO64:
+		case INS_FSTORO32:
+		case INS_FSTORO64:
+		case INS_FADD32:
+		case INS_FADD64:
+		case INS_FSUB32:
+		case INS_FSUB64:
+		case INS_FMUL32:
+		case INS_FMUL64:
+		case INS_FDIV32:
+		case INS_FDIV64:
+		case INS_FSQRT32:
+		case INS_FSQRT64:
+		case INS_FMA32:
+		case INS_FMA64:
+		case INS_FCMP32:
+		case INS_FCMP64:
+		case INS_FWIDEN:
+		case INS_FNARROW:
+		case INS_FITOF32:
+		case INS_FITOF64:
+		case INS_FFTOI32:
+		case INS_FFTOI64:
+		case INS_MCOPY:
+		case INS_MFILL:
+		case INS_MCMP:
+		case INS_XCHG:
+		case INS_XADD:
+		case INS_CAS:
+			return true;
+
+		default:
+			return conditional(id) || instruction_vector_func(id) != NULL;
+	}
+}
+
+bool conditional(instruction_id id)
+{
+	return id >= INS_JEQ && id <= INS_JGEU;
+}
+
+bool uses_registers(instruction_id id)
+{
+	switch (id) {
+		case INS_NOP:
+		case INS_JMPC:
+		case INS_CALLC:
+		case INS_RET:
+		case INS_ENTER:
+		case INS_LEAVE:
+		case INS_VMOV:
+		case INS_VSHUF32:
+		case INS_FMOVFF:
+		case INS_FADD32:
+		case INS_FADD64:
+		case INS_FSUB32:
+		case INS_FSUB64:
+		case INS_FMUL32:
+		case INS_FMUL64:
+		case INS_FDIV32:
+		case INS_FDIV64:
+		case INS_FSQRT32:
+		case INS_FSQRT64:
+		case INS_FMA32:
+		case INS_FMA64:
+		case INS_FCMP32:
+		case INS_FCMP64:
+		case INS_FWIDEN:
+		case INS_FNARROW:
+			return false;
+
+		default:
+			return !conditional(id) && instruction_vector_func(id) == NULL;
+	}
+}
+
+void translate(FILE *out, mem_addr ip)
+{
+	instruction_decoded ins;
+	mem_addr addr = ip;
+	unsigned count = 0;
+	bool ended = false; // Whether the block ends in a jump
+	bool branches = false; // Whether that jump is conditional
+	bool returns = false; // Whether it's a ret, going wherever the stack says
+	bool uses_regs = false;
+	mem_addr target = 0;
+
+	// Find how far the block reaches first, as every exit refunds the
+	// part of the budget it didn't use
+	while (count < AOT_BLOCK_INS && addr < image_size) {
+		instruction_decode(vm, addr, &ins);
+
+		if (!translatable(ins.id)) {
+			// Left to the interpreter, which carries on after it
+			if (ins.id != INS_INVALID && ins.id != INS_HLT) {
+				add_entry(addr + ins.size);
+			}
+			break;
+		}
+
+		addr += ins.size;
+		++count;
+
+		if (uses_registers(ins.id)) {
+			uses_regs = true;
+		}
+
+		if (ins.id == INS_RET) {
+			ended = true;
+			returns = true;
+			break;
+		}
+
+		if (ins.id == INS_JMPC || ins.id == INS_CALLC || conditional(ins.id)) {
+			ended = true;
+			branches = conditional(ins.id);
+			target = ins.ops.imm;
+			add_entry(target);
+			break;
+		}
+	}
+
+	if (count == 0) {
+		return;
+	}
+
+	// Carries on from the next instruction unless it ends in a jmpc or
+	// ret, a call coming back to it later
+	if (!ended || branches || ins.id == INS_CALLC) {
+		add_entry(addr);
+	}
+
+	block_info *blk = &blocks[num_blocks++];
+	blk->addr = ip;
+	blk->size = addr - ip;
+	blk->num_ins = count;
+
+	uint8_t code[AOT_BLOCK_INS * INS_MAX_SIZE];
+	mem_read_mem(vm, ip, code, blk->size);
+
+	// The code the block must still match in memory to be run, see aot_block
+	fprintf(out, "static const uint8_t code_%08x[] = {", ip);
+	for (mem_size i = 0; i < blk->size; ++i) {
+		fprintf(out, "%s0x%02x", i == 0 ? "\n\t" : i % 16 == 0 ? ",\n\t" : ", ", code[i]);
+	}
+	fprintf(out, "\n};\n\n");
+
+	// Blocks jumping back to their own start loop without leaving
+	bool loops = ended && !returns && target == ip;
+	const char *indent = loops ? "\t\t" : "\t";
+
+	fprintf(out, "static mem_addr block_%08x(vx4_cpu *vcpu, int64_t *budget)\n{\n", ip);
+	if (uses_regs) {
+		fprintf(out, "\tuint32_t *const r = vcpu->registers;\n");
+	}
+	else if (!branches && !loops) {
+		fprintf(out, "\t(void)vcpu;\n");
+	}
+
+	if (branches) {
+		fprintf(out, "\tint taken;\n");
+	}
+	else if (returns) {
+		fprintf(out, "\tuint32_t ret;\n");
+	}
+
+	fprintf(out, "\n");
+
+	if (loops) {
+		fprintf(out, "\tdo {\n");
+	}
+
+	fprintf(out, "%s*budget -= %u;\n", indent, count);
+
+	addr = ip;
+
+	for (unsigned i = 0; i < count; ++i) {
+		instruction_decode(vm, addr, &ins);
+		addr += ins.size;
+
+		fputs(indent, out);
+		emit_instruction(out, &ins, addr, i, count);
+	}
+
+	if (loops) {
+		fprintf(out, "\t} while (%s*budget >= %u && !aot_events_pending(vcpu));\n", branches ? "taken && " : "", count);
+	}
+
+	if (branches) {
+		fprintf(out, "\n\treturn taken ? 0x%08xu : 0x%08xu;\n}\n\n", target, addr);
+	}
+	else if (returns) {
+		fprintf(out, "\n\treturn ret;\n}\n\n");
+	}
+	else {
+		fprintf(out, "\n\treturn 0x%08xu;\n}\n\n", ended ? target : addr);
+	}
+}
+
+void emit_instruction(FILE *out, const instruction_decoded *ins, mem_addr next, unsigned index, unsigned count)
+{
+	const instruction_ops *ops = &ins->ops;
+
+	// A failed store has still run, so only the instructions after it are refunded
+	unsigned refund = count - index - 1;
+
+	switch (ins->id) {
+		case INS_NOP:
+		case INS_JMPC:
+			fprintf(out, "// %s\n", instruction_name(ins->id));
+			break;
+
+		case INS_CALLC:
+			fprintf(out, "if (aot_fault(vcpu, stack_push(vcpu, 0x%08xu))) { return 0x%08xu; }\n", next, next);
+			break;
+
+		case INS_RET:
+			fprintf(out, "if (aot_fault(vcpu, stack_pop(vcpu, &ret))) { return 0x%08xu; }\n", next);
+			break;
+
+		case INS_ENTER:
+			fprintf(out, "if (aot_fault(vcpu, stack_enter_frame(vcpu)) || aot_events_pending(vcpu)) { *budget += %u; return 0x%08xu; }\n",
+				refund, next);
+			break;
+
+		case INS_LEAVE:
+			fprintf(out, "if (aot_fault(vcpu, stack_leave_frame(vcpu))) { *budget += %u; return 0x%08xu; }\n", refund, next);
+			break;
+
+		case INS_PUSHR:
+			fprintf(out, "if (aot_fault(vcpu, stack_push(vcpu, r[%u])) || aot_events_pending(vcpu)) { *budget += %u; return 0x%08xu; }\n",
+				ops->reg[0], refund, next);
+			break;
+
+		case INS_POPR:
+			fprintf(out, "if (aot_fault(vcpu, stack_pop(vcpu, &r[%u]))) { *budget += %u; return 0x%08xu; }\n",
+				ops->reg[0], refund, next);
+			break;
+
+		case INS_MOVRC:
+			fprintf(out, "r[%u] = 0x%08xu;\n", ops->reg[0], ops->imm);
+			break;
+
+		case INS_ADDRC:
+			fprintf(out, "r[%u] += 0x%08xu;\n", ops->reg[0], ops->imm);
+			break;
+
+		case INS_MOVMR:
+			fprintf(out, "if (aot_store(vcpu, 0x%08xu, r[%u])) { *budget += %u; return 0x%08xu; }\n",
+				ops->imm, ops->reg[0], refund, next);
+			break;
+
+		case INS_STORR:
+			fprintf(out, "if (aot_store(vcpu, r[%u], r[%u])) { *budget += %u; return 0x%08xu; }\n",
+				ops->reg[0], ops->reg[1], refund, next);
+			break;
+
+		case INS_STORO:
+			fprintf(out, "if (aot_store(vcpu, r[%u] + 0x%08xu, r[%u])) { *budget += %u; return 0x%08xu; }\n",
+				ops->reg[0], ops->imm, ops->reg[1], refund, next);
+			break;
+
+		case INS_MOVRM:
+			fprintf(out, "if (aot_load(vcpu, 0x%08xu, &r[%u])) { *budget += %u; return 0x%08xu; }\n",
+				ops->imm, ops->reg[0], refund, next);
+			break;
+
+		case INS_LOADO:
+			fprintf(out, "if (aot_load(vcpu, r[%u] + 0x%08xu, &r[%u])) { *budget += %u; return 0x%08xu; }\n",
+				ops->reg[0], ops->imm, ops->reg[1], refund, next);
+			break;
+
+		case INS_MOVRR:
+			fprintf(out, "r[%u] = r[%u];\n", ops->reg[0], ops->reg[1]);
+			break;
+
+		case INS_ADDRR:
+		case INS_SUBRR:
+		case INS_MULRR:
+		case INS_ANDRR:
+		case INS_ORRR:
+		case INS_XORRR:
+			fprintf(out, "r[%u] %s= r[%u];\n", ops->reg[0], c_operator(ins->id), ops->reg[1]);
+			break;
+
+		case INS_SUBRC:
+		case INS_MULRC:
+		case INS_ANDRC:
+		case INS_ORRC:
+		case INS_XORRC:
+			fprintf(out, "r[%u] %s= 0x%08xu;\n", ops->reg[0], c_operator(ins->id), ops->imm);
+			break;
+
+		case INS_SHLRR:
+		case INS_SHRRR:
+			fprintf(out, "r[%u] %s= r[%u] %% 32;\n", ops->reg[0], c_operator(ins->id), ops->reg[1]);
+			break;
+
+		case INS_SHLRC:
+		case INS_SHRRC:
+			fprintf(out, "r[%u] %s= %u;\n", ops->reg[0], c_operator(ins->id), ops->imm % 32);
+			break;
+
+		case INS_SARRR:
+			fprintf(out, "r[%u] = (uint32_t)((int32_t)r[%u] >> r[%u] %% 32);\n", ops->reg[0], ops->reg[0], ops->reg[1]);
+			break;
+
+		case INS_SARRC:
+			fprintf(out, "r[%u] = (uint32_t)((int32_t)r[%u] >> %u);\n", ops->reg[0], ops->reg[0], ops->imm % 32);
+			break;
+
+		case INS_CMPRR:
+			fprintf(out, "vcpu->compared[0] = r[%u]; vcpu->compared[1] = r[%u];\n", ops->reg[0], ops->reg[1]);
+			break;
+
+		case INS_CMPRC:
+			fprintf(out, "vcpu->compared[0] = r[%u]; vcpu->compared[1] = 0x%08xu;\n", ops->reg[0], ops->imm);
+			break;
+
+		case INS_VLOAD:
+			fprintf(out, "if (aot_fault(vcpu, mmu_read_vector(vcpu, r[%u], &vcpu->vregisters[%u]))) { *budget += %u; return 0x%08xu; }\n",
+				ops->reg[1], ops->reg[0], refund, next);
+			break;
+
+		case INS_VSTOR:
+			fprintf(out, "if (aot_fault(vcpu, mmu_write_vector(vcpu, r[%u], &vcpu->vregisters[%u])) || aot_events_pending(vcpu)) { *budget += %u; return 0x%08xu; }\n",
+				ops->reg[0], ops->reg[1], refund, next);
+			break;
+
+		case INS_VMOV:
+			fprintf(out, "vcpu->vregisters[%u] = vcpu->vregisters[%u];\n", ops->reg[0], ops->reg[1]);
+			break;
+
+		case INS_VSPLAT:
+			fprintf(out, "for (int i = 0; i < 4; ++i) { vcpu->vregisters[%u].w[i] = r[%u]; }\n", ops->reg[0], ops->reg[1]);
+			break;
+
+		case INS_VEXTR:
+			fprintf(out, "r[%u] = vcpu->vregisters[%u].w[%u];\n", ops->reg[0], ops->reg[1], ops->imm);
+			break;
+
+		case INS_FMOVFF:
+			fprintf(out, "vcpu->fregisters[%u].bits = vcpu->fregisters[%u].bits;\n", ops->reg[0], ops->reg[1]);
+			break;
+
+		case INS_FMOVFR:
+			fprintf(out, "vcpu->fregisters[%u].word = r[%u];\n", ops->reg[0], ops->reg[1]);
+			break;
+
+		case INS_FMOVRF:
+			fprintf(out, "r[%u] = vcpu->fregisters[%u].word;\n", ops->reg[0], ops->reg[1]);
+			break;
+
+		case INS_FLOADO32:
+			fprintf(out, "if (aot_fault(vcpu, mmu_read_word(vcpu, r[%u] + 0x%08xu, &vcpu->fregisters[%u].word))) { *budget += %u; return 0x%08xu; }\n",
+				ops->reg[0], ops->imm, ops->reg[1], refund, next);
+			break;
+
+		case INS_FLOADO64:
+			fprintf(out, "if (aot_fault(vcpu, mmu_read_dword(vcpu, r[%u] + 0x%08xu, &vcpu->fregisters[%u].bits))) { *budget += %u; return 0x%08xu; }\n",
+				ops->reg[0], ops->imm, ops->reg[1], refund, next);
+			break;
+
+		case INS_FSTORO32:
+			fprintf(out, "if (aot_fault(vcpu, mmu_write_word(vcpu, r[%u] + 0x%08xu, vcpu->fregisters[%u].word)) || aot_events_pending(vcpu)) { *budget += %u; return 0x%08xu; }\n",
+				ops->reg[0], ops->imm, ops->reg[1], refund, next);
+			break;
+
+		case INS_FSTORO64:
+			fprintf(out, "if (aot_fault(vcpu, mmu_write_dword(vcpu, r[%u] + 0x%08xu, vcpu->fregisters[%u].bits)) || aot_events_pending(vcpu)) { *budget += %u; return 0x%08xu; }\n",
+				ops->reg[0], ops->imm, ops->reg[1], refund, next);
+			break;
+
+		case INS_FADD32:
+			fprintf(out, "vcpu->fregisters[%u].f += vcpu->fregisters[%u].f;\n", ops->reg[0], ops->reg[1]);
+			break;
+
+		case INS_FADD64:
+			fprintf(out, "vcpu->fregisters[%u].d += vcpu->fregisters[%u].d;\n", ops->reg[0], ops->reg[1]);
+			break;
+
+		case INS_FSUB32:
+			fprintf(out, "vcpu->fregisters[%u].f -= vcpu->fregisters[%u].f;\n", ops->reg[0], ops->reg[1]);
+			break;
+
+		case INS_FSUB64:
+			fprintf(out, "vcpu->fregisters[%u].d -= vcpu->fregisters[%u].d;\n", ops->reg[0], ops->reg[1]);
+			break;
+
+		case INS_FMUL32:
+			fprintf(out, "vcpu->fregisters[%u].f *= vcpu->fregisters[%u].f;\n", ops->reg[0], ops->reg[1]);
+			break;
+
+		case INS_FMUL64:
+			fprintf(out, "vcpu->fregisters[%u].d *= vcpu->fregisters[%u].d;\n", ops->reg[0], ops->reg[1]);
+			break;
+
+		case INS_FDIV32:
+			fprintf(out, "vcpu->fregisters[%u].f /= vcpu->fregisters[%u].f;\n", ops->reg[0], ops->reg[1]);
+			break;
+
+		case INS_FDIV64:
+			fprintf(out, "vcpu->fregisters[%u].d /= vcpu->fregisters[%u].d;\n", ops->reg[0], ops->reg[1]);
+			break;
+
+		case INS_FSQRT32:
+			fprintf(out, "vcpu->fregisters[%u].f = sqrtf(vcpu->fregisters[%u].f);\n", ops->reg[0], ops->reg[1]);
+			break;
+
+		case INS_FSQRT64:
+			fprintf(out, "vcpu->fregisters[%u].d = sqrt(vcpu->fregisters[%u].d);\n", ops->reg[0], ops->reg[1]);
+			break;
+
+		case INS_FMA32:
+			fprintf(out, "fpu_fma32(&vcpu->fregisters[%u], &vcpu->fregisters[%u], &vcpu->fregisters[%u]);\n",
+				ops->reg[0], ops->reg[1], ops->imm);
+			break;
+
+		case INS_FMA64:
+			fprintf(out, "fpu_fma64(&vcpu->fregisters[%u], &vcpu->fregisters[%u], &vcpu->fregisters[%u]);\n",
+				ops->reg[0], ops->reg[1], ops->imm);
+			break;
+
+		case INS_FCMP32:
+			fprintf(out, "vcpu->compared[0] = fpu_compare(vcpu->fregisters[%u].f, vcpu->fregisters[%u].f); vcpu->compared[1] = 0;\n",
+				ops->reg[0], ops->reg[1]);
+			break;
+
+		case INS_FCMP64:
+			fprintf(out, "vcpu->compared[0] = fpu_compare(vcpu->fregisters[%u].d, vcpu->fregisters[%u].d); vcpu->compared[1] = 0;\n",
+				ops->reg[0], ops->reg[1]);
+			break;
+
+		case INS_FWIDEN:
+			fprintf(out, "vcpu->fregisters[%u].d = vcpu->fregisters[%u].f;\n", ops->reg[0], ops->reg[1]);
+			break;
+
+		case INS_FNARROW:
+			fprintf(out, "vcpu->fregisters[%u].f = (float)vcpu->fregisters[%u].d;\n", ops->reg[0], ops->reg[1]);
+			break;
+
+		case INS_FITOF32:
+			fprintf(out, "vcpu->fregisters[%u].f = (float)(int32_t)r[%u];\n", ops->reg[0], ops->reg[1]);
+			break;
+
+		case INS_FITOF64:
+			fprintf(out, "vcpu->fregisters[%u].d = (int32_t)r[%u];\n", ops->reg[0], ops->reg[1]);
+			break;
+
+		case INS_FFTOI32:
+			fprintf(out, "fpu_ftoi32(&r[%u], &vcpu->fregisters[%u]);\n", ops->reg[0], ops->reg[1]);
+			break;
+
+		case INS_FFTOI64:
+			fprintf(out, "fpu_ftoi64(&r[%u], &vcpu->fregisters[%u]);\n", ops->reg[0], ops->reg[1]);
+			break;
+
+		case INS_MCOPY:
+			fprintf(out, "mmu_copy(vcpu, r[%u], r[%u], r[%u]); if (aot_events_pending(vcpu)) { *budget += %u; return 0x%08xu; }\n",
+				ops->reg[0], ops->reg[1], ops->imm, refund, next);
+			break;
+
+		case INS_MFILL:
+			fprintf(out, "mmu_set_bytes(vcpu, r[%u], (uint8_t)r[%u], r[%u]); if (aot_events_pending(vcpu)) { *budget += %u; return 0x%08xu; }\n",
+				ops->reg[0], ops->reg[1], ops->imm, refund, next);
+			break;
+
+		case INS_MCMP:
+			fprintf(out, "{ mem_size offset; mmu_compare(vcpu, r[%u], r[%u], r[%u], vcpu->compared, &offset); }\n", ops->reg[0], ops->reg[1], ops->imm);
+			break;
+
+		case INS_XCHG:
+		case INS_XADD:
+			fprintf(out, "if (aot_fault(vcpu, %s(vcpu, r[%u], r[%u], &r[%u])) || aot_events_pending(vcpu)) { *budget += %u; return 0x%08xu; }\n",
+				ins->id == INS_XCHG ? "mmu_exchange_word" : "mmu_fetch_add_word", ops->reg[0], ops->reg[1], ops->reg[1], refund, next);
+			break;
+
+		case INS_CAS:
+			// The compared operands are set before leaving for a pending event
+			fprintf(out, "vcpu->compared[1] = r[%u]; if (aot_fault(vcpu, mmu_cas_word(vcpu, r[%u], &r[%u], r[%u]))) { *budget += %u; return 0x%08xu; } "
+				"vcpu->compared[0] = r[%u]; if (aot_events_pending(vcpu)) { *budget += %u; return 0x%08xu; }\n",
+				ops->reg[1], ops->reg[0], ops->reg[1], ops->imm, refund, next, ops->reg[1], refund, next);
+			break;
+
+		case INS_VSHUF32:
+			fprintf(out, "vector_shuf32(&vcpu->vregisters[%u], &vcpu->vregisters[%u], 0x%02x);\n", ops->reg[0], ops->reg[1], ops->imm);
+			break;
+
+		default:
+			if (instruction_vector_func(ins->id) != NULL) {
+				// The vector_* functions are named after the mnemonics
+				fprintf(out, "vector_%s(&vcpu->vregisters[%u], &vcpu->vregisters[%u]);\n",
+					instruction_name(ins->id) + 1, ops->reg[0], ops->reg[1]);
+			}
+			else if (conditional(ins->id)) {
+				bool is_signed = ins->id <= INS_JGE;
+				const char *cast = is_signed ? "(int32_t)" : "";
+
+				fprintf(out, "taken = %svcpu->compared[0] %s %svcpu->compared[1];\n",
+					cast, c_operator(ins->id), cast);
+			}
+			break;
+	}
+}
+
+const char *c_operator(instruction_id id)
+{
+	switch (id) {
+		case INS_ADDRR: return "+";
+		case INS_SUBRR: case INS_SUBRC: return "-";
+		case INS_MULRR: case INS_MULRC: return "*";
+		case INS_ANDRR: case INS_ANDRC: return "&";
+		case INS_ORRR: case INS_ORRC: return "|";
+		case INS_XORRR: case INS_XORRC: return "^";
+		case INS_SHLRR: case INS_SHLRC: return "<<";
+		case INS_SHRRR: case INS_SHRRC: return ">>";
+		case INS_JEQ: return "==";
+		case INS_JNE: return "!=";
+		case INS_JLT: case INS_JLTU: return "<";
+		case INS_JLE: case INS_JLEU: return "<=";
+		case INS_JGT: case INS_JGTU: return ">";
+		default: return ">="; // INS_JGE and INS_JGEU
+	}
+}
+
+int compare_blocks(const void *a, const void *b)
+{
+	mem_addr addr_a = ((const block_info *)a)->addr;
+	mem_addr addr_b = ((const block_info *)b)->addr;
+
+	return (addr_a > addr_b) - (addr_a < addr_b);
+}
+
+void emit_image(FILE *out, const char *name, const char *source)
+{
+	qsort(blocks, num_blocks, sizeof (block_info), compare_blocks);
+
+	fprintf(out, "static const aot_block blocks[] = {\n");
+
+	for (size_t i = 0; i < num_blocks; ++i) {
+		const block_info *blk = &blocks[i];
+
+		fprintf(out, "\t{0x%08xu, %u, %u, code_%08x, block_%08x},\n",
+			blk->addr, blk->size, blk->num_ins, blk->addr, blk->addr);
+	}
+
+	// Keeps the array valid C even if nothing could be translated
+	if (num_blocks == 0) {
+		fprintf(out, "\t{0, 0, 0, NULL, NULL},\n");
+	}
+
+	fprintf(out, "};\n\n");
+	fprintf(out, "const aot_image %s = {\"%s\", blocks, %zu};\n", name, source, num_blocks);
+}
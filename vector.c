@@ -0,0 +1,330 @@
+#include "vector.h"
+
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif // __SSSE3__
+
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif // __SSE4_1__
+
+////////////////////////////////////////////////////////////////////////////////
+// Internal constants + helper macros
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef __SSE2__
+// Registers are only guaranteed the alignment of their lanes
+#define LOAD(reg) _mm_loadu_si128((const __m128i *)(reg))
+#define STORE(reg, val) _mm_storeu_si128((__m128i *)(reg), (val))
+#endif // __SSE2__
+
+// The number of lanes of each size in a register
+#define LANES_8 16
+#define LANES_16 8
+#define LANES_32 4
+
+////////////////////////////////////////////////////////////////////////////////
+// Interface functions
+////////////////////////////////////////////////////////////////////////////////
+
+void vector_add8(vreg *dest, const vreg *src)
+{
+	#ifdef __SSE2__
+	STORE(dest, _mm_add_epi8(LOAD(dest), LOAD(src)));
+	#else
+	for (int i = 0; i < LANES_8; ++i) {
+		dest->b[i] += src->b[i];
+	}
+	#endif // __SSE2__
+}
+
+void vector_add16(vreg *dest, const vreg *src)
+{
+	#ifdef __SSE2__
+	STORE(dest, _mm_add_epi16(LOAD(dest), LOAD(src)));
+	#else
+	for (int i = 0; i < LANES_16; ++i) {
+		dest->h[i] += src->h[i];
+	}
+	#endif // __SSE2__
+}
+
+void vector_add32(vreg *dest, const vreg *src)
+{
+	#ifdef __SSE2__
+	STORE(dest, _mm_add_epi32(LOAD(dest), LOAD(src)));
+	#else
+	for (int i = 0; i < LANES_32; ++i) {
+		dest->w[i] += src->w[i];
+	}
+	#endif // __SSE2__
+}
+
+void vector_sub8(vreg *dest, const vreg *src)
+{
+	#ifdef __SSE2__
+	STORE(dest, _mm_sub_epi8(LOAD(dest), LOAD(src)));
+	#else
+	for (int i = 0; i < LANES_8; ++i) {
+		dest->b[i] -= src->b[i];
+	}
+	#endif // __SSE2__
+}
+
+void vector_sub16(vreg *dest, const vreg *src)
+{
+	#ifdef __SSE2__
+	STORE(dest, _mm_sub_epi16(LOAD(dest), LOAD(src)));
+	#else
+	for (int i = 0; i < LANES_16; ++i) {
+		dest->h[i] -= src->h[i];
+	}
+	#endif // __SSE2__
+}
+
+void vector_sub32(vreg *dest, const vreg *src)
+{
+	#ifdef __SSE2__
+	STORE(dest, _mm_sub_epi32(LOAD(dest), LOAD(src)));
+	#else
+	for (int i = 0; i < LANES_32; ++i) {
+		dest->w[i] -= src->w[i];
+	}
+	#endif // __SSE2__
+}
+
+void vector_mul8(vreg *dest, const vreg *src)
+{
+	#ifdef __SSE2__
+	// SSE has no byte multiply, so the even and odd bytes are multiplied as dbytes
+	__m128i a = LOAD(dest), b = LOAD(src);
+	__m128i even = _mm_mullo_epi16(a, b);
+	__m128i odd = _mm_mullo_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+
+	even = _mm_and_si128(even, _mm_set1_epi16(0xFF));
+	STORE(dest, _mm_or_si128(even, _mm_slli_epi16(odd, 8)));
+	#else
+	for (int i = 0; i < LANES_8; ++i) {
+		dest->b[i] = (uint8_t)(dest->b[i] * src->b[i]);
+	}
+	#endif // __SSE2__
+}
+
+void vector_mul16(vreg *dest, const vreg *src)
+{
+	#ifdef __SSE2__
+	STORE(dest, _mm_mullo_epi16(LOAD(dest), LOAD(src)));
+	#else
+	for (int i = 0; i < LANES_16; ++i) {
+		dest->h[i] = (uint16_t)(dest->h[i] * src->h[i]);
+	}
+	#endif // __SSE2__
+}
+
+void vector_mul32(vreg *dest, const vreg *src)
+{
+	#ifdef __SSE4_1__
+	STORE(dest, _mm_mullo_epi32(LOAD(dest), LOAD(src)));
+	#else
+	for (int i = 0; i < LANES_32; ++i) {
+		dest->w[i] *= src->w[i];
+	}
+	#endif // __SSE4_1__
+}
+
+void vector_minu8(vreg *dest, const vreg *src)
+{
+	#ifdef __SSE2__
+	STORE(dest, _mm_min_epu8(LOAD(dest), LOAD(src)));
+	#else
+	for (int i = 0; i < LANES_8; ++i) {
+		dest->b[i] = src->b[i] < dest->b[i] ? src->b[i] : dest->b[i];
+	}
+	#endif // __SSE2__
+}
+
+void vector_minu16(vreg *dest, const vreg *src)
+{
+	#ifdef __SSE2__
+	// SSE2 only has a signed dbyte minimum, but a saturating subtract gets there
+	__m128i a = LOAD(dest);
+	STORE(dest, _mm_sub_epi16(a, _mm_subs_epu16(a, LOAD(src))));
+	#else
+	for (int i = 0; i < LANES_16; ++i) {
+		dest->h[i] = src->h[i] < dest->h[i] ? src->h[i] : dest->h[i];
+	}
+	#endif // __SSE2__
+}
+
+void vector_minu32(vreg *dest, const vreg *src)
+{
+	#ifdef __SSE4_1__
+	STORE(dest, _mm_min_epu32(LOAD(dest), LOAD(src)));
+	#else
+	for (int i = 0; i < LANES_32; ++i) {
+		dest->w[i] = src->w[i] < dest->w[i] ? src->w[i] : dest->w[i];
+	}
+	#endif // __SSE4_1__
+}
+
+void vector_maxu8(vreg *dest, const vreg *src)
+{
+	#ifdef __SSE2__
+	STORE(dest, _mm_max_epu8(LOAD(dest), LOAD(src)));
+	#else
+	for (int i = 0; i < LANES_8; ++i) {
+		dest->b[i] = src->b[i] > dest->b[i] ? src->b[i] : dest->b[i];
+	}
+	#endif // __SSE2__
+}
+
+void vector_maxu16(vreg *dest, const vreg *src)
+{
+	#ifdef __SSE2__
+	__m128i b = LOAD(src);
+	STORE(dest, _mm_add_epi16(b, _mm_subs_epu16(LOAD(dest), b)));
+	#else
+	for (int i = 0; i < LANES_16; ++i) {
+		dest->h[i] = src->h[i] > dest->h[i] ? src->h[i] : dest->h[i];
+	}
+	#endif // __SSE2__
+}
+
+void vector_maxu32(vreg *dest, const vreg *src)
+{
+	#ifdef __SSE4_1__
+	STORE(dest, _mm_max_epu32(LOAD(dest), LOAD(src)));
+	#else
+	for (int i = 0; i < LANES_32; ++i) {
+		dest->w[i] = src->w[i] > dest->w[i] ? src->w[i] : dest->w[i];
+	}
+	#endif // __SSE4_1__
+}
+
+void vector_cmpeq8(vreg *dest, const vreg *src)
+{
+	#ifdef __SSE2__
+	STORE(dest, _mm_cmpeq_epi8(LOAD(dest), LOAD(src)));
+	#else
+	for (int i = 0; i < LANES_8; ++i) {
+		dest->b[i] = dest->b[i] == src->b[i] ? (uint8_t)-1 : 0;
+	}
+	#endif // __SSE2__
+}
+
+void vector_cmpeq16(vreg *dest, const vreg *src)
+{
+	#ifdef __SSE2__
+	STORE(dest, _mm_cmpeq_epi16(LOAD(dest), LOAD(src)));
+	#else
+	for (int i = 0; i < LANES_16; ++i) {
+		dest->h[i] = dest->h[i] == src->h[i] ? (uint16_t)-1 : 0;
+	}
+	#endif // __SSE2__
+}
+
+void vector_cmpeq32(vreg *dest, const vreg *src)
+{
+	#ifdef __SSE2__
+	STORE(dest, _mm_cmpeq_epi32(LOAD(dest), LOAD(src)));
+	#else
+	for (int i = 0; i < LANES_32; ++i) {
+		dest->w[i] = dest->w[i] == src->w[i] ? (uint32_t)-1 : 0;
+	}
+	#endif // __SSE2__
+}
+
+void vector_cmpgt8(vreg *dest, const vreg *src)
+{
+	#ifdef __SSE2__
+	STORE(dest, _mm_cmpgt_epi8(LOAD(dest), LOAD(src)));
+	#else
+	for (int i = 0; i < LANES_8; ++i) {
+		dest->b[i] = (int8_t)dest->b[i] > (int8_t)src->b[i] ? (uint8_t)-1 : 0;
+	}
+	#endif // __SSE2__
+}
+
+void vector_cmpgt16(vreg *dest, const vreg *src)
+{
+	#ifdef __SSE2__
+	STORE(dest, _mm_cmpgt_epi16(LOAD(dest), LOAD(src)));
+	#else
+	for (int i = 0; i < LANES_16; ++i) {
+		dest->h[i] = (int16_t)dest->h[i] > (int16_t)src->h[i] ? (uint16_t)-1 : 0;
+	}
+	#endif // __SSE2__
+}
+
+void vector_cmpgt32(vreg *dest, const vreg *src)
+{
+	#ifdef __SSE2__
+	STORE(dest, _mm_cmpgt_epi32(LOAD(dest), LOAD(src)));
+	#else
+	for (int i = 0; i < LANES_32; ++i) {
+		dest->w[i] = (int32_t)dest->w[i] > (int32_t)src->w[i] ? (uint32_t)-1 : 0;
+	}
+	#endif // __SSE2__
+}
+
+void vector_and(vreg *dest, const vreg *src)
+{
+	#ifdef __SSE2__
+	STORE(dest, _mm_and_si128(LOAD(dest), LOAD(src)));
+	#else
+	for (int i = 0; i < LANES_32; ++i) {
+		dest->w[i] &= src->w[i];
+	}
+	#endif // __SSE2__
+}
+
+void vector_or(vreg *dest, const vreg *src)
+{
+	#ifdef __SSE2__
+	STORE(dest, _mm_or_si128(LOAD(dest), LOAD(src)));
+	#else
+	for (int i = 0; i < LANES_32; ++i) {
+		dest->w[i] |= src->w[i];
+	}
+	#endif // __SSE2__
+}
+
+void vector_xor(vreg *dest, const vreg *src)
+{
+	#ifdef __SSE2__
+	STORE(dest, _mm_xor_si128(LOAD(dest), LOAD(src)));
+	#else
+	for (int i = 0; i < LANES_32; ++i) {
+		dest->w[i] ^= src->w[i];
+	}
+	#endif // __SSE2__
+}
+
+void vector_shuf8(vreg *dest, const vreg *src)
+{
+	#ifdef __SSSE3__
+	STORE(dest, _mm_shuffle_epi8(LOAD(dest), LOAD(src)));
+	#else
+	vreg from = *dest;
+
+	for (int i = 0; i < LANES_8; ++i) {
+		dest->b[i] = (src->b[i] & 0x80) ? 0 : from.b[src->b[i] & 0xF];
+	}
+	#endif // __SSSE3__
+}
+
+void vector_shuf32(vreg *dest, const vreg *src, uint8_t order)
+{
+	// The order is only known at run time, so the shuffle is done by hand
+	vreg from = *src;
+
+	for (int i = 0; i < LANES_32; ++i) {
+		dest->w[i] = from.w[(order >> (i * 2)) & 0x3];
+	}
+}
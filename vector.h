@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdint.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+typedef uint8_t vreg_id;
+
+/**
+ * A 128-bit vector register, viewed as 16 byte lanes, 8 dbyte lanes or
+ * 4 word lanes. Lane 0 is at the lowest address when loaded or stored.
+ */
+typedef union _vreg {
+	uint8_t b[16];
+	uint16_t h[8];
+	uint32_t w[4];
+} vreg;
+
+// Implements a vector instruction on its two register operands
+typedef void (*vector_pf)(vreg *dest, const vreg *src);
+
+////////////////////////////////////////////////////////////////////////////////
+// Constants + helper macros
+////////////////////////////////////////////////////////////////////////////////
+
+#define VREG_NUM_REGS 16
+#define VREG_SIZE 16 // Bytes in a vector register, and the alignment of vector loads and stores
+
+#define IS_VALID_VREGISTER(reg) ((reg) < VREG_NUM_REGS)
+
+////////////////////////////////////////////////////////////////////////////////
+// Machine state
+////////////////////////////////////////////////////////////////////////////////
+
+// Should not be touched except by functions in vector.c or the CPU cores
+typedef vreg vreg_file[VREG_NUM_REGS];
+
+////////////////////////////////////////////////////////////////////////////////
+// Function declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Lane-wise operations, with the result replacing the first operand. The
+ * suffix gives the lane size in bits. Arithmetic wraps within each lane,
+ * min and max are unsigned, and the comparisons (equal, and signed greater
+ * than) set each lane to all ones where true and zero where false.
+ *
+ * Each uses the host's SSE2 (or SSE4.1, where the build targets it)
+ * instructions when available, and plain C otherwise.
+ *
+ * IN dest: The first operand, and where the result is written.
+ * IN src: The second operand.
+ */
+extern void vector_add8(vreg *dest, const vreg *src);
+extern void vector_add16(vreg *dest, const vreg *src);
+extern void vector_add32(vreg *dest, const vreg *src);
+extern void vector_sub8(vreg *dest, const vreg *src);
+extern void vector_sub16(vreg *dest, const vreg *src);
+extern void vector_sub32(vreg *dest, const vreg *src);
+extern void vector_mul8(vreg *dest, const vreg *src);
+extern void vector_mul16(vreg *dest, const vreg *src);
+extern void vector_mul32(vreg *dest, const vreg *src);
+extern void vector_minu8(vreg *dest, const vreg *src);
+extern void vector_minu16(vreg *dest, const vreg *src);
+extern void vector_minu32(vreg *dest, const vreg *src);
+extern void vector_maxu8(vreg *dest, const vreg *src);
+extern void vector_maxu16(vreg *dest, const vreg *src);
+extern void vector_maxu32(vreg *dest, const vreg *src);
+extern void vector_cmpeq8(vreg *dest, const vreg *src);
+extern void vector_cmpeq16(vreg *dest, const vreg *src);
+extern void vector_cmpeq32(vreg *dest, const vreg *src);
+extern void vector_cmpgt8(vreg *dest, const vreg *src);
+extern void vector_cmpgt16(vreg *dest, const vreg *src);
+extern void vector_cmpgt32(vreg *dest, const vreg *src);
+extern void vector_and(vreg *dest, const vreg *src);
+extern void vector_or(vreg *dest, const vreg *src);
+extern void vector_xor(vreg *dest, const vreg *src);
+
+/**
+ * Rearranges the bytes of dest, each byte lane of src giving the index
+ * (0-15) of the byte to take, or zeroing the lane if its top bit is set.
+ */
+extern void vector_shuf8(vreg *dest, const vreg *src);
+
+/**
+ * Sets dest to the word lanes of src in a new order, each 2 bits of
+ * order (from the lowest) giving the lane of src to take.
+ */
+extern void vector_shuf32(vreg *dest, const vreg *src, uint8_t order);
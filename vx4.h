@@ -0,0 +1,20 @@
+#pragma once
+
+////////////////////////////////////////////////////////////////////////////////
+// Type declarations
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Holds every piece of state belonging to one emulated machine, so that
+ * any number of machines can share a process. The full definition is in
+ * machine.h, this declaration lets each module's header take a machine
+ * without depending on every other module.
+ */
+typedef struct _vx4_machine vx4_machine;
+
+/**
+ * Holds the state private to one of a machine's virtual CPUs, defined in
+ * machine.h. Anything that runs on a particular CPU takes one of these
+ * instead of the machine, which it can reach through the CPU.
+ */
+typedef struct _vx4_cpu vx4_cpu;